@@ -49,4 +49,8 @@ namespace Barrier {
         asm volatile("isb" : : : "memory");
     }
 
+    static inline void relax(void) {
+        asm volatile("yield" : : : "memory");
+    }
+
 }
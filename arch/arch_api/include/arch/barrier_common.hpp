@@ -26,4 +26,7 @@ namespace Barrier {
     static inline void rw_before_rw(void);
     static inline void system(void);
     static inline void instruction(void);
+
+    /* Hint that the CPU is spinning on a value another CPU will change. */
+    static inline void relax(void);
 }
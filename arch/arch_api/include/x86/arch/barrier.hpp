@@ -41,4 +41,8 @@ namespace Barrier {
     static inline void instruction(void) {
     }
 
+    static inline void relax(void) {
+        asm volatile("pause" : : : "memory");
+    }
+
 }
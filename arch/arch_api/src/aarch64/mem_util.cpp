@@ -1,5 +1,5 @@
 /**
- * Copyright (C) 2019-2024 BlueRock Security, Inc.
+ * Copyright (C) 2019-2025 BlueRock Security, Inc.
  * All rights reserved.
  *
  * This software is distributed under the terms of the BlueRock Open-Source License.
@@ -37,23 +37,67 @@ icache_invalidate_line(mword va) {
     asm volatile("ic ivau, %0" : : "r"(va) : "memory");
 }
 
+/*
+ * Decoded CTR_EL0, read once: the register is the same on all the cores the VMM runs on.
+ * - IDC: cleaning the data cache to PoU is not required for instruction to data coherence,
+ * - DIC: invalidating the instruction cache to PoU is not required either.
+ */
+struct CacheInfo {
+    uint64 dcache_line_size;
+    uint64 icache_line_size;
+    bool dcache_clean_pou_for_itod;
+    bool icache_clean_pou_for_itod;
+
+    CacheInfo() {
+        Msr::Info::Ctr ctr;
+
+        dcache_line_size = ctr.dcache_line_size();
+        icache_line_size = ctr.icache_line_size();
+        dcache_clean_pou_for_itod = ctr.dcache_clean_pou_for_itod();
+        icache_clean_pou_for_itod = ctr.icache_clean_pou_for_itod();
+    }
+};
+
+static const CacheInfo&
+cache_info() {
+    static const CacheInfo info;
+    return info;
+}
+
+/*
+ * Apply CACHE_OP to every line of the range, eight lines per iteration. DC and IC operations
+ * are ordered after the earlier stores to the same line, only their completion needs a barrier.
+ */
 template<void (*CACHE_OP)(mword)>
-void
-dcache_op_range(void* va_start, size_t size) {
-    Msr::Info::Ctr ctr;
-    uint64 cache_line_size = ctr.dcache_line_size();
+static void
+cache_op_range(void* va_start, size_t size, uint64 cache_line_size) {
+    static constexpr unsigned UNROLL = 8;
     mword va = align_dn(reinterpret_cast<mword>(va_start), cache_line_size);
     mword va_end = align_up(reinterpret_cast<mword>(va_start) + size, cache_line_size);
+    mword stride = UNROLL * cache_line_size;
 
-    /* Make sure that previous writes have completed. */
-    Barrier::rw_before_rw();
+    for (; va_end - va >= stride; va += stride) {
+        CACHE_OP(va);
+        CACHE_OP(va + cache_line_size);
+        CACHE_OP(va + 2 * cache_line_size);
+        CACHE_OP(va + 3 * cache_line_size);
+        CACHE_OP(va + 4 * cache_line_size);
+        CACHE_OP(va + 5 * cache_line_size);
+        CACHE_OP(va + 6 * cache_line_size);
+        CACHE_OP(va + 7 * cache_line_size);
+    }
 
-    /* Clean the data cache for the VA range to PoU. */
     for (; va < va_end; va += cache_line_size) {
         CACHE_OP(va);
     }
+}
 
-    /* Make sure we finish all dcache clean operations. */
+template<void (*CACHE_OP)(mword)>
+void
+dcache_op_range(void* va_start, size_t size) {
+    cache_op_range<CACHE_OP>(va_start, size, cache_info().dcache_line_size);
+
+    /* Make sure we finish all dcache maintenance operations. */
     Barrier::rw_before_rw();
 }
 
@@ -69,16 +113,17 @@ dcache_clean_invalidate_range(void* va_start, size_t size) {
 
 void
 icache_invalidate_range(void* va_start, size_t size) {
-    Msr::Info::Ctr ctr;
-    uint64 cache_line_size = ctr.icache_line_size();
-    mword va = align_dn(reinterpret_cast<mword>(va_start), cache_line_size);
-    mword va_end = align_up(reinterpret_cast<mword>(va_start) + size, cache_line_size);
+    const CacheInfo& info = cache_info();
 
-    /* Invalidate the instruction cache for the VA range to PoU. */
-    for (; va < va_end; va += cache_line_size) {
-        icache_invalidate_line(va);
+    /* With DIC, the instruction caches are coherent: only the context synchronization is needed. */
+    if (!info.icache_clean_pou_for_itod) {
+        Barrier::instruction();
+        return;
     }
 
+    /* Invalidate the instruction cache for the VA range to PoU. */
+    cache_op_range<icache_invalidate_line>(va_start, size, info.icache_line_size);
+
     /* Make sure we finish the icache invalidation. */
     Barrier::rw_before_rw();
     Barrier::instruction();
@@ -89,10 +134,14 @@ icache_invalidate_range(void* va_start, size_t size) {
 
 void
 icache_sync_range(void* va_start, size_t size) {
-    Msr::Info::Ctr ctr;
+    const CacheInfo& info = cache_info();
 
-    if (ctr.dcache_clean_pou_for_itod())
+    /* With IDC, the stores only need to be visible to the instruction fetches of other cores. */
+    if (info.dcache_clean_pou_for_itod)
         dcache_op_range<dcache_clean_line_pou>(va_start, size);
-    if (ctr.icache_clean_pou_for_itod())
+    else
+        Barrier::w_before_w();
+
+    if (info.icache_clean_pou_for_itod)
         icache_invalidate_range(va_start, size);
 }
@@ -1,28 +1,107 @@
 /**
- * Copyright (C) 2020 BlueRock Security, Inc.
+ * Copyright (C) 2020-2025 BlueRock Security, Inc.
  * All rights reserved.
  *
  * This software is distributed under the terms of the BlueRock Open-Source License.
  * See the LICENSE-BlueRock file in the repository root for details.
  */
 
+#include <arch/barrier.hpp>
 #include <arch/mem_util.hpp>
+#include <cpuid.h>
+#include <platform/bits.hpp>
 #include <platform/types.hpp>
 
-void
-dcache_clean_range(void* start, size_t size) {
-    uint64 cache_line_size = 64; // Could we query this at run-time?
+/*
+ * Cache maintenance capabilities of the CPU, probed once:
+ * - CPUID.01H:EBX[15:8] is the size of the line flushed by CLFLUSH, in 8-byte units,
+ * - CPUID.(EAX=07H,ECX=0):EBX[23] is CLFLUSHOPT, EBX[24] is CLWB.
+ * CLFLUSHOPT and CLWB are only ordered by a fence, unlike CLFLUSH which is ordered with respect
+ * to other writes and flushes: a loop of them followed by one SFENCE pipelines the write-backs.
+ */
+struct CacheInfo {
+    static constexpr uint32 DEFAULT_LINE_SIZE = 64;
+    static constexpr uint32 LEAF1_EBX_CLFLUSH_SHIFT = 8;
+    static constexpr uint32 LEAF7_EBX_CLFLUSHOPT = 1u << 23;
+    static constexpr uint32 LEAF7_EBX_CLWB = 1u << 24;
+
+    uint64 line_size{DEFAULT_LINE_SIZE};
+    bool clflushopt{false};
+    bool clwb{false};
 
-    for (size_t i = 0; i < size; i += cache_line_size) {
-        const char* addr = reinterpret_cast<char*>(start) + i;
+    CacheInfo() {
+        unsigned eax, ebx, ecx, edx;
 
-        asm volatile("clflush (%0)" : : "r"(addr) : "memory");
+        if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) != 0) {
+            uint64 size = ((ebx >> LEAF1_EBX_CLFLUSH_SHIFT) & 0xff) * 8;
+            if (size != 0)
+                line_size = size;
+        }
+
+        if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) != 0) {
+            clflushopt = (ebx & LEAF7_EBX_CLFLUSHOPT) != 0;
+            clwb = (ebx & LEAF7_EBX_CLWB) != 0;
+        }
     }
+};
+
+static const CacheInfo&
+cache_info() {
+    static const CacheInfo info;
+    return info;
+}
+
+static inline void
+clflush_line(mword va) {
+    asm volatile("clflush (%0)" : : "r"(va) : "memory");
+}
+
+static inline void
+clflushopt_line(mword va) {
+    asm volatile("clflushopt (%0)" : : "r"(va) : "memory");
+}
+
+static inline void
+clwb_line(mword va) {
+    asm volatile("clwb (%0)" : : "r"(va) : "memory");
+}
+
+template<void (*CACHE_OP)(mword), bool FENCE>
+static void
+dcache_op_range(void* va_start, size_t size, uint64 cache_line_size) {
+    mword va = align_dn(reinterpret_cast<mword>(va_start), cache_line_size);
+    mword va_end = align_up(reinterpret_cast<mword>(va_start) + size, cache_line_size);
+
+    for (; va < va_end; va += cache_line_size) {
+        CACHE_OP(va);
+    }
+
+    /* Make sure that the weakly-ordered flushes are complete. */
+    if (FENCE)
+        Barrier::w_before_w();
+}
+
+void
+dcache_clean_range(void* va_start, size_t size) {
+    const CacheInfo& info = cache_info();
+
+    /* CLWB may leave the line in the cache, the cheapest way to write it back. */
+    if (info.clwb)
+        dcache_op_range<clwb_line, true>(va_start, size, info.line_size);
+    else if (info.clflushopt)
+        dcache_op_range<clflushopt_line, true>(va_start, size, info.line_size);
+    else
+        dcache_op_range<clflush_line, false>(va_start, size, info.line_size);
 }
 
 void
 dcache_clean_invalidate_range(void* va_start, size_t size) {
-    return dcache_clean_range(va_start, size);
+    const CacheInfo& info = cache_info();
+
+    if (info.clflushopt)
+        dcache_op_range<clflushopt_line, true>(va_start, size, info.line_size);
+    else
+        dcache_op_range<clflush_line, false>(va_start, size, info.line_size);
 }
 
 void
@@ -31,6 +110,11 @@ icache_invalidate_range(void*, size_t) {
 }
 
 void
-icache_sync_range(void* start, size_t size) {
-    dcache_clean_range(start, size);
+icache_sync_range(void*, size_t) {
+    /*
+     * Instruction caches are coherent with the data caches on x86: stores are seen by
+     * instruction fetches, and the entry into the guest serializes the vCPU. Only the compiler
+     * must not sink the stores past this point.
+     */
+    asm volatile("" : : : "memory");
 }
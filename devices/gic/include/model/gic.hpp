@@ -9,6 +9,7 @@
 
 #include <debug_switches.hpp>
 #include <model/cpu_affinity.hpp>
+#include <model/guest_mem_view.hpp>
 #include <model/irq_controller.hpp>
 #include <model/vcpu_types.hpp>
 #include <platform/atomic.hpp>
@@ -35,6 +36,18 @@ namespace Model {
     static constexpr uint8 GICV2_MAX_CPUS = 8;
     // Must a multiple of 32, bigger than 32 (to fit PPIs and SGIs)
     static constexpr uint8 GICD_MIN_LINES = 64;
+
+    // Bitmap of the IRQs that are currently active, indexed by INTID
+    using IrqActiveMap = AtomicBitmap<MAX_IRQ_NO_LPI>;
+
+    // LPIs are allocated by chunks, only when the guest starts using a range of INTIDs
+    static constexpr uint32 LPI_CHUNK_SIZE = 1024;
+    static constexpr uint32 NUM_LPI_CHUNKS = (MAX_IRQ - LPI_BASE) / LPI_CHUNK_SIZE;
+    static_assert(LPI_BASE % LPI_CHUNK_SIZE == 0, "LPI chunks must match the bitmap leaves");
+
+    // Per-VCPU status bitmap indexed by INTID. Leaf 0 covers SGIs, PPIs and SPIs and the
+    // leaves covering LPIs are allocated with the matching LPI chunk.
+    using IrqStatusMap = SparseAtomicBitmap<MAX_IRQ, LPI_CHUNK_SIZE>;
 }
 
 class Model::GicD : public Model::IrqController {
@@ -49,8 +62,8 @@ private:
     class IrqTarget {
     public:
         /* The CPU set format is only supported in GICv2 mode. A consequence of that
-         * is that the mask will never have more than 8 bits sets because GICv2 will
-         * no handle more CPUs than that.
+         * is that the mask will never have more than GICV2_MAX_CPUS bits sets because
+         * GICv2 will no handle more CPUs than that.
          */
         enum Format { CPU_ID = 0u << 31, CPU_SET = 1u << 31 };
 
@@ -70,14 +83,14 @@ private:
             if (!is_targeting_a_set())
                 return target() == id;
             else {
-                ASSERT(id < 8);
+                ASSERT(id < Model::GICV2_MAX_CPUS);
                 return (target() & (1u << id)) != 0u;
             }
         }
 
         void add_target_to_set(Vcpu_id id) {
             ASSERT(is_targeting_a_set());
-            ASSERT(id < 8);
+            ASSERT(id < Model::GICV2_MAX_CPUS);
             _tgt |= 1u << id;
         }
 
@@ -104,6 +117,7 @@ private:
             IrqTarget tgt(static_cast<uint32>(_info));
             return tgt.is_cpu_targeted(id);
         }
+        IrqTarget target() const { return IrqTarget(static_cast<uint32>(_info)); }
 
         void set_target_cpu(const IrqTarget &tgt) { _info = (_info & 0xffffffff00000000ull) | tgt.raw(); }
 
@@ -182,6 +196,95 @@ private:
         atomic<uint64> _info;
     };
 
+    /*
+     * Fixed-size lock-free ring of INTIDs that became pending for a VCPU. Asserters post to
+     * the ring of the target and ring the doorbell, the target moves the INTIDs to its pending
+     * bitmap at its next injection point. Producers reserve slots on the tail and publish them
+     * with a sequence number (bounded queue of D. Vyukov). Draining is normally done by the
+     * target VCPU but GICR accesses can drain from another VCPU: drains are serialized so that
+     * a caller never returns while INTIDs are still being handed over by another drain.
+     */
+    class IrqMailbox {
+    public:
+        static constexpr uint32 SIZE = 64;
+
+        IrqMailbox() {
+            for (uint32 i = 0; i < SIZE; i++)
+                _slots[i].seq = i;
+        }
+
+        /*! \brief Post an INTID to the mailbox
+         *  \param intid INTID that is now pending
+         *  \return false if the mailbox is full, the caller must then set the IRQ pending itself
+         */
+        bool post(uint16 intid) {
+            uint32 pos = _tail;
+
+            for (;;) {
+                Slot &slot = _slots[pos % SIZE];
+                int32 diff = static_cast<int32>(slot.seq - pos);
+
+                if (diff == 0) {
+                    if (_tail.cas(pos, pos + 1, true))
+                        break;
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = _tail;
+                }
+            }
+
+            Slot &slot = _slots[pos % SIZE];
+            slot.intid = intid;
+            slot.seq = pos + 1;
+            _doorbell = true;
+            return true;
+        }
+
+        /*! \brief Hand over all the posted INTIDs to a callback
+         *  \param f callback called with every INTID removed from the mailbox
+         */
+        template<typename F>
+        void drain(F f) {
+            if (!_doorbell.load() && !_draining.load())
+                return;
+
+            bool expected = false;
+            while (!_draining.cas(expected, true, true))
+                expected = false;
+
+            _doorbell = false;
+
+            for (;;) {
+                Slot &slot = _slots[_head % SIZE];
+
+                // Empty, or the producer did not publish yet. It will ring again.
+                if (slot.seq != _head + 1)
+                    break;
+
+                uint16 intid = slot.intid;
+                slot.seq = _head + SIZE;
+                _head++;
+                f(intid);
+            }
+
+            _draining = false;
+        }
+
+    private:
+        struct Slot {
+            atomic<uint32> seq{0};
+            uint16 intid{0};
+        };
+
+        // Producers only write to the tail and the doorbell, the head belongs to the drain
+        alignas(64) atomic<uint32> _tail{0};
+        atomic<bool> _doorbell{false};
+        alignas(64) atomic<bool> _draining{false};
+        uint32 _head{0};
+        Slot _slots[SIZE];
+    };
+
     class Irq {
         uint16 _id{0};
         uint16 _pintid{0};
@@ -212,6 +315,18 @@ private:
         bool _group1{false};
         bool _hw{false};
         bool _active{false};
+        IrqActiveMap *_active_map{nullptr}; // Mirrors _active, shared by all IRQs of the same bank
+
+        void set_active(bool active) {
+            _active = active;
+            if (_active_map == nullptr)
+                return;
+
+            if (active)
+                _active_map->set(_id);
+            else
+                _active_map->clr(_id);
+        }
 
     public:
         IrqInjectionInfo injection_info{0};
@@ -242,6 +357,7 @@ private:
         void prio(uint8 const p) { _prio = p; }
 
         void set_id(uint16 id) { _id = id; }
+        void set_active_map(IrqActiveMap *map) { _active_map = map; }
         uint16 id() const { return _id; }
         bool hw() const { return _hw; }
         uint16 hw_int_id() const { return _pintid; }
@@ -267,11 +383,11 @@ private:
         bool active() const { return _active; }
         void activate(bool mmio_one = true) {
             if (mmio_one)
-                _active = true;
+                set_active(true);
         }
         void deactivate(bool mmio_one = true) {
             if (mmio_one)
-                _active = false;
+                set_active(false);
         }
 
         bool pending() const {
@@ -310,6 +426,17 @@ private:
         // stats purposes
         atomic<uint64> num_asserted{0};
         atomic<uint64> num_acked{0};
+
+        // latency tracing purposes (see GicD::trace_latency), in ns, zero means 'not recorded'
+        atomic<uint64> ts_asserted{0};
+        atomic<uint64> ts_injected{0};
+        atomic<uint64> ts_acked{0};
+
+        /*
+         * VCPU whose load counter (Banked::spi_load) currently accounts for this IRQ.
+         * Only SPIs routed to a single VCPU are accounted for.
+         */
+        atomic<Vcpu_id> load_owner{INVALID_VCPU_ID};
     };
 
 public:
@@ -373,15 +500,27 @@ private:
         Irq sgi[MAX_SGI];
         Irq ppi[MAX_PPI];
 
-        AtomicBitset<MAX_IRQ> pending_irqs;
-        AtomicBitset<MAX_IRQ> in_injection_irqs;
+        IrqStatusMap pending_irqs;
+        IrqStatusMap in_injection_irqs;
+        IrqActiveMap active_irqs; // SGIs and PPIs of this VCPU only
+        IrqMailbox mailbox;       // INTIDs posted by asserters, not yet in pending_irqs
         CpuIrqInterface *notify{nullptr};
 
+        /*
+         * Number of SPIs routed to this VCPU that were not handled yet. This is used
+         * to balance 1-of-N SPIs across VCPUs (see route_spi).
+         */
+        atomic<uint32> spi_load{0};
+
         Banked() {
-            for (uint8 i = 0; i < MAX_SGI; i++)
+            for (uint8 i = 0; i < MAX_SGI; i++) {
                 sgi[i].set_id(i);
-            for (uint8 i = 0; i < MAX_PPI; i++)
+                sgi[i].set_active_map(&active_irqs);
+            }
+            for (uint8 i = 0; i < MAX_PPI; i++) {
                 ppi[i].set_id(static_cast<uint16>(i + MAX_SGI));
+                ppi[i].set_active_map(&active_irqs);
+            }
         }
     };
 
@@ -400,33 +539,53 @@ private:
 
     Banked *_local{nullptr};
     Irq *_spi{nullptr};
+    IrqActiveMap _active_spis;
 
-    // LPI support
-    Irq *_lpi{nullptr};
+    // LPI support: two-level table, indexed by (INTID - LPI_BASE) / LPI_CHUNK_SIZE
+    atomic<Irq *> _lpi[NUM_LPI_CHUNKS]{};
     uint64 _prop_baser{0};
     uint64 _pend_baser{0};
     Vbus::Bus *_mem_bus{nullptr}; // for LPI configuration table reading
     Vector<cxx::Pair<uint64, Gits *>> _registered_gits;
 
-    // simple way to round-robin IRQs when GICv3 is enabled
+    // starting point when looking for a VCPU to receive a 1-of-N SPI (GICv3 only)
     atomic<uint16> _vcpu_global_hint{0};
 
-    Irq &irq_object(Banked &cpu, uint64 const id) {
+    // Latency histograms indexed by INTID (LPIs are not traced). Allocated when first needed.
+    atomic<IrqLatency *> _latency{nullptr};
+
+    enum LatencyEvent { LAT_ASSERTED, LAT_INJECTED, LAT_ACKED, LAT_HANDLED };
+
+    IrqLatency *latency_histograms();
+    void trace_latency(Irq &irq, LatencyEvent event);
+
+    Irq *lpi_chunk(uint64 const id) const { return _lpi[(id - LPI_BASE) / LPI_CHUNK_SIZE]; }
+
+    // Returns nullptr if the chunk holding this LPI was never allocated
+    Irq *lpi_object(uint64 const id) const {
+        Irq *chunk = lpi_chunk(id);
+        return chunk == nullptr ? nullptr : &chunk[(id - LPI_BASE) % LPI_CHUNK_SIZE];
+    }
+
+    Irq *alloc_lpi(uint32 pintid);
+
+    // Returns nullptr for an LPI whose chunk was never allocated, callers that can see LPIs must check
+    Irq *irq_object(Banked &cpu, uint64 const id) {
         if (id < MAX_SGI)
-            return cpu.sgi[id];
+            return &cpu.sgi[id];
         if (id < MAX_SGI + MAX_PPI)
-            return cpu.ppi[id - MAX_SGI];
+            return &cpu.ppi[id - MAX_SGI];
         else
-            return id < LPI_BASE ? _spi[id - MAX_SGI - MAX_PPI] : _lpi[id - LPI_BASE];
+            return id < LPI_BASE ? &_spi[id - MAX_SGI - MAX_PPI] : lpi_object(id);
     }
 
-    const Irq &irq_object(Banked const &cpu, uint64 const id) const {
+    const Irq *irq_object(Banked const &cpu, uint64 const id) const {
         if (id < MAX_SGI)
-            return cpu.sgi[id];
+            return &cpu.sgi[id];
         if (id < MAX_SGI + MAX_PPI)
-            return cpu.ppi[id - MAX_SGI];
+            return &cpu.ppi[id - MAX_SGI];
         else
-            return id < LPI_BASE ? _spi[id - MAX_SGI - MAX_PPI] : _lpi[id - LPI_BASE];
+            return id < LPI_BASE ? &_spi[id - MAX_SGI - MAX_PPI] : lpi_object(id);
     }
 
     enum AccessType {
@@ -540,7 +699,7 @@ private:
 
         for (unsigned i = 0; i < acc.num_irqs(); i++) {
             uint64 const pos = acc.first_irq_accessed() + i;
-            Irq &irq = irq_object(cpu, pos);
+            Irq &irq = *irq_object(cpu, pos);
             T const val = static_cast<T>((value >> (i * irq_per_bytes_to_bits(acc.irq_per_bytes)))
                                          & irq_per_bytes_to_mask(acc.irq_per_bytes));
             (irq.*IRQ_FUN)(val);
@@ -557,7 +716,7 @@ private:
 
         for (unsigned i = 0; i < acc.num_irqs(); i++) {
             uint64 const pos = acc.first_irq_accessed() + i;
-            Irq &irq = irq_object(cpu, pos);
+            Irq &irq = *irq_object(cpu, pos);
             uint8 const val = static_cast<uint8>((value >> (i * irq_per_bytes_to_bits(acc.irq_per_bytes)))
                                                  & irq_per_bytes_to_mask(acc.irq_per_bytes));
 
@@ -576,7 +735,7 @@ private:
 
         for (unsigned i = 0; i < acc.num_irqs(); i++) {
             uint64 const pos = acc.first_irq_accessed() + i;
-            Irq &irq = irq_object(_local[vcpu_id], pos);
+            Irq &irq = *irq_object(_local[vcpu_id], pos);
 
             uint8 sender_bitfield = static_cast<uint8>(value >> (i * Model::GICV2_MAX_CPUS));
 
@@ -596,7 +755,7 @@ private:
 
         for (unsigned i = 0; i < acc.num_irqs(); i++) {
             uint64 const pos = acc.first_irq_accessed() + i;
-            Irq &irq = irq_object(_local[cpu_id], pos);
+            Irq &irq = *irq_object(_local[cpu_id], pos);
 
             bool const set = (value >> i) & 0x1;
             if (!set)
@@ -615,7 +774,7 @@ private:
         value = 0;
         for (unsigned i = 0; i < acc.num_irqs(); i++) {
             uint64 const pos = acc.first_irq_accessed() + i;
-            Irq const &irq = irq_object(cpu, pos);
+            Irq const &irq = *irq_object(cpu, pos);
 
             value |= static_cast<uint64>((irq.*IRQ_FUN)()) << (i * irq_per_bytes_to_bits(acc.irq_per_bytes));
         }
@@ -667,10 +826,15 @@ private:
     bool assert_pi_sw(Vcpu_id vcpu_id, Irq &irq);
     bool deassert_pi(Vcpu_id vcpu_id, Irq &irq);
     bool deassert_pi_sw(Vcpu_id vcpu_id, Irq &irq);
+    bool enable_pi(Vcpu_id vcpu_id, Irq &irq);
+    bool disable_pi(Vcpu_id vcpu_id, Irq &irq);
     bool deassert_sgi(Vcpu_id, Vcpu_id, Irq &irq);
     void deassert_line(Vcpu_id cpu_id, uint32 irq_id);
 
     bool notify_target(Irq &irq, const IrqTarget &target);
+    void charge_spi_load(Irq &irq, Vcpu_id vcpu_id);
+    void release_spi_load(Irq &irq);
+    uint32 spi_routing_cost(Vcpu_id vcpu_id) const;
     IrqTarget route_spi(Model::GicD::Irq &irq, Vcpu_id vcpu_hint_start);
     IrqTarget route_spi_no_affinity(Model::GicD::Irq &irq);
     bool redirect_spi(Irq &irq, Vcpu_id vcpu_hint_start);
@@ -682,7 +846,15 @@ private:
             return true; // only SPIs participate in the 1-of-N model
         return gic_r->can_receive_irq();
     }
+    void post_pending(Banked &cpu, uint16 irq_id) {
+        if (__UNLIKELY__(!cpu.mailbox.post(irq_id)))
+            cpu.pending_irqs.set(irq_id); // Mailbox full, fall back to the shared bitmap
+    }
+    void drain_mailbox(Banked &cpu) {
+        cpu.mailbox.drain([&cpu](uint16 irq_id) { cpu.pending_irqs.set(irq_id); });
+    }
     void reset_status_bitfields_on_vcpu(uint16 vcpu_idx);
+    void check_status_bitfields_on_vcpu(Vcpu_id cpu_id, bool any_active, bool any_in_injection);
     uint64 get_typer() const {
         uint64 itl = configured_irqs() == MAX_IRQ ? 31ull : (configured_irqs() / 32) - 1;
 
@@ -690,9 +862,9 @@ private:
             itl |= (1ULL << 17); /* LPI supported */
 
         return itl
-               | (static_cast<uint64>(min(_num_vcpus, static_cast<uint16>(8)) - 1)
+               | (static_cast<uint64>(min(_num_vcpus, static_cast<uint16>(GICV2_MAX_CPUS)) - 1)
                   << 5)        /* No of PEs that can be used without affinity routing. It is a 3bit field. */
-               | (9ULL << 19)  /* id bits */
+               | ((lpi_supported() ? MAX_IRQ_ID_BITS - 1ULL : 9ULL) << 19) /* id bits */
                | (1ULL << 24); /* Aff3 supported */
     }
 
@@ -717,7 +889,9 @@ public:
     ~GicD() override {
         delete[] _local;
         delete[] _spi;
-        delete[] _lpi;
+        for (auto &chunk : _lpi)
+            delete[] chunk.load();
+        delete[] _latency.load();
     }
 
     void add_its(uint64 addr, Gits *ptr) { _registered_gits.push_back({addr, ptr}); }
@@ -741,26 +915,17 @@ public:
         if (_local == nullptr or _spi == nullptr)
             return false;
 
-        for (uint16 i = 0; i < configured_spis(); i++)
-            _spi[i].set_id(static_cast<uint16>(MAX_PPI + MAX_SGI + i));
-
-        if (_version == GIC_V3 && _mem_bus != nullptr) {
-            _lpi = new (nothrow) Irq[MAX_IRQ - LPI_BASE];
-            if (_lpi == nullptr) {
-                delete[] _local;
-                delete[] _spi;
+        for (uint16 i = 0; i < _num_vcpus; i++)
+            if (!_local[i].pending_irqs.prepare(0) || !_local[i].in_injection_irqs.prepare(0))
                 return false;
-            }
 
-            for (uint16 i = 0; i < (MAX_IRQ - LPI_BASE); ++i) {
-                _lpi[i].enable();
-                _lpi[i].set_id(i + LPI_BASE);
-                _lpi[i].set_group1(true);
-                _lpi[i].prio(PRIORITY_ANY);
-                _lpi[i].configure_hw(false /*non HW*/, 0 /*pINTID doesn't matter*/, true /*edge*/);
-            }
+        for (uint16 i = 0; i < configured_spis(); i++) {
+            _spi[i].set_id(static_cast<uint16>(MAX_PPI + MAX_SGI + i));
+            _spi[i].set_active_map(&_active_spis);
         }
 
+        // LPIs are allocated on demand, see alloc_lpi
+
         reset();
 
         return true;
@@ -808,7 +973,7 @@ public:
             return false;
 
         const Banked &cpu = _local[id];
-        const Irq &irq = irq_object(cpu, irq_id);
+        const Irq &irq = *irq_object(cpu, irq_id);
         info.active = irq.active();
         info.pending = irq.pending();
         info.enabled = irq.enabled();
@@ -828,6 +993,26 @@ public:
         return true;
     }
 
+    /*! \brief Query the latency histograms of an IRQ
+     *  \param irq_id INTID of the IRQ (SGIs and PPIs are aggregated across VCPUs)
+     *  \return the histograms or nullptr if no latency was recorded for this INTID yet
+     */
+    const IrqLatency *get_irq_latency(uint16 irq_id) const {
+        const IrqLatency *lat = _latency;
+
+        if (lat == nullptr || irq_id >= configured_irqs())
+            return nullptr;
+        return &lat[irq_id];
+    }
+
+    /*! \brief Log the latency histograms of all the IRQs that were traced
+     */
+    void dump_irq_latency() const;
+
+    /*! \brief Discard all the latency samples recorded so far
+     */
+    void reset_irq_latency();
+
     bool is_irq_in_injection(Vcpu_id id, uint16 irq_id) const {
         if (id >= _num_vcpus)
             return false;
@@ -838,13 +1023,19 @@ public:
         return cpu.in_injection_irqs.is_set(irq_id);
     }
 
-    bool is_irq_in_pending(Vcpu_id id, uint16 irq_id) const {
+    /*! \brief Is [irq_id] pending on [id]?
+     *
+     *  The INTIDs posted to the mailbox of [id] but not handed over yet are pending too: the
+     *  mailbox is drained into the pending bitmap first.
+     */
+    bool is_irq_in_pending(Vcpu_id id, uint16 irq_id) {
         if (id >= _num_vcpus)
             return false;
         if (irq_id >= configured_irqs() && irq_id < LPI_BASE)
             return false;
 
-        const Banked &cpu = _local[id];
+        Banked &cpu = _local[id];
+        drain_mailbox(cpu);
         return cpu.pending_irqs.is_set(irq_id);
     }
 };
@@ -902,6 +1093,7 @@ class Model::Gits : public Vbus::Device {
     uint64 _creadr{0};
 
     Vbus::Bus *_mem_bus{nullptr}; // reading ITS commands from a guest memory
+    Model::GuestMemView _cmd_queue; // Mapping of the command queue, acquired on the first fetch
     GicD *_distr;
 
     bool enabled() const { return (_ctlr & 1u) != 0u; }
@@ -939,6 +1131,7 @@ public:
         _cbaser = 0;
         _cwriter = 0;
         _creadr = 0;
+        _cmd_queue.release();
     }
     void handle_msi(uint32 event_id, uint32 dev_id);
 };
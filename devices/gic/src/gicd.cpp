@@ -18,6 +18,8 @@
 #include <platform/compiler.hpp>
 #include <platform/errno.hpp>
 #include <platform/log.hpp>
+#include <platform/new.hpp>
+#include <platform/time.hpp>
 #include <platform/types.hpp>
 #include <vbus/vbus.hpp>
 
@@ -179,7 +181,7 @@ Model::GicD::write_irouter(Banked &cpu, uint64 offset, uint8 bytes, uint64 value
     if (irq_id < SPI_BASE || irq_id >= configured_irqs())
         return true; /* ignore */
 
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq &irq = *irq_object(cpu, irq_id);
 
     if (__UNLIKELY__(Debug::current_level > Debug::CONDENSED))
         INFO("GOS requested IRQ %u to be routed to VCPU " FMTu64, irq.id(), value);
@@ -236,10 +238,10 @@ Model::GicD::mmio_write_32_or_less(Vcpu_id cpu_id, IrqMmioAccess &acc, uint64 va
         return write<bool, &Irq::set_group1>(cpu, acc, value);
     case GICD_ISENABLER ... GICD_ISENABLER_END:
         acc.base_abs = GICD_ISENABLER;
-        return write<bool, &Irq::enable>(cpu, acc, value);
+        return mmio_assert<&GicD::enable_pi>(cpu_id, acc, value);
     case GICD_ICENABLER ... GICD_ICENABLER_END:
         acc.base_abs = GICD_ICENABLER;
-        return write<bool, &Irq::disable>(cpu, acc, value);
+        return mmio_assert<&GicD::disable_pi>(cpu_id, acc, value);
     case GICD_ISPENDR ... GICD_ISPENDR_END: {
         uint64 reg = value;
         if (acc.offset == GICD_ISPENDR)
@@ -495,7 +497,7 @@ Model::GicD::mmio_read(Vcpu_id const cpu_id, uint64 const offset, uint8 const by
         if (!_ctlr.affinity_routing())
             return true; /* RAZ */
 
-        Irq const &irq = irq_object(cpu, irq_id);
+        Irq const &irq = *irq_object(cpu, irq_id);
         value = irq.routing.value;
 
         return true;
@@ -534,7 +536,7 @@ Model::GicD::config_irq(Vcpu_id const cpu_id, uint32 const irq_id, bool const hw
         return false;
 
     Banked &cpu = _local[cpu_id];
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq &irq = *irq_object(cpu, irq_id);
     irq.configure_hw(hw, pintid, edge);
 
     return true;
@@ -548,7 +550,7 @@ Model::GicD::assert_ppi(Vcpu_id const cpu_id, uint32 const irq_id) {
         return false;
 
     Banked &cpu = _local[cpu_id];
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq &irq = *irq_object(cpu, irq_id);
 
     if (!irq.hw_edge())
         irq.assert_line();
@@ -564,7 +566,7 @@ Model::GicD::deassert_line(Vcpu_id const cpu_id, uint32 const irq_id) {
         return;
 
     Banked &cpu = _local[cpu_id];
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq &irq = *irq_object(cpu, irq_id);
 
     irq.deassert_line();
 
@@ -590,23 +592,29 @@ Model::GicD::deassert_global_line(uint32 const irq_id) {
 bool
 Model::GicD::has_irq_in_injection(Vcpu_id cpu_id) {
     Banked &cpu = _local[cpu_id];
+    bool const in_injection = cpu.in_injection_irqs.any();
 
-    return cpu.in_injection_irqs.first_set(0, configured_irqs() - 1) != AtomicBitset<MAX_IRQ>::NOT_FOUND
-           || cpu.in_injection_irqs.first_set(LPI_BASE, MAX_IRQ - 1) != AtomicBitset<MAX_IRQ>::NOT_FOUND;
+    if (__UNLIKELY__(Debug::current_level == Debug::FULL))
+        check_status_bitfields_on_vcpu(cpu_id, any_irq_active(cpu_id), in_injection);
+
+    return in_injection;
 }
 
 bool
 Model::GicD::get_next_pending_irq(Vcpu_id cpu_id, size_t &next) {
     Banked &cpu = _local[cpu_id];
-    const size_t irq_id = next < LPI_BASE ? cpu.pending_irqs.first_set(next, configured_irqs() - 1) :
-                                            cpu.pending_irqs.first_set(next, MAX_IRQ - 1);
-    if (irq_id == AtomicBitset<MAX_IRQ>::NOT_FOUND) {
-        if (next < LPI_BASE) {
-            next = LPI_BASE;
-            return get_next_pending_irq(cpu_id, next);
-        }
-        return false;
+    size_t irq_id = IrqStatusMap::NOT_FOUND;
+
+    if (next < configured_irqs())
+        irq_id = cpu.pending_irqs.first_set(next, configured_irqs() - next);
+
+    if (irq_id == IrqStatusMap::NOT_FOUND) {
+        const size_t start = next < LPI_BASE ? static_cast<size_t>(LPI_BASE) : next;
+        irq_id = cpu.pending_irqs.first_set(start, MAX_IRQ - start);
+        if (irq_id == IrqStatusMap::NOT_FOUND)
+            return false;
     }
+
     next = irq_id;
     return true;
 }
@@ -618,12 +626,20 @@ Model::GicD::highest_irq(Vcpu_id const cpu_id, bool redirect_irq) {
     Banked &cpu = _local[cpu_id];
     const LocalIrqController *gic_r = _local[cpu_id].notify->local_irq_ctlr();
 
+    drain_mailbox(cpu);
+
     do {
         if (!get_next_pending_irq(cpu_id, irq_id))
             break;
 
-        Irq &irq = irq_object(cpu, irq_id);
+        Irq *lpi_or_irq = irq_object(cpu, irq_id);
+        if (__UNLIKELY__(lpi_or_irq == nullptr)) {
+            cpu.pending_irqs.clr(irq_id); // Stale pending bit for an LPI that was never allocated
+            irq_id++;
+            continue;
+        }
 
+        Irq &irq = *lpi_or_irq;
         IrqInjectionInfoUpdate cur = irq.injection_info.read();
 
         if (((irq.group0() && _ctlr.group0_enabled()) || (irq.group1() && _ctlr.group1_enabled())) && cur.is_targeting_cpu(cpu_id)
@@ -643,7 +659,7 @@ Model::GicD::highest_irq(Vcpu_id const cpu_id, bool redirect_irq) {
         }
 
         irq_id++;
-    } while (irq_id < configured_irqs());
+    } while (irq_id < MAX_IRQ);
 
     return r;
 }
@@ -652,14 +668,35 @@ bool
 Model::GicD::any_irq_active(Vcpu_id cpu_id) {
     Banked &cpu = _local[cpu_id];
 
+    return cpu.active_irqs.any() || _active_spis.any();
+}
+
+/*
+ * Debugging helper: the summary bitmaps are only an optimization. Recompute the
+ * answers from the per-IRQ state and report any divergence. Note that a guest
+ * racing on the active state of an IRQ from several VCPUs can legitimately
+ * trigger a report.
+ */
+void
+Model::GicD::check_status_bitfields_on_vcpu(Vcpu_id cpu_id, bool any_active, bool any_in_injection) {
+    Banked &cpu = _local[cpu_id];
+    bool active = false;
+
     for (uint32 i = 0; i < configured_irqs(); i++) {
-        Irq &irq = irq_object(cpu, i);
+        Irq &irq = *irq_object(cpu, i);
+        IrqActiveMap &map = (i < SPI_BASE) ? cpu.active_irqs : _active_spis;
 
-        if (irq.active())
-            return true;
+        if (irq.active() != map.is_set(i))
+            WARN("GICD: IRQ %u active state %u doesn't match the bitmap on VCPU " FMTu64, i, irq.active(), cpu_id);
+
+        active |= irq.active();
     }
 
-    return false;
+    if (active != any_active)
+        WARN("GICD: active summary %u doesn't match the IRQ state on VCPU " FMTu64, any_active, cpu_id);
+
+    if (cpu.in_injection_irqs.any_slow() != any_in_injection)
+        WARN("GICD: in-injection summary %u doesn't match the bitmap on VCPU " FMTu64, any_in_injection, cpu_id);
 }
 
 bool
@@ -692,6 +729,9 @@ Model::GicD::pending_irq(Vcpu_id const cpu_id, Lr &lr, uint8 min_priority) {
     Banked &cpu = _local[cpu_id];
     IrqState state = IrqState::PENDING;
 
+    if (Stats::enabled())
+        trace_latency(*irq, LAT_INJECTED);
+
     cpu.in_injection_irqs.set(irq->id());
     cpu.pending_irqs.clr(irq->id());
 
@@ -722,14 +762,16 @@ Model::GicD::pending_irq(Vcpu_id const cpu_id, Lr &lr, uint8 min_priority) {
 void
 Model::GicD::update_inj_status_inactive(Vcpu_id const cpu_id, uint32 irq_id) {
     Banked &cpu = _local[cpu_id];
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq &irq = *irq_object(cpu, irq_id);
 
     // Done injecting
     if (__UNLIKELY__(Debug::current_level > Debug::CONDENSED))
         INFO("IRQ %u handled by the guest on VCPU " FMTu64, irq_id, cpu_id);
 
-    if (Stats::enabled())
+    if (Stats::enabled()) {
         irq.num_acked++;
+        trace_latency(irq, LAT_HANDLED);
+    }
 
     IrqInjectionInfoUpdate desired, cur;
 
@@ -749,12 +791,14 @@ Model::GicD::update_inj_status_inactive(Vcpu_id const cpu_id, uint32 irq_id) {
 
     if (irq.pending())
         cpu.pending_irqs.set(irq.id());
+    else
+        release_spi_load(irq);
 }
 
 void
 Model::GicD::update_inj_status_active_or_pending(Vcpu_id const cpu_id, IrqState state, uint32 irq_id, bool in_injection) {
     Banked &cpu = _local[cpu_id];
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq &irq = *irq_object(cpu, irq_id);
 
     if (__UNLIKELY__(Debug::current_level > Debug::CONDENSED))
         INFO("IRQ %u came back, not yet injected on VCPU " FMTu64, irq_id, cpu_id);
@@ -763,6 +807,9 @@ Model::GicD::update_inj_status_active_or_pending(Vcpu_id const cpu_id, IrqState
         irq.deactivate();
     } else {
         irq.activate();
+
+        if (Stats::enabled())
+            trace_latency(irq, LAT_ACKED);
     }
 
     IrqInjectionInfoUpdate desired, cur;
@@ -787,9 +834,15 @@ Model::GicD::update_inj_status_active_or_pending(Vcpu_id const cpu_id, IrqState
 void
 Model::GicD::update_inj_status(Vcpu_id const cpu_id, uint32 irq_id, IrqState state, bool in_injection) {
     ASSERT(cpu_id < _num_vcpus);
-    ASSERT(irq_id < configured_irqs() || irq_id >= LPI_BASE);
+    ASSERT(irq_id < configured_irqs() || (irq_id >= LPI_BASE && irq_id < MAX_IRQ));
     Banked &cpu = _local[cpu_id];
-    Irq &irq = irq_object(cpu, irq_id);
+    Irq *lpi_or_irq = irq_object(cpu, irq_id);
+    if (__UNLIKELY__(lpi_or_irq == nullptr)) {
+        WARN("%s: LPI %u was never allocated", __func__, irq_id);
+        return;
+    }
+
+    Irq &irq = *lpi_or_irq;
     if (!in_injection) {
         ASSERT(state == PENDING or state == INACTIVE);
         cpu.in_injection_irqs.clr(irq.id());
@@ -809,10 +862,14 @@ Model::GicD::update_inj_status(Vcpu_id const cpu_id, uint32 irq_id, IrqState sta
 bool
 Model::GicD::notify_target(Irq &irq, const IrqTarget &target) {
     if (__UNLIKELY__(!target.is_valid())) {
+        release_spi_load(irq);
         return false;
     }
 
     if (target.is_targeting_a_set()) {
+        // Only single-target SPIs are accounted for, drop the charge of a previous routing
+        release_spi_load(irq);
+
         for (uint16 i = 0; i < min<uint16>(_num_vcpus, Model::GICV2_MAX_CPUS); i++) {
             if (!target.is_cpu_targeted(i))
                 continue;
@@ -820,7 +877,7 @@ Model::GicD::notify_target(Irq &irq, const IrqTarget &target) {
             Banked *target_cpu = &_local[i];
             const LocalIrqController *gic_r = target_cpu->notify->local_irq_ctlr();
 
-            target_cpu->pending_irqs.set(irq.id());
+            post_pending(*target_cpu, irq.id());
 
             // Avoid recalling a VCPU that has silenced IRQs
             if (__LIKELY__(vcpu_can_receive_irq(gic_r, irq.id())))
@@ -830,7 +887,8 @@ Model::GicD::notify_target(Irq &irq, const IrqTarget &target) {
         Banked *target_cpu = &_local[target.target()];
         const LocalIrqController *gic_r = target_cpu->notify->local_irq_ctlr();
 
-        target_cpu->pending_irqs.set(irq.id());
+        charge_spi_load(irq, target.target());
+        post_pending(*target_cpu, irq.id());
 
         if (__LIKELY__(vcpu_can_receive_irq(gic_r, irq.id())))
             target_cpu->notify->notify_interrupt_pending();
@@ -839,6 +897,41 @@ Model::GicD::notify_target(Irq &irq, const IrqTarget &target) {
     return true;
 }
 
+void
+Model::GicD::charge_spi_load(Irq &irq, Vcpu_id vcpu_id) {
+    // Disabled SPIs are charged when enabled again, see enable_pi()
+    if (irq.id() < SPI_BASE || irq.id() >= LPI_BASE || !irq.enabled())
+        return;
+
+    Vcpu_id prev = irq.load_owner.exchange(vcpu_id);
+    if (prev == vcpu_id)
+        return;
+
+    if (prev != INVALID_VCPU_ID)
+        _local[prev].spi_load--;
+    _local[vcpu_id].spi_load++;
+}
+
+void
+Model::GicD::release_spi_load(Irq &irq) {
+    Vcpu_id prev = irq.load_owner.exchange(INVALID_VCPU_ID);
+
+    if (prev != INVALID_VCPU_ID)
+        _local[prev].spi_load--;
+}
+
+/*
+ * The cost of routing a 1-of-N SPI to a given VCPU. The number of SPIs already waiting
+ * on that VCPU matters most. For VCPUs with the same load, a halted VCPU is preferred:
+ * waking it up does not interrupt guest execution and it will handle the IRQ right away.
+ */
+uint32
+Model::GicD::spi_routing_cost(Vcpu_id vcpu_id) const {
+    const Banked &cpu = _local[vcpu_id];
+
+    return (cpu.spi_load << 1) | (cpu.notify->is_halted() ? 0u : 1u);
+}
+
 bool
 Model::GicD::redirect_spi(Irq &irq, Vcpu_id vcpu_hint_start) {
     ASSERT(irq.id() >= SPI_BASE);
@@ -862,6 +955,34 @@ Model::GicD::redirect_spi(Irq &irq, Vcpu_id vcpu_hint_start) {
     return notify_target(irq, target);
 }
 
+bool
+Model::GicD::enable_pi(Vcpu_id, Irq &irq) {
+    irq.enable();
+
+    // A 1-of-N SPI left pending while disabled is charged again to the VCPU it waits on
+    IrqInjectionInfoUpdate const cur = irq.injection_info.read();
+    IrqTarget const target = cur.target();
+
+    if (cur.pending() && !cur.in_injection() && target.is_valid() && !target.is_targeting_a_set())
+        charge_spi_load(irq, target.target());
+
+    return true;
+}
+
+bool
+Model::GicD::disable_pi(Vcpu_id, Irq &irq) {
+    irq.disable();
+
+    /*
+     * A disabled IRQ will not be injected, it must not bias the routing anymore. An IRQ
+     * already handed to a VCPU keeps its charge until that VCPU deactivates it.
+     */
+    if (!irq.injection_info.read().in_injection())
+        release_spi_load(irq);
+
+    return true;
+}
+
 bool
 Model::GicD::assert_pi_sw(Vcpu_id cpu_id, Irq &irq) {
     ASSERT(irq.id() >= PPI_BASE || _ctlr.affinity_routing());
@@ -890,8 +1011,10 @@ Model::GicD::assert_pi(Vcpu_id cpu_id, Irq &irq) {
     update.set_pending();
     irq.injection_info.set(update);
 
-    if (Stats::enabled())
+    if (Stats::enabled()) {
         irq.num_asserted++;
+        trace_latency(irq, LAT_ASSERTED);
+    }
 
     return notify_target(irq, target);
 }
@@ -916,8 +1039,10 @@ Model::GicD::assert_sgi(Vcpu_id sender, Vcpu_id target, Irq &irq) {
         desired.set_pending(static_cast<uint8>(sender));
     } while (!irq.injection_info.cas(cur, desired));
 
-    if (Stats::enabled())
+    if (Stats::enabled()) {
         irq.num_asserted++;
+        trace_latency(irq, LAT_ASSERTED);
+    }
 
     if (__UNLIKELY__(Debug::current_level == Debug::FULL))
         INFO("SGI %u sent from " FMTx64 " to " FMTx64, irq.id(), sender, target);
@@ -946,8 +1071,12 @@ Model::GicD::deassert_pi(Vcpu_id, Irq &irq) {
     if (Stats::enabled() and irq.pending())
         irq.num_acked++;
 
+    // The IRQ will not be injected, forget about the pending assertion
+    irq.ts_asserted = 0;
+
     IrqInjectionInfoUpdate update(0);
     irq.injection_info.set(update);
+    release_spi_load(irq);
 
     return true;
 }
@@ -974,10 +1103,9 @@ Model::GicD::deassert_sgi(Vcpu_id sender, Vcpu_id target, Irq &irq) {
 
 Model::GicD::IrqTarget
 Model::GicD::route_spi_no_affinity(Model::GicD::Irq &irq) {
-    constexpr uint16 TARGET_MODE_MAX_CPUS = 8U;
     IrqTarget res(IrqTarget::CPU_SET, 0);
 
-    for (Vcpu_id i = 0; i < min<uint16>(_num_vcpus, TARGET_MODE_MAX_CPUS); i++) {
+    for (Vcpu_id i = 0; i < min<uint16>(_num_vcpus, Model::GICV2_MAX_CPUS); i++) {
         if (_local[i].notify == nullptr)
             continue;
 
@@ -1003,20 +1131,37 @@ Model::GicD::route_spi(Model::GicD::Irq &irq, Vcpu_id vcpu_hint_start) {
         // !_ctlr.group1_enabled()))
         //     return IrqTarget(); // Empty target;
 
+        /*
+         * Pick the VCPU with the lowest routing cost among the ones that can receive
+         * the IRQ. Starting from the hint spreads IRQs across VCPUs with equal costs.
+         */
+        Vcpu_id best = INVALID_VCPU_ID;
+        uint32 best_cost = ~0u;
         uint64 cpus_tried = 0;
         do {
             CpuIrqInterface *const cpu = _local[vcpu_hint_start].notify;
             ASSERT(cpu);
 
             const LocalIrqController *gicr = cpu->local_irq_ctlr();
-            if (gicr->can_receive_irq())
-                return IrqTarget(IrqTarget::CPU_ID, vcpu_hint_start);
+            if (gicr->can_receive_irq()) {
+                uint32 cost = spi_routing_cost(vcpu_hint_start);
+                if (cost == 0)
+                    return IrqTarget(IrqTarget::CPU_ID, vcpu_hint_start);
+
+                if (cost < best_cost) {
+                    best = vcpu_hint_start;
+                    best_cost = cost;
+                }
+            }
 
             cpus_tried++;
             vcpu_hint_start++;
             vcpu_hint_start %= _num_vcpus;
         } while (cpus_tried != _num_vcpus);
 
+        if (best != INVALID_VCPU_ID)
+            return IrqTarget(IrqTarget::CPU_ID, best);
+
         /*
          * Nobody was nice enough to accept that interrupt... It is possible that all
          * VCPUs are sleeping or disabled. We park the IRQ in the queue of the current
@@ -1159,8 +1304,10 @@ Model::GicD::send_sgi(Vcpu_id const from, Vcpu_id const target, uint32 const sgi
 
 void
 Model::GicD::reset_status_bitfields_on_vcpu(uint16 vcpu_idx) {
+    drain_mailbox(_local[vcpu_idx]);
+
     for (uint32 i = 0; i < configured_irqs(); i++) {
-        Irq &irq = irq_object(_local[vcpu_idx], i);
+        Irq &irq = *irq_object(_local[vcpu_idx], i);
 
         if (irq.hw()) {
             if (_local[vcpu_idx].in_injection_irqs.is_set(i)) {
@@ -1200,6 +1347,7 @@ Model::GicD::reset() {
 
     for (uint32 spi = 0; spi < configured_spis(); spi++) {
         _spi[spi].reset(1);
+        release_spi_load(_spi[spi]);
     }
     _ctlr.value = 0;
 }
@@ -1212,18 +1360,70 @@ Model::GicD::assert_msi(uint64 msi_addr, uint32 msi_data, uint32 rid, IrqAsserti
     });
 }
 
+Model::GicD::Irq *
+Model::GicD::alloc_lpi(uint32 pintid) {
+    Irq *irq = lpi_object(pintid);
+    if (__LIKELY__(irq != nullptr))
+        return irq;
+
+    const uint32 chunk_idx = (pintid - LPI_BASE) / LPI_CHUNK_SIZE;
+    const uint32 chunk_base = LPI_BASE + chunk_idx * LPI_CHUNK_SIZE;
+
+    // Status bits must be available before the LPIs can be found by other VCPUs
+    for (uint16 i = 0; i < _num_vcpus; i++)
+        if (!_local[i].pending_irqs.prepare(chunk_base) || !_local[i].in_injection_irqs.prepare(chunk_base))
+            return nullptr;
+
+    Irq *chunk = new (nothrow) Irq[LPI_CHUNK_SIZE];
+    if (chunk == nullptr)
+        return nullptr;
+
+    for (uint32 i = 0; i < LPI_CHUNK_SIZE; ++i) {
+        chunk[i].enable();
+        chunk[i].set_id(static_cast<uint16>(chunk_base + i));
+        chunk[i].set_group1(true);
+        chunk[i].prio(PRIORITY_ANY);
+        chunk[i].configure_hw(false /*non HW*/, 0 /*pINTID doesn't matter*/, true /*edge*/);
+    }
+
+    Irq *expected = nullptr;
+    if (!_lpi[chunk_idx].cas(expected, chunk))
+        delete[] chunk; // Another VCPU allocated it concurrently
+
+    return lpi_object(pintid);
+}
+
 void
 Model::GicD::assert_lpi(uint32 pintid, uint64 target_cpu) {
-    ASSERT(pintid < MAX_IRQ);
-    ASSERT(pintid >= LPI_BASE);
+    if (__UNLIKELY__(pintid < LPI_BASE || pintid >= MAX_IRQ)) {
+        WARN("%s: INTID %u is out of the LPI range", __func__, pintid);
+        return;
+    }
+
+    if (__UNLIKELY__(_version != GIC_V3 || _mem_bus == nullptr)) {
+        WARN("%s: LPIs are not supported by this GICD", __func__);
+        return;
+    }
+
+    // GICR_PROPBASER.IDbits bounds the LPI range the guest sized its property table for
+    const uint64 id_bits = _prop_baser & 0x1full;
+    if (__UNLIKELY__(_prop_baser == 0u || pintid > (1ull << (id_bits + 1)) - 1)) {
+        WARN("%s: INTID %u is above the range programmed in GICR_PROPBASER", __func__, pintid);
+        return;
+    }
 
     const uint32 lpi_id = pintid - LPI_BASE;
 
-    Irq &irq = _lpi[lpi_id];
+    Irq *lpi = alloc_lpi(pintid);
+    if (__UNLIKELY__(lpi == nullptr)) {
+        WARN("%s: unable to allocate LPI %u", __func__, pintid);
+        return;
+    }
+
+    Irq &irq = *lpi;
     if (irq.pending())
         return;
 
-    ASSERT(_prop_baser != 0u);
     const uint64 conf_tbl_base = _prop_baser & 0xFFFFFFFFF000ull;
 
     uint8 lpi_prop = 0;
@@ -1248,3 +1448,120 @@ Model::GicD::assert_lpi(uint32 pintid, uint64 target_cpu) {
     irq.injection_info.set(update);
     notify_target(irq, target);
 }
+
+Model::IrqLatency *
+Model::GicD::latency_histograms() {
+    IrqLatency *lat = _latency;
+
+    if (__LIKELY__(lat != nullptr))
+        return lat;
+
+    IrqLatency *expected = nullptr;
+    lat = new (nothrow) IrqLatency[configured_irqs()];
+    if (lat == nullptr)
+        return nullptr;
+
+    if (!_latency.cas(expected, lat)) {
+        // Somebody else allocated the histograms concurrently
+        delete[] lat;
+        return expected;
+    }
+
+    return lat;
+}
+
+/*
+ * Record the time of an event in the life of an IRQ and account for the latency since
+ * the previous event. Only the first assertion is considered if an IRQ is asserted
+ * several times before being acknowledged. If the guest handled the IRQ before we could
+ * observe it active, the acknowledgement is considered to happen at the EOI.
+ */
+void
+Model::GicD::trace_latency(Irq &irq, LatencyEvent event) {
+    if (irq.id() >= configured_irqs())
+        return;
+
+    IrqLatency *lat = latency_histograms();
+    if (lat == nullptr)
+        return;
+
+    IrqLatency &hist = lat[irq.id()];
+    uint64 const now = now_ns();
+    uint64 prev;
+
+    switch (event) {
+    case LAT_ASSERTED:
+        prev = 0;
+        irq.ts_asserted.cas(prev, now);
+        break;
+    case LAT_INJECTED:
+        irq.ts_injected = now;
+        irq.ts_acked = 0;
+        prev = irq.ts_asserted;
+        if (prev != 0)
+            hist.stage[ASSERT_TO_INJECT].add(now - prev);
+        break;
+    case LAT_ACKED:
+        if (irq.ts_acked != 0)
+            break; // Already seen active
+        irq.ts_acked = now;
+        prev = irq.ts_injected;
+        if (prev != 0)
+            hist.stage[INJECT_TO_ACK].add(now - prev);
+        prev = irq.ts_asserted.exchange(0);
+        if (prev != 0)
+            hist.stage[ASSERT_TO_ACK].add(now - prev);
+        break;
+    case LAT_HANDLED:
+        if (irq.ts_acked == 0)
+            trace_latency(irq, LAT_ACKED);
+        prev = irq.ts_acked.exchange(0);
+        if (prev != 0)
+            hist.stage[ACK_TO_EOI].add(now - prev);
+        irq.ts_injected = 0;
+        break;
+    }
+}
+
+void
+Model::GicD::dump_irq_latency() const {
+    static const char *const stage_names[NUM_LATENCY_STAGES] = {"assert->inject", "inject->ack", "ack->eoi", "assert->ack"};
+    const IrqLatency *lat = _latency;
+
+    if (lat == nullptr) {
+        INFO("GICD: no IRQ latency recorded");
+        return;
+    }
+
+    for (uint16 irq_id = 0; irq_id < configured_irqs(); irq_id++) {
+        for (uint8 s = 0; s < NUM_LATENCY_STAGES; s++) {
+            const IrqLatencyHistogram &h = lat[irq_id].stage[s];
+            uint64 const samples = h.samples;
+
+            if (samples == 0)
+                continue;
+
+            INFO("IRQ %u %s: samples " FMTu64 " avg " FMTu64 " ns max " FMTu64 " ns", irq_id, stage_names[s], samples,
+                 h.total / samples, h.max.load());
+
+            for (uint8 b = 0; b < IrqLatencyHistogram::NUM_BUCKETS; b++) {
+                uint64 const count = h.buckets[b];
+
+                if (count != 0)
+                    INFO("    [2^%02u, 2^%02u) ns: " FMTu64, b, b + 1, count);
+            }
+        }
+    }
+}
+
+void
+Model::GicD::reset_irq_latency() {
+    IrqLatency *lat = _latency;
+
+    if (lat == nullptr)
+        return;
+
+    for (uint16 irq_id = 0; irq_id < configured_irqs(); irq_id++)
+        for (auto &h : lat[irq_id].stage)
+            h.reset();
+}
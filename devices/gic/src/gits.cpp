@@ -68,6 +68,7 @@ Model::Gits::write_baser(uint8 index, uint64 value) {
 bool
 Model::Gits::write_cbaser(uint64 value) {
     _cbaser = value;
+    _cmd_queue.release();
     return true;
 }
 
@@ -267,12 +268,19 @@ Model::Gits::fetch_commands() {
     const uint64 cbaser_size = ((_cbaser & 0xFFFull) + 1) * PAGE_SIZE;
     // To make sure that we do not loop infinitely over command queue ring-buffer due to some error.
     uint64 max_iterations = cbaser_size / COMMAND_SIZE;
+    const uint64 cbaser_base = _cbaser & 0xFFFFFFFFFF000ull;
+
+    // The queue is mapped once: the commands are then read without a bus lookup
+    if (!_cmd_queue.covers(GPA(cbaser_base), cbaser_size))
+        (void)_cmd_queue.acquire(*_mem_bus, GPA(cbaser_base), cbaser_size, false);
 
     while ((_cwriter != _creadr) and (0u != max_iterations--)) {
-        const uint64 its_command_addr = (_cbaser & 0xFFFFFFFFFF000ull) + _creadr;
+        const uint64 its_command_addr = cbaser_base + _creadr;
         uint64 its_command[4] = {0, 0, 0, 0};
-        if (Errno::NONE
-            == Model::SimpleAS::read_bus(*_mem_bus, its_command_addr, reinterpret_cast<char *>(its_command), COMMAND_SIZE)) {
+        Errno err = _cmd_queue.valid()
+                        ? _cmd_queue.read(GPA(its_command_addr), its_command, COMMAND_SIZE)
+                        : Model::SimpleAS::read_bus(*_mem_bus, its_command_addr, reinterpret_cast<char *>(its_command), COMMAND_SIZE);
+        if (Errno::NONE == err) {
             handle_command(its_command[0], its_command[1], its_command[2], its_command[3]);
         } else {
             _creadr |= 1u; // stalled
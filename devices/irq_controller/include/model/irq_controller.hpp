@@ -8,6 +8,10 @@
 #pragma once
 
 #include <model/vcpu_types.hpp>
+#include <platform/atomic.hpp>
+#include <platform/bits.hpp>
+#include <platform/compiler.hpp>
+#include <platform/time.hpp>
 #include <platform/types.hpp>
 #include <platform/unique_ptr.hpp>
 #include <vbus/vbus.hpp>
@@ -27,7 +31,8 @@ namespace Model {
         MAX_SPI = 992,
         MAX_IRQ_NO_LPI = 1024 - 4,
         LPI_BASE = 8192,
-        MAX_IRQ = LPI_BASE + 1024,
+        MAX_IRQ_ID_BITS = 16,
+        MAX_IRQ = 1 << MAX_IRQ_ID_BITS,
     };
 
     struct IrqInfo {
@@ -42,6 +47,59 @@ namespace Model {
         uint64 num_handled{0};
     };
 
+    /*
+     * Steps of the life of an interrupt that are timed when stats are enabled.
+     * The latency between two consecutive events is recorded in an IrqLatencyHistogram.
+     */
+    enum IrqLatencyStage {
+        ASSERT_TO_INJECT = 0, // The IRQ was asserted, it is now programmed in the CPU interface
+        INJECT_TO_ACK,        // The guest acknowledged the IRQ after its injection
+        ACK_TO_EOI,           // The guest signaled the end of the IRQ after acknowledging it
+        ASSERT_TO_ACK,        // End to end: from the assertion to the guest acknowledging the IRQ
+        NUM_LATENCY_STAGES,
+    };
+
+    /*
+     * Log-scale histogram of latencies: bucket N counts the samples in [2^N, 2^(N+1))
+     * nanoseconds. Bucket 0 also counts samples of 0 and the last bucket counts everything above.
+     */
+    struct IrqLatencyHistogram {
+        static constexpr uint8 NUM_BUCKETS = 32;
+
+        atomic<uint64> buckets[NUM_BUCKETS]{};
+        atomic<uint64> samples{0};
+        atomic<uint64> total{0};
+        atomic<uint64> max{0};
+
+        static uint8 bucket(uint64 latency) {
+            if (latency == 0)
+                return 0;
+            return static_cast<uint8>(::min(63 - clz64(latency), NUM_BUCKETS - 1));
+        }
+
+        void add(uint64 latency) {
+            buckets[bucket(latency)]++;
+            samples++;
+            total += latency;
+
+            uint64 cur = max;
+            while (cur < latency && !max.cas(cur, latency)) {
+            }
+        }
+
+        void reset() {
+            for (auto &b : buckets)
+                b = 0;
+            samples = 0;
+            total = 0;
+            max = 0;
+        }
+    };
+
+    struct IrqLatency {
+        IrqLatencyHistogram stage[NUM_LATENCY_STAGES];
+    };
+
     enum IRQCtlrVersion {
         // ARM
         GIC_UNKNOWN = 0,
@@ -694,7 +694,8 @@ Msr::flush_on_cache_toggle(const VcpuCtx *vcpu, uint64 new_value) {
 
     /*
      * This is the counter-part of the Set/Way flushing logic emulation. Every time the
-     * cache is toggled, we flush the guest AS. Moreover, if the cache is enabled we stop
+     * cache is toggled, we flush the guest AS - only the pages written since the previous flush
+     * if the AS tracks the writes. Moreover, if the cache is enabled we stop
      * trapping the virtual memory registers and wait for an eventual new (nothrow) call to Set/way
      * instructions before flushing again.
      *
@@ -706,7 +707,7 @@ Msr::flush_on_cache_toggle(const VcpuCtx *vcpu, uint64 new_value) {
 
         Vbus::Bus *bus = Msr::SetWayFlushReg::get_associated_bus();
         ASSERT(bus != nullptr);
-        bus->iter_devices<const VcpuCtx>(Model::SimpleAS::flush_callback, nullptr);
+        Model::SimpleAS::flush_bus(*bus);
     }
 
     if (after.cache_enabled()) {
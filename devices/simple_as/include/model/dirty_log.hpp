@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+#pragma once
+
+/*! \file Log of the pages of a guest memory region written since they were last collected
+ */
+
+#include <platform/atomic.hpp>
+#include <platform/bits.hpp>
+#include <platform/new.hpp>
+#include <platform/types.hpp>
+
+namespace Model {
+    class DirtyLog;
+};
+
+/*! \brief Bitmap of the written pages of a guest memory region, one bit per 4 KiB page
+ *
+ *  Writers mark the pages once the data is in memory, a collector takes the bits 64 pages at a
+ *  time and clears them atomically: a page is either reported by the collection that follows its
+ *  write or by the next one, it is never lost. The collector must read the pages after taking
+ *  their bits, the data it reads is at least the one that set them.
+ *
+ *  The bitmap is independent of the size of the host pages, offsets are relative to the
+ *  beginning of the region.
+ */
+class Model::DirtyLog {
+public:
+    static constexpr uint64 GRANULE_BITS = 12;
+    static constexpr uint64 GRANULE = 1ull << GRANULE_BITS;
+
+    DirtyLog() = default;
+    DirtyLog(const DirtyLog &) = delete;
+    DirtyLog &operator=(const DirtyLog &) = delete;
+    ~DirtyLog() { delete[] _bits; }
+
+    /*! \brief Allocate the bitmap of a region, all its pages clean
+     *  \param size_bytes Size of the region
+     *  \return true on success, false if the bitmap cannot be allocated
+     */
+    bool init(uint64 size_bytes) {
+        uint64 words = (align_up(size_bytes, GRANULE) / GRANULE + 63) / 64;
+
+        _bits = new (nothrow) atomic<uint64>[words];
+        if (_bits == nullptr)
+            return false;
+
+        for (uint64 i = 0; i < words; i++)
+            _bits[i] = 0;
+        _size = size_bytes;
+        return true;
+    }
+
+    uint64 size() const { return _size; }
+    uint64 pages() const { return align_up(_size, GRANULE) / GRANULE; }
+    uint64 words() const { return (pages() + 63) / 64; }
+
+    /*! \brief Mark the pages of [off, off + size_bytes) written
+     *  \pre The data is written. The range lies within the region.
+     */
+    void mark(uint64 off, uint64 size_bytes) {
+        if (size_bytes == 0)
+            return;
+
+        uint64 first = off >> GRANULE_BITS;
+        uint64 last = (off + size_bytes - 1) >> GRANULE_BITS;
+
+        for (uint64 w = first / 64; w <= last / 64; w++) {
+            uint64 lo = (w == first / 64) ? first % 64 : 0;
+            uint64 hi = (w == last / 64) ? last % 64 : 63;
+            uint64 mask = (hi == 63 ? ~0ull : (1ull << (hi + 1)) - 1) & ~((1ull << lo) - 1);
+
+            mark_word(w, mask);
+        }
+    }
+
+    /*! \brief Mark the pages 64 * [word] + i for every bit i set in [bits]
+     */
+    void mark_word(uint64 word, uint64 bits) {
+        // Most writes hit pages already dirty: avoid the locked operation for them
+        if (bits != 0 && (_bits[word].load(std::memory_order_relaxed) & bits) != bits)
+            _bits[word].fetch_or(bits, std::memory_order_release);
+    }
+
+    /*! \brief Mark the whole region written, e.g. when its content changed behind the log
+     */
+    void mark_all() { mark(0, _size); }
+
+    /*! \brief Take the dirty bits of the pages 64 * [word] to 64 * [word] + 63 and clear them
+     *  \return bit i is set if the page 64 * [word] + i was written since the last collection
+     */
+    uint64 get_and_clear(uint64 word) {
+        // The word is read first: the clean words, the vast majority, are not written
+        if (_bits[word].load(std::memory_order_relaxed) == 0)
+            return 0;
+
+        return _bits[word].exchange(0, std::memory_order_acquire);
+    }
+
+    /*! \brief Was the page holding [off] written since the last collection?
+     */
+    bool is_dirty(uint64 off) const {
+        uint64 page = off >> GRANULE_BITS;
+        return (_bits[page / 64].load(std::memory_order_acquire) & (1ull << (page % 64))) != 0;
+    }
+
+private:
+    atomic<uint64> *_bits{nullptr};
+    uint64 _size{0};
+};
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+#pragma once
+
+/*! \file Persistent mapping of a guest range for the device models that access it often
+ */
+
+#include <model/simple_as.hpp>
+#include <platform/atomic.hpp>
+#include <platform/errno.hpp>
+#include <platform/string.hpp>
+#include <platform/types.hpp>
+#include <vbus/vbus.hpp>
+
+namespace Model {
+    class GuestMemView;
+};
+
+/*! \brief Handle on a guest physical range held by a single address space
+ *
+ *  The address space is looked up and the range mapped once, by acquire(): the accesses are then
+ *  plain loads and stores, without the bus lookup and the temporary mapping of read_bus() and
+ *  write_bus(). The VMM view of the AS is used when it has one, a mapping of the range otherwise.
+ *
+ *  The view is invalidated when its AS is unregistered from its bus or destructed: valid() turns
+ *  false and the callback given to acquire() is called. The owner must then stop using the view
+ *  and release() it, or acquire() another range. The callback must not release the view itself.
+ *  The SimpleAS object must outlive its views.
+ */
+class Model::GuestMemView {
+public:
+    class Callback {
+    public:
+        virtual ~Callback() {}
+        /*! \brief [view] is not usable anymore, called with the views of the AS locked
+         */
+        virtual void view_invalidated(Model::GuestMemView &view) = 0;
+    };
+
+    GuestMemView() = default;
+    ~GuestMemView() { release(); }
+
+    GuestMemView(const GuestMemView &) = delete;
+    GuestMemView &operator=(const GuestMemView &) = delete;
+
+    /*! \brief Map [gpa, gpa + size) for the accesses to come, releasing the range held before
+     *  \pre Full ownership of this view
+     *  \post On success, the view is valid and serves accesses to the range until it is released
+     *        or invalidated.
+     *  \param bus Bus holding the address spaces
+     *  \param gpa Start of the range
+     *  \param size Size of the range, held by a single address space
+     *  \param write Will the range be written?
+     *  \param cb Called when the view is invalidated, may be nullptr
+     *  \return Errno::NONE on success, Errno::INVAL if no AS holds the whole range, Errno::PERM if
+     *          the AS is read-only and [write] is set, Errno::NOMEM if it cannot be mapped
+     */
+    Errno acquire(const Vbus::Bus &bus, GPA gpa, size_t size, bool write, Callback *cb = nullptr);
+
+    /*! \brief Stop using the range and unmap it
+     */
+    void release();
+
+    bool valid() const { return _valid.load(std::memory_order_acquire); }
+
+    /*! \brief Is [gpa, gpa + sz) served by this view?
+     */
+    bool covers(GPA gpa, size_t sz) const {
+        return valid() && gpa.get_value() >= _gpa.get_value() && sz <= _size && gpa.get_value() - _gpa.get_value() <= _size - sz;
+    }
+
+    GPA gpa() const { return _gpa; }
+    size_t size() const { return _size; }
+    char *hva() const { return _hva; }
+
+    /*! \brief Copy [gpa, gpa + sz) of the guest to [dst]
+     *  \return Errno::NONE on success, Errno::INVAL if the view does not cover the range
+     */
+    Errno read(GPA gpa, void *dst, size_t sz) const {
+        if (!covers(gpa, sz))
+            return Errno::INVAL;
+
+        memcpy(dst, _hva + (gpa.get_value() - _gpa.get_value()), sz);
+        return Errno::NONE;
+    }
+
+    /*! \brief Copy [src] to [gpa, gpa + sz) of the guest, with the log and cache maintenance
+     *         SimpleAS::write() does
+     *  \return Errno::NONE on success, Errno::INVAL if the view does not cover the range,
+     *          Errno::PERM if it was not acquired for write
+     */
+    Errno write(GPA gpa, const void *src, size_t sz);
+
+private:
+    friend class Model::SimpleAS;
+
+    Model::SimpleAS *_as{nullptr};
+    Callback *_cb{nullptr};
+    char *_hva{nullptr};
+    GPA _gpa;
+    size_t _size{0};
+    bool _write{false};
+    bool _own_mapping{false}; // [_hva] is a mapping of ours, not the VMM view of the AS
+    atomic<bool> _valid{false};
+    Model::GuestMemView *_next{nullptr}; // Next view of [_as], protected by its lock
+};
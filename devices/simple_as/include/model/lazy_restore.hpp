@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+#pragma once
+
+/*! \file Restore of the guest memory from a snapshot file, page by page as it is accessed
+ */
+
+#include <platform/atomic.hpp>
+#include <platform/types.hpp>
+#include <platform/userfault.hpp>
+
+namespace Model {
+    class LazyRestore;
+    class SimpleAS;
+}
+
+/*! \brief Fill a SimpleAS from a snapshot file while the guest runs
+ *
+ *  The VMM view of the AS is registered with userfaultfd: the first access to a page blocks until
+ *  run_faults() reads it from the snapshot and copies it in. run_prefetch() restores the remaining
+ *  pages in the background: first the ones given to start(), typically the order in which a
+ *  previous run of the same snapshot accessed them (access_order()), then all the others in
+ *  address order. The embedder runs both loops from threads it created, the vCPUs can run as soon
+ *  as run_faults() is running. To finish, it joins the thread running run_prefetch(), calls
+ *  wait(), then stop() and joins the thread running run_faults().
+ *
+ *  The snapshot holds the content of the AS from offset 0, as written by SimpleAS::capture().
+ *  Pages past its end are restored zeroed. The AS must be mapped with map_host() and not be
+ *  copy-on-write, its memory must not have been touched since it was created: the pages present
+ *  are not restored. Other mappings of the memory, e.g. map_guest_mem(), are populated through
+ *  the VMM view before they are created.
+ */
+class Model::LazyRestore {
+public:
+    struct Stats {
+        atomic<uint64> faults{0};     // Pages restored on demand
+        atomic<uint64> prefetched{0}; // Pages restored in the background
+    };
+
+    LazyRestore(Model::SimpleAS &as, int snapshot_fd) : _as(&as), _snap_fd(snapshot_fd) {}
+    ~LazyRestore();
+
+    LazyRestore(const LazyRestore &) = delete;
+    LazyRestore &operator=(const LazyRestore &) = delete;
+
+    /*! \brief Register the AS, its faults are served by run_faults()
+     *  \param order Indexes of the pages (see granule()) to prefetch first, may be nullptr
+     *  \param order_len Number of entries of [order]
+     *  \return true on success, false if userfaultfd cannot serve the memory of the AS
+     */
+    bool start(const uint64 *order = nullptr, size_t order_len = 0);
+
+    /*! \brief Serve the faults on the AS until stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created.
+     */
+    void run_faults();
+
+    /*! \brief Restore the pages nobody accessed, until all are restored or stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created. Without it, the pages are restored by wait().
+     */
+    void run_prefetch();
+
+    /*! \brief Restore all the pages left from the calling thread
+     *  \pre The thread running run_prefetch(), if any, is joined
+     *  \return true if every page was restored, false otherwise
+     */
+    bool wait();
+
+    /*! \brief Make run_faults() and run_prefetch() return
+     *
+     *  The caller then joins the threads running them, before destroying the object: the
+     *  destructor unregisters the AS.
+     */
+    void stop();
+
+    /*! \brief Are all the pages restored? */
+    bool done() const { return _restored.load() == _pages; }
+
+    /*! \brief Make sure that [offset, offset + size) of the AS is restored, for the accesses that
+     *         do not go through the VMM view
+     */
+    void populate(mword offset, size_t size) const;
+
+    /*! \brief Pages restored on demand so far, in the order of the accesses
+     *  \param out Receives up to [max] page indexes, to give to start() next time
+     *  \return the number of indexes written
+     */
+    size_t access_order(uint64 *out, size_t max) const;
+
+    /*! \brief Size of the pages restored at once: the huge page size for hugetlbfs, the base page
+     *         size otherwise
+     */
+    size_t granule() const { return _granule; }
+
+    const Stats &stats() const { return _stats; }
+
+private:
+    static constexpr size_t PREFETCH_BYTES = 256 * 1024; // Restored with a single copy
+
+    bool restore_pages(uint64 first, uint64 count, char *buf, bool on_demand);
+    bool read_snapshot(char *buf, mword offset, size_t size) const;
+    bool mark_restored(uint64 page);
+    bool is_restored(uint64 page) const {
+        return (_restored_map[page / 64].load(std::memory_order_acquire) & (1ull << (page % 64))) != 0;
+    }
+    size_t prefetch_size() const { return _granule > PREFETCH_BYTES ? _granule : PREFETCH_BYTES; }
+
+    Model::SimpleAS *_as;
+    int _snap_fd;
+    char *_view{nullptr};
+    size_t _granule{0};
+    uint64 _pages{0};
+
+    Platform::UserFault _uffd;
+    atomic<bool> _stop{false};
+    bool _started{false};
+
+    atomic<uint64> *_restored_map{nullptr}; // One bit per page
+    atomic<uint64> _restored{0};
+    uint64 *_first{nullptr};                // Pages to prefetch first
+    size_t _first_len{0};
+    uint64 *_order{nullptr};                // Pages restored on demand, in order
+    atomic<size_t> _order_len{0};
+    char *_fault_buf{nullptr};
+    char *_prefetch_buf{nullptr};
+
+    Stats _stats;
+};
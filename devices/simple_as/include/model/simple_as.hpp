@@ -10,15 +10,21 @@
 /*! \file Basic Address Space representation of the guest memory
  */
 
+#include <arch/barrier.hpp>
+#include <model/dirty_log.hpp>
+#include <platform/atomic.hpp>
 #include <platform/errno.hpp>
 #include <platform/log.hpp>
 #include <platform/memory.hpp>
+#include <platform/mutex.hpp>
 #include <platform/rangemap.hpp>
 #include <platform/types.hpp>
 #include <platform/vector.hpp>
 #include <vbus/vbus.hpp>
 
 namespace Model {
+    class GuestMemView;
+    class LazyRestore;
     class SimpleAS;
 };
 
@@ -382,7 +388,42 @@ public:
  * is flushing the whole AS of the guest.
  */
 class Model::SimpleAS : public Vbus::Device {
+    friend class Model::GuestMemView;
+
+    /*
+     * Lock of the state shared by all the AS. A static Platform::Mutex would be used before any
+     * Platform_ctx is available to init() it, this spin lock is constant-initialized and needs no
+     * setup on any platform. It is never held across a blocking call other than the flushes and
+     * dirty page queries of flush_bus() and sync_dirty_log(), which run with the guest quiescent.
+     */
+    class CAPABILITY("mutex") StaticLock {
+    public:
+        void enter() ACQUIRE() {
+            while (_held.exchange(true, std::memory_order_acquire)) {
+                while (_held.load(std::memory_order_relaxed))
+                    Barrier::relax();
+            }
+        }
+        void exit() RELEASE() { _held.store(false, std::memory_order_release); }
+
+    private:
+        atomic<bool> _held{false};
+    };
+
+    class SCOPED_CAPABILITY StaticGuard {
+    public:
+        explicit StaticGuard(StaticLock &l) ACQUIRE(l) : _l(l) { _l.enter(); }
+        StaticGuard(const StaticGuard &) = delete;
+        StaticGuard &operator=(const StaticGuard &) = delete;
+        ~StaticGuard() RELEASE() { _l.exit(); }
+
+    private:
+        StaticLock &_l;
+    };
+
 public:
+    static constexpr uint16 NO_NUMA_NODE = 0xffff; /*!< Platform::Numa::NO_NODE, see numa_node() */
+
     /*! \brief Construct a Simple AS
      *  \pre Gives up ownership of the name string
      *  \post Full ownership of Simple AS. The Vbus::Device is initialized and read_only is stored.
@@ -393,16 +434,99 @@ public:
              bool flush_on_reset = true, bool flush_on_write = true, Vbus::Device::Type type = GUEST_PHYSICAL_STATIC_MEMORY,
              const char *name = "SimpleAS")
         : Vbus::Device(name, type), _guest_cred(guest_cred), _flush_on_reset(flush_on_reset), _flush_on_write(flush_on_write),
-          _as(guest_range), _mobject(descr) {}
+          _as(guest_range), _mobject(descr) {
+        if (!_views_lock.init()) {
+            ABORT_WITH("Unable to initialize the views lock");
+        }
+    }
     SimpleAS(const SimpleAS &) = delete;
 
     /**
      * @brief Map to host address space for direct access via get_vmm_view(), and return true on success.
      * \pre Full ownership of this object.
      * \post Full ownership back. If and only if this succeeds, then and only then [get_vmm_view() != nullptr].
+     *       Memory backed by hugetlbfs pages can only be mapped if the guest range is aligned on them.
+     *       A copy-on-write AS (Platform::Mem::MemDescr::cow()) must be mapped before any access: all
+     *       of them, map_guest_mem() included, go through the VMM view that holds its private pages.
      */
     bool map_host();
     bool destruct();
+
+    /*! \brief Track the pages of the VMM view written since the last flush_bus()
+     *  \pre Full ownership of this object. map_host() succeeded. The guest memory is only written
+     *       through the VMM view: the hypervisor is given this mapping, not another one.
+     *  \post Ownership unchanged. On success, flush_bus() only cleans and invalidates the pages
+     *        written since the previous flush_bus().
+     *  \return true if the platform tracks the writes, false otherwise (whole AS flushes).
+     */
+    bool enable_dirty_tracking();
+
+    /*! \brief Log the pages of this AS written by the VMM, and by everybody else if [host_writes]
+     *  \pre Full ownership of this object. With [host_writes], map_host() succeeded and the guest
+     *       memory is only written through the VMM view, as for enable_dirty_tracking().
+     *  \post Ownership unchanged. On success, the writes of the VMM through this class, write_bus()
+     *        and the virtio chains mark dirty_log(). With [host_writes], sync_dirty_log() adds the
+     *        pages written through the VMM view by the vCPUs and anything else, the whole AS is
+     *        dirty until then. Writes through map_guest_mem() mappings, such as the virtqueue
+     *        rings, are not logged: their owner saves them by other means.
+     *  \return true on success, false if the log cannot be allocated or the platform does not
+     *          track the writes
+     */
+    bool enable_dirty_log(bool host_writes = false);
+
+    /*! \brief Log of the pages of this AS written, nullptr if enable_dirty_log() was not called
+     */
+    DirtyLog *dirty_log() const { return _dirty_log.load(std::memory_order_acquire); }
+
+    /*! \brief Mark [gpa, gpa + size) written in the log of this AS, if it has one
+     *  \pre The data is written. The range belongs to this AS.
+     */
+    void mark_dirty(GPA gpa, size_t size) const {
+        DirtyLog *log = dirty_log();
+        if (log != nullptr)
+            log->mark(gpa.get_value() - _as.begin(), size);
+    }
+
+    /*! \brief Mark [gpa, gpa + size) written in the logs of the address spaces holding it
+     */
+    static void mark_dirty_bus(const Vbus::Bus &bus, GPA gpa, size_t size);
+
+    /*! \brief Add the pages written since the last call to the logs fed by the host
+     *  \pre The logs to feed belong to [bus]: the platform clears the written state of the whole
+     *       process at once. The vCPUs are stopped, or the pages they write while the state is
+     *       collected are only reported by the next call.
+     *  \post The logs of the address spaces of [bus] enabled with [host_writes] hold the pages
+     *        written since the previous call. The next flush_bus() flushes the AS tracking the
+     *        writes entirely.
+     *  \return true if the written state was collected and cleared, false otherwise
+     */
+    static bool sync_dirty_log(const Vbus::Bus &bus);
+
+    /*! \brief Save the content of this AS to a file, e.g. to be the base image of new clones
+     *  \pre Partial ownership of this object. map_host() succeeded. The guest memory does not change
+     *       during the call: the vCPUs are stopped.
+     *  \post Ownership unchanged. On success, [fd] holds the content of the AS from offset 0.
+     *  \param fd File receiving the content
+     *  \param delta Only write the pages of a copy-on-write AS that differ from its base image, [fd]
+     *         being a copy of that image
+     *  \return true on success, false otherwise
+     */
+    bool capture(int fd, bool delta = false) const;
+
+    /*! \brief Drop the writes made to a copy-on-write AS: it holds its base image again
+     *  \pre Full ownership of this object. map_host() succeeded on a Platform::Mem::MemDescr::cow()
+     *       descriptor. The vCPUs are stopped.
+     *  \post Ownership unchanged. On success, the AS reads as its base image, every page of the AS
+     *        is dirty in its log and the next flush_bus() flushes the whole AS.
+     *  \return true on success, false otherwise
+     */
+    bool restore();
+
+    /*! \brief Populate the other mappings of this AS through [lazy], see Model::LazyRestore
+     *  \note Set by LazyRestore::start() and cleared once all the pages are restored
+     */
+    void set_lazy_restore(LazyRestore *lazy) { _lazy.store(lazy, std::memory_order_release); }
+
     const Range<mword> &get_range() const { return _as; }
 
     /*! \brief Get the beginning of this AS's GPA range
@@ -426,6 +550,35 @@ public:
      */
     const Platform::Mem::MemDescr &get_mem_fd() const { return _mobject; }
 
+    /*! \brief Place the memory of this AS on a host NUMA node
+     *  \pre Full ownership of this object. map_host() succeeded.
+     *  \post Ownership unchanged. On success, the pages of the AS are allocated on [node] and the
+     *        pages already allocated are moved there.
+     *  \param node Host NUMA node, see Platform::Numa
+     *  \return true on success, false otherwise
+     */
+    bool set_numa_node(uint16 node);
+
+    /*! \brief Host NUMA node holding this AS, NO_NUMA_NODE if it has no placement
+     */
+    uint16 numa_node() const { return _numa_node; }
+
+    /*! \brief Host NUMA node holding a guest address, NO_NUMA_NODE if unknown
+     */
+    static uint16 numa_node_at(const Vbus::Bus &bus, GPA gpa);
+
+    /*! \brief Size of the host pages backing this AS
+     *  \pre Partial ownership of this object
+     *  \post Ownership unchanged.
+     *  \return the page size of the memory descriptor, or the base page size if the guest range is
+     *          not aligned on it: the guest cannot get large mappings of such a range.
+     */
+    size_t page_size() const {
+        size_t sz = _mobject.page_size();
+        return (align_dn(_as.begin(), sz) == _as.begin() && align_dn(_as.size(), sz) == _as.size()) ? sz
+                                                                                                   : static_cast<size_t>(PAGE_SIZE);
+    }
+
     /*! \brief Is the given GPA valid in this AS?
      *  \pre Partial ownership of the object.
      *  \post Ownership unchanged. true if the address belongs to this AS, false otherwise.
@@ -458,6 +611,7 @@ public:
      *  \pre Partial ownership of the object. Full ownership of the destination buffer.
      *  \post Ownership unchanged. The data is copied from the guest AS to the buffer if the
      * parameters given by the caller are valid. Otherwise, the buffer is left untouched.
+     *  \note read_bus() handles ranges spanning several address spaces
      *  \param dst buffer that will receive the guest data
      *  \param size size to read
      *  \param addr start of the read on the guest AS
@@ -495,6 +649,7 @@ public:
      *  \pre Partial ownership of the object. Full ownership of the source buffer.
      *  \post Ownership unchanged. The data is copied from the buffer to the guest AS if the
      * parameters given by the caller are valid. Otherwise, the guest AS is left untouched.
+     *  \note write_bus() handles ranges spanning several address spaces
      *  \param gpa start of the write on the guest AS
      *  \param size size to write
      *  \param src buffer that contains the data to write
@@ -509,6 +664,14 @@ public:
      */
     static void flush_callback(Vbus::Bus::DeviceEntry *de, const VcpuCtx *);
 
+    /*! \brief Make sure that all data written to the address spaces of a bus made it to physical RAM
+     *  \pre Nothing
+     *  \post Every AS of the bus is flushed as flush_callback() does. The AS tracking the writes
+     *        only flush the pages written since the last call, all the pages otherwise.
+     *  \param bus Bus holding the address spaces
+     */
+    static void flush_bus(const Vbus::Bus &bus);
+
     /*! \brief Access function inherited from the parent class
      *  \pre Partial ownership of this device
      *  \post Ownership unchanged
@@ -524,6 +687,10 @@ public:
      */
     void reset() override {}
 
+    /*! \brief Removed from the bus: the GuestMemView of this AS are invalidated
+     */
+    void unregistered() override { invalidate_views(); }
+
     /*! \brief Converts a GPA to an address valid for the VMM
      *  \pre Partial ownership of this device
      *  \post Ownership unchanged. It the GPA is within this AS, a valid pointer to memory. nullptr
@@ -548,7 +715,41 @@ public:
     static Errno read_bus(const Vbus::Bus &bus, GPA addr, char *dst, size_t sz);
     static Errno write_bus(const Vbus::Bus &bus, GPA addr, const char *src, size_t sz);
 
-    static void lookup_mem_ranges(const Vbus::Bus &bus, const Range<uint64> &gpa_range, Vector<Model::SimpleAS *> &out);
+    /*! \brief Part of a guest range backed by a single address space
+     */
+    struct MemSegment {
+        Range<uint64> gpa;   /*!< Guest physical range of the segment */
+        char *hva;           /*!< VMM view of [gpa], nullptr if the AS has no persistent mapping */
+        Model::SimpleAS *as; /*!< Address space holding [gpa] */
+    };
+
+    /*! \brief Find the address spaces covering a guest range, in order
+     *  \pre Partial ownership of the bus
+     *  \post Ownership unchanged. [out] holds the address spaces found from the beginning of the
+     *        range, up to the first address that no AS covers.
+     *  \param bus Bus holding the address spaces
+     *  \param gpa_range Guest physical range to look up
+     *  \param out Address spaces covering the range
+     *  \return true if the address spaces cover the whole range, false otherwise
+     */
+    static bool lookup_mem_ranges(const Vbus::Bus &bus, const Range<uint64> &gpa_range, Vector<Model::SimpleAS *> &out);
+
+    /*! \brief Split a guest range into the segments backed by each address space
+     *  \pre Partial ownership of the bus
+     *  \post Ownership unchanged. [out] holds the segments found from the beginning of the range,
+     *        up to the first address that no AS covers.
+     *  \param bus Bus holding the address spaces
+     *  \param gpa_range Guest physical range to look up
+     *  \param out Segments covering the range, in order
+     *  \return true if the segments cover the whole range, false otherwise
+     */
+    static bool lookup_mem_segments(const Vbus::Bus &bus, const Range<uint64> &gpa_range, Vector<MemSegment> &out);
+
+    /*! \brief Size of the part of [gpa, gpa + sz) held by the address space containing [gpa]
+     *  \return the size of the first segment of the range, 0 if no AS contains [gpa]
+     */
+    static size_t segment_size(const Vbus::Bus &bus, GPA gpa, size_t sz);
+
     Errno clean_invalidate(GPA gpa, size_t size) const;
 
     uint64 single_access_read(uint64 off, uint8 size) const;
@@ -564,6 +765,18 @@ protected:
      */
     void flush_guest_as();
     bool mapped() const { return (_vmm_view != nullptr); }
+    bool needs_flush() const { return !is_read_only() && _flush_on_reset && _mobject.cred().write(); }
+
+    void attach_view(GuestMemView *view);
+    void detach_view(GuestMemView *view);
+    void invalidate_views();
+
+    bool snapshot_dirty() REQUIRES(_dirty_lock);
+    void flush_dirty(uint64 epoch) REQUIRES(_dirty_lock);
+    static void snapshot_callback(Vbus::Bus::DeviceEntry *de, bool *tracked) REQUIRES(_dirty_lock);
+    static void flush_dirty_callback(Vbus::Bus::DeviceEntry *de, const uint64 *epoch) REQUIRES(_dirty_lock);
+    bool harvest_dirty_log() REQUIRES(_dirty_lock);
+    static void harvest_callback(Vbus::Bus::DeviceEntry *de, bool *logged) REQUIRES(_dirty_lock);
 
     Platform::Mem::Cred _guest_cred;  /*!< Permissions for guest mappings to this range. */
     const bool _flush_on_reset;       /*!< Do we flush on memory state change? Reboot or cache toggle */
@@ -572,6 +785,42 @@ protected:
     Range<mword> _as;                 /*!< Range(gpa RAM base, guest RAM size) */
 
     Platform::Mem::MemDescr _mobject; /*!< BHV Memory Range object behind this guest range */
+    uint16 _numa_node{NO_NUMA_NODE}; /*!< Host NUMA node holding this range */
+
+    /*
+     * Write tracking: the platform clears the dirty state of all the pages at once, [_dirty_clears]
+     * counts these clears. The dirty state of this AS is only complete if [_dirty_epoch] matches
+     * it, i.e. no flush_bus() missed this AS since the last one that flushed it. Writes made through
+     * another mapping than the VMM view (map_view()) are not tracked and force a whole AS flush.
+     */
+    uint64 *_dirty_map GUARDED_BY(_dirty_lock){nullptr}; /*!< One bit per page, dirty pages to flush */
+    uint64 _dirty_epoch GUARDED_BY(_dirty_lock){~0ull};
+    bool _dirty_snapshot GUARDED_BY(_dirty_lock){false}; /*!< [_dirty_map] holds the pages to flush */
+    mutable atomic<bool> _untracked_write{false};
+
+    /*
+     * Write log: [_dirty_log] is set once and lives as long as the AS. [_host_dirty] receives the
+     * pages written according to the platform, merged into the log before every clear.
+     */
+    atomic<DirtyLog *> _dirty_log{nullptr};
+    uint64 *_host_dirty GUARDED_BY(_dirty_lock){nullptr};
+
+    atomic<LazyRestore *> _lazy{nullptr}; /*!< Restore filling the VMM view, if any */
+
+    mutable Platform::Mutex _views_lock;
+    GuestMemView *_views GUARDED_BY(_views_lock){nullptr}; /*!< Views to invalidate with the AS */
+
+    /*
+     * The VMM views of the copy-on-write AS: map_guest_mem() hands out parts of them, which
+     * unmap_guest_mem() must leave in place.
+     */
+    Model::SimpleAS *_next_cow GUARDED_BY(_cow_lock){nullptr};
+    static Model::SimpleAS *_cow_views GUARDED_BY(_cow_lock);
+    static atomic<size_t> _num_cow_views; /*!< Length of _cow_views, lets unmap_guest_mem() skip the lock */
+    static StaticLock _cow_lock;
+
+    static StaticLock _dirty_lock;
+    static uint64 _dirty_clears GUARDED_BY(_dirty_lock);
 };
 
 class MappingGuard {
@@ -589,10 +838,12 @@ public:
     }
 
     void unmap() {
-        if (_write)
+        if (_write) {
+            Model::SimpleAS::mark_dirty_bus(*_bus, _gpa, _size_bytes);
             Model::SimpleAS::demand_unmap_bus_clean(*_bus, _gpa, _size_bytes, _va);
-        else
+        } else {
             Model::SimpleAS::demand_unmap_bus(*_bus, _gpa, _size_bytes, _va);
+        }
 
         _va = nullptr;
     }
@@ -0,0 +1,80 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <arch/mem_util.hpp>
+#include <model/guest_mem_view.hpp>
+#include <model/simple_as.hpp>
+#include <platform/errno.hpp>
+#include <platform/log.hpp>
+#include <platform/string.hpp>
+#include <platform/types.hpp>
+#include <vbus/vbus.hpp>
+
+Errno
+Model::GuestMemView::acquire(const Vbus::Bus &bus, GPA gpa, size_t size, bool write, Callback *cb) {
+    release();
+
+    Model::SimpleAS *as = Model::SimpleAS::get_as_device_at(bus, gpa, size);
+    if (as == nullptr || size == 0 || !as->is_gpa_valid(gpa, size))
+        return Errno::INVAL;
+
+    if (write && as->is_read_only())
+        return Errno::PERM;
+
+    char *hva = as->gpa_to_vmm_view(gpa, size);
+    bool own = (hva == nullptr);
+    if (own) {
+        hva = static_cast<char *>(as->map_view(gpa.get_value() - as->get_guest_view().get_value(), size, write));
+        if (hva == nullptr)
+            return Errno::NOMEM;
+    }
+
+    _as = as;
+    _cb = cb;
+    _hva = hva;
+    _gpa = gpa;
+    _size = size;
+    _write = write;
+    _own_mapping = own;
+    as->attach_view(this);
+    return Errno::NONE;
+}
+
+void
+Model::GuestMemView::release() {
+    if (_as == nullptr)
+        return;
+
+    _as->detach_view(this);
+    if (_own_mapping)
+        Model::SimpleAS::unmap_guest_mem(_hva, _size);
+
+    _as = nullptr;
+    _cb = nullptr;
+    _hva = nullptr;
+    _size = 0;
+}
+
+Errno
+Model::GuestMemView::write(GPA gpa, const void *src, size_t sz) {
+    if (!covers(gpa, sz))
+        return Errno::INVAL;
+    if (!_write)
+        return Errno::PERM;
+
+    char *dst = _hva + (gpa.get_value() - _gpa.get_value());
+    memcpy(dst, src, sz);
+    _as->mark_dirty(gpa, sz);
+
+    if (_as->_flush_on_write) {
+        dcache_clean_range(dst, sz);
+        icache_invalidate_range(dst, sz);
+    }
+
+    return Errno::NONE;
+}
@@ -0,0 +1,252 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <cerrno>
+#include <model/lazy_restore.hpp>
+#include <model/simple_as.hpp>
+#include <platform/bits.hpp>
+#include <platform/log.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+#include <unistd.h>
+
+Model::LazyRestore::~LazyRestore() {
+    if (_started) {
+        if (!done())
+            WARN("Guest region " FMTx64 ": " FMTu64 " pages could not be restored, they read as zeroes",
+                 _as->get_guest_view().get_value(), _pages - _restored.load());
+
+        _as->set_lazy_restore(nullptr);
+        _uffd.unregister(_view, _pages * _granule);
+        _uffd.destroy();
+    }
+
+    delete[] _restored_map;
+    delete[] _first;
+    delete[] _order;
+    delete[] _fault_buf;
+    delete[] _prefetch_buf;
+}
+
+bool
+Model::LazyRestore::start(const uint64 *order, size_t order_len) {
+    const Platform::Mem::MemDescr &descr = _as->get_mem_fd();
+
+    _view = _as->get_vmm_view();
+    if (_started || _view == nullptr || descr.copy_on_write())
+        return false;
+
+    _granule = descr.hugetlb() ? descr.page_size() : static_cast<size_t>(PAGE_SIZE);
+    _pages = align_up(_as->get_size(), _granule) / _granule;
+
+    size_t words = (_pages + 63) / 64;
+    _restored_map = new (nothrow) atomic<uint64>[words];
+    _order = new (nothrow) uint64[_pages];
+    _fault_buf = new (nothrow) char[_granule];
+    _prefetch_buf = new (nothrow) char[prefetch_size()];
+    if (_restored_map == nullptr || _order == nullptr || _fault_buf == nullptr || _prefetch_buf == nullptr)
+        return false;
+
+    for (size_t i = 0; i < words; i++)
+        _restored_map[i] = 0;
+
+    if (order_len != 0) {
+        _first = new (nothrow) uint64[order_len];
+        if (_first == nullptr)
+            return false;
+        memcpy(_first, order, order_len * sizeof(uint64));
+        _first_len = order_len;
+    }
+
+    if (!_uffd.init())
+        return false;
+
+    if (!_uffd.register_missing(_view, _pages * _granule)) {
+        WARN("Guest region " FMTx64 " cannot be restored lazily: userfaultfd refuses its memory",
+             _as->get_guest_view().get_value());
+        _uffd.destroy();
+        return false;
+    }
+
+    _stop = false;
+    _started = true;
+    _as->set_lazy_restore(this);
+
+    INFO("Guest region " FMTx64 " restored lazily, " FMTu64 " pages of %zu KiB", _as->get_guest_view().get_value(), _pages,
+         _granule / 1024);
+    return true;
+}
+
+bool
+Model::LazyRestore::wait() {
+    if (!_started)
+        return done();
+
+    run_prefetch();
+
+    // Pages left missing would read as zeroes: keep populating the other mappings
+    if (!done())
+        return false;
+
+    _as->set_lazy_restore(nullptr);
+    return true;
+}
+
+void
+Model::LazyRestore::stop() {
+    _stop = true;
+    if (_started && !_uffd.interrupt())
+        WARN("Unable to wake up the lazy restore fault loop");
+}
+
+void
+Model::LazyRestore::populate(mword offset, size_t size) const {
+    if (size == 0)
+        return;
+
+    // A read through the VMM view raises the fault that restores the page
+    for (uint64 page = offset / _granule; page <= (offset + size - 1) / _granule && page < _pages; page++) {
+        if (!is_restored(page))
+            (void)*static_cast<volatile char *>(_view + page * _granule);
+    }
+}
+
+size_t
+Model::LazyRestore::access_order(uint64 *out, size_t max) const {
+    size_t n = min(max, _order_len.load(std::memory_order_acquire));
+
+    memcpy(out, _order, n * sizeof(uint64));
+    return n;
+}
+
+bool
+Model::LazyRestore::mark_restored(uint64 page) {
+    uint64 bit = 1ull << (page % 64);
+    if ((_restored_map[page / 64].fetch_or(bit, std::memory_order_release) & bit) != 0)
+        return false;
+
+    _restored++;
+    return true;
+}
+
+bool
+Model::LazyRestore::read_snapshot(char *buf, mword offset, size_t size) const {
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(_snap_fd, buf + done, size - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            WARN("Unable to read the snapshot at 0x%lx: %d", offset + done, errno);
+            return false;
+        }
+        if (n == 0)
+            break;
+        done += static_cast<size_t>(n);
+    }
+
+    // Past the end of the snapshot
+    memset(buf + done, 0, size - done);
+    return true;
+}
+
+/*
+ * Copy [count] pages from [first] into the AS. The other loop may have restored some of them in
+ * the meantime: the kernel refuses to copy over them, they are skipped.
+ */
+bool
+Model::LazyRestore::restore_pages(uint64 first, uint64 count, char *buf, bool on_demand) {
+    mword offset = first * _granule;
+    size_t size = count * _granule;
+    size_t done = 0;
+
+    if (!read_snapshot(buf, offset, size))
+        return false;
+
+    while (done < size) {
+        size_t copied = 0;
+        Errno err = _uffd.copy(_view + offset + done, buf + done, size - done, copied);
+
+        if (err == Errno::EXIST) {
+            // Somebody may wait for this page: the copy that provided it could predate the fault
+            _uffd.wake(_view + offset + done, _granule);
+            mark_restored((offset + done) / _granule);
+            done += _granule;
+            continue;
+        }
+
+        if (err == Errno::INVAL) {
+            WARN("Unable to restore guest memory at offset 0x%lx: %d", offset + done, errno);
+            return false;
+        }
+
+        for (uint64 page = (offset + done) / _granule; page < (offset + done + copied) / _granule; page++) {
+            if (!mark_restored(page))
+                continue;
+
+            if (!on_demand) {
+                _stats.prefetched++;
+                continue;
+            }
+
+            _stats.faults++;
+            _order[_order_len.load(std::memory_order_relaxed)] = page;
+            _order_len.store(_order_len.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+        done += copied;
+    }
+
+    return true;
+}
+
+void
+Model::LazyRestore::run_faults() {
+    while (!_stop) {
+        mword addr = 0;
+        Errno err = _uffd.next_fault(addr);
+
+        if (err == Errno::AGAIN)
+            continue;
+        if (err != Errno::NONE) {
+            WARN("Lazy restore of guest region " FMTx64 ": cannot read the faults", _as->get_guest_view().get_value());
+            return;
+        }
+
+        uint64 page = (addr - reinterpret_cast<mword>(_view)) / _granule;
+        if (page >= _pages || !restore_pages(page, 1, _fault_buf, true))
+            ABORT_WITH("Unable to restore the guest memory at 0x%lx", addr);
+    }
+}
+
+void
+Model::LazyRestore::run_prefetch() {
+    const uint64 run = prefetch_size() / _granule;
+
+    for (size_t i = 0; i < _first_len && !_stop; i++) {
+        if (_first[i] < _pages && !is_restored(_first[i]) && !restore_pages(_first[i], 1, _prefetch_buf, false))
+            return;
+    }
+
+    // The pages left, in address order and by runs of missing pages
+    uint64 page = 0;
+    while (page < _pages && !_stop) {
+        if (is_restored(page)) {
+            page++;
+            continue;
+        }
+
+        uint64 count = 1;
+        while (count < run && page + count < _pages && !is_restored(page + count))
+            count++;
+
+        if (!restore_pages(page, count, _prefetch_buf, false))
+            return;
+        page += count;
+    }
+}
@@ -8,17 +8,30 @@
 
 #include <arch/barrier.hpp>
 #include <arch/mem_util.hpp>
+#include <model/guest_mem_view.hpp>
+#include <model/lazy_restore.hpp>
 #include <model/simple_as.hpp>
 #include <platform/compiler.hpp>
 #include <platform/errno.hpp>
 #include <platform/log.hpp>
 #include <platform/memory.hpp>
+#include <platform/mutex.hpp>
+#include <platform/new.hpp>
+#include <platform/numa.hpp>
 #include <platform/rangemap.hpp>
 #include <platform/string.hpp>
 #include <platform/types.hpp>
 #include <platform/vector.hpp>
 #include <vbus/vbus.hpp>
 
+static_assert(Model::SimpleAS::NO_NUMA_NODE == Platform::Numa::NO_NODE, "NUMA node sentinels differ");
+
+Model::SimpleAS::StaticLock Model::SimpleAS::_dirty_lock;
+uint64 Model::SimpleAS::_dirty_clears = 0;
+Model::SimpleAS::StaticLock Model::SimpleAS::_cow_lock;
+Model::SimpleAS* Model::SimpleAS::_cow_views = nullptr;
+atomic<size_t> Model::SimpleAS::_num_cow_views{0};
+
 // Alignment is ensured by the caller but the compiler does not know this
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcast-align"
@@ -128,6 +141,7 @@ Model::SimpleAS::single_access_write(uint64 off, uint8 size, uint64 value) const
         ABORT_WITH("could not map offset 0x%llx sz 0x%x", off, size);
 
     single_mapped_write(ptr, size, value);
+    mark_dirty(GPA(_as.begin() + off), size);
 
     if (!mapped()) {
         unmap_guest_mem(ptr, size);
@@ -171,6 +185,7 @@ Model::SimpleAS::write(const GPA& gpa, size_t size, const char* src) const {
     }
 
     memcpy(dst, src, size);
+    mark_dirty(gpa, size);
 
     if (_flush_on_write)
         return demand_unmap_clean(gpa, size, dst);
@@ -190,6 +205,10 @@ Model::SimpleAS::demand_map(const GPA& gpa, size_t size_bytes, void*& va, bool w
 
     mword offset = gpa.get_value() - get_guest_view().get_value();
     if (!mapped()) {
+        // Another mapping would not see the private pages of the AS
+        if (_mobject.copy_on_write())
+            return Errno::NOMEM;
+
         DEBUG("demand_map pa:0x%llx size:0x%lx write:%d (+0x%lx)", gpa.get_value(), size_bytes, write, offset);
         va = Platform::Mem::map_mem(_mobject, offset, size_bytes, Platform::Mem::READ | (write ? Platform::Mem::WRITE : 0),
                                     get_mem_fd().msel());
@@ -237,6 +256,21 @@ Model::SimpleAS::map_view(mword offset, size_t size, bool write) const {
     if (is_read_only() && write && !_mobject.cred().write())
         return nullptr;
 
+    // The VMM view holds the private pages of the AS, the writes through it are tracked
+    if (_mobject.copy_on_write()) {
+        if (!mapped())
+            ABORT_WITH("Copy-on-write guest region:" FMTx64 " is used before map_host()", get_guest_view().get_value());
+        return _vmm_view + offset;
+    }
+
+    if (write)
+        _untracked_write = true;
+
+    // A new mapping does not raise the faults of the VMM view: restore the pages first
+    LazyRestore* lazy = _lazy.load(std::memory_order_acquire);
+    if (lazy != nullptr)
+        lazy->populate(offset, size);
+
     void* dst = Platform::Mem::map_mem(_mobject, offset, size, Platform::Mem::READ | (write ? Platform::Mem::WRITE : 0),
                                        get_mem_fd().msel());
     if (dst == nullptr)
@@ -275,7 +309,7 @@ Model::SimpleAS::clean_invalidate(GPA gpa, size_t size) const {
 
 void
 Model::SimpleAS::flush_guest_as() {
-    if (is_read_only() or not _flush_on_reset or not _mobject.cred().write())
+    if (!needs_flush())
         return;
 
     void* mapped_area;
@@ -309,6 +343,273 @@ Model::SimpleAS::flush_callback(Vbus::Bus::DeviceEntry* de, const VcpuCtx*) {
     }
 }
 
+/*
+ * Collect the pages written since the last clear of the dirty state. Returns true if this AS
+ * tracks the writes, whether they could be collected or not.
+ */
+bool
+Model::SimpleAS::snapshot_dirty() {
+    _dirty_snapshot = false;
+    if (_dirty_map == nullptr || !needs_flush())
+        return false;
+
+    // Something escaped the tracking: flush the whole AS this time
+    if (_untracked_write.exchange(false) || _dirty_epoch != _dirty_clears)
+        return true;
+
+    _dirty_snapshot = Platform::Mem::dirty_pages(_vmm_view, get_size(), _dirty_map);
+    return true;
+}
+
+void
+Model::SimpleAS::flush_dirty(uint64 epoch) {
+    if (!needs_flush())
+        return;
+
+    if (!_dirty_snapshot) {
+        flush_guest_as();
+    } else {
+        const size_t page_size = static_cast<size_t>(PAGE_SIZE);
+        const size_t pages = align_up(get_size(), page_size) / page_size;
+        size_t page = 0;
+
+        // Clean and invalidate every run of dirty pages with a single call
+        while (page < pages) {
+            uint64 word = _dirty_map[page / 64] >> (page % 64);
+
+            if (word == 0) {
+                page = align_dn(page, 64) + 64;
+                continue;
+            }
+
+            page += static_cast<size_t>(__builtin_ctzll(word));
+            size_t first = page;
+            while (page < pages && (_dirty_map[page / 64] & (1ull << (page % 64))) != 0)
+                page++;
+
+            mword off = first * page_size;
+            dcache_clean_invalidate_range(_vmm_view + off, min(page * page_size, get_size()) - off);
+        }
+
+        Barrier::system();
+    }
+
+    if (_dirty_map != nullptr)
+        _dirty_epoch = epoch;
+    _dirty_snapshot = false;
+}
+
+void
+Model::SimpleAS::snapshot_callback(Vbus::Bus::DeviceEntry* de, bool* tracked) {
+    Vbus::Device* dev = de->device;
+
+    if (dev->type() == Vbus::Device::GUEST_PHYSICAL_STATIC_MEMORY || dev->type() == Vbus::Device::GUEST_PHYSICAL_DYNAMIC_MEMORY) {
+        Model::SimpleAS* as = reinterpret_cast<Model::SimpleAS*>(dev);
+
+        // The logs fed by the platform must take the written pages before they are cleared
+        bool logged = as->harvest_dirty_log();
+        if (as->snapshot_dirty() || logged)
+            *tracked = true;
+    }
+}
+
+void
+Model::SimpleAS::flush_dirty_callback(Vbus::Bus::DeviceEntry* de, const uint64* epoch) {
+    Vbus::Device* dev = de->device;
+
+    if (dev->type() == Vbus::Device::GUEST_PHYSICAL_STATIC_MEMORY || dev->type() == Vbus::Device::GUEST_PHYSICAL_DYNAMIC_MEMORY) {
+        Model::SimpleAS* as = reinterpret_cast<Model::SimpleAS*>(dev);
+
+        as->flush_dirty(*epoch);
+    }
+}
+
+/*
+ * The dirty state of all the AS is collected first, then cleared, then the collected pages are
+ * flushed: a page written after the clear is flushed by the next call. A page first written
+ * between its collection and the clear is missed, callers flush with the guest quiescent.
+ * If the clear fails, the dirty state keeps accumulating and the next call flushes a superset.
+ */
+void
+Model::SimpleAS::flush_bus(const Vbus::Bus& bus) {
+    StaticGuard guard{_dirty_lock};
+    bool tracked = false;
+
+    bus.iter_devices<bool>(snapshot_callback, &tracked);
+    if (tracked && Platform::Mem::dirty_clear())
+        _dirty_clears++;
+
+    const uint64 epoch = _dirty_clears;
+    bus.iter_devices<const uint64>(flush_dirty_callback, &epoch);
+}
+
+/*
+ * Merge the pages written according to the platform into the log. The log is made entirely dirty
+ * if they cannot be collected. Returns true if the log is fed by the platform.
+ */
+bool
+Model::SimpleAS::harvest_dirty_log() {
+    DirtyLog* log = dirty_log();
+    if (_host_dirty == nullptr || log == nullptr)
+        return false;
+
+    if (!Platform::Mem::dirty_pages(_vmm_view, get_size(), _host_dirty)) {
+        log->mark_all();
+        return true;
+    }
+
+    const size_t page_size = static_cast<size_t>(PAGE_SIZE);
+    const size_t pages = align_up(get_size(), page_size) / page_size;
+
+    for (size_t w = 0; w < (pages + 63) / 64; w++) {
+        uint64 word = _host_dirty[w];
+
+        if (page_size == DirtyLog::GRANULE) {
+            log->mark_word(w, word);
+            continue;
+        }
+
+        for (; word != 0; word &= word - 1) {
+            mword off = (w * 64 + static_cast<size_t>(__builtin_ctzll(word))) * page_size;
+            log->mark(off, min(page_size, static_cast<size_t>(get_size() - off)));
+        }
+    }
+
+    return true;
+}
+
+void
+Model::SimpleAS::harvest_callback(Vbus::Bus::DeviceEntry* de, bool* logged) {
+    Vbus::Device* dev = de->device;
+
+    if (dev->type() == Vbus::Device::GUEST_PHYSICAL_STATIC_MEMORY || dev->type() == Vbus::Device::GUEST_PHYSICAL_DYNAMIC_MEMORY) {
+        Model::SimpleAS* as = reinterpret_cast<Model::SimpleAS*>(dev);
+
+        if (as->harvest_dirty_log())
+            *logged = true;
+    }
+}
+
+/*
+ * Clearing the written state bumps [_dirty_clears]: the AS tracking the writes for flush_bus() miss
+ * the pages written before this call, they flush everything next time.
+ */
+bool
+Model::SimpleAS::sync_dirty_log(const Vbus::Bus& bus) {
+    StaticGuard guard{_dirty_lock};
+    bool logged = false;
+
+    bus.iter_devices<bool>(harvest_callback, &logged);
+    if (!logged || !Platform::Mem::dirty_clear())
+        return false;
+
+    _dirty_clears++;
+    return true;
+}
+
+void
+Model::SimpleAS::mark_dirty_bus(const Vbus::Bus& bus, GPA gpa, size_t size) {
+    const Model::SimpleAS* as = get_as_device_at(bus, gpa, size);
+    if (__LIKELY__(as != nullptr && as->is_gpa_valid(gpa, size))) {
+        as->mark_dirty(gpa, size);
+        return;
+    }
+
+    Vector<MemSegment> segs;
+    lookup_mem_segments(bus, Range<uint64>(gpa.get_value(), size), segs);
+    for (const MemSegment& seg : segs)
+        seg.as->mark_dirty(GPA(seg.gpa.begin()), seg.gpa.size());
+}
+
+bool
+Model::SimpleAS::enable_dirty_log(bool host_writes) {
+    if (host_writes && (!mapped() || !Platform::Mem::dirty_tracking_supported()))
+        return false;
+
+    StaticGuard guard{_dirty_lock};
+    DirtyLog* log = dirty_log();
+    if (log == nullptr) {
+        log = new (nothrow) DirtyLog;
+        if (log == nullptr || !log->init(get_size())) {
+            delete log;
+            return false;
+        }
+
+        _dirty_log.store(log, std::memory_order_release);
+    }
+
+    if (host_writes && _host_dirty == nullptr) {
+        const size_t page_size = static_cast<size_t>(PAGE_SIZE);
+        const size_t pages = align_up(get_size(), page_size) / page_size;
+        _host_dirty = new (nothrow) uint64[(pages + 63) / 64];
+        if (_host_dirty == nullptr)
+            return false;
+
+        // What was written before the first sync_dirty_log() is unknown
+        log->mark_all();
+    }
+
+    return true;
+}
+
+bool
+Model::SimpleAS::capture(int fd, bool delta) const {
+    if (!mapped() || (delta && !_mobject.copy_on_write()))
+        return false;
+
+    if (!delta)
+        return Platform::Mem::write_pages(fd, _vmm_view, get_size(), nullptr);
+
+    const size_t page_size = static_cast<size_t>(PAGE_SIZE);
+    const size_t pages = align_up(get_size(), page_size) / page_size;
+    uint64* priv = new (nothrow) uint64[(pages + 63) / 64];
+    if (priv == nullptr)
+        return false;
+
+    // Without the private pages, the whole content is written
+    bool ok = Platform::Mem::private_pages(_vmm_view, get_size(), priv);
+    ok = Platform::Mem::write_pages(fd, _vmm_view, get_size(), ok ? priv : nullptr);
+    delete[] priv;
+    return ok;
+}
+
+bool
+Model::SimpleAS::restore() {
+    if (!mapped() || !_mobject.copy_on_write())
+        return false;
+
+    if (!Platform::Mem::discard_private(_vmm_view, get_size()))
+        return false;
+
+    // The content changed behind the trackers
+    _untracked_write = true;
+    DirtyLog* log = dirty_log();
+    if (log != nullptr)
+        log->mark_all();
+    return true;
+}
+
+bool
+Model::SimpleAS::enable_dirty_tracking() {
+    if (!mapped() || !Platform::Mem::dirty_tracking_supported())
+        return false;
+
+    StaticGuard guard{_dirty_lock};
+    if (_dirty_map != nullptr)
+        return true;
+
+    const size_t page_size = static_cast<size_t>(PAGE_SIZE);
+    const size_t pages = align_up(get_size(), page_size) / page_size;
+    _dirty_map = new (nothrow) uint64[(pages + 63) / 64];
+    if (_dirty_map == nullptr)
+        return false;
+
+    // The first flush_bus() flushes the whole AS and starts the tracking
+    _dirty_epoch = ~0ull;
+    _untracked_write = false;
+    return true;
+}
+
 char*
 Model::SimpleAS::gpa_to_vmm_view(GPA addr, size_t sz) const {
     if (!is_gpa_valid(addr, sz))
@@ -346,11 +647,23 @@ Model::SimpleAS::gpa_to_vmm_view(const Vbus::Bus& bus, GPA addr, size_t sz) {
 
 Errno
 Model::SimpleAS::read_bus(const Vbus::Bus& bus, GPA addr, char* dst, size_t sz) {
+    // The bus returns any AS overlapping the range: the fast path needs one holding all of it
     Model::SimpleAS* tgt = get_as_device_at(bus, addr, sz);
-    if (tgt == nullptr)
+    if (__LIKELY__(tgt != nullptr && tgt->is_gpa_valid(addr, sz)))
+        return tgt->read(dst, sz, addr);
+
+    // The range may span several address spaces: copy each segment with a single memcpy
+    Vector<MemSegment> segs;
+    if (!lookup_mem_segments(bus, Range<uint64>(addr.get_value(), sz), segs))
         return Errno::INVAL;
 
-    return tgt->read(dst, sz, addr);
+    for (const MemSegment& seg : segs) {
+        Errno err = seg.as->read(dst + (seg.gpa.begin() - addr.get_value()), seg.gpa.size(), GPA(seg.gpa.begin()));
+        if (err != Errno::NONE)
+            return err;
+    }
+
+    return Errno::NONE;
 }
 
 Errno
@@ -389,28 +702,162 @@ Model::SimpleAS::demand_unmap_bus_clean(const Vbus::Bus& bus, const GPA& gpa, si
 
 Errno
 Model::SimpleAS::write_bus(const Vbus::Bus& bus, GPA addr, const char* src, size_t sz) {
+    // The bus returns any AS overlapping the range: the fast path needs one holding all of it
     Model::SimpleAS* tgt = get_as_device_at(bus, addr, sz);
-    if (tgt == nullptr)
+    if (__LIKELY__(tgt != nullptr && tgt->is_gpa_valid(addr, sz)))
+        return tgt->write(addr, sz, src);
+
+    /*
+     * The range may span several address spaces. Every segment is mapped before the first byte is
+     * copied: nothing is written unless all of them are found and writable.
+     */
+    Vector<MemSegment> segs;
+    if (!lookup_mem_segments(bus, Range<uint64>(addr.get_value(), sz), segs))
         return Errno::INVAL;
 
-    return tgt->write(addr, sz, src);
+    Vector<void*> dst;
+    dst.resize(segs.size(), nullptr);
+    Errno err = Errno::NONE;
+    size_t mapped = 0;
+    while (mapped < segs.size()) {
+        const MemSegment& seg = segs[mapped];
+        err = seg.as->demand_map(GPA(seg.gpa.begin()), seg.gpa.size(), dst[mapped], true);
+        if (err != Errno::NONE)
+            break;
+        mapped++;
+    }
+
+    if (err == Errno::NONE) {
+        for (size_t i = 0; i < segs.size(); i++) {
+            memcpy(dst[i], src + (segs[i].gpa.begin() - addr.get_value()), segs[i].gpa.size());
+            segs[i].as->mark_dirty(GPA(segs[i].gpa.begin()), segs[i].gpa.size());
+        }
+    }
+
+    for (size_t i = 0; i < mapped; i++) {
+        const MemSegment& seg = segs[i];
+        const GPA gpa(seg.gpa.begin());
+        const bool clean = err == Errno::NONE && seg.as->_flush_on_write;
+        Errno unmap_err = clean ? seg.as->demand_unmap_clean(gpa, seg.gpa.size(), dst[i])
+                                : seg.as->demand_unmap(gpa, seg.gpa.size(), dst[i]);
+        if (err == Errno::NONE)
+            err = unmap_err;
+    }
+
+    return err;
 }
 
 bool
 Model::SimpleAS::map_host() {
+    size_t huge = _mobject.page_size();
+    if (page_size() != huge) {
+        WARN("Guest region " FMTx64 " size " FMTx64 " is not aligned on its 0x%zx host pages", get_guest_view().get_value(),
+             get_size(), huge);
+        if (_mobject.hugetlb())
+            return false;
+    }
+
     _vmm_view = reinterpret_cast<char*>(
         Platform::Mem::map_mem(_mobject, 0, _as.size(),
                                Platform::Mem::READ | (_mobject.cred().write() ? Platform::Mem::WRITE : 0), get_mem_fd().msel()));
-    return (_vmm_view != nullptr);
+    if (_vmm_view == nullptr)
+        return false;
+
+    if (_mobject.copy_on_write()) {
+        StaticGuard guard{_cow_lock};
+        _next_cow = _cow_views;
+        _cow_views = this;
+        _num_cow_views.fetch_add(1, std::memory_order_release);
+    }
+
+    INFO("Guest region " FMTx64 " size " FMTx64 " backed by %zu KiB pages%s", get_guest_view().get_value(), get_size(),
+         page_size() / 1024, _mobject.huge_pages() == Platform::Mem::HugePages::THP ? " (transparent)" : "");
+    return true;
+}
+
+bool
+Model::SimpleAS::set_numa_node(uint16 node) {
+    if (!mapped() || node >= Platform::Numa::node_count())
+        return false;
+
+    if (!Platform::Numa::bind_mem(_vmm_view, get_size(), node)) {
+        WARN("Unable to place guest region " FMTx64 " on NUMA node %u", get_guest_view().get_value(), node);
+        return false;
+    }
+
+    _numa_node = node;
+    return true;
+}
+
+uint16
+Model::SimpleAS::numa_node_at(const Vbus::Bus& bus, GPA gpa) {
+    const Model::SimpleAS* as = get_as_device_at(bus, gpa, 1);
+    return (as == nullptr) ? NO_NUMA_NODE : as->numa_node();
+}
+
+void
+Model::SimpleAS::attach_view(GuestMemView* view) {
+    Platform::MutexGuard guard{_views_lock};
+    view->_next = _views;
+    _views = view;
+    view->_valid.store(true, std::memory_order_release);
+}
+
+void
+Model::SimpleAS::detach_view(GuestMemView* view) {
+    Platform::MutexGuard guard{_views_lock};
+    for (GuestMemView** p = &_views; *p != nullptr; p = &(*p)->_next) {
+        if (*p == view) {
+            *p = view->_next;
+            break;
+        }
+    }
+
+    view->_next = nullptr;
+    view->_valid.store(false, std::memory_order_release);
+}
+
+void
+Model::SimpleAS::invalidate_views() {
+    Platform::MutexGuard guard{_views_lock};
+    while (_views != nullptr) {
+        GuestMemView* view = _views;
+
+        _views = view->_next;
+        view->_next = nullptr;
+        view->_valid.store(false, std::memory_order_release);
+        if (view->_cb != nullptr)
+            view->_cb->view_invalidated(*view);
+    }
 }
 
 bool
 Model::SimpleAS::destruct() {
+    invalidate_views();
+
+    if (mapped() && _mobject.copy_on_write()) {
+        StaticGuard guard{_cow_lock};
+        for (Model::SimpleAS** p = &_cow_views; *p != nullptr; p = &(*p)->_next_cow) {
+            if (*p == this) {
+                *p = _next_cow;
+                _num_cow_views.fetch_sub(1, std::memory_order_release);
+                break;
+            }
+        }
+    }
+
     if (mapped()) {
         if (!Platform::Mem::unmap_mem(reinterpret_cast<void*>(_vmm_view), _as.size()))
             return false;
         _vmm_view = nullptr;
     }
+
+    StaticGuard guard{_dirty_lock};
+    delete[] _dirty_map;
+    _dirty_map = nullptr;
+    delete[] _host_dirty;
+    _host_dirty = nullptr;
+    delete _dirty_log.exchange(nullptr);
     return true;
 }
 
@@ -440,6 +887,15 @@ Model::SimpleAS::map_guest_mem(const Vbus::Bus& bus, GPA gpa, size_t sz, bool wr
 
 void
 Model::SimpleAS::unmap_guest_mem(const void* mem, size_t sz) {
+    // Without copy-on-write AS, every mapping handed out by map_guest_mem() is a private one
+    if (_num_cow_views.load(std::memory_order_acquire) != 0) {
+        StaticGuard guard{_cow_lock};
+        for (const Model::SimpleAS* as = _cow_views; as != nullptr; as = as->_next_cow) {
+            if (mem >= as->_vmm_view && mem < as->_vmm_view + as->get_size())
+                return;
+        }
+    }
+
     /* unmap memory */
     DEBUG("unmap_guest_mem mem:0x%p size:0x%lx", mem, sz);
     bool b = Platform::Mem::unmap_mem(mem, sz);
@@ -447,11 +903,49 @@ Model::SimpleAS::unmap_guest_mem(const void* mem, size_t sz) {
         ABORT_WITH("Unable to unmap guest memory mem:0x%p size:0x%lx", mem, sz);
 }
 
-void
+bool
 Model::SimpleAS::lookup_mem_ranges(const Vbus::Bus& bus, const Range<uint64>& gpa_range, Vector<Model::SimpleAS*>& out) {
     out.reset();
+
+    // Common case: a single AS holds the whole range
     auto* dev_p = SimpleAS::get_as_device_at(bus, GPA{gpa_range.begin()}, gpa_range.size());
-    if (dev_p != nullptr) {
+    if (dev_p != nullptr && dev_p->is_gpa_valid(GPA{gpa_range.begin()}, gpa_range.size())) {
         out.push_back(dev_p);
+        return true;
+    }
+
+    Vector<MemSegment> segs;
+    bool covered = lookup_mem_segments(bus, gpa_range, segs);
+    for (const MemSegment& seg : segs)
+        out.push_back(seg.as);
+
+    return covered;
+}
+
+bool
+Model::SimpleAS::lookup_mem_segments(const Vbus::Bus& bus, const Range<uint64>& gpa_range, Vector<MemSegment>& out) {
+    out.reset();
+
+    uint64 addr = gpa_range.begin();
+    while (addr < gpa_range.end()) {
+        Model::SimpleAS* as = get_as_device_at(bus, GPA(addr), 1);
+        if (as == nullptr)
+            return false;
+
+        uint64 end = min(gpa_range.end(), static_cast<uint64>(as->get_range().end()));
+        MemSegment seg{Range<uint64>(addr, end - addr), as->gpa_to_vmm_view(GPA(addr), end - addr), as};
+        out.push_back(seg);
+        addr = end;
     }
+
+    return !gpa_range.empty();
+}
+
+size_t
+Model::SimpleAS::segment_size(const Vbus::Bus& bus, GPA gpa, size_t sz) {
+    const Model::SimpleAS* as = get_as_device_at(bus, gpa, 1);
+    if (as == nullptr)
+        return 0;
+
+    return min(sz, static_cast<size_t>(as->get_range().end() - gpa.get_value()));
 }
@@ -109,6 +109,13 @@ public:
      */
     virtual void shutdown() {} // Not all devices may need to make use of it
 
+    /*! \brief Called once the device was removed from a bus
+     *  \pre The caller has partial ownership of a valid Device object.
+     *  \post The ownership of the object is returned to the caller. The device no longer hands
+     *        out what depends on its place on the bus.
+     */
+    virtual void unregistered() {}
+
     /*! \brief Query the type of the device
      *  \pre The caller has partial ownership of a valid Device object
      *  \post The return value contains 'DEVICE'. Ownership and state of the device is unchanged.
@@ -196,5 +196,7 @@ Vbus::Bus::unregister_device(mword addr, mword bytes) {
     }
     _vbus_lock.wexit();
 
+    if (rm_dev != nullptr)
+        rm_dev->device->unregistered();
     delete rm_dev;
 }
@@ -10,7 +10,9 @@
 
 #include <model/iommu_interface.hpp>
 #include <model/irq_controller.hpp>
+#include <model/simple_as.hpp>
 #include <model/virtio_common.hpp>
+#include <model/virtio_sg.hpp>
 #include <model/virtqueue.hpp>
 #include <platform/bits.hpp>
 #include <platform/errno.hpp>
@@ -20,6 +22,7 @@
 namespace Virtio {
     class Console;
     class Device;
+    class GuestMemDevice;
 };
 
 class Virtio::Device : public Vbus::Device, public Model::IOMMUManagedDevice {
@@ -99,14 +102,47 @@ protected:
     bool use_io_mappings() const { return iommu_avail and attached and _dev_state.platform_specific_access_enabled(); }
 
 public:
+    /*! \brief Construct a device serving the first [num_queues] queues of [queues], see Virtio::QueueStorage
+     */
+    template<uint16 N>
     Device(const char *name, Virtio::DeviceID device_id, const Vbus::Bus &bus, Model::IrqController &irq_ctlr, void *config_space,
            uint32 config_size, uint16 const irq, uint16 const queue_num, Virtio::Transport *transport,
-           uint64 const device_feature = 0)
+           uint64 const device_feature, Virtio::QueueStorage<N> &queues, uint16 const num_queues)
         : Vbus::Device(name), _irq_ctlr(&irq_ctlr), _vbus(&bus), _irq(irq),
-          _dev_state(queue_num, VENDOR_ID, static_cast<uint32>(device_id), device_feature, config_space, config_size),
+          _dev_state(queue_num, VENDOR_ID, static_cast<uint32>(device_id), device_feature, config_space, config_size, queues,
+                     num_queues),
           _transport(transport) {}
 
     uint64 drv_feature() const { return combine_low_high(_dev_state.drv_feature_lower, _dev_state.drv_feature_upper); }
 
     Errno deinit() override { return Errno::NONE; }
 };
+
+/*! \brief Virtio::Device whose chains are accessed in the guest memory of its bus
+ *
+ *  Implements the Virtio::Sg::Buffer::ChainAccessor hooks common to the devices: the copies are
+ *  split at the boundaries of the guest memory regions and the guest pages written by the device
+ *  are logged. The translation of the addresses to the VMM views is left to the device.
+ */
+class Virtio::GuestMemDevice : public Virtio::Device, public Virtio::Sg::Buffer::ChainAccessor {
+public:
+    using Virtio::Device::Device;
+
+    // [Virtio::Sg::Buffer::ChainAccessor] override: split the copies at the boundaries of the guest memory regions
+    size_t vq_addr_segment_size(uint64 vqa, size_t size_bytes) override {
+        GPA gpa = vq_addr_to_gpa(vqa, size_bytes);
+        return gpa.invalid() ? 0 : Model::SimpleAS::segment_size(*_vbus, gpa, size_bytes);
+    }
+
+    // [Virtio::Sg::Buffer::ChainAccessor] override: log the guest pages written by the device
+    void vq_addr_written(uint64 vqa, size_t size_bytes) override {
+        GPA gpa = vq_addr_to_gpa(vqa, size_bytes);
+        if (!gpa.invalid())
+            Model::SimpleAS::mark_dirty_bus(*_vbus, gpa, size_bytes);
+    }
+
+private:
+    GPA vq_addr_to_gpa(uint64 vqa, size_t size_bytes) const {
+        return use_io_mappings() ? GPA(translate_io(vqa, size_bytes)) : GPA(vqa);
+    }
+};
@@ -29,6 +29,8 @@ namespace Virtio {
     enum FeatureBits : uint64;
     class QueueState;
     struct QueueData;
+    template<uint16 N>
+    struct QueueStorage;
     struct DeviceState;
     bool read_register(uint64, uint32, uint32, uint8, uint64, uint64 &);
     template<typename T>
@@ -193,16 +195,28 @@ public:
     Virtio::DeviceQueue &device_queue() { return _device_queue; }
 };
 
+/*! \brief Queues of a device, N is the largest number of queues it can advertise
+ *
+ *  The device inherits the storage before Virtio::Device, so that it is constructed first, and
+ *  hands it over to the Virtio::Device constructor along with the number of queues it advertises.
+ */
+template<uint16 N>
+struct Virtio::QueueStorage {
+    static constexpr uint16 NUM = N;
+
+    QueueData data_array[N];
+    QueueState state_array[N];
+};
+
 struct Virtio::DeviceState {
-    explicit DeviceState(uint16 const num_max, uint32 vendor, uint32 id, uint64 const feature, void *config, uint32 config_sz)
-        : queue_num_max(num_max), vendor_id(vendor), device_id(id), device_feature_lower(static_cast<uint32>(feature)),
-          // We always set [VIRTIO_F_VERSION_1] i.e. no legacy VirtIO emulation.
-          device_feature_upper(static_cast<uint32>((feature | Virtio::FeatureBits::VIRTIO_F_VERSION_1) >> 32)),
-          config_space(static_cast<uint8 *>(config)), config_size(config_sz) {
-        for (uint16 i = 0; i < static_cast<uint8>(Virtio::Queues::MAX); i++) {
-            data[i] = QueueData(queue_num_max);
-        }
-    }
+    template<uint16 N>
+    DeviceState(uint16 const num_max, uint32 vendor, uint32 id, uint64 const feature, void *config, uint32 config_sz,
+                QueueStorage<N> &queues, uint16 const advertised)
+        : DeviceState(num_max, vendor, id, feature, config, config_sz, queues.data_array, queues.state_array,
+                      advertised < N ? advertised : N) {}
+
+    DeviceState(const DeviceState &) = delete;
+    DeviceState &operator=(const DeviceState &) = delete;
 
     QueueData const &selected_queue_data() const { return data[sel_queue]; }
     QueueData &selected_queue_data() { return data[sel_queue]; }
@@ -220,7 +234,7 @@ struct Virtio::DeviceState {
     }
 
     void reset() {
-        for (int i = 0; i < static_cast<uint8>(Virtio::Queues::MAX); i++) {
+        for (uint16 i = 0; i < num_queues; i++) {
             queue[i].destruct();
             data[i] = QueueData(queue_num_max);
         }
@@ -296,8 +310,22 @@ struct Virtio::DeviceState {
     static constexpr size_t MSIX_TBL_SIZE = sizeof(tbl_data);
     static constexpr size_t MSIX_PBA_SIZE = sizeof(pba_data);
 
-    QueueData data[static_cast<uint8>(Virtio::Queues::MAX)];
-    QueueState queue[static_cast<uint8>(Virtio::Queues::MAX)];
+    uint16 const num_queues; // Advertised to the guest, the driver cannot select the others
+    QueueData *const data;
+    QueueState *const queue;
+
+private:
+    DeviceState(uint16 const num_max, uint32 vendor, uint32 id, uint64 const feature, void *config, uint32 config_sz,
+                QueueData *queue_data, QueueState *queue_state, uint16 queues)
+        : queue_num_max(num_max), vendor_id(vendor), device_id(id), device_feature_lower(static_cast<uint32>(feature)),
+          // We always set [VIRTIO_F_VERSION_1] i.e. no legacy VirtIO emulation.
+          device_feature_upper(static_cast<uint32>((feature | Virtio::FeatureBits::VIRTIO_F_VERSION_1) >> 32)),
+          config_space(static_cast<uint8 *>(config)), config_size(config_sz), num_queues(queues), data(queue_data),
+          queue(queue_state) {
+        for (uint16 i = 0; i < num_queues; i++) {
+            data[i] = QueueData(queue_num_max);
+        }
+    }
 };
 
 inline bool
@@ -156,7 +156,7 @@ public:
             return Virtio::write_register(offset, RW_DRIVER_FEATURE_SEL, RW_DRIVER_FEATURE_SEL_END, bytes, value,
                                           state.drv_feature_sel);
         case WO_QUEUE_SEL ... WO_QUEUE_SEL_END:
-            if (value >= static_cast<uint8>(Virtio::Queues::MAX))
+            if (value >= state.num_queues)
                 return true; /* ignore out of bound */
             return Virtio::write_register(offset, WO_QUEUE_SEL, WO_QUEUE_SEL_END, bytes, value, state.sel_queue);
         case WO_QUEUE_NUM ... WO_QUEUE_NUM_END:
@@ -526,6 +526,11 @@ public:
     // NOTE: This is an idempotent function.
     void conclude_chain_use(Virtio::Queue &vq) { conclude_chain_use(vq, false); }
 
+    // [buff.record_written_bytes(off, sz)] accounts for bytes written into the writable portion
+    // of the chain without going through the copy functions, e.g. by a host system call on the
+    // translated addresses. They are then reported in the used entry by [conclude_chain_use].
+    Errno record_written_bytes(size_t off, size_t size_bytes);
+
 private:
     // NOTE: called after the copy succeeds - which means that the flag validation/size
     // checks have already been completed.
@@ -571,9 +576,29 @@ public:
         Errno copy_from_vqa(BulkCopier *copier, char *dst_hva, uint64 src_vqa, size_t size_bytes);
         Errno copy_to_vqa(BulkCopier *copier, uint64 dst_vqa, const char *src_hva, size_t size_bytes);
 
+        // Size of the range starting at [vqa], at most [byte_size], that translates to a single
+        // host range. The copies above split a range that cannot be translated as a whole, e.g.
+        // one spanning several regions of guest memory, at this boundary. 0 if unknown.
+        virtual size_t vq_addr_segment_size(uint64 vqa, size_t byte_size) {
+            (void)vqa;
+            return byte_size;
+        }
+
+        // The device wrote [byte_size] bytes at [vqa], e.g. to log the guest pages it modified.
+        // Called by the copies above once the data is written.
+        virtual void vq_addr_written(uint64 vqa, size_t byte_size) {
+            (void)vqa;
+            (void)byte_size;
+        }
+
+    private:
+        static size_t segment_size(ChainAccessor &dst_accessor, ChainAccessor &src_accessor, uint64 dst_vqa, uint64 src_vqa,
+                                   size_t size_bytes);
+        static Errno copy_between_vqa_split(BulkCopier *copier, ChainAccessor &dst_accessor, ChainAccessor &src_accessor,
+                                            uint64 dst_vqa, uint64 src_vqa, size_t size_bytes, size_t seg);
+
         // The follow methods are used in [copy_XXX_gpa] when the underlying
         // [Virtio::Queue::AddressTranslator] methods return [err != Errno::NONE].
-    private:
         virtual void handle_translation_failure(bool is_src, Errno err, mword address, size_t sz) {
             (void)is_src;
             (void)err;
@@ -585,6 +610,10 @@ public:
         }
     };
 
+    // Same as [record_written_bytes(off, sz)], and report the written ranges to [accessor]
+    // as the copy functions do.
+    Errno record_written_bytes(ChainAccessor &accessor, size_t off, size_t size_bytes);
+
     // BEGIN Asynchronous interface for copying from [this] Sg::Buffer to [dst] Sg::Buffer
 private:
     virtual Errno start_copy_to_sg_impl(Virtio::Sg::Buffer &dst) const;
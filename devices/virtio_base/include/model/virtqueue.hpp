@@ -558,11 +558,24 @@ public:
     void enable_notifications();
     void disable_notifications();
 
+    // Completion batching: between [begin_batch] and [end_batch], [send] only fills used ring
+    // entries. The used index is published once, by [end_batch].
+    void begin_batch();
+    void end_batch();
+
+    // Give back the last [count] chains returned by [recv], which were not used. They are
+    // returned again by the next calls to [recv].
+    void unpop(uint16 count);
+
 private:
     // NOTE: hook for specifying the interesting effect of [_prev = _driven_idx++;], namely,
     // getting a new [Ghost.used_entry]
     inline void bump_driven_idx() { _prev = _driven_idx++; }
 
+    bool _batching{false};
+    // Value of [_driven_idx] when the current batch was opened
+    uint16 _batch_start{0};
+
     // Device manipulates avail_event field to suggest driver to suppress notifications till it has
     // added avail_event number of buffers to queue.
     inline void set_avail_event(uint16 index) { _used.set_avail_event(index); }
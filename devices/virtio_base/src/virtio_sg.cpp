@@ -16,9 +16,13 @@ Virtio::Sg::DescMetadata::heuristically_track_written_bytes(size_t off, size_t s
 
     if (off <= local_prefix_written_bytes) {
         local_prefix_written_bytes = off + size_bytes;
-        if (local_prefix_written_bytes < _prefix_written_bytes || UINT32_MAX < local_prefix_written_bytes) {
+        if (UINT32_MAX < local_prefix_written_bytes) {
             local_prefix_written_bytes = UINT32_MAX;
         }
+        // Writing again within the prefix does not shrink it
+        if (local_prefix_written_bytes < _prefix_written_bytes) {
+            local_prefix_written_bytes = _prefix_written_bytes;
+        }
 
         // This is a provably redundant cast, but the compiler is not smart enough to notice this.
         _prefix_written_bytes = static_cast<uint32>(local_prefix_written_bytes);
@@ -81,6 +85,45 @@ Virtio::Sg::Buffer::heuristically_track_written_bytes(size_t off, size_t size_by
     }
 }
 
+Errno
+Virtio::Sg::Buffer::record_written_bytes(size_t off, size_t size_bytes) {
+    if (size_bytes == 0ul)
+        return Errno::NONE;
+
+    size_t first_writable = 0;
+    Errno err = first_writable_byte(first_writable);
+    if (Errno::NONE != err)
+        return err;
+
+    if (off < first_writable || this->size_bytes() <= off || this->size_bytes() - off < size_bytes)
+        return Errno::INVAL;
+
+    heuristically_track_written_bytes(off, size_bytes);
+    return Errno::NONE;
+}
+
+Errno
+Virtio::Sg::Buffer::record_written_bytes(ChainAccessor &accessor, size_t off, size_t size_bytes) {
+    Errno err = record_written_bytes(off, size_bytes);
+    if (Errno::NONE != err)
+        return err;
+
+    for (auto it = begin(); it != end() && size_bytes != 0; ++it) {
+        const LinearizedDesc &desc = it.desc_ref();
+        if (off >= desc.length) {
+            off -= desc.length;
+            continue;
+        }
+
+        size_t n = min(static_cast<size_t>(desc.length) - off, size_bytes);
+        accessor.vq_addr_written(desc.address + off, n);
+        size_bytes -= n;
+        off = 0;
+    }
+
+    return Errno::NONE;
+}
+
 uint32
 Virtio::Sg::Buffer::written_bytes_lowerbound_heuristic() const {
     // NOTE: [walk_chain] ensures that chain lengths are no greater than [UINT32_MAX].
@@ -350,6 +393,27 @@ Virtio::Sg::Buffer::modify_link(size_t chain_idx, uint64 address, uint32 length)
     return Errno::NONE;
 }
 
+/*
+ * Largest prefix of the copy that translates to a single host range on both sides, once the
+ * translation of the whole range failed on one of them.
+ */
+size_t
+Virtio::Sg::Buffer::ChainAccessor::segment_size(ChainAccessor &dst_accessor, ChainAccessor &src_accessor, uint64 dst_vqa,
+                                                uint64 src_vqa, size_t size_bytes) {
+    return min(dst_accessor.vq_addr_segment_size(dst_vqa, size_bytes), src_accessor.vq_addr_segment_size(src_vqa, size_bytes));
+}
+
+Errno
+Virtio::Sg::Buffer::ChainAccessor::copy_between_vqa_split(BulkCopier *copier, ChainAccessor &dst_accessor,
+                                                          ChainAccessor &src_accessor, uint64 dst_vqa, uint64 src_vqa,
+                                                          size_t size_bytes, size_t seg) {
+    Errno err = copy_between_vqa(copier, dst_accessor, src_accessor, dst_vqa, src_vqa, seg);
+    if (Errno::NONE != err)
+        return err;
+
+    return copy_between_vqa(copier, dst_accessor, src_accessor, dst_vqa + seg, src_vqa + seg, size_bytes - seg);
+}
+
 Errno
 Virtio::Sg::Buffer::ChainAccessor::copy_between_vqa(BulkCopier *copier, ChainAccessor &dst_accessor, ChainAccessor &src_accessor,
                                                     uint64 dst_vqa, uint64 src_vqa, size_t size_bytes) {
@@ -363,17 +427,33 @@ Virtio::Sg::Buffer::ChainAccessor::copy_between_vqa(BulkCopier *copier, ChainAcc
 
     err = dst_accessor.vq_addr_to_w_hva(dst_vqa, size_bytes, dst_hva);
     if (Errno::NONE != err) {
+        size_t seg = segment_size(dst_accessor, src_accessor, dst_vqa, src_vqa, size_bytes);
+        if (seg != 0 && seg < size_bytes)
+            return copy_between_vqa_split(copier, dst_accessor, src_accessor, dst_vqa, src_vqa, size_bytes, seg);
+
         dst_accessor.handle_translation_failure(false /* !is_src */, err, dst_vqa, size_bytes);
         return err;
     }
 
     err = src_accessor.vq_addr_to_r_hva(src_vqa, size_bytes, src_hva);
     if (Errno::NONE != err) {
+        size_t seg = segment_size(dst_accessor, src_accessor, dst_vqa, src_vqa, size_bytes);
+        if (seg != 0 && seg < size_bytes) {
+            err = dst_accessor.vq_addr_to_w_hva_post(dst_vqa, size_bytes, dst_hva);
+            if (Errno::NONE != err) {
+                dst_accessor.handle_translation_post_failure(false /* !is_src */, err, dst_vqa, size_bytes);
+                return err;
+            }
+
+            return copy_between_vqa_split(copier, dst_accessor, src_accessor, dst_vqa, src_vqa, size_bytes, seg);
+        }
+
         src_accessor.handle_translation_failure(true /* is_src */, err, src_vqa, size_bytes);
         return err;
     }
 
     copier->bulk_copy(dst_hva, src_hva, size_bytes);
+    dst_accessor.vq_addr_written(dst_vqa, size_bytes);
 
     err = src_accessor.vq_addr_to_r_hva_post(src_vqa, size_bytes, src_hva);
     if (Errno::NONE != err) {
@@ -401,6 +481,13 @@ Virtio::Sg::Buffer::ChainAccessor::copy_from_vqa(BulkCopier *copier, char *dst_h
 
     err = vq_addr_to_r_hva(src_vqa, size_bytes, src_hva);
     if (Errno::NONE != err) {
+        // The range spans several host ranges: copy them one after the other
+        size_t seg = vq_addr_segment_size(src_vqa, size_bytes);
+        if (seg != 0 && seg < size_bytes) {
+            err = copy_from_vqa(copier, dst_hva, src_vqa, seg);
+            return (Errno::NONE != err) ? err : copy_from_vqa(copier, dst_hva + seg, src_vqa + seg, size_bytes - seg);
+        }
+
         this->handle_translation_failure(true /* is_src */, err, src_vqa, size_bytes);
         return err;
     }
@@ -427,11 +514,19 @@ Virtio::Sg::Buffer::ChainAccessor::copy_to_vqa(BulkCopier *copier, uint64 dst_vq
 
     err = vq_addr_to_w_hva(dst_vqa, size_bytes, dst_hva);
     if (Errno::NONE != err) {
+        // The range spans several host ranges: copy them one after the other
+        size_t seg = vq_addr_segment_size(dst_vqa, size_bytes);
+        if (seg != 0 && seg < size_bytes) {
+            err = copy_to_vqa(copier, dst_vqa, src_hva, seg);
+            return (Errno::NONE != err) ? err : copy_to_vqa(copier, dst_vqa + seg, src_hva + seg, size_bytes - seg);
+        }
+
         this->handle_translation_failure(false /* !is_src */, err, dst_vqa, size_bytes);
         return err;
     }
 
     copier->bulk_copy(dst_hva, src_hva, size_bytes);
+    vq_addr_written(dst_vqa, size_bytes);
 
     err = vq_addr_to_w_hva_post(dst_vqa, size_bytes, dst_hva);
     if (Errno::NONE != err) {
@@ -73,7 +73,9 @@ namespace Virtio {
         bump_driven_idx(); // _prev = _driven_idx++;
         _used.set_ring(_prev % _size, desc.index(), len);
 
-        // cf. 2.6.13.3 - Batching is allowed, but we don't do it
+        // cf. 2.6.13.3 - Batching is allowed, the used index is then published by [end_batch]
+        if (_batching)
+            return;
 
         // cf. 2.6.13.4 - The driver performs a suitable memory barrier to ensure the device sees
         //                the updated descriptor table and available ring before the next step.
@@ -159,6 +161,31 @@ namespace Virtio {
         return (_available.flags() & VIRTQ_AVAIL_NO_INTERRUPT) != 0;
     }
 
+    // Open a batch of completions: the chains given to [send] are placed in the used ring but the
+    // used index is left untouched until [end_batch].
+    void DeviceQueue::begin_batch() {
+        _batching = true;
+        _batch_start = _driven_idx;
+    }
+
+    // Publish all the chains sent since [begin_batch] with a single update of the used index.
+    void DeviceQueue::end_batch() {
+        _batching = false;
+        if (_driven_idx == _batch_start)
+            return;
+
+        // From the point of view of [used_event_notify], the batch is a single step of the used
+        // index, going from [_batch_start] to [_driven_idx].
+        _prev = _batch_start;
+        Barrier::w_before_w();
+        _used.set_index(_driven_idx);
+    }
+
+    // Rewind the local available index. The chains must not have been given to [send].
+    void DeviceQueue::unpop(uint16 count) {
+        _idx = static_cast<uint16>(_idx - count);
+    }
+
     // Host (Device) can suppress notifications using these routines.
     void DeviceQueue::enable_notifications() {
         _used.set_flags(0);
@@ -10,9 +10,11 @@
 
 #include <model/iommu_interface.hpp>
 #include <model/irq_controller.hpp>
+#include <model/simple_as.hpp>
 #include <model/virtio.hpp>
 #include <model/virtio_block_defs.hpp>
 #include <model/virtio_common.hpp>
+#include <model/virtio_sg.hpp>
 #include <model/virtqueue.hpp>
 #include <platform/errno.hpp>
 #include <platform/signal.hpp>
@@ -24,6 +26,9 @@ namespace Model {
     class VirtioBlock;
     class VirtioBlockCallback;
     class Irq_contoller;
+
+    // Request queues of a VirtioBlock device, enough for one per vCPU
+    using VirtioBlockQueues = Virtio::QueueStorage<32>;
 }
 
 class Model::VirtioBlockCallback {
@@ -38,15 +43,30 @@ public:
     virtual Errno unmap(const Model::IOMapping &m) = 0;
 };
 
-class Model::VirtioBlock : public Virtio::Device {
+// NOTE: [VirtioBlock] is a [Virtio::Sg::Buffer::ChainAccessor] so that backends can access the
+// request chains directly. Translations go through the persistent view of guest memory, this
+// allows the returned HVAs to be handed over to asynchronous I/O without having to unmap them.
+class Model::VirtioBlock : private Model::VirtioBlockQueues, public Virtio::GuestMemDevice {
+public:
+    static constexpr uint16 MAX_QUEUES = VirtioBlockQueues::NUM;
+
 private:
     enum { REQUEST = 0 };
     Virtio::Callback *_callback{nullptr};
     Model::VirtioBlockCallback *_virtio_block_callback{nullptr};
     VirtioBlockConfig _config;
     Platform::Signal *_sig;
+    // Per request queue signal, [_sig] is used for the queues that don't have one
+    Platform::Signal *_queue_sig[MAX_QUEUES]{};
+    uint16 _num_queues{1};
     bool _backend_connected{false};
 
+    static uint64 features(const uint64 feature, uint16 num_queues) {
+        if (num_queues > 1)
+            return feature | static_cast<uint64>(Model::VirtioBlockFeatures::MQ);
+        return feature;
+    }
+
     void notify(uint32) override;
     void driver_ok() override;
 
@@ -60,14 +80,40 @@ public:
         uint64 device_feature{static_cast<uint64>(Model::VirtioBlockFeatures::SEG_MAX)
                               | static_cast<uint64>(Model::VirtioBlockFeatures::BLK_SIZE_MAX)};
         Model::VirtioBlockConfig block_config;
+        // Number of request queues. VIRTIO_BLK_F_MQ is offered when there is more than one.
+        uint16 num_queues{1};
     };
 
     VirtioBlock(IrqController &irq_ctlr, const Vbus::Bus &bus, uint16 const irq, uint16 const queue_entries,
                 const UserConfig &config, Platform::Signal *sig)
-        : Virtio::Device("virtio block", Virtio::DeviceID::BLOCK, bus, irq_ctlr, &_config, sizeof(_config), irq, queue_entries,
-                         config.transport, config.device_feature),
-          _sig(sig) {
+        : Virtio::GuestMemDevice("virtio block", Virtio::DeviceID::BLOCK, bus, irq_ctlr, &_config, sizeof(_config), irq,
+                                 queue_entries, config.transport,
+                                 features(config.device_feature, clamp_queues(config.num_queues)),
+                                 static_cast<VirtioBlockQueues &>(*this), clamp_queues(config.num_queues)),
+          _sig(sig), _num_queues(clamp_queues(config.num_queues)) {
         memcpy(&_config, &config.block_config, sizeof(Model::VirtioBlockConfig));
+        if (_num_queues > 1)
+            _config.num_queues = _num_queues;
+    }
+
+    static uint16 clamp_queues(uint16 num_queues) {
+        if (num_queues == 0)
+            return 1;
+        return num_queues < MAX_QUEUES ? num_queues : MAX_QUEUES;
+    }
+
+    uint16 num_queues() const { return _num_queues; }
+
+    /*! \brief Set the signal raised when the guest notifies a given request queue
+     *  \param queue Index of the request queue
+     *  \param sig Signal to raise, nullptr to fall back to the signal given at construction
+     *  \return false if the queue doesn't exist
+     */
+    bool set_queue_signal(uint16 queue, Platform::Signal *sig) {
+        if (queue >= _num_queues)
+            return false;
+        _queue_sig[queue] = sig;
+        return true;
     }
 
     void register_callback(Virtio::Callback &callback, Model::VirtioBlockCallback &block_callback) {
@@ -88,6 +134,36 @@ public:
     Errno map(const Model::IOMapping &m) override;
     Errno unmap(const Model::IOMapping &m) override;
 
-    Virtio::DeviceQueue &request_queue() { return device_queue(REQUEST); }
-    Virtio::QueueData const &queue_data_request() const { return queue_data(REQUEST); }
+    bool request_queue_constructed(uint16 index = 0) {
+        return index < _num_queues && queue(static_cast<uint8>(REQUEST + index)).constructed();
+    }
+    Virtio::DeviceQueue &request_queue(uint16 index = 0) { return device_queue(static_cast<uint8>(REQUEST + index)); }
+    Virtio::QueueData const &queue_data_request(uint16 index = 0) const {
+        return queue_data(static_cast<uint8>(REQUEST + index));
+    }
+
+    GPA translate(uint64 addr, size_t size_bytes) const {
+        if (not use_io_mappings())
+            return GPA(addr);
+
+        return GPA(translate_io(addr, size_bytes));
+    }
+
+    // [Virtio::Queue::AddressTranslator] overrides inherited by [Virtio::Sg::Buffer::ChainAccessor]
+    Errno vq_addr_to_r_hva(uint64 vqa, size_t size_bytes, char *&hva) override { return vq_addr_to_hva(vqa, size_bytes, hva); }
+    Errno vq_addr_to_w_hva(uint64 vqa, size_t size_bytes, char *&hva) override { return vq_addr_to_hva(vqa, size_bytes, hva); }
+
+private:
+    Errno vq_addr_to_hva(uint64 vqa, size_t size_bytes, char *&hva) const {
+        GPA gpa = translate(vqa, size_bytes);
+        if (gpa.invalid())
+            return Errno::PERM;
+
+        char *view = Model::SimpleAS::gpa_to_vmm_view(*_vbus, gpa, size_bytes);
+        if (view == nullptr)
+            return Errno::INVAL;
+
+        hva = view;
+        return Errno::NONE;
+    }
 };
@@ -15,6 +15,7 @@ namespace Model {
     struct VirtioBlockRequestHeader;
     struct VirtioBlockDiscardWriteZeroes;
     enum class VirtioBlockFeatures : uint64;
+    enum class VirtioBlockDiscardWriteZeroesFlags : uint32;
     enum class VirtioBlockRequestType : uint32;
     enum class VirtioBlockStatus : uint8;
     enum class VirtioBlockProtocol : size_t;
@@ -30,6 +31,7 @@ enum class Model::VirtioBlockFeatures : uint64 {
     FLUSH = (1 << 9),
     TOPOLOGY = (1 << 10),
     CONFIG_WCE = (1 << 11),
+    MQ = (1 << 12),
     DISCARD = (1 << 13),
     WRITE_ZEROES = (1 << 14),
     LIFETIME = (1 << 15),     // VirtIO v1.2
@@ -96,7 +98,8 @@ struct Model::VirtioBlockConfig {
     } topology;
 
     uint8 writeback{0};
-    uint8 reserved0[3]{0};
+    uint8 reserved0{0};
+    uint16 num_queues{0};
     uint32 max_discard_sectors{0};
     uint32 max_discard_seg{0};
     uint32 discard_sector_alignment{0};
@@ -104,9 +107,12 @@ struct Model::VirtioBlockConfig {
     uint32 max_write_zeroes_seg{0};
     uint8 write_zeroes_may_unmap{0};
     uint8 reserved1[3]{0};
+    uint32 max_secure_erase_sectors{0};      // VirtIO v1.2
+    uint32 max_secure_erase_seg{0};          // VirtIO v1.2
+    uint32 secure_erase_sector_alignment{0}; // VirtIO v1.2
 };
 
-static_assert(sizeof(Model::VirtioBlockConfig) == 60);
+static_assert(sizeof(Model::VirtioBlockConfig) == 72);
 
 struct Model::VirtioBlockRequestHeader {
     uint32 type{0};
@@ -123,3 +129,10 @@ struct Model::VirtioBlockDiscardWriteZeroes {
     uint32 num_sectors;
     uint32 flags;
 };
+
+static_assert(sizeof(Model::VirtioBlockDiscardWriteZeroes) == 16);
+
+enum class Model::VirtioBlockDiscardWriteZeroesFlags : uint32 {
+    // Only valid for WRITE_ZEROES: the device may deallocate the range instead of writing zeroes
+    UNMAP = (1 << 0),
+};
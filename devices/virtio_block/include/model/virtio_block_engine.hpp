@@ -0,0 +1,184 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Backend serving the requests of a VirtioBlock device from a host file
+ */
+
+#include <model/virtio_block.hpp>
+#include <model/virtio_block_defs.hpp>
+#include <model/virtio_sg.hpp>
+#include <model/virtqueue.hpp>
+#include <platform/atomic.hpp>
+#include <platform/context.hpp>
+#include <platform/io_uring.hpp>
+#include <platform/mutex.hpp>
+#include <platform/types.hpp>
+#include <sys/uio.h>
+
+namespace Model {
+    class VirtioBlockEngine;
+}
+
+/*! \brief Request engine of one request queue of a VirtioBlock device
+ *
+ *  Chains are popped from the request queue, up to the configured queue depth, and the data
+ *  buffers of IN/OUT requests are handed to the host directly as an I/O vector. When io_uring
+ *  is available, all the popped requests are submitted at once and their completions are
+ *  collected asynchronously. Otherwise, the engine falls back to preadv/pwritev. The completed
+ *  requests are published to the guest in batches, with a single update of the used index and
+ *  a single interrupt per batch.
+ *
+ *  The IN/OUT requests popped in one round form a submission window. The window is sorted by
+ *  sector and contiguous requests of the same type are coalesced into a single host I/O. The
+ *  result of a merged I/O is split back into per-request statuses on completion.
+ *
+ *  DISCARD, WRITE_ZEROES and SECURE_ERASE are executed synchronously with fallocate() on the
+ *  backing file, segment by segment.
+ *
+ *  The engine is driven by a single backend thread calling process() whenever the queue is
+ *  notified. reset() must be called from the VirtioBlockCallback::device_reset callback. With
+ *  VIRTIO_BLK_F_MQ, each request queue is served by its own engine, see VirtioBlockWorkers.
+ */
+class Model::VirtioBlockEngine {
+public:
+    struct Config {
+        int fd{-1};                      // Backing file, opened by the caller
+        uint64 capacity{0};              // Size of the device, in 512 bytes sectors
+        bool read_only{false};           // OUT requests are failed with IOERR
+        uint16 queue_depth{32};          // Maximum number of requests in flight
+        bool use_io_uring{true};         // Set to false to force the synchronous fallback
+        const char *serial{""};          // Returned by GET_ID requests, truncated to 20 bytes
+        uint32 max_merge_size{1u << 20}; // Maximum size of a merged host I/O, 0 disables merging
+        uint16 queue{0};                 // Index of the request queue served by the engine
+    };
+
+    /*! \brief Request merging counters, collected when Stats::enabled()
+     */
+    struct MergeStats {
+        atomic<uint64> requests{0};        // Requests completed, of any type
+        atomic<uint64> rw_requests{0};     // IN/OUT requests handed to the host
+        atomic<uint64> host_ios{0};        // Host reads and writes issued for them
+        atomic<uint64> merged_requests{0}; // IN/OUT requests coalesced into a preceding one
+
+        /*! \brief Average number of IN/OUT requests per host I/O, in hundredths */
+        uint64 merge_ratio() const {
+            uint64 ios = host_ios;
+            return ios == 0 ? 0 : (rw_requests * 100) / ios;
+        }
+
+        void reset() {
+            requests = 0;
+            rw_requests = 0;
+            host_ios = 0;
+            merged_requests = 0;
+        }
+    };
+
+    /*! \brief Advertise the commands that the backing file can serve
+     *
+     *  Sets the DISCARD, WRITE_ZEROES and SECURE_ERASE features of [user_config] and the
+     *  associated limits, based on the capabilities of the host file system. This must be
+     *  called before the VirtioBlock device is created.
+     *  \param config Configuration of the engine that will serve the device
+     *  \param user_config Configuration of the device to update
+     */
+    static void advertise_features(const Config &config, Model::VirtioBlock::UserConfig &user_config);
+
+    VirtioBlockEngine(Model::VirtioBlock &dev, const Config &config) : _dev(&dev), _config(config) {}
+    ~VirtioBlockEngine();
+
+    VirtioBlockEngine(const VirtioBlockEngine &) = delete;
+    VirtioBlockEngine &operator=(const VirtioBlockEngine &) = delete;
+
+    /*! \brief Allocate the request slots and set up io_uring
+     *  \param ctx Platform context
+     *  \param queue_entries Size of the REQUEST queue, bounds the length of a chain
+     *  \return true on success, false otherwise
+     */
+    bool init(const Platform_ctx *ctx, uint16 queue_entries);
+
+    /*! \brief Serve the requests available in the request queue
+     *
+     *  Returns once the queue is empty and all the popped requests have been completed.
+     */
+    void process();
+
+    /*! \brief Wait for the I/O in flight and drop all the requests
+     */
+    void reset();
+
+    bool uses_io_uring() const { return _ring.is_valid(); }
+
+    const MergeStats &stats() const { return _stats; }
+    void reset_stats() { _stats.reset(); }
+
+private:
+    static constexpr uint16 NO_SLOT = UINT16_MAX;
+    // Bound on the I/O vector of a merged request, well below IOV_MAX
+    static constexpr uint16 MERGE_IOV_MAX = 256;
+    // Bound on the number of segments of a DISCARD/WRITE_ZEROES/SECURE_ERASE request
+    static constexpr uint32 MAX_RANGE_SEGMENTS = 256;
+
+    struct Request {
+        Virtio::Sg::Buffer *buf{nullptr};
+        // Data of the request. When other requests are merged into this one, their vectors
+        // are appended and [iov_cnt]/[io_size] describe the whole host I/O.
+        iovec *iov{nullptr};
+        uint16 iov_cnt{0};
+        uint64 offset{0};
+        size_t data_size{0};
+        size_t io_size{0};
+        uint16 merge_next{NO_SLOT};
+        VirtioBlockRequestType type{VirtioBlockRequestType::IN};
+        VirtioBlockStatus status{VirtioBlockStatus::OK};
+    };
+
+    bool pop_request(Virtio::DeviceQueue &vq, uint16 slot);
+    VirtioBlockStatus parse_data(Request &req);
+    void submit_window();
+    bool try_merge(Request &into, const Request &req) const;
+    VirtioBlockStatus execute_ranges(Request &req);
+    int zero_range(uint64 offset, uint64 size, bool unmap, bool overwrite);
+    int write_zeroes(uint64 offset, uint64 size);
+    int write_zeroes_sync(uint64 offset, uint64 size);
+    void start_io(uint16 slot);
+    void complete_io(uint16 slot, int64 res);
+    void reap(bool wait);
+    void publish(Virtio::DeviceQueue &vq);
+    void drop_all();
+
+    void complete(uint16 slot, VirtioBlockStatus status) {
+        _reqs[slot].status = status;
+        _done[_num_done++] = slot;
+    }
+
+    Model::VirtioBlock *_dev;
+    Config _config;
+    Platform::Mutex _lock;
+    Platform::IoUring _ring;
+
+    uint16 _max_chain_length{0};
+    uint16 _iov_capacity{0};
+    Request *_reqs{nullptr};
+    uint16 *_free{nullptr};
+    uint16 _num_free{0};
+    uint16 *_done{nullptr};
+    uint16 _num_done{0};
+    uint16 *_window{nullptr};
+    uint16 _num_window{0};
+    uint16 _in_flight{0};
+
+    bool _punch_hole{false};
+    bool _zero_range{true};
+    char *_zeroes{nullptr}; // Written over the ranges the file system cannot zero
+    iovec _zero_iov[2];     // Whole buffer and last chunk of a range, see write_zeroes()
+
+    MergeStats _stats;
+};
@@ -0,0 +1,83 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Engines serving the request queues of a VirtioBlock device, one loop per queue
+ */
+
+#include <model/virtio_block.hpp>
+#include <model/virtio_block_engine.hpp>
+#include <platform/atomic.hpp>
+#include <platform/context.hpp>
+#include <platform/signal.hpp>
+#include <platform/types.hpp>
+
+namespace Model {
+    class VirtioBlockWorkers;
+}
+
+/*! \brief One VirtioBlockEngine and one service loop per request queue
+ *
+ *  Each loop waits for the notifications of its queue and serves it with its own engine, and
+ *  therefore its own io_uring instance. Loops never share state, the number of requests served
+ *  in parallel scales with the number of queues the guest uses, typically one per vCPU.
+ *
+ *  The embedder runs each loop, see run(), from a thread it created. The guest maps the vCPU i
+ *  to the queue i: running the loop of queue i next to the host CPU running vCPU i keeps the
+ *  submission and completion paths local to that CPU.
+ */
+class Model::VirtioBlockWorkers {
+public:
+    struct Config {
+        VirtioBlockEngine::Config engine; // Common to all the queues, [engine.queue] is ignored
+    };
+
+    VirtioBlockWorkers(Model::VirtioBlock &dev, const Config &config) : _dev(&dev), _config(config) {}
+    ~VirtioBlockWorkers();
+
+    VirtioBlockWorkers(const VirtioBlockWorkers &) = delete;
+    VirtioBlockWorkers &operator=(const VirtioBlockWorkers &) = delete;
+
+    /*! \brief Create the engines and the signals of all the request queues of the device
+     *  \param ctx Platform context
+     *  \param queue_entries Size of the request queues
+     *  \return true on success, false otherwise
+     */
+    bool init(const Platform_ctx *ctx, uint16 queue_entries);
+
+    /*! \brief Serve a request queue until stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created, one per queue.
+     *  \param queue Index of the request queue, lower than num_queues()
+     */
+    void run(uint16 queue);
+
+    /*! \brief Make all the loops return once their current round is over
+     *
+     *  The caller then joins the threads running them, before destroying the object.
+     */
+    void stop();
+
+    /*! \brief Reset all the engines, to be called on device reset
+     */
+    void reset();
+
+    uint16 num_queues() const { return _num_queues; }
+    const VirtioBlockEngine &engine(uint16 queue) const { return *_engines[queue]; }
+
+private:
+    Model::VirtioBlock *_dev;
+    Config _config;
+    uint16 _num_queues{0};
+    atomic<bool> _stop{false};
+
+    VirtioBlockEngine *_engines[VirtioBlock::MAX_QUEUES]{};
+    Platform::Signal *_sigs[VirtioBlock::MAX_QUEUES]{};
+};
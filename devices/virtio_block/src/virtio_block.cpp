@@ -14,10 +14,14 @@
 #include <platform/types.hpp>
 
 void
-Model::VirtioBlock::notify(uint32 const) {
-    if (_backend_connected) {
+Model::VirtioBlock::notify(uint32 const queue) {
+    if (!_backend_connected)
+        return;
+
+    if (queue < _num_queues && _queue_sig[queue] != nullptr)
+        _queue_sig[queue]->sig();
+    else
         _sig->sig();
-    }
 }
 
 void
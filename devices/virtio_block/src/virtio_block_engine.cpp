@@ -0,0 +1,685 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <debug_switches.hpp>
+#include <fcntl.h>
+#include <model/virtio_block_engine.hpp>
+#include <platform/log.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
+
+static constexpr size_t HEADER_SIZE = sizeof(Model::VirtioBlockRequestHeader);
+static constexpr size_t STATUS_SIZE = sizeof(uint8);
+static constexpr size_t SECTOR_SIZE = static_cast<size_t>(Model::VirtioBlockProtocol::SIZE);
+static constexpr size_t ID_SIZE = static_cast<size_t>(Model::VirtioBlockGetID::DATA_SIZE);
+static constexpr size_t SEGMENT_SIZE = sizeof(Model::VirtioBlockDiscardWriteZeroes);
+// Bound on the sectors of a DISCARD/WRITE_ZEROES/SECURE_ERASE segment, served on the engine thread
+static constexpr uint32 MAX_RANGE_SECTORS = static_cast<uint32>((64ull << 20) / SECTOR_SIZE);
+// Size of the buffer of zeroes written when a range cannot be zeroed by the file system
+static constexpr size_t ZERO_BUF_SIZE = 1ull << 20;
+// Tag of the host writes of zeroes, the other I/Os are tagged with their request slot
+static constexpr uint64 ZERO_IO = UINT64_MAX;
+
+/*
+ * Hole punching is probed past the end of the file, where it has no effect. The file systems
+ * that do not support it fail with EOPNOTSUPP. fallocate() is only available on Linux: elsewhere,
+ * ranges are always zeroed by writing zeroes.
+ */
+static bool
+supports_punch_hole([[maybe_unused]] int fd) {
+#ifdef __linux__
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return false;
+
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st.st_size, static_cast<off_t>(SECTOR_SIZE)) == 0;
+#else
+    return false;
+#endif
+}
+
+static int
+sync_data(int fd) {
+#ifdef __linux__
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+void
+Model::VirtioBlockEngine::advertise_features(const Config &config, Model::VirtioBlock::UserConfig &user_config) {
+    if (config.read_only)
+        return;
+
+    Model::VirtioBlockConfig &blk = user_config.block_config;
+    uint32 max_sectors = config.capacity < MAX_RANGE_SECTORS ? static_cast<uint32>(config.capacity) : MAX_RANGE_SECTORS;
+    uint32 alignment = 1;
+
+    struct stat st;
+    if (fstat(config.fd, &st) == 0 && static_cast<size_t>(st.st_blksize) > SECTOR_SIZE)
+        alignment = static_cast<uint32>(static_cast<size_t>(st.st_blksize) / SECTOR_SIZE);
+
+    bool punch_hole = supports_punch_hole(config.fd);
+    if (punch_hole) {
+        user_config.device_feature |= static_cast<uint64>(VirtioBlockFeatures::DISCARD);
+        blk.max_discard_sectors = max_sectors;
+        blk.max_discard_seg = MAX_RANGE_SEGMENTS;
+        blk.discard_sector_alignment = alignment;
+    }
+
+    // Zeroes can always be written explicitly when the file system cannot zero a range
+    user_config.device_feature |= static_cast<uint64>(VirtioBlockFeatures::WRITE_ZEROES);
+    blk.max_write_zeroes_sectors = max_sectors;
+    blk.max_write_zeroes_seg = MAX_RANGE_SEGMENTS;
+    blk.write_zeroes_may_unmap = punch_hole ? 1 : 0;
+
+    user_config.device_feature |= static_cast<uint64>(VirtioBlockFeatures::SECURE_ERASE);
+    blk.max_secure_erase_sectors = max_sectors;
+    blk.max_secure_erase_seg = MAX_RANGE_SEGMENTS;
+    blk.secure_erase_sector_alignment = alignment;
+}
+
+Model::VirtioBlockEngine::~VirtioBlockEngine() {
+    if (_reqs != nullptr) {
+        for (uint16 i = 0; i < _config.queue_depth; i++) {
+            if (_reqs[i].buf != nullptr)
+                _reqs[i].buf->deinit();
+            delete _reqs[i].buf;
+            delete[] _reqs[i].iov;
+        }
+    }
+
+    delete[] _reqs;
+    delete[] _free;
+    delete[] _done;
+    delete[] _window;
+    delete[] _zeroes;
+}
+
+bool
+Model::VirtioBlockEngine::init(const Platform_ctx *ctx, uint16 queue_entries) {
+    if (_config.queue_depth == 0 || queue_entries == 0)
+        return false;
+
+    if (!_lock.init(ctx))
+        return false;
+
+    _max_chain_length = queue_entries;
+    _iov_capacity = _config.max_merge_size != 0 && MERGE_IOV_MAX > queue_entries ? MERGE_IOV_MAX : queue_entries;
+    _reqs = new (nothrow) Request[_config.queue_depth];
+    _free = new (nothrow) uint16[_config.queue_depth];
+    _done = new (nothrow) uint16[_config.queue_depth];
+    _window = new (nothrow) uint16[_config.queue_depth];
+    _zeroes = new (nothrow) char[ZERO_BUF_SIZE]();
+    if (_reqs == nullptr || _free == nullptr || _done == nullptr || _window == nullptr || _zeroes == nullptr)
+        return false;
+
+    for (uint16 i = 0; i < _config.queue_depth; i++) {
+        Request &req = _reqs[i];
+
+        req.buf = new (nothrow) Virtio::Sg::Buffer(_max_chain_length);
+        req.iov = new (nothrow) iovec[_iov_capacity];
+        if (req.buf == nullptr || req.iov == nullptr)
+            return false;
+        if (req.buf->init() != Errno::NONE)
+            return false;
+
+        _free[_num_free++] = i;
+    }
+
+    _punch_hole = supports_punch_hole(_config.fd);
+
+    if (_config.use_io_uring && !_ring.init(_config.queue_depth))
+        INFO("virtio block: io_uring is not available, falling back to synchronous I/O");
+
+    return true;
+}
+
+void
+Model::VirtioBlockEngine::process() {
+    Platform::MutexGuard guard{_lock};
+
+    if (!_dev->request_queue_constructed(_config.queue))
+        return;
+
+    Virtio::DeviceQueue &vq = _dev->request_queue(_config.queue);
+    bool queue_empty = false;
+
+    do {
+        // Fill all the free slots, the I/O is only handed to the kernel once the queue is
+        // drained or the queue depth is reached.
+        while (!queue_empty && _num_free > 0) {
+            if (!pop_request(vq, _free[_num_free - 1]))
+                queue_empty = true;
+            else
+                _num_free--;
+        }
+
+        submit_window();
+        reap(_num_done == 0);
+        publish(vq);
+    } while (_in_flight > 0 || !queue_empty);
+}
+
+void
+Model::VirtioBlockEngine::reset() {
+    Platform::MutexGuard guard{_lock};
+
+    drop_all();
+}
+
+bool
+Model::VirtioBlockEngine::pop_request(Virtio::DeviceQueue &vq, uint16 slot) {
+    Request &req = _reqs[slot];
+
+    Errno err = req.buf->walk_chain(vq);
+    if (err != Errno::NONE)
+        return false;
+
+    req.iov_cnt = 0;
+    req.data_size = 0;
+    req.io_size = 0;
+    req.merge_next = NO_SLOT;
+    req.status = VirtioBlockStatus::OK;
+
+    size_t size = req.buf->size_bytes();
+    if (size < HEADER_SIZE + STATUS_SIZE) {
+        complete(slot, VirtioBlockStatus::IOERR);
+        return true;
+    }
+
+    VirtioBlockRequestHeader hdr;
+    size_t hdr_size = HEADER_SIZE;
+    err = req.buf->copy_to_linear(&hdr, *_dev, hdr_size);
+    if (err != Errno::NONE) {
+        complete(slot, VirtioBlockStatus::IOERR);
+        return true;
+    }
+
+    req.type = static_cast<VirtioBlockRequestType>(hdr.type);
+    req.offset = hdr.sector * SECTOR_SIZE;
+
+    switch (req.type) {
+    case VirtioBlockRequestType::OUT:
+        if (_config.read_only) {
+            complete(slot, VirtioBlockStatus::IOERR);
+            return true;
+        }
+        [[fallthrough]];
+    case VirtioBlockRequestType::IN: {
+        VirtioBlockStatus status = parse_data(req);
+        if (status != VirtioBlockStatus::OK) {
+            complete(slot, status);
+            return true;
+        }
+
+        uint64 num_sectors = req.data_size / SECTOR_SIZE;
+        if (hdr.sector > _config.capacity || num_sectors > _config.capacity - hdr.sector)
+            complete(slot, VirtioBlockStatus::IOERR);
+        else if (req.data_size == 0)
+            complete(slot, VirtioBlockStatus::OK);
+        else
+            _window[_num_window++] = slot;
+        return true;
+    }
+    case VirtioBlockRequestType::FLUSH:
+        // The writes popped before the flush are queued first, the flush is drained behind them
+        submit_window();
+        start_io(slot);
+        return true;
+    case VirtioBlockRequestType::DISCARD:
+    case VirtioBlockRequestType::WRITE_ZEROES:
+    case VirtioBlockRequestType::SECURE_ERASE:
+        // The ranges are only changed once the I/O popped before the request has completed
+        submit_window();
+        while (_in_flight > 0)
+            reap(true);
+        complete(slot, execute_ranges(req));
+        return true;
+    case VirtioBlockRequestType::GET_ID: {
+        char id[ID_SIZE];
+        size_t id_size = min(ID_SIZE, size - HEADER_SIZE - STATUS_SIZE);
+
+        memset(id, 0, sizeof(id));
+        memcpy(id, _config.serial, strnlen(_config.serial, sizeof(id)));
+        err = req.buf->copy_from_linear(id, *_dev, id_size, HEADER_SIZE);
+        complete(slot, err == Errno::NONE ? VirtioBlockStatus::OK : VirtioBlockStatus::IOERR);
+        return true;
+    }
+    default:
+        complete(slot, VirtioBlockStatus::UNSUPP);
+        return true;
+    }
+}
+
+/*
+ * Build the I/O vector covering the data of the request, i.e. everything between the header
+ * and the status byte. The data of an IN request must be writable by the device, the data of an
+ * OUT request must be readable.
+ */
+Model::VirtioBlockStatus
+Model::VirtioBlockEngine::parse_data(Request &req) {
+    bool write = req.type == VirtioBlockRequestType::IN;
+    size_t data_end = req.buf->size_bytes() - STATUS_SIZE;
+    size_t off = 0;
+
+    for (auto it = req.buf->begin(); it != req.buf->end(); ++it) {
+        const Virtio::Sg::LinearizedDesc &desc = it.desc_ref();
+        size_t start = off;
+        size_t end = off + desc.length;
+
+        off = end;
+        if (end <= HEADER_SIZE || start >= data_end)
+            continue;
+
+        size_t skip = start < HEADER_SIZE ? HEADER_SIZE - start : 0;
+        size_t len = min(end, data_end) - start - skip;
+        if (len == 0)
+            continue;
+
+        if (write != ((desc.flags & VIRTQ_DESC_WRITE_ONLY) != 0))
+            return VirtioBlockStatus::IOERR;
+
+        char *hva = nullptr;
+        Errno err = write ? _dev->vq_addr_to_w_hva(desc.address + skip, len, hva)
+                          : _dev->vq_addr_to_r_hva(desc.address + skip, len, hva);
+        if (err != Errno::NONE)
+            return VirtioBlockStatus::IOERR;
+
+        req.iov[req.iov_cnt].iov_base = hva;
+        req.iov[req.iov_cnt].iov_len = len;
+        req.iov_cnt++;
+        req.data_size += len;
+    }
+
+    if (req.data_size % SECTOR_SIZE != 0)
+        return VirtioBlockStatus::IOERR;
+
+    req.io_size = req.data_size;
+    return VirtioBlockStatus::OK;
+}
+
+/*
+ * Hand the IN/OUT requests of the current window to the host. The window is sorted by type and
+ * offset so that sequential requests end up next to each other and can be merged.
+ */
+void
+Model::VirtioBlockEngine::submit_window() {
+    for (uint16 i = 1; i < _num_window; i++) {
+        uint16 slot = _window[i];
+        const Request &req = _reqs[slot];
+        uint16 j = i;
+
+        for (; j > 0; j--) {
+            const Request &prev = _reqs[_window[j - 1]];
+            if (prev.type < req.type || (prev.type == req.type && prev.offset <= req.offset))
+                break;
+            _window[j] = _window[j - 1];
+        }
+        _window[j] = slot;
+    }
+
+    uint16 head = NO_SLOT;
+    uint16 tail = NO_SLOT;
+    for (uint16 i = 0; i < _num_window; i++) {
+        uint16 slot = _window[i];
+
+        if (Stats::enabled())
+            _stats.rw_requests++;
+        if (head != NO_SLOT && try_merge(_reqs[head], _reqs[slot])) {
+            _reqs[tail].merge_next = slot;
+            tail = slot;
+            if (Stats::enabled())
+                _stats.merged_requests++;
+            continue;
+        }
+
+        if (head != NO_SLOT)
+            start_io(head);
+        head = tail = slot;
+    }
+
+    if (head != NO_SLOT)
+        start_io(head);
+
+    _num_window = 0;
+}
+
+bool
+Model::VirtioBlockEngine::try_merge(Request &into, const Request &req) const {
+    if (into.type != req.type || into.offset + into.io_size != req.offset)
+        return false;
+    if (into.io_size + req.data_size > _config.max_merge_size)
+        return false;
+
+    // The last segment of [into] and the first segment of [req] can share a vector entry when
+    // they are contiguous in host memory.
+    const iovec &last = into.iov[into.iov_cnt - 1];
+    bool contiguous = static_cast<char *>(last.iov_base) + last.iov_len == req.iov[0].iov_base;
+    uint16 needed = static_cast<uint16>(req.iov_cnt - (contiguous ? 1 : 0));
+
+    if (into.iov_cnt + needed > MERGE_IOV_MAX)
+        return false;
+
+    uint16 first = 0;
+    if (contiguous) {
+        into.iov[into.iov_cnt - 1].iov_len += req.iov[0].iov_len;
+        first = 1;
+    }
+    for (uint16 i = first; i < req.iov_cnt; i++)
+        into.iov[into.iov_cnt++] = req.iov[i];
+
+    into.io_size += req.data_size;
+    return true;
+}
+
+/*
+ * Execute the segments of a DISCARD/WRITE_ZEROES/SECURE_ERASE request. A DISCARD deallocates the
+ * range, WRITE_ZEROES may do so if the guest allows it. SECURE_ERASE overwrites the range with
+ * zeroes and syncs it: deallocating it would leave the data in place on the host.
+ */
+Model::VirtioBlockStatus
+Model::VirtioBlockEngine::execute_ranges(Request &req) {
+    if (_config.read_only)
+        return VirtioBlockStatus::IOERR;
+    if (req.type == VirtioBlockRequestType::DISCARD && !_punch_hole)
+        return VirtioBlockStatus::UNSUPP;
+
+    size_t data_size = req.buf->size_bytes() - HEADER_SIZE - STATUS_SIZE;
+    size_t num_segments = data_size / SEGMENT_SIZE;
+    if (num_segments == 0 || num_segments > MAX_RANGE_SEGMENTS || data_size % SEGMENT_SIZE != 0)
+        return VirtioBlockStatus::IOERR;
+
+    uint32 allowed_flags = 0;
+    if (req.type == VirtioBlockRequestType::WRITE_ZEROES)
+        allowed_flags = static_cast<uint32>(VirtioBlockDiscardWriteZeroesFlags::UNMAP);
+
+    for (size_t i = 0; i < num_segments; i++) {
+        VirtioBlockDiscardWriteZeroes seg;
+        size_t seg_size = SEGMENT_SIZE;
+
+        Errno err = req.buf->copy_to_linear(&seg, *_dev, seg_size, HEADER_SIZE + i * SEGMENT_SIZE);
+        if (err != Errno::NONE)
+            return VirtioBlockStatus::IOERR;
+        if ((seg.flags & ~allowed_flags) != 0)
+            return VirtioBlockStatus::UNSUPP;
+        if (seg.sector > _config.capacity || seg.num_sectors > _config.capacity - seg.sector)
+            return VirtioBlockStatus::IOERR;
+        if (seg.num_sectors > MAX_RANGE_SECTORS)
+            return VirtioBlockStatus::IOERR;
+
+        bool unmap = req.type == VirtioBlockRequestType::DISCARD
+                     || (seg.flags & static_cast<uint32>(VirtioBlockDiscardWriteZeroesFlags::UNMAP)) != 0;
+        bool overwrite = req.type == VirtioBlockRequestType::SECURE_ERASE;
+
+        int res = zero_range(seg.sector * SECTOR_SIZE, seg.num_sectors * SECTOR_SIZE, unmap && _punch_hole, overwrite);
+        if (res != 0) {
+            WARN("virtio block: cannot zero sectors [%llu, +%u): %d", static_cast<unsigned long long>(seg.sector),
+                 seg.num_sectors, res);
+            return VirtioBlockStatus::IOERR;
+        }
+    }
+
+    if (req.type == VirtioBlockRequestType::SECURE_ERASE && sync_data(_config.fd) != 0)
+        return VirtioBlockStatus::IOERR;
+
+    return VirtioBlockStatus::OK;
+}
+
+int
+Model::VirtioBlockEngine::zero_range(uint64 offset, uint64 size, bool unmap, bool overwrite) {
+    if (size == 0)
+        return 0;
+
+    if (overwrite)
+        return write_zeroes(offset, size);
+
+    if (!unmap && !_zero_range)
+        return write_zeroes(offset, size);
+
+#ifdef __linux__
+    int mode = unmap ? FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE : FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+    if (fallocate(_config.fd, mode, static_cast<off_t>(offset), static_cast<off_t>(size)) == 0)
+        return 0;
+
+    int err = errno;
+    if (!unmap && err == EOPNOTSUPP) {
+        // Not supported by the file system, don't try again
+        _zero_range = false;
+        return write_zeroes(offset, size);
+    }
+
+    return -err;
+#else
+    // [unmap] is never set without hole punching
+    _zero_range = false;
+    return write_zeroes(offset, size);
+#endif
+}
+
+/*
+ * Overwrite a range with zeroes. With io_uring, up to a queue depth of chunks of the zero buffer
+ * are written in parallel. The engine is idle at this point: all the slots of the rings are free.
+ */
+int
+Model::VirtioBlockEngine::write_zeroes(uint64 offset, uint64 size) {
+    if (!_ring.is_valid())
+        return write_zeroes_sync(offset, size);
+
+    _zero_iov[0].iov_base = _zeroes;
+    _zero_iov[0].iov_len = ZERO_BUF_SIZE;
+    _zero_iov[1].iov_base = _zeroes;
+
+    while (size > 0) {
+        uint16 queued = 0;
+        uint64 queued_size = 0;
+
+        while (queued_size < size && queued < _config.queue_depth) {
+            uint64 chunk = min<uint64>(size - queued_size, ZERO_BUF_SIZE);
+            const iovec *iov = &_zero_iov[0];
+
+            // Only the last chunk of the range can be shorter than the buffer
+            if (chunk != ZERO_BUF_SIZE) {
+                _zero_iov[1].iov_len = static_cast<size_t>(chunk);
+                iov = &_zero_iov[1];
+            }
+            if (!_ring.prep_writev(_config.fd, iov, 1, offset + queued_size, ZERO_IO))
+                break;
+
+            queued++;
+            queued_size += chunk;
+        }
+
+        if (queued == 0)
+            return write_zeroes_sync(offset, size);
+
+        int err = 0;
+        uint64 written = 0;
+        while (queued > 0) {
+            int ret = _ring.submit(queued);
+            if (ret < 0 && ret != -EINTR && ret != -EBUSY)
+                return ret;
+
+            uint64 user_data;
+            int32 res;
+            while (queued > 0 && _ring.next_completion(user_data, res)) {
+                ASSERT(user_data == ZERO_IO);
+                queued--;
+                if (res < 0)
+                    err = res;
+                else
+                    written += static_cast<uint64>(res);
+            }
+        }
+
+        if (err != 0)
+            return err;
+        if (written != queued_size)
+            return -EIO;
+
+        offset += queued_size;
+        size -= queued_size;
+    }
+
+    return 0;
+}
+
+int
+Model::VirtioBlockEngine::write_zeroes_sync(uint64 offset, uint64 size) {
+    while (size > 0) {
+        size_t chunk = size < ZERO_BUF_SIZE ? static_cast<size_t>(size) : ZERO_BUF_SIZE;
+        ssize_t res = pwrite(_config.fd, _zeroes, chunk, static_cast<off_t>(offset));
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        offset += static_cast<uint64>(res);
+        size -= static_cast<uint64>(res);
+    }
+
+    return 0;
+}
+
+void
+Model::VirtioBlockEngine::start_io(uint16 slot) {
+    Request &req = _reqs[slot];
+
+    if (Stats::enabled() and req.type != VirtioBlockRequestType::FLUSH)
+        _stats.host_ios++;
+
+    if (_ring.is_valid()) {
+        bool ok;
+        if (req.type == VirtioBlockRequestType::IN)
+            ok = _ring.prep_readv(_config.fd, req.iov, req.iov_cnt, req.offset, slot);
+        else if (req.type == VirtioBlockRequestType::OUT)
+            ok = _ring.prep_writev(_config.fd, req.iov, req.iov_cnt, req.offset, slot);
+        else
+            ok = _ring.prep_fdatasync(_config.fd, slot, true);
+
+        if (__LIKELY__(ok)) {
+            _in_flight++;
+            return;
+        }
+    }
+
+    ssize_t res;
+    if (req.type == VirtioBlockRequestType::IN)
+        res = preadv(_config.fd, req.iov, req.iov_cnt, static_cast<off_t>(req.offset));
+    else if (req.type == VirtioBlockRequestType::OUT)
+        res = pwritev(_config.fd, req.iov, req.iov_cnt, static_cast<off_t>(req.offset));
+    else
+        res = sync_data(_config.fd);
+
+    complete_io(slot, res < 0 ? -errno : res);
+}
+
+/*
+ * Split the result of a host I/O between the requests that were merged into it. They are chained
+ * by offset, so a short transfer completes a prefix of the chain.
+ */
+void
+Model::VirtioBlockEngine::complete_io(uint16 slot, int64 res) {
+    if (res < 0)
+        WARN("virtio block: I/O error %lld on request type %u", static_cast<long long>(res),
+             static_cast<uint32>(_reqs[slot].type));
+
+    size_t done = res < 0 ? 0 : static_cast<size_t>(res);
+    while (slot != NO_SLOT) {
+        const Request &req = _reqs[slot];
+        uint16 next = req.merge_next;
+        bool ok = res >= 0 && done >= req.data_size;
+
+        // The host wrote the data of IN requests straight into the chain
+        if (req.type == VirtioBlockRequestType::IN && done != 0)
+            req.buf->record_written_bytes(*_dev, HEADER_SIZE, min(done, req.data_size));
+
+        done -= min(done, req.data_size);
+        complete(slot, ok ? VirtioBlockStatus::OK : VirtioBlockStatus::IOERR);
+        slot = next;
+    }
+}
+
+void
+Model::VirtioBlockEngine::reap(bool wait) {
+    if (!_ring.is_valid())
+        return;
+
+    int ret = _ring.submit(wait && _in_flight > 0 ? 1u : 0u);
+    if (ret < 0 && ret != -EINTR && ret != -EBUSY)
+        WARN("virtio block: io_uring submission failed: %d", ret);
+
+    uint64 user_data;
+    int32 res;
+    while (_ring.next_completion(user_data, res)) {
+        // Writes of zeroes are waited for by write_zeroes(), unless it gave up on them
+        if (user_data == ZERO_IO)
+            continue;
+
+        _in_flight--;
+        complete_io(static_cast<uint16>(user_data), res);
+    }
+}
+
+/*
+ * Write the status of all the completed requests and hand them back to the guest. The used
+ * index is updated once for the whole batch and the guest is notified once.
+ */
+void
+Model::VirtioBlockEngine::publish(Virtio::DeviceQueue &vq) {
+    if (_num_done == 0)
+        return;
+
+    vq.begin_batch();
+    for (uint16 i = 0; i < _num_done; i++) {
+        uint16 slot = _done[i];
+        Request &req = _reqs[slot];
+        size_t size = req.buf->size_bytes();
+
+        if (size >= STATUS_SIZE) {
+            uint8 status = static_cast<uint8>(req.status);
+            size_t status_size = STATUS_SIZE;
+            req.buf->copy_from_linear(&status, *_dev, status_size, size - STATUS_SIZE);
+        }
+
+        req.buf->conclude_chain_use(vq);
+        _free[_num_free++] = slot;
+    }
+    vq.end_batch();
+
+    if (Stats::enabled())
+        _stats.requests += _num_done;
+    _num_done = 0;
+    _dev->signal();
+}
+
+void
+Model::VirtioBlockEngine::drop_all() {
+    if (_reqs == nullptr)
+        return;
+
+    while (_in_flight > 0)
+        reap(true);
+
+    // The queue is being reset: no chain is given back to the guest.
+    _num_window = 0;
+    _num_done = 0;
+    _num_free = 0;
+    for (uint16 i = 0; i < _config.queue_depth; i++) {
+        _reqs[i].buf->reset();
+        _free[_num_free++] = i;
+    }
+}
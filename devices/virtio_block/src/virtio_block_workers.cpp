@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <model/virtio_block_workers.hpp>
+#include <platform/log.hpp>
+#include <platform/new.hpp>
+
+Model::VirtioBlockWorkers::~VirtioBlockWorkers() {
+    for (uint16 q = 0; q < _num_queues; q++) {
+        _dev->set_queue_signal(q, nullptr);
+        delete _engines[q];
+        delete _sigs[q];
+    }
+}
+
+bool
+Model::VirtioBlockWorkers::init(const Platform_ctx *ctx, uint16 queue_entries) {
+    for (uint16 q = 0; q < _dev->num_queues(); q++) {
+        VirtioBlockEngine::Config config = _config.engine;
+        config.queue = q;
+
+        _engines[q] = new (nothrow) VirtioBlockEngine(*_dev, config);
+        _sigs[q] = new (nothrow) Platform::Signal();
+        _num_queues++;
+
+        if (_engines[q] == nullptr || _sigs[q] == nullptr)
+            return false;
+        if (!_sigs[q]->init(ctx) || !_engines[q]->init(ctx, queue_entries))
+            return false;
+
+        _dev->set_queue_signal(q, _sigs[q]);
+    }
+
+    return true;
+}
+
+void
+Model::VirtioBlockWorkers::stop() {
+    _stop = true;
+    for (uint16 q = 0; q < _num_queues; q++)
+        _sigs[q]->sig();
+}
+
+void
+Model::VirtioBlockWorkers::reset() {
+    for (uint16 q = 0; q < _num_queues; q++)
+        _engines[q]->reset();
+}
+
+void
+Model::VirtioBlockWorkers::run(uint16 queue) {
+    ASSERT(queue < _num_queues);
+
+    while (!_stop) {
+        _sigs[queue]->wait();
+        if (_stop)
+            return;
+
+        _engines[queue]->process();
+    }
+}
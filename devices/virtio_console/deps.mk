@@ -1,3 +1,3 @@
-LIBS = vbus virtio_base irq_controller simple_as $(PLATFORM)
+LIBS = vbus virtio_base irq_controller simple_as arch_api $(PLATFORM)
 
 $(eval $(call dep_hook,virtio_console,$(LIBS)))
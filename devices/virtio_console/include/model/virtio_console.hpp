@@ -27,6 +27,9 @@ namespace Model {
     struct VirtioConsoleConfig;
     class VirtioConsoleCallback;
     class IrqController;
+
+    // Queues of a VirtioConsole device: RX and TX of the single port
+    using VirtioConsoleQueues = Virtio::QueueStorage<2>;
 }
 
 struct Model::VirtioConsoleConfig {
@@ -44,9 +47,13 @@ public:
 
 // NOTE: while [Virtio::Device] is a concrete instance of [Virtio::Sg::Buffer::ChainAccessor],
 // it overloads the necessary functions using the
-// [Model::SimpleAS::map_guest_mem]/[Model::SimpleAS::unmap_guest_mem] functions. [VirtioConsole],
-// however, needs to do demand (un)mapping which means that we must provide custom overrides.
-class Model::VirtioConsole : public Virtio::Device, public Virtio::Sg::Buffer::ChainAccessor {
+// [Model::SimpleAS::map_guest_mem]/[Model::SimpleAS::unmap_guest_mem] functions. [VirtioConsole]
+// provides custom overrides: guest buffers are accessed through the persistent VMM view of the
+// guest memory when it exists, and (un)mapped on demand otherwise.
+//
+// [to_guest] and [from_guest] drain as many chains as the data allows in one batch: the used
+// index is published once and a single interrupt is raised for the whole batch.
+class Model::VirtioConsole : private Model::VirtioConsoleQueues, public Virtio::GuestMemDevice {
 private:
     enum { RX = 0, TX = 1 };
     Model::VirtioConsoleConfig _config;
@@ -58,7 +65,9 @@ private:
     Platform::Signal *_sig_notify_event;
     bool _driver_initialized{false};
     Platform::Signal _sig_notify_empty_space;
-    Platform::Mutex _io_lock;
+    // Serialize the IOMMU translations of each direction against map()/unmap()/detach()
+    Platform::Mutex _rx_lock; // to_guest(): writable buffers
+    Platform::Mutex _tx_lock; // from_guest(): readable buffers
 
     // [Virtio::Device] overrides
     void notify(uint32) override;
@@ -70,8 +79,9 @@ private:
 public:
     VirtioConsole(IrqController &irq_ctlr, const Vbus::Bus &bus, uint16 const irq, uint16 const queue_entries,
                   Virtio::Transport *transport, Platform::Signal *sig, uint64 device_features = 0)
-        : Virtio::Device("virtio console", Virtio::DeviceID::CONSOLE, bus, irq_ctlr, &_config, sizeof(_config), irq,
-                         queue_entries, transport, device_features),
+        : Virtio::GuestMemDevice("virtio console", Virtio::DeviceID::CONSOLE, bus, irq_ctlr, &_config,
+                                 sizeof(_config), irq, queue_entries, transport, device_features,
+                                 static_cast<VirtioConsoleQueues &>(*this), VirtioConsoleQueues::NUM),
           _rx_buff(Virtio::Sg::Buffer(queue_entries)), _tx_buff(Virtio::Sg::Buffer(queue_entries)), _sig_notify_event(sig) {}
 
     bool init(const Platform_ctx *ctx) {
@@ -81,7 +91,9 @@ public:
             return false;
         if (not _sig_notify_empty_space.init(ctx))
             return false;
-        return _io_lock.init(ctx);
+        if (not _rx_lock.init(ctx))
+            return false;
+        return _tx_lock.init(ctx);
     }
 
     bool to_guest(const char *buff, size_t size_bytes);
@@ -111,69 +123,42 @@ public:
 
 private:
     void detach() override {
-        Platform::MutexGuard l{_io_lock};
+        Platform::MutexGuard rx{_rx_lock};
+        Platform::MutexGuard tx{_tx_lock};
         Model::IOMMUManagedDevice::detach();
     }
 
     Errno map(const Model::IOMapping &m) override {
-        Platform::MutexGuard l{_io_lock};
+        Platform::MutexGuard rx{_rx_lock};
+        Platform::MutexGuard tx{_tx_lock};
         return Model::IOMMUManagedDevice::map(m);
     }
 
     Errno unmap(const Model::IOMapping &m) override {
-        Platform::MutexGuard l{_io_lock};
+        Platform::MutexGuard rx{_rx_lock};
+        Platform::MutexGuard tx{_tx_lock};
         return Model::IOMMUManagedDevice::unmap(m);
     }
 
-    GPA translate(uint64 addr, size_t size_bytes) {
-        if (not use_io_mappings()) {
+    Platform::Mutex &io_lock(bool write) { return write ? _rx_lock : _tx_lock; }
+
+    // Callers hold the lock of the direction (io_lock), only around the translation and its mapping
+    GPA translate(uint64 addr, size_t size_bytes) const {
+        if (not use_io_mappings())
             return GPA(addr);
-        }
-        Platform::MutexGuard l{_io_lock};
+
         return GPA(translate_io(addr, size_bytes));
     }
 
+    Errno vq_addr_to_hva(uint64 vqa, size_t size_bytes, char *&hva, bool write);
+
     // [Virtio::Queue::AddressTranslator] overrides inherited by [Virtio::Sg::Buffer::ChainAccessor]
     Errno vq_addr_to_r_hva(uint64 vqa, size_t size_bytes, char *&hva) override {
-        GPA gpa = translate(vqa, size_bytes);
-        if (gpa.invalid())
-            return Errno::PERM;
-
-        void *temp_hva = nullptr;
-        Errno err = Model::SimpleAS::demand_map_bus(*_vbus, gpa, size_bytes, temp_hva, false);
-
-        if (Errno::NONE == err) {
-            hva = static_cast<char *>(temp_hva);
-        }
-
-        return err;
+        return vq_addr_to_hva(vqa, size_bytes, hva, false);
     }
     Errno vq_addr_to_w_hva(uint64 vqa, size_t size_bytes, char *&hva) override {
-        GPA gpa = translate(vqa, size_bytes);
-        if (gpa.invalid()) {
-            return Errno::PERM;
-        }
-        void *temp_hva = nullptr;
-        Errno err = Model::SimpleAS::demand_map_bus(*_vbus, gpa, size_bytes, temp_hva, true);
-
-        if (Errno::NONE == err) {
-            hva = static_cast<char *>(temp_hva);
-        }
-
-        return err;
-    }
-    Errno vq_addr_to_r_hva_post(uint64 vqa, size_t size_bytes, char *hva) override {
-        GPA gpa = translate(vqa, size_bytes);
-        if (gpa.invalid()) {
-            return Errno::PERM;
-        }
-        return Model::SimpleAS::demand_unmap_bus(*_vbus, gpa, size_bytes, hva);
-    }
-    Errno vq_addr_to_w_hva_post(uint64 vqa, size_t size_bytes, char *hva) override {
-        GPA gpa = translate(vqa, size_bytes);
-        if (gpa.invalid()) {
-            return Errno::PERM;
-        }
-        return Model::SimpleAS::demand_unmap_bus_clean(*_vbus, gpa, size_bytes, hva);
+        return vq_addr_to_hva(vqa, size_bytes, hva, true);
     }
+    Errno vq_addr_to_r_hva_post(uint64 vqa, size_t size_bytes, char *hva) override;
+    Errno vq_addr_to_w_hva_post(uint64 vqa, size_t size_bytes, char *hva) override;
 };
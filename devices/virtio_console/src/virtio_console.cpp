@@ -6,12 +6,15 @@
  * See the LICENSE-BlueRock file in the repository root for details.
  */
 
+#include <arch/mem_util.hpp>
+#include <model/simple_as.hpp>
 #include <model/virtio_common.hpp>
 #include <model/virtio_console.hpp>
 #include <model/virtio_sg.hpp>
 #include <model/virtqueue.hpp>
 #include <platform/bits.hpp>
 #include <platform/errno.hpp>
+#include <platform/mutex.hpp>
 #include <platform/signal.hpp>
 #include <platform/types.hpp>
 
@@ -34,17 +37,73 @@ Model::VirtioConsole::driver_ok() {
         _callback->driver_ok();
 }
 
+Errno
+Model::VirtioConsole::vq_addr_to_hva(uint64 vqa, size_t size_bytes, char *&hva, bool write) {
+    Platform::MutexGuard l{io_lock(write)};
+    GPA gpa = translate(vqa, size_bytes);
+    if (gpa.invalid())
+        return Errno::PERM;
+
+    char *view = Model::SimpleAS::gpa_to_vmm_view(*_vbus, gpa, size_bytes);
+    if (view != nullptr) {
+        hva = view;
+        return Errno::NONE;
+    }
+
+    // The guest memory has no persistent VMM view: map the buffer for the duration of the copy
+    void *temp_hva = nullptr;
+    Errno err = Model::SimpleAS::demand_map_bus(*_vbus, gpa, size_bytes, temp_hva, write);
+    if (Errno::NONE == err)
+        hva = static_cast<char *>(temp_hva);
+
+    return err;
+}
+
+Errno
+Model::VirtioConsole::vq_addr_to_r_hva_post(uint64 vqa, size_t size_bytes, char *hva) {
+    Platform::MutexGuard l{_tx_lock};
+    GPA gpa = translate(vqa, size_bytes);
+    if (gpa.invalid())
+        return Errno::PERM;
+
+    if (Model::SimpleAS::gpa_to_vmm_view(*_vbus, gpa, size_bytes) == hva)
+        return Errno::NONE;
+
+    return Model::SimpleAS::demand_unmap_bus(*_vbus, gpa, size_bytes, hva);
+}
+
+Errno
+Model::VirtioConsole::vq_addr_to_w_hva_post(uint64 vqa, size_t size_bytes, char *hva) {
+    Platform::MutexGuard l{_rx_lock};
+    GPA gpa = translate(vqa, size_bytes);
+    if (gpa.invalid())
+        return Errno::PERM;
+
+    // The guest may read its buffers with the caches off
+    if (Model::SimpleAS::gpa_to_vmm_view(*_vbus, gpa, size_bytes) == hva) {
+        dcache_clean_range(hva, size_bytes);
+        return Errno::NONE;
+    }
+
+    return Model::SimpleAS::demand_unmap_bus_clean(*_vbus, gpa, size_bytes, hva);
+}
+
 bool
 Model::VirtioConsole::to_guest(const char *buff, size_t size_bytes) {
     if (!queue(RX).constructed() || (!_driver_initialized))
         return false;
 
+    Virtio::DeviceQueue &vq = device_queue(RX);
     size_t buf_idx = 0;
+    bool ok = true;
+    bool used = false;
+
+    vq.begin_batch();
     while (size_bytes != 0u) {
-        Errno err = _rx_buff.walk_chain(device_queue(RX));
+        Errno err = _rx_buff.walk_chain(vq);
         if (Errno::NONE != err) {
-            assert_irq();
-            return false;
+            ok = false;
+            break;
         }
 
         size_t n_copy = min(size_bytes, _rx_buff.size_bytes());
@@ -52,18 +111,23 @@ Model::VirtioConsole::to_guest(const char *buff, size_t size_bytes) {
         // NOTE: [Model::VirtioConsole] is a concrete instantiation of
         // [Virtio::Sg::Buffer::ChainAccessor].
         err = _rx_buff.copy_from_linear(buff + buf_idx, *this, n_copy);
-        _rx_buff.conclude_chain_use(device_queue(RX));
-        assert_irq();
+        _rx_buff.conclude_chain_use(vq);
+        used = true;
 
         if (Errno::NONE != err) {
-            return false; /* outside guest physical memory */
+            ok = false; /* outside guest physical memory */
+            break;
         }
 
         size_bytes -= n_copy;
         buf_idx += n_copy;
     }
+    vq.end_batch();
 
-    return true;
+    if (used || !ok)
+        assert_irq();
+
+    return ok;
 }
 
 size_t
@@ -71,15 +135,18 @@ Model::VirtioConsole::from_guest(char *out_buf, size_t size_bytes) {
     if (!queue(TX).constructed() || (!_driver_initialized))
         return 0;
 
+    Virtio::DeviceQueue &vq = device_queue(TX);
     size_t was_read = 0;
+    bool used = false;
     Errno err = Errno::NONE;
 
+    vq.begin_batch();
     while (size_bytes != 0) {
         // NOTE: prior to any [walk_chain] - or right after a [conclude_chain_use] - [0 ==
         // _tx_buff.size_bytes()]
         if (0 == _tx_buff.size_bytes()) {
             _tx_buff_progress = 0;
-            err = _tx_buff.walk_chain(device_queue(TX));
+            err = _tx_buff.walk_chain(vq);
             if (Errno::NONE != err) {
                 break;
             }
@@ -93,17 +160,21 @@ Model::VirtioConsole::from_guest(char *out_buf, size_t size_bytes) {
             err = _tx_buff.copy_to_linear(out_buf + was_read, *this, n_copy, _tx_buff_progress);
         }
         if (Errno::NONE != err || 0 == n_copy) {
-            _tx_buff.conclude_chain_use(device_queue(TX));
-            assert_irq();
+            _tx_buff.conclude_chain_use(vq);
+            used = true;
 
             if (Errno::NONE != err)
-                return was_read;
+                break;
         } else {
             _tx_buff_progress += n_copy;
             size_bytes -= n_copy;
             was_read += n_copy;
         }
     }
+    vq.end_batch();
+
+    if (used)
+        assert_irq();
 
     return was_read;
 }
@@ -1,3 +1,3 @@
-LIBS = vbus virtio_base irq_controller $(PLATFORM)
+LIBS = vbus virtio_base irq_controller simple_as $(PLATFORM)
 
 $(eval $(call dep_hook,virtio_net,$(LIBS)))
@@ -10,8 +10,11 @@
 
 #include <model/iommu_interface.hpp>
 #include <model/irq_controller.hpp>
+#include <model/simple_as.hpp>
 #include <model/virtio.hpp>
 #include <model/virtio_common.hpp>
+#include <model/virtio_sg.hpp>
+#include <model/virtqueue.hpp>
 #include <platform/compiler.hpp>
 #include <platform/errno.hpp>
 #include <platform/signal.hpp>
@@ -22,8 +25,13 @@
 namespace Model {
     class VirtioNet;
     struct VirtioNetConfig;
+    struct VirtioNetHeader;
     class VirtioNetCallback;
+    class VirtioNetCtrl;
     class Irq_contoller;
+
+    // Queues of a VirtioNet device: up to 15 RX/TX queue pairs and the control queue
+    using VirtioNetQueues = Virtio::QueueStorage<31>;
 }
 
 enum : uint64 {
@@ -48,6 +56,7 @@ enum : uint64 {
     VIRTIO_NET_GUEST_ANNOUNCE = (1 << 21),
     VIRTIO_NET_MQ = (1 << 22),
     VIRTIO_NET_CTRL_MAC_ADDR = (1 << 23),
+    VIRTIO_NET_RSS = 1ull << 60,
     VIRTIO_NET_RSC_EXT = 1ull << 61,
     VIRTIO_NET_STANDBY = 1ull << 62,
 };
@@ -62,9 +71,43 @@ struct Model::VirtioNetConfig {
     uint16 status{0};
     uint16 num_virtqueue_pairs{0};
     uint16 mtu{0};
+    uint32 speed{0};
+    uint8 duplex{0};
+    // Only meaningful with VIRTIO_NET_F_RSS
+    uint8 rss_max_key_size{0};
+    uint16 rss_max_indirection_table_length{0};
+    uint32 supported_hash_types{0};
+};
+
+// 5.1.6 Device Operation: header prepended to every packet, on both the RX and TX queues.
+// VIRTIO_F_VERSION_1 is always offered, [num_buffers] is therefore always present.
+struct Model::VirtioNetHeader {
+    uint8 flags{0};
+    uint8 gso_type{0};
+    uint16 hdr_len{0};
+    uint16 gso_size{0};
+    uint16 csum_start{0};
+    uint16 csum_offset{0};
+    uint16 num_buffers{0};
 };
 #pragma pack()
 
+static_assert(sizeof(Model::VirtioNetHeader) == 12, "virtio_net_hdr is 12 bytes long");
+
+enum : uint8 {
+    VIRTIO_NET_HDR_F_NEEDS_CSUM = (1 << 0),
+    VIRTIO_NET_HDR_F_DATA_VALID = (1 << 1),
+    VIRTIO_NET_HDR_F_RSC_INFO = (1 << 2),
+};
+
+enum : uint8 {
+    VIRTIO_NET_HDR_GSO_NONE = 0,
+    VIRTIO_NET_HDR_GSO_TCPV4 = 1,
+    VIRTIO_NET_HDR_GSO_UDP = 3,
+    VIRTIO_NET_HDR_GSO_TCPV6 = 4,
+    VIRTIO_NET_HDR_GSO_ECN = 0x80,
+};
+
 class Model::VirtioNetCallback {
 public:
     virtual void device_reset() = 0;
@@ -77,19 +120,31 @@ public:
     virtual Errno unmap(const Model::IOMapping &m) = 0;
 };
 
-class Model::VirtioNet : public Virtio::Device {
+// NOTE: [VirtioNet] is a [Virtio::Sg::Buffer::ChainAccessor] so that backends can copy packets
+// from and to the chains directly, through the persistent view of guest memory.
+class Model::VirtioNet : private Model::VirtioNetQueues, public Virtio::GuestMemDevice {
 
 private:
+    // Queue pair i is made of the queues 2i (RX) and 2i + 1 (TX), the control queue follows them
     enum { RX = 0, TX = 1 };
+    static constexpr uint16 MAX_QUEUE_PAIRS = (VirtioNetQueues::NUM - 1) / 2;
+
     Virtio::Callback *_callback{nullptr};
     Model::VirtioNetCallback *_virtio_net_callback{nullptr};
+    Model::VirtioNetCtrl *_ctrl{nullptr};
     VirtioNetConfig _config;
     Platform::Signal *_sig;
+    uint16 _max_queue_pairs{1};
+    // Per queue signal, [_sig] is used for the queues that don't have one
+    Platform::Signal *_queue_sig[VirtioNetQueues::NUM]{};
     bool _backend_connected{false};
 
     void notify(uint32) override;
     void driver_ok() override;
 
+    static uint8 rx_index(uint16 pair) { return static_cast<uint8>(2 * pair + RX); }
+    static uint8 tx_index(uint16 pair) { return static_cast<uint8>(2 * pair + TX); }
+
 public:
     struct UserConfig {
         Virtio::Transport *transport{nullptr};
@@ -97,19 +152,65 @@ public:
         uint64 mac{0};
         uint16 mtu{0};
         uint16 port_id{0};
+        // Only meaningful with VIRTIO_NET_F_MQ
+        uint16 max_queue_pairs{1};
+        // Only meaningful with VIRTIO_NET_F_RSS
+        uint8 rss_max_key_size{0};
+        uint16 rss_max_indirection_table_length{0};
+        uint32 supported_hash_types{0};
     };
 
     VirtioNet(IrqController &irq_ctlr, const Vbus::Bus &vbus, uint16 irq, uint16 const queue_entries, const UserConfig &config,
               Platform::Signal *sig)
-        : Virtio::Device("virtio network", Virtio::DeviceID::NET, vbus, irq_ctlr, &_config, sizeof(_config), irq, queue_entries,
-                         config.transport, config.device_feature),
-          _config{reinterpret_cast<const uint8 *>(&config.mac), config.mtu}, _sig(sig) {}
+        : Virtio::GuestMemDevice("virtio network", Virtio::DeviceID::NET, vbus, irq_ctlr, &_config,
+                                 sizeof(_config), irq, queue_entries, config.transport, config.device_feature,
+                                 static_cast<VirtioNetQueues &>(*this), num_queues(config)),
+          _config{reinterpret_cast<const uint8 *>(&config.mac), config.mtu}, _sig(sig) {
+        if ((config.device_feature & VIRTIO_NET_MQ) != 0) {
+            _max_queue_pairs = clamp_queue_pairs(config.max_queue_pairs);
+            _config.num_virtqueue_pairs = _max_queue_pairs;
+        }
+        if ((config.device_feature & VIRTIO_NET_RSS) != 0) {
+            _config.rss_max_key_size = config.rss_max_key_size;
+            _config.rss_max_indirection_table_length = config.rss_max_indirection_table_length;
+            _config.supported_hash_types = config.supported_hash_types;
+        }
+    }
+
+    // Queues advertised with [config]: the queue pairs, then the control queue if it is offered
+    static uint16 num_queues(const UserConfig &config) {
+        uint16 pairs = (config.device_feature & VIRTIO_NET_MQ) != 0 ? clamp_queue_pairs(config.max_queue_pairs) : 1;
+        return static_cast<uint16>(2 * pairs + ((config.device_feature & VIRTIO_NET_CTRL_VQ) != 0 ? 1 : 0));
+    }
+
+    static uint16 clamp_queue_pairs(uint16 pairs) {
+        if (pairs == 0)
+            return 1;
+        return pairs < MAX_QUEUE_PAIRS ? pairs : MAX_QUEUE_PAIRS;
+    }
 
     void register_callback(Virtio::Callback &callback, Model::VirtioNetCallback &virtio_net_callback) {
         _callback = &callback;
         _virtio_net_callback = &virtio_net_callback;
     }
 
+    /*! \brief Set the signal raised when the guest notifies a given queue
+     *  \param queue Index of the queue
+     *  \param sig Signal to raise, nullptr to fall back to the signal given at construction
+     *  \return false if the queue doesn't exist
+     */
+    bool set_queue_signal(uint16 queue, Platform::Signal *sig) {
+        if (queue >= VirtioNetQueues::NUM)
+            return false;
+        _queue_sig[queue] = sig;
+        return true;
+    }
+
+    /*! \brief Serve the control queue with [ctrl], nullptr to stop serving it
+     */
+    void set_ctrl(Model::VirtioNetCtrl *ctrl) { _ctrl = ctrl; }
+    Model::VirtioNetCtrl *ctrl() const { return _ctrl; }
+
     void connect() { _backend_connected = true; }
 
     void disconnect() { _backend_connected = false; }
@@ -127,8 +228,54 @@ public:
     Errno map(const Model::IOMapping &m) override;
     Errno unmap(const Model::IOMapping &m) override;
 
-    Virtio::QueueData const &queue_data_rx() const { return queue_data(RX); }
-    Virtio::QueueData const &queue_data_tx() const { return queue_data(TX); }
+    uint16 max_queue_pairs() const { return _max_queue_pairs; }
+    // Index of the control queue, it depends on the negotiation of VIRTIO_NET_F_MQ
+    uint8 ctrl_queue_index() const {
+        return static_cast<uint8>((drv_feature() & VIRTIO_NET_MQ) != 0 ? 2 * _max_queue_pairs : 2);
+    }
+
+    Virtio::QueueData const &queue_data_rx(uint16 pair = 0) const { return queue_data(rx_index(pair)); }
+    Virtio::QueueData const &queue_data_tx(uint16 pair = 0) const { return queue_data(tx_index(pair)); }
+
+    bool rx_queue_constructed(uint16 pair = 0) { return pair < _max_queue_pairs && queue(rx_index(pair)).constructed(); }
+    bool tx_queue_constructed(uint16 pair = 0) { return pair < _max_queue_pairs && queue(tx_index(pair)).constructed(); }
+    bool ctrl_queue_constructed() { return queue(ctrl_queue_index()).constructed(); }
+    Virtio::DeviceQueue &rx_queue(uint16 pair = 0) { return device_queue(rx_index(pair)); }
+    Virtio::DeviceQueue &tx_queue(uint16 pair = 0) { return device_queue(tx_index(pair)); }
+    Virtio::DeviceQueue &ctrl_queue() { return device_queue(ctrl_queue_index()); }
+
+    bool mergeable_rx_buffers() const { return (drv_feature() & VIRTIO_NET_MRG_RXBUF) != 0; }
 
     void get_device_specific_config(Model::VirtioNetConfig &config) const { config = _config; }
+
+    // VIRTIO_NET_CTRL_MAC_ADDR_SET: the new address is reflected in the configuration space
+    void set_mac(const uint8 *mac) {
+        memcpy(_config.mac, mac, ARRAY_LENGTH(_config.mac));
+        update_config_gen();
+    }
+
+    GPA translate(uint64 addr, size_t size_bytes) const {
+        if (not use_io_mappings())
+            return GPA(addr);
+
+        return GPA(translate_io(addr, size_bytes));
+    }
+
+    // [Virtio::Queue::AddressTranslator] overrides inherited by [Virtio::Sg::Buffer::ChainAccessor]
+    Errno vq_addr_to_r_hva(uint64 vqa, size_t size_bytes, char *&hva) override { return vq_addr_to_hva(vqa, size_bytes, hva); }
+    Errno vq_addr_to_w_hva(uint64 vqa, size_t size_bytes, char *&hva) override { return vq_addr_to_hva(vqa, size_bytes, hva); }
+
+private:
+    Errno vq_addr_to_hva(uint64 vqa, size_t size_bytes, char *&hva) const {
+        GPA gpa = translate(vqa, size_bytes);
+        if (gpa.invalid())
+            return Errno::PERM;
+
+        char *view = Model::SimpleAS::gpa_to_vmm_view(*_vbus, gpa, size_bytes);
+        if (view == nullptr)
+            return Errno::INVAL;
+
+        hva = view;
+        return Errno::NONE;
+    }
 };
@@ -0,0 +1,220 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Control queue of a VirtioNet device: receive filters and multiqueue steering
+ */
+
+#include <model/virtio_net.hpp>
+#include <model/virtio_sg.hpp>
+#include <platform/atomic.hpp>
+#include <platform/context.hpp>
+#include <platform/mutex.hpp>
+#include <platform/types.hpp>
+
+namespace Model {
+    class VirtioNetCtrl;
+    enum class VirtioNetCtrlClass : uint8;
+    enum class VirtioNetCtrlAck : uint8;
+}
+
+// 5.1.6.5 Control Virtqueue: every command is a virtio_net_ctrl header, followed by the data of
+// the command and by a device-writable ack byte.
+enum class Model::VirtioNetCtrlClass : uint8 {
+    RX = 0,
+    MAC = 1,
+    VLAN = 2,
+    ANNOUNCE = 3,
+    MQ = 4,
+    GUEST_OFFLOADS = 5,
+};
+
+enum class Model::VirtioNetCtrlAck : uint8 {
+    OK = 0,
+    ERR = 1,
+};
+
+enum : uint8 {
+    VIRTIO_NET_CTRL_RX_PROMISC = 0,
+    VIRTIO_NET_CTRL_RX_ALLMULTI = 1,
+    VIRTIO_NET_CTRL_MAC_TABLE_SET = 0,
+    VIRTIO_NET_CTRL_MAC_ADDR_SET = 1,
+    VIRTIO_NET_CTRL_VLAN_ADD = 0,
+    VIRTIO_NET_CTRL_VLAN_DEL = 1,
+    VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET = 0,
+    VIRTIO_NET_CTRL_MQ_RSS_CONFIG = 1,
+};
+
+enum : uint32 {
+    VIRTIO_NET_RSS_HASH_TYPE_IPV4 = (1 << 0),
+    VIRTIO_NET_RSS_HASH_TYPE_TCPV4 = (1 << 1),
+    VIRTIO_NET_RSS_HASH_TYPE_UDPV4 = (1 << 2),
+    VIRTIO_NET_RSS_HASH_TYPE_IPV6 = (1 << 3),
+    VIRTIO_NET_RSS_HASH_TYPE_TCPV6 = (1 << 4),
+    VIRTIO_NET_RSS_HASH_TYPE_UDPV6 = (1 << 5),
+};
+
+/*! \brief Serve the control queue of a VirtioNet device and steer the received packets
+ *
+ *  Commands are executed synchronously when the guest notifies the control queue:
+ *  - VIRTIO_NET_CTRL_RX: promiscuous and all-multicast modes,
+ *  - VIRTIO_NET_CTRL_MAC: unicast and multicast filter tables, and the MAC address,
+ *  - VIRTIO_NET_CTRL_VLAN: VLAN filter,
+ *  - VIRTIO_NET_CTRL_MQ: number of queue pairs in use and RSS configuration.
+ *
+ *  Backends call classify() on every received packet: it applies the filters and picks the
+ *  queue pair that receives the packet. With RSS, the Toeplitz hash of the IP addresses (and
+ *  TCP/UDP ports) indexes the indirection table programmed by the guest, which lets the guest
+ *  steer every flow to the queue whose interrupt targets the vCPU consuming it. With
+ *  VQ_PAIRS_SET only, flows are spread evenly over the queue pairs in use with a default key.
+ *
+ *  The Toeplitz hash is computed from a table of the contributions of every byte value at every
+ *  position of the input, rebuilt when the key changes: one lookup per input byte.
+ *
+ *  classify() and hash() take no lock: the filters and the steering state live in two snapshots.
+ *  A command edits the one not in use under the lock, then publishes it. Readers pin the published
+ *  snapshot with a reader count, the next command waits for it to drop to zero before reusing it.
+ */
+class Model::VirtioNetCtrl {
+public:
+    static constexpr uint16 MAC_TABLE_ENTRIES = 64;
+    static constexpr uint8 RSS_MAX_KEY_SIZE = 40;
+    static constexpr uint16 RSS_MAX_INDIRECTION_TABLE_LENGTH = 128;
+    static constexpr uint32 SUPPORTED_HASH_TYPES = VIRTIO_NET_RSS_HASH_TYPE_IPV4 | VIRTIO_NET_RSS_HASH_TYPE_TCPV4
+                                                   | VIRTIO_NET_RSS_HASH_TYPE_UDPV4 | VIRTIO_NET_RSS_HASH_TYPE_IPV6
+                                                   | VIRTIO_NET_RSS_HASH_TYPE_TCPV6 | VIRTIO_NET_RSS_HASH_TYPE_UDPV6;
+    // Largest header prefix classify() looks at: Ethernet, VLAN tag, IPv6 header and L4 ports
+    static constexpr size_t MAX_HEADERS = 14 + 4 + 40 + 4;
+
+    struct Stats {
+        atomic<uint64> commands{0}; // Commands executed
+        atomic<uint64> errors{0};   // Commands rejected
+        atomic<uint64> filtered{0}; // Packets dropped by the receive filters
+
+        void reset() {
+            commands = 0;
+            errors = 0;
+            filtered = 0;
+        }
+    };
+
+    /*! \brief Offer the control queue, and multiqueue with RSS if [max_queue_pairs] is above one
+     *  \param user_config Configuration of the device to update, before the device is created
+     *  \param max_queue_pairs Number of queue pairs served by the backend
+     */
+    static void advertise_features(Model::VirtioNet::UserConfig &user_config, uint16 max_queue_pairs = 1);
+
+    /*! \brief Reference Toeplitz hash, one bit at a time
+     *  \param key Secret key, at least [len] + 4 bytes long
+     *  \param data Input of the hash, in network order
+     *  \param len Size of the input
+     */
+    static uint32 toeplitz(const uint8 *key, const uint8 *data, size_t len);
+
+    explicit VirtioNetCtrl(Model::VirtioNet &dev) : _dev(&dev) {}
+    ~VirtioNetCtrl();
+
+    VirtioNetCtrl(const VirtioNetCtrl &) = delete;
+    VirtioNetCtrl &operator=(const VirtioNetCtrl &) = delete;
+
+    /*! \brief Allocate the chain buffer and the hash table, and start serving the control queue
+     *  \param ctx Platform context
+     *  \param queue_entries Size of the control queue
+     *  \return true on success, false otherwise
+     */
+    bool init(const Platform_ctx *ctx, uint16 queue_entries);
+
+    /*! \brief Execute the pending commands, called by the device when the queue is notified
+     *  \return true if at least one command completed and the guest must be interrupted
+     */
+    bool process();
+
+    /*! \brief Back to the state of a freshly reset device: promiscuous, empty filter tables and a
+     *         single queue pair
+     */
+    void reset();
+
+    /*! \brief Apply the receive filters to a packet and pick the queue pair receiving it
+     *  \param frame Packet, starting with the Ethernet header. Only the first MAX_HEADERS bytes
+     *         are looked at.
+     *  \param size Size of [frame]
+     *  \param pair Queue pair that must receive the packet
+     *  \return false if the packet must be dropped
+     */
+    bool classify(const char *frame, size_t size, uint16 &pair) const;
+
+    /*! \brief RSS hash of a packet with the current key and hash types
+     *  \return false if the packet cannot be classified
+     */
+    bool hash(const char *frame, size_t size, uint32 &value) const;
+
+    uint16 active_queue_pairs() const { return _active_pairs; }
+    const Stats &stats() const { return _stats; }
+
+private:
+    bool execute();
+    bool read(void *dst, size_t size, size_t off) const;
+    bool exec_rx(uint8 cmd);
+    bool exec_mac(uint8 cmd);
+    bool exec_vlan(uint8 cmd);
+    bool exec_mq(uint8 cmd);
+    bool exec_rss_config();
+    // Receive filters and steering state, only changed by the commands
+    struct Filters {
+        bool promisc{true};
+        bool allmulti{false};
+        uint8 mac[6]{};
+        uint8 uni[MAC_TABLE_ENTRIES][6]{};
+        uint8 multi[MAC_TABLE_ENTRIES][6]{};
+        uint16 uni_count{0};
+        uint16 multi_count{0};
+        bool uni_overflow{false};
+        bool multi_overflow{false};
+        uint64 vlans[4096 / 64]{};
+
+        bool steering{false};
+        uint32 hash_types{0};
+        uint16 indir_mask{0};
+        uint16 indir[RSS_MAX_INDIRECTION_TABLE_LENGTH]{};
+        uint16 unclassified{0};
+        uint8 key[RSS_MAX_KEY_SIZE]{};
+        uint8 key_len{0};
+    };
+
+    struct Snapshot {
+        mutable atomic<uint32> readers{0};
+        Filters filters;
+        // [hash_table[i][b]]: contribution of the byte value b at the position i of the input
+        uint32 (*hash_table)[256]{nullptr};
+    };
+
+    bool read_mac_table(size_t &off, uint8 (*table)[6], uint16 &count, bool &overflow);
+    Snapshot &edit();
+    void publish(Snapshot &next) { _current.store(&next); }
+    const Snapshot &enter() const;
+    static void leave(const Snapshot &cur) { cur.readers--; }
+    static void set_key(Snapshot &snap, const uint8 *key, uint8 len);
+    void set_default_steering(Snapshot &snap, uint16 pairs);
+    bool accept(const Filters &filters, const uint8 *frame, size_t size) const;
+    static bool hash_input(const Filters &filters, const uint8 *frame, size_t size, uint8 *input, size_t &len);
+    static uint32 table_hash(const Snapshot &snap, const uint8 *input, size_t len);
+    bool negotiated(uint64 feature) const { return (_dev->drv_feature() & feature) != 0; }
+
+    Model::VirtioNet *_dev;
+    Virtio::Sg::Buffer *_buf{nullptr};
+    size_t _readable{0};
+    mutable Platform::Mutex _lock;
+
+    atomic<uint16> _active_pairs{1};
+    Snapshot _snapshots[2];
+    atomic<Snapshot *> _current{&_snapshots[0]}; // Read by classify() and hash()
+    Snapshot *_next{nullptr};                    // Edited by the command being executed
+
+    mutable Stats _stats;
+};
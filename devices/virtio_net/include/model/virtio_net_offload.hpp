@@ -0,0 +1,123 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Software checksum and segmentation offloads for VirtioNet
+ */
+
+#include <model/virtio_net.hpp>
+#include <platform/errno.hpp>
+#include <platform/types.hpp>
+
+namespace Model {
+    class VirtioNetOffload;
+}
+
+/*! \brief Complete in software the offloads that the receiver of a packet cannot handle
+ *
+ *  A packet travels with its virtio_net_hdr, either from the guest to the host backend (TX) or
+ *  from the backend to the guest (RX). When the header asks for an offload that the receiving
+ *  side did not negotiate, process() performs it before handing the packet over:
+ *  - VIRTIO_NET_HDR_F_NEEDS_CSUM: the checksum is computed from [csum_start] to the end of the
+ *    packet and stored at [csum_start + csum_offset],
+ *  - VIRTIO_NET_HDR_GSO_TCPV4/TCPV6: the packet is split into segments of [gso_size] bytes of
+ *    payload, each with its own IP and TCP headers and checksums.
+ *
+ *  The device can therefore offer OFFLOAD_FEATURES to the guest whatever the backend supports,
+ *  and the guest can hand over 64KiB TCP frames in a single chain.
+ *
+ *  UDP fragmentation offload (VIRTIO_NET_HDR_GSO_UDP) is not implemented, packets asking for it
+ *  are rejected unless the receiver handles them.
+ */
+class Model::VirtioNetOffload {
+public:
+    static constexpr uint64 OFFLOAD_FEATURES
+        = VIRTIO_NET_CSUM | VIRTIO_NET_HOST_TSO4 | VIRTIO_NET_HOST_TSO6 | VIRTIO_NET_HOST_ECN;
+    // Largest GSO packet, Ethernet header and virtio_net_hdr excluded
+    static constexpr size_t MAX_GSO_SIZE = 0x10000;
+    // Largest L2 + L3 + L4 header prefix of a GSO packet
+    static constexpr size_t MAX_HEADERS = 256;
+
+    // Offloads handled by the receiver of the packets
+    struct Offloads {
+        bool csum{false};
+        bool tso4{false};
+        bool tso6{false};
+        bool ecn{false};
+    };
+
+    class Output {
+    public:
+        virtual ~Output() {}
+        /*! \brief Hand over one packet, the buffer is only valid during the call
+         */
+        virtual Errno packet(const VirtioNetHeader &hdr, const char *pkt, size_t size) = 0;
+    };
+
+    /*! \brief Offloads that the guest can receive, given the negotiated features
+     */
+    static Offloads guest_offloads(uint64 drv_features);
+
+    /*! \brief Does [hdr] ask for an offload that [peer] cannot handle?
+     */
+    static bool needs_offload(const VirtioNetHeader &hdr, const Offloads &peer);
+
+    /*! \brief One's complement sum of a buffer, folded to 32 bits
+     *  \param buf Start of the data, any alignment. Buffers summed into the same checksum must
+     *         start at an even offset of the packet.
+     *  \param len Size of the data
+     *  \param sum Sum to accumulate into
+     *  \return Sum to fold with csum_fold() once all the data is accumulated
+     */
+    static uint32 csum_partial(const void *buf, size_t len, uint32 sum);
+
+    /*! \brief Fold a sum to 16 bits and complement it
+     *  \return Checksum to store as is, in memory order, in the packet
+     */
+    static uint16 csum_fold(uint32 sum);
+
+    /*! \brief Complete a checksum requested with VIRTIO_NET_HDR_F_NEEDS_CSUM
+     *  \param hdr Header of the packet, NEEDS_CSUM is cleared on success
+     *  \param pkt Packet, starting with the Ethernet header
+     *  \param size Size of the packet
+     *  \return INVAL if the checksum location is not within the packet
+     */
+    static Errno complete_checksum(VirtioNetHeader &hdr, char *pkt, size_t size);
+
+    VirtioNetOffload() {}
+    ~VirtioNetOffload();
+
+    VirtioNetOffload(const VirtioNetOffload &) = delete;
+    VirtioNetOffload &operator=(const VirtioNetOffload &) = delete;
+
+    /*! \brief Allocate the buffer in which segments are built
+     *  \return true on success, false otherwise
+     */
+    bool init();
+
+    /*! \brief Hand a packet over to [out], after performing the offloads [peer] cannot handle
+     *  \param hdr Header of the packet
+     *  \param pkt Packet, starting with the Ethernet header. It can be modified in place.
+     *  \param size Size of the packet
+     *  \param peer Offloads of the receiver
+     *  \param out Receiver, called once per resulting packet
+     *  \return NONE on success, INVAL if the packet is malformed or cannot be offloaded, or the
+     *          first error returned by [out]
+     */
+    Errno process(const VirtioNetHeader &hdr, char *pkt, size_t size, const Offloads &peer, Output &out);
+
+    /*! \brief Split a TCP GSO packet into segments of [hdr.gso_size] bytes of payload
+     *  \return NONE on success, INVAL if the packet is malformed, or the first error returned by
+     *          [out]
+     */
+    Errno segment(const VirtioNetHeader &hdr, const char *pkt, size_t size, Output &out);
+
+private:
+    char *_seg{nullptr};
+};
@@ -0,0 +1,146 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Device side of the RX queue of a VirtioNet device
+ */
+
+#include <model/virtio_net.hpp>
+#include <model/virtio_sg.hpp>
+#include <model/virtqueue.hpp>
+#include <platform/atomic.hpp>
+#include <platform/errno.hpp>
+#include <platform/types.hpp>
+#include <sys/uio.h>
+
+namespace Model {
+    class VirtioNetRx;
+}
+
+/*! \brief Deliver packets to the guest through the RX queue of a VirtioNet device
+ *
+ *  When the driver negotiated VIRTIO_NET_F_MRG_RXBUF, a packet is spread over as many available
+ *  chains as needed and [num_buffers] of its virtio_net_hdr tells the driver how many chains were
+ *  used. The driver can then post small buffers: a small packet only consumes one of them and a
+ *  large GSO packet doesn't need a chain big enough to hold it entirely. Otherwise, every packet
+ *  must fit in a single chain.
+ *
+ *  The chains of a packet are published with a single update of the used index. Packets received
+ *  between begin() and end() are all published at once and the guest is notified once per batch.
+ *
+ *  Packets are either copied by receive(), or written by the host directly into guest memory:
+ *  prepare() pops enough chains for a packet of a given maximum size and returns their I/O
+ *  vector, commit() then publishes the chains actually filled and hands the others back.
+ *
+ *  The helper is not thread safe, it is meant to be driven by the single thread feeding the RX
+ *  queue. reset() must be called when the device is reset.
+ */
+class Model::VirtioNetRx {
+public:
+    static constexpr uint16 HEADER_SIZE = sizeof(VirtioNetHeader);
+    // Enough for a 64KiB GSO packet spread over buffers of 1518 bytes, the smallest mergeable
+    // buffer that Linux posts.
+    static constexpr uint16 DEFAULT_MAX_BUFFERS = 64;
+
+    struct Stats {
+        atomic<uint64> packets{0}; // Packets delivered to the guest
+        atomic<uint64> buffers{0}; // Chains used to deliver them
+        atomic<uint64> dropped{0}; // Packets that could never fit in the RX chains
+
+        void reset() {
+            packets = 0;
+            buffers = 0;
+            dropped = 0;
+        }
+    };
+
+    /*! \brief Helper for the RX queue of the queue pair [pair], see VirtioNetCtrl::classify()
+     */
+    explicit VirtioNetRx(Model::VirtioNet &dev, uint16 pair = 0) : _dev(&dev), _pair(pair) {}
+    ~VirtioNetRx();
+
+    VirtioNetRx(const VirtioNetRx &) = delete;
+    VirtioNetRx &operator=(const VirtioNetRx &) = delete;
+
+    /*! \brief Allocate the chain buffers
+     *  \param queue_entries Size of the RX queue, bounds the length of a chain
+     *  \param max_buffers Maximum number of chains a packet can be spread over
+     *  \return true on success, false otherwise
+     */
+    bool init(uint16 queue_entries, uint16 max_buffers = DEFAULT_MAX_BUFFERS);
+
+    /*! \brief Open a batch, the used index is not updated until end() is called
+     */
+    void begin();
+
+    /*! \brief Publish the packets received since begin() and notify the guest if needed
+     */
+    void end();
+
+    /*! \brief Copy a packet, prefixed by its header, into the available chains of the RX queue
+     *
+     *  [num_buffers] of [hdr] is ignored and filled by the helper.
+     *  \param hdr virtio_net_hdr of the packet
+     *  \param pkt Packet data, starting with the Ethernet header
+     *  \param size Size of the packet
+     *  \return NONE if the packet was delivered, NOENT if the guest didn't post enough buffers
+     *          (the packet can be retried later), INVAL if the packet was dropped because it
+     *          cannot fit in the RX chains.
+     */
+    Errno receive(const VirtioNetHeader &hdr, const void *pkt, size_t size);
+
+    /*! \brief Pop the chains for a packet written directly into guest memory
+     *
+     *  Chains are popped until [size] bytes fit in them, or until a chain is popped without
+     *  mergeable buffers, or the maximum number of chains is reached. When [iov] cannot describe
+     *  all of them, the chains it doesn't reach are handed back: the packet is bounded by the
+     *  vector. The packet is to be written at the start of the vector, prefixed by its
+     *  virtio_net_hdr.
+     *  \param size Maximum size of the packet, header included
+     *  \param iov I/O vector to fill
+     *  \param max_iov Size of [iov]
+     *  \param iov_cnt Number of entries filled in [iov]
+     *  \return NONE on success, NOENT if the guest didn't post enough buffers, another error if
+     *          the RX queue is broken. commit() or cancel() must follow a successful call.
+     */
+    Errno prepare(size_t size, iovec *iov, uint16 max_iov, uint16 &iov_cnt);
+
+    /*! \brief Publish a packet written in the vector returned by prepare()
+     *
+     *  [num_buffers] is filled by the helper, the chains left unused are handed back.
+     *  \param written Size of the packet written, header included. At least HEADER_SIZE.
+     */
+    void commit(size_t written);
+
+    /*! \brief Hand back all the chains popped by prepare()
+     */
+    void cancel();
+
+    /*! \brief Drop the chains in use, to be called on device reset
+     */
+    void reset();
+
+    const Stats &stats() const { return _stats; }
+    void reset_stats() { _stats.reset(); }
+
+private:
+    Errno pop_chains(Virtio::DeviceQueue &vq, size_t size, uint16 &used, size_t &room);
+    void give_back(Virtio::DeviceQueue &vq, uint16 count);
+    void publish(Virtio::DeviceQueue &vq, uint16 used);
+
+    Model::VirtioNet *_dev;
+    uint16 _pair;
+    Virtio::Sg::Buffer **_bufs{nullptr};
+    uint16 _max_buffers{0};
+    uint16 _pending{0};
+    bool _batching{false};
+    uint16 _batch_packets{0};
+
+    Stats _stats;
+};
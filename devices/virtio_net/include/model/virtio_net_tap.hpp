@@ -0,0 +1,235 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Backend connecting a VirtioNet device to a Linux TAP interface
+ */
+
+#include <model/virtio_net.hpp>
+#include <model/virtio_net_offload.hpp>
+#include <model/virtio_net_rx.hpp>
+#include <model/virtio_sg.hpp>
+#include <platform/atomic.hpp>
+#include <platform/context.hpp>
+#include <platform/mutex.hpp>
+#include <platform/signal.hpp>
+#include <platform/types.hpp>
+#include <sys/uio.h>
+
+namespace Model {
+    class VirtioNetTap;
+}
+
+/*! \brief TX and RX engines of a VirtioNet device backed by a TAP interface
+ *
+ *  The TAP interface is opened with IFF_VNET_HDR: the virtio_net_hdr of the guest travels with
+ *  every packet, so checksum and segmentation offloads are handled by the host kernel. With
+ *  Config::vnet_hdr cleared, plain Ethernet frames are exchanged instead: VirtioNetOffload
+ *  completes the offloads of the guest packets before they are written, and the frames read are
+ *  delivered after an empty header.
+ *
+ *  TX: the chains of the TX queue are drained in batches, each packet is written with writev()
+ *  straight from guest memory, header included. The chains of a batch are published with a
+ *  single update of the used index and a single interrupt.
+ *
+ *  RX: every time the TAP interface is readable, packets are read with readv() straight into the
+ *  chains of the RX queue, spread over several chains with mergeable RX buffers. All the packets
+ *  read in one wakeup are published at once. When the guest runs out of buffers, the engine
+ *  waits for a notification of the RX queue and packets are left in the TAP queue meanwhile. A
+ *  packet asking for an offload the guest did not negotiate, queued on the TAP interface before
+ *  driver_ok() updated its offloads, is completed with VirtioNetOffload and copied instead.
+ *
+ *  Every queue pair of the device is served: with more than one, the TAP interface is opened with
+ *  IFF_MULTI_QUEUE and each pair gets a queue of its own. When the device serves a control queue
+ *  (VirtioNetCtrl), the receive filters are applied to the packets read and the packets are
+ *  delivered to the pair classify() picks. The kernel spreads the flows over the TAP queues with a
+ *  hash of its own: a packet read on the queue of another pair is copied into the chains of the
+ *  right one. So is a packet read while the pair of the TAP queue is out of buffers, or not set
+ *  up by the guest, so that the packets for the other pairs keep flowing. A packet whose pair is
+ *  out of buffers is held until the guest notifies the RX queue of that pair, as with a single
+ *  pair: the TAP queue it was read from waits meanwhile.
+ *
+ *  Each direction of each pair is served by its own loop, run_tx() and run_rx(), that the embedder
+ *  runs from threads it created. driver_ok() must be called from the Virtio::Callback::driver_ok
+ *  callback and reset() from VirtioNetCallback::device_reset.
+ */
+class Model::VirtioNetTap {
+public:
+    struct Config {
+        const char *ifname{""}; // Name of the TAP interface, created if needed. Empty: picked by the kernel
+        uint16 tx_batch{64};    // Maximum number of TX chains published at once
+        uint16 rx_batch{64};    // Maximum number of packets read per wakeup
+        bool vnet_hdr{true};    // Exchange the virtio_net_hdr with the TAP interface, see above
+    };
+
+    struct Stats {
+        atomic<uint64> tx_packets{0};  // Packets written to the TAP interface
+        atomic<uint64> tx_batches{0};  // Used index updates on the TX queue
+        atomic<uint64> tx_errors{0};   // Chains that could not be transmitted
+        atomic<uint64> rx_packets{0};  // Packets read from the TAP interface
+        atomic<uint64> rx_batches{0};  // Wakeups that delivered packets
+        atomic<uint64> tx_offloads{0}; // TX packets whose offloads were completed in software
+        atomic<uint64> rx_offloads{0}; // RX packets whose offloads were completed in software
+        atomic<uint64> rx_steered{0};  // RX packets copied to the pair the guest steers them to
+        atomic<uint64> rx_dropped{0};  // RX packets that could not be copied to their pair
+
+        void reset() {
+            tx_packets = 0;
+            tx_batches = 0;
+            tx_errors = 0;
+            rx_packets = 0;
+            rx_batches = 0;
+            tx_offloads = 0;
+            rx_offloads = 0;
+            rx_steered = 0;
+            rx_dropped = 0;
+        }
+    };
+
+    /*! \brief Offer the features served by the engine: mergeable RX buffers and the offloads
+     *
+     *  Multiqueue and RSS are offered by VirtioNetCtrl::advertise_features().
+     *
+     *  \param user_config Configuration of the device to update, before the device is created
+     */
+    static void advertise_features(Model::VirtioNet::UserConfig &user_config);
+
+    VirtioNetTap(Model::VirtioNet &dev, const Config &config) : _dev(&dev), _config(config) {}
+    ~VirtioNetTap();
+
+    VirtioNetTap(const VirtioNetTap &) = delete;
+    VirtioNetTap &operator=(const VirtioNetTap &) = delete;
+
+    /*! \brief Open a queue of the TAP interface per queue pair and allocate the chain buffers
+     *  \param ctx Platform context
+     *  \param queue_entries Size of the RX and TX queues
+     *  \return true on success, false otherwise
+     */
+    bool init(const Platform_ctx *ctx, uint16 queue_entries);
+
+    /*! \brief Serve the TX queue of a queue pair until stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created.
+     *  \param pair Queue pair, below queue_pairs()
+     */
+    void run_tx(uint16 pair = 0);
+
+    /*! \brief Read the queue of the TAP interface of a queue pair until stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created.
+     *  \param pair Queue pair, below queue_pairs()
+     */
+    void run_rx(uint16 pair = 0);
+
+    /*! \brief Make run_tx() and run_rx() return
+     *
+     *  The caller then joins the threads running them, before destroying the object.
+     */
+    void stop();
+
+    /*! \brief Apply the offloads negotiated by the guest to the TAP interface
+     */
+    void driver_ok();
+
+    /*! \brief Drop the chains in use, to be called on device reset
+     */
+    void reset();
+
+    const char *ifname() const { return _ifname; }
+    uint16 queue_pairs() const { return _num_pairs; }
+
+    const Stats &stats() const { return _stats; }
+    const VirtioNetRx::Stats &rx_stats(uint16 pair = 0) const { return _pairs[pair]->rx.stats(); }
+
+private:
+    static constexpr uint16 RX_IOV_MAX = 256;
+
+    struct Pair;
+
+    // Writes the packets completed by VirtioNetOffload to the queue of the TAP interface, without header
+    class TxOutput : public VirtioNetOffload::Output {
+    public:
+        explicit TxOutput(Pair &pair) : _pair(&pair) {}
+        Errno packet(const VirtioNetHeader &hdr, const char *pkt, size_t size) override;
+
+    private:
+        Pair *_pair;
+    };
+
+    // Copies the packets completed by VirtioNetOffload to the RX queue
+    class RxOutput : public VirtioNetOffload::Output {
+    public:
+        explicit RxOutput(Pair &pair) : _pair(&pair) {}
+        Errno packet(const VirtioNetHeader &hdr, const char *pkt, size_t size) override;
+
+    private:
+        Pair *_pair;
+    };
+
+    // A queue pair of the device and the queue of the TAP interface serving it
+    struct Pair {
+        Pair(Model::VirtioNet &dev, uint16 idx) : index(idx), tx_out(*this), rx(dev, idx), rx_out(*this) {}
+        ~Pair();
+
+        Pair(const Pair &) = delete;
+        Pair &operator=(const Pair &) = delete;
+
+        uint16 index;
+        int fd{-1};
+
+        Platform::Signal tx_sig;
+        Platform::Signal rx_sig;
+        Platform::Mutex tx_lock;
+        Platform::Mutex rx_lock;
+
+        Virtio::Sg::Buffer *tx_buf{nullptr};
+        iovec *tx_iov{nullptr};
+        uint16 tx_iov_max{0};
+        VirtioNetOffload tx_offload;
+        TxOutput tx_out;
+        char *tx_pkt{nullptr}; // Linear copy of a TX chain, to complete its offloads
+
+        VirtioNetRx rx;
+        iovec rx_iov[RX_IOV_MAX];
+        size_t rx_size{0};
+        VirtioNetOffload rx_offload;
+        RxOutput rx_out;
+        VirtioNetOffload::Offloads rx_guest; // Offloads negotiated by the guest
+        char *rx_pkt{nullptr};               // Linear copy of a packet read, see process_rx()
+        size_t rx_pending{0};                // Size of the packet held in rx_pkt for deliver()
+        uint16 rx_target{0};                 // Pair of the held packet
+        bool rx_full{false};                 // The held packet filled the buffers it was read into
+        atomic<uint16> rx_waiters{0};        // Loops waiting for buffers on the RX queue
+    };
+
+    bool init_pair(Pair &p, const Platform_ctx *ctx, uint16 queue_entries);
+    bool open_queue(Pair &p);
+    void process_tx(Pair &p);
+    bool process_rx(Pair &p);
+    ssize_t read_packet(Pair &p, uint16 iov_cnt);
+    bool offload_rx(Pair &p, uint16 iov_cnt, size_t size);
+    bool deliver(Pair &from);
+    void wait_rx_buffers(Pair &p);
+    bool classify(const Pair &p, uint16 iov_cnt, size_t size, uint16 &target) const;
+    bool transmit(Pair &p);
+    bool transmit_offloaded(Pair &p);
+
+    Model::VirtioNet *_dev;
+    Config _config;
+    Pair **_pairs{nullptr};
+    uint16 _num_pairs{0};
+    int _stop_fd{-1};
+    char _ifname[16]{};
+
+    atomic<bool> _stop{false};
+
+    Stats _stats;
+};
@@ -9,19 +9,36 @@
 #include <model/iommu_interface.hpp>
 #include <model/virtio_common.hpp>
 #include <model/virtio_net.hpp>
+#include <model/virtio_net_ctrl.hpp>
 #include <platform/errno.hpp>
 #include <platform/signal.hpp>
 #include <platform/types.hpp>
 
 void
-Model::VirtioNet::notify(uint32 const) {
-    if (_backend_connected) {
-        _sig->sig();
+Model::VirtioNet::notify(uint32 const queue) {
+    // Control commands are served synchronously, the driver polls for their completion
+    if (_ctrl != nullptr && queue == ctrl_queue_index()) {
+        if (_ctrl->process())
+            assert_irq();
+        return;
     }
+
+    if (!_backend_connected)
+        return;
+
+    if (queue < VirtioNetQueues::NUM && _queue_sig[queue] != nullptr)
+        _queue_sig[queue]->sig();
+    else
+        _sig->sig();
 }
 
 void
 Model::VirtioNet::driver_ok() {
+    // Control commands are only accepted once the driver is ready: a new driver starts from the
+    // default filters, even if the previous one reset the device through the status register.
+    if (_ctrl != nullptr)
+        _ctrl->reset();
+
     if (_callback != nullptr)
         _callback->driver_ok();
 }
@@ -36,6 +53,8 @@ void
 Model::VirtioNet::reset() {
     if (_virtio_net_callback != nullptr)
         _virtio_net_callback->device_reset();
+    if (_ctrl != nullptr)
+        _ctrl->reset();
 
     reset_virtio();
 }
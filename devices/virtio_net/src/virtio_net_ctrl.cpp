@@ -0,0 +1,601 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <arch/barrier.hpp>
+#include <model/virtio_net_ctrl.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+
+static constexpr size_t ETH_HLEN = 14;
+static constexpr size_t VLAN_HLEN = 4;
+static constexpr uint16 ETH_P_IP = 0x0800;
+static constexpr uint16 ETH_P_IPV6 = 0x86dd;
+static constexpr uint16 ETH_P_8021Q = 0x8100;
+static constexpr uint16 ETH_P_8021AD = 0x88a8;
+static constexpr uint8 IPPROTO_TCP_NUM = 6;
+static constexpr uint8 IPPROTO_UDP_NUM = 17;
+static constexpr size_t IPV4_MIN_HLEN = 20;
+static constexpr size_t IPV6_HLEN = 40;
+// IPv6 addresses and L4 ports
+static constexpr size_t MAX_HASH_INPUT = 16 + 16 + 4;
+
+static_assert(MAX_HASH_INPUT + 4 <= Model::VirtioNetCtrl::RSS_MAX_KEY_SIZE, "the key covers every hash input");
+
+// Default key of the Microsoft RSS specification, used when the guest didn't program one
+static const uint8 DEFAULT_KEY[Model::VirtioNetCtrl::RSS_MAX_KEY_SIZE]
+    = {0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+       0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+       0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+
+static inline uint16
+be16(const uint8 *p) {
+    return static_cast<uint16>((p[0] << 8) | p[1]);
+}
+
+void
+Model::VirtioNetCtrl::advertise_features(Model::VirtioNet::UserConfig &user_config, uint16 max_queue_pairs) {
+    user_config.device_feature |= VIRTIO_NET_CTRL_VQ | VIRTIO_NET_CTRL_RX | VIRTIO_NET_CTRL_VLAN | VIRTIO_NET_CTRL_MAC_ADDR;
+
+    if (max_queue_pairs > 1) {
+        user_config.device_feature |= VIRTIO_NET_MQ | VIRTIO_NET_RSS;
+        user_config.max_queue_pairs = max_queue_pairs;
+        user_config.rss_max_key_size = RSS_MAX_KEY_SIZE;
+        user_config.rss_max_indirection_table_length = RSS_MAX_INDIRECTION_TABLE_LENGTH;
+        user_config.supported_hash_types = SUPPORTED_HASH_TYPES;
+    }
+}
+
+uint32
+Model::VirtioNetCtrl::toeplitz(const uint8 *key, const uint8 *data, size_t len) {
+    uint32 result = 0;
+    uint32 window = static_cast<uint32>(key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3]);
+    size_t key_bit = 32;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--, key_bit++) {
+            if (((data[i] >> bit) & 1) != 0)
+                result ^= window;
+            window = (window << 1) | ((key[key_bit / 8] >> (7 - key_bit % 8)) & 1u);
+        }
+    }
+
+    return result;
+}
+
+Model::VirtioNetCtrl::~VirtioNetCtrl() {
+    if (_dev->ctrl() == this)
+        _dev->set_ctrl(nullptr);
+
+    if (_buf != nullptr)
+        _buf->deinit();
+    delete _buf;
+    for (auto &snap : _snapshots)
+        delete[] snap.hash_table;
+}
+
+bool
+Model::VirtioNetCtrl::init(const Platform_ctx *ctx, uint16 queue_entries) {
+    if (queue_entries == 0 || !_lock.init(ctx))
+        return false;
+
+    _buf = new (nothrow) Virtio::Sg::Buffer(queue_entries);
+    if (_buf == nullptr || _buf->init() != Errno::NONE)
+        return false;
+
+    for (auto &snap : _snapshots) {
+        snap.hash_table = new (nothrow) uint32[MAX_HASH_INPUT][256];
+        if (snap.hash_table == nullptr)
+            return false;
+    }
+
+    reset();
+    _dev->set_ctrl(this);
+    return true;
+}
+
+void
+Model::VirtioNetCtrl::reset() {
+    Platform::MutexGuard guard{_lock};
+
+    // The queue is being reset: no chain is given back to the guest.
+    if (_buf != nullptr)
+        _buf->reset();
+
+    if (_snapshots[0].hash_table == nullptr || _snapshots[1].hash_table == nullptr)
+        return;
+
+    Snapshot &next = edit();
+    Filters &f = next.filters;
+
+    VirtioNetConfig config;
+    _dev->get_device_specific_config(config);
+    memcpy(f.mac, config.mac, sizeof(f.mac));
+
+    f.promisc = true;
+    f.allmulti = false;
+    f.uni_count = 0;
+    f.multi_count = 0;
+    f.uni_overflow = false;
+    f.multi_overflow = false;
+    memset(f.vlans, 0, sizeof(f.vlans));
+
+    set_default_steering(next, 1);
+    publish(next);
+}
+
+/*
+ * Copy the published snapshot into the other one, for the command to change it. A reader may still
+ * use the other one, published by the previous command: it is done with it in a few hundred cycles.
+ */
+Model::VirtioNetCtrl::Snapshot &
+Model::VirtioNetCtrl::edit() {
+    Snapshot *cur = _current.load();
+    Snapshot &next = cur == &_snapshots[0] ? _snapshots[1] : _snapshots[0];
+
+    while (next.readers.load() != 0)
+        Barrier::relax();
+
+    next.filters = cur->filters;
+    memcpy(next.hash_table, cur->hash_table, MAX_HASH_INPUT * sizeof(next.hash_table[0]));
+    return next;
+}
+
+/*
+ * Pin the published snapshot. A command may have published the other one, and started to edit
+ * this one, before the reader count went up: start over in that case.
+ */
+const Model::VirtioNetCtrl::Snapshot &
+Model::VirtioNetCtrl::enter() const {
+    while (true) {
+        const Snapshot *cur = _current.load();
+        cur->readers++;
+        if (_current.load() == cur)
+            return *cur;
+        cur->readers--;
+    }
+}
+
+void
+Model::VirtioNetCtrl::set_key(Snapshot &snap, const uint8 *key, uint8 len) {
+    uint8 *snap_key = snap.filters.key;
+
+    memset(snap_key, 0, RSS_MAX_KEY_SIZE);
+    memcpy(snap_key, key, len);
+    snap.filters.key_len = len;
+
+    for (size_t pos = 0; pos < MAX_HASH_INPUT; pos++) {
+        // Key bits [pos * 8, pos * 8 + 40): the 32-bit windows used by the 8 bits of the byte
+        uint64 bits = 0;
+        for (size_t i = 0; i < 5; i++)
+            bits = (bits << 8) | snap_key[pos + i];
+
+        uint32 windows[8];
+        for (uint8 bit = 0; bit < 8; bit++)
+            windows[bit] = static_cast<uint32>(bits >> (8 - bit));
+
+        for (uint16 value = 0; value < 256; value++) {
+            uint32 contribution = 0;
+            for (uint8 bit = 0; bit < 8; bit++) {
+                if (((value >> (7 - bit)) & 1) != 0)
+                    contribution ^= windows[bit];
+            }
+            snap.hash_table[pos][value] = contribution;
+        }
+    }
+}
+
+void
+Model::VirtioNetCtrl::set_default_steering(Snapshot &snap, uint16 pairs) {
+    Filters &f = snap.filters;
+
+    _active_pairs = pairs;
+    f.steering = pairs > 1;
+    f.hash_types = SUPPORTED_HASH_TYPES;
+    f.indir_mask = RSS_MAX_INDIRECTION_TABLE_LENGTH - 1;
+    for (uint16 i = 0; i < RSS_MAX_INDIRECTION_TABLE_LENGTH; i++)
+        f.indir[i] = static_cast<uint16>(i % pairs);
+    f.unclassified = 0;
+
+    if (f.key_len != RSS_MAX_KEY_SIZE || memcmp(f.key, DEFAULT_KEY, RSS_MAX_KEY_SIZE) != 0)
+        set_key(snap, DEFAULT_KEY, RSS_MAX_KEY_SIZE);
+}
+
+bool
+Model::VirtioNetCtrl::process() {
+    if (_buf == nullptr || !_dev->ctrl_queue_constructed())
+        return false;
+
+    Virtio::DeviceQueue &vq = _dev->ctrl_queue();
+    bool completed = false;
+
+    while (_buf->walk_chain(vq) == Errno::NONE) {
+        size_t ack_off;
+
+        if (_buf->first_writable_byte(ack_off) != Errno::NONE) {
+            // No room for the ack, the command is not executed
+            _stats.errors++;
+        } else {
+            _readable = ack_off;
+            VirtioNetCtrlAck ack = execute() ? VirtioNetCtrlAck::OK : VirtioNetCtrlAck::ERR;
+            if (ack != VirtioNetCtrlAck::OK)
+                _stats.errors++;
+            _stats.commands++;
+
+            size_t n = sizeof(ack);
+            _buf->copy_from_linear(&ack, *_dev, n, ack_off);
+        }
+
+        _buf->conclude_chain_use(vq);
+        completed = true;
+    }
+
+    return completed;
+}
+
+bool
+Model::VirtioNetCtrl::read(void *dst, size_t size, size_t off) const {
+    if (off > _readable || size > _readable - off)
+        return false;
+    if (size == 0)
+        return true;
+
+    size_t n = size;
+    return _buf->copy_to_linear(dst, *_dev, n, off) == Errno::NONE && n == size;
+}
+
+bool
+Model::VirtioNetCtrl::execute() {
+    uint8 hdr[2];
+    if (!read(hdr, sizeof(hdr), 0))
+        return false;
+
+    Platform::MutexGuard guard{_lock};
+    bool ok;
+
+    // The changes are published at once, and only if the command succeeds
+    _next = &edit();
+
+    switch (static_cast<VirtioNetCtrlClass>(hdr[0])) {
+    case VirtioNetCtrlClass::RX:
+        ok = negotiated(VIRTIO_NET_CTRL_RX) && exec_rx(hdr[1]);
+        break;
+    case VirtioNetCtrlClass::MAC:
+        ok = exec_mac(hdr[1]);
+        break;
+    case VirtioNetCtrlClass::VLAN:
+        ok = negotiated(VIRTIO_NET_CTRL_VLAN) && exec_vlan(hdr[1]);
+        break;
+    case VirtioNetCtrlClass::MQ:
+        ok = exec_mq(hdr[1]);
+        break;
+    default:
+        ok = false;
+        break;
+    }
+
+    if (ok)
+        publish(*_next);
+    _next = nullptr;
+    return ok;
+}
+
+bool
+Model::VirtioNetCtrl::exec_rx(uint8 cmd) {
+    uint8 on;
+    if (!read(&on, sizeof(on), 2))
+        return false;
+
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_RX_PROMISC:
+        _next->filters.promisc = on != 0;
+        return true;
+    case VIRTIO_NET_CTRL_RX_ALLMULTI:
+        _next->filters.allmulti = on != 0;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool
+Model::VirtioNetCtrl::read_mac_table(size_t &off, uint8 (*table)[6], uint16 &count, bool &overflow) {
+    uint32 entries;
+    if (!read(&entries, sizeof(entries), off))
+        return false;
+    off += sizeof(entries);
+
+    size_t size = static_cast<size_t>(entries) * 6;
+    if (off > _readable || size > _readable - off)
+        return false;
+
+    // Too many addresses to filter: everything is accepted, like with allmulti/promiscuous
+    overflow = entries > MAC_TABLE_ENTRIES;
+    count = overflow ? 0 : static_cast<uint16>(entries);
+    if (!overflow && !read(table, size, off))
+        return false;
+
+    off += size;
+    return true;
+}
+
+bool
+Model::VirtioNetCtrl::exec_mac(uint8 cmd) {
+    if (cmd == VIRTIO_NET_CTRL_MAC_ADDR_SET) {
+        uint8 mac[6];
+        if (!negotiated(VIRTIO_NET_CTRL_MAC_ADDR) || !read(mac, sizeof(mac), 2))
+            return false;
+
+        memcpy(_next->filters.mac, mac, sizeof(mac));
+        _dev->set_mac(mac);
+        return true;
+    }
+
+    if (cmd != VIRTIO_NET_CTRL_MAC_TABLE_SET || !negotiated(VIRTIO_NET_CTRL_RX))
+        return false;
+
+    uint8 uni[MAC_TABLE_ENTRIES][6];
+    uint8 multi[MAC_TABLE_ENTRIES][6];
+    uint16 uni_count, multi_count;
+    bool uni_overflow, multi_overflow;
+    size_t off = 2;
+
+    if (!read_mac_table(off, uni, uni_count, uni_overflow) || !read_mac_table(off, multi, multi_count, multi_overflow))
+        return false;
+
+    Filters &f = _next->filters;
+    memcpy(f.uni, uni, uni_count * sizeof(uni[0]));
+    memcpy(f.multi, multi, multi_count * sizeof(multi[0]));
+    f.uni_count = uni_count;
+    f.multi_count = multi_count;
+    f.uni_overflow = uni_overflow;
+    f.multi_overflow = multi_overflow;
+    return true;
+}
+
+bool
+Model::VirtioNetCtrl::exec_vlan(uint8 cmd) {
+    uint16 vid;
+    if (!read(&vid, sizeof(vid), 2) || vid >= 4096)
+        return false;
+
+    uint64 bit = 1ull << (vid % 64);
+    switch (cmd) {
+    case VIRTIO_NET_CTRL_VLAN_ADD:
+        _next->filters.vlans[vid / 64] |= bit;
+        return true;
+    case VIRTIO_NET_CTRL_VLAN_DEL:
+        _next->filters.vlans[vid / 64] &= ~bit;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool
+Model::VirtioNetCtrl::exec_mq(uint8 cmd) {
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG)
+        return negotiated(VIRTIO_NET_RSS) && exec_rss_config();
+
+    uint16 pairs;
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || !negotiated(VIRTIO_NET_MQ) || !read(&pairs, sizeof(pairs), 2))
+        return false;
+    if (pairs == 0 || pairs > _dev->max_queue_pairs())
+        return false;
+
+    set_default_steering(*_next, pairs);
+    return true;
+}
+
+/*
+ * struct virtio_net_rss_config {
+ *     le32 hash_types;
+ *     le16 indirection_table_mask;
+ *     le16 unclassified_queue;
+ *     le16 indirection_table[indirection_table_mask + 1];
+ *     le16 max_tx_vq;
+ *     u8 hash_key_length;
+ *     u8 hash_key_data[hash_key_length];
+ * };
+ */
+bool
+Model::VirtioNetCtrl::exec_rss_config() {
+    uint32 hash_types;
+    uint16 mask, unclassified, max_tx_vq;
+    uint16 indir[RSS_MAX_INDIRECTION_TABLE_LENGTH];
+    uint8 key_len;
+    uint8 key[RSS_MAX_KEY_SIZE];
+    size_t off = 2;
+
+    if (!read(&hash_types, sizeof(hash_types), off) || !read(&mask, sizeof(mask), off + 4)
+        || !read(&unclassified, sizeof(unclassified), off + 6))
+        return false;
+    off += 8;
+
+    uint32 entries = static_cast<uint32>(mask) + 1;
+    if (entries > RSS_MAX_INDIRECTION_TABLE_LENGTH || (entries & mask) != 0 || (hash_types & ~SUPPORTED_HASH_TYPES) != 0)
+        return false;
+
+    if (!read(indir, entries * sizeof(indir[0]), off))
+        return false;
+    off += entries * sizeof(indir[0]);
+
+    if (!read(&max_tx_vq, sizeof(max_tx_vq), off) || !read(&key_len, sizeof(key_len), off + 2))
+        return false;
+    off += 3;
+
+    uint16 max_pairs = _dev->max_queue_pairs();
+    if (key_len > RSS_MAX_KEY_SIZE || !read(key, key_len, off) || unclassified >= max_pairs || max_tx_vq == 0
+        || max_tx_vq > max_pairs)
+        return false;
+
+    for (uint32 i = 0; i < entries; i++) {
+        if (indir[i] >= max_pairs)
+            return false;
+    }
+
+    Filters &f = _next->filters;
+    _active_pairs = max_tx_vq;
+    f.steering = true;
+    f.hash_types = hash_types;
+    f.indir_mask = mask;
+    memcpy(f.indir, indir, entries * sizeof(indir[0]));
+    f.unclassified = unclassified;
+    set_key(*_next, key, key_len);
+    return true;
+}
+
+bool
+Model::VirtioNetCtrl::accept(const Filters &filters, const uint8 *frame, size_t size) const {
+    if (size < ETH_HLEN)
+        return false;
+    if (filters.promisc)
+        return true;
+
+    if (be16(frame + 12) == ETH_P_8021Q && negotiated(VIRTIO_NET_CTRL_VLAN)) {
+        if (size < ETH_HLEN + VLAN_HLEN)
+            return false;
+
+        uint16 vid = be16(frame + ETH_HLEN) & 0xfff;
+        if ((filters.vlans[vid / 64] & (1ull << (vid % 64))) == 0)
+            return false;
+    }
+
+    if ((frame[0] & 1) != 0) {
+        static const uint8 BROADCAST[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+        if (filters.allmulti || filters.multi_overflow || memcmp(frame, BROADCAST, 6) == 0)
+            return true;
+
+        for (uint16 i = 0; i < filters.multi_count; i++) {
+            if (memcmp(frame, filters.multi[i], 6) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    if (filters.uni_overflow || memcmp(frame, filters.mac, 6) == 0)
+        return true;
+
+    for (uint16 i = 0; i < filters.uni_count; i++) {
+        if (memcmp(frame, filters.uni[i], 6) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * 5.1.6.4.3.1: the input is made of the source and destination addresses, followed by the
+ * source and destination ports if the L4 hash type of the packet is enabled. A packet falls
+ * back to the IP hash type when its L4 type is disabled or when it is a fragment.
+ */
+bool
+Model::VirtioNetCtrl::hash_input(const Filters &filters, const uint8 *frame, size_t size, uint8 *input, size_t &len) {
+    if (size < ETH_HLEN)
+        return false;
+
+    size_t l3 = ETH_HLEN;
+    uint16 type = be16(frame + 12);
+    if (type == ETH_P_8021Q || type == ETH_P_8021AD) {
+        if (size < ETH_HLEN + VLAN_HLEN)
+            return false;
+        type = be16(frame + ETH_HLEN + 2);
+        l3 += VLAN_HLEN;
+    }
+
+    size_t l4;
+    uint8 proto;
+    uint32 ip_type, tcp_type, udp_type;
+
+    if (type == ETH_P_IP) {
+        if (size < l3 + IPV4_MIN_HLEN)
+            return false;
+
+        size_t ihl = static_cast<size_t>(frame[l3] & 0xf) * 4;
+        if (ihl < IPV4_MIN_HLEN)
+            return false;
+
+        len = 8;
+        memcpy(input, frame + l3 + 12, len);
+        l4 = l3 + ihl;
+        // Fragments other than the first one carry no ports
+        proto = (be16(frame + l3 + 6) & 0x3fff) != 0 ? 0 : frame[l3 + 9];
+        ip_type = VIRTIO_NET_RSS_HASH_TYPE_IPV4;
+        tcp_type = VIRTIO_NET_RSS_HASH_TYPE_TCPV4;
+        udp_type = VIRTIO_NET_RSS_HASH_TYPE_UDPV4;
+    } else if (type == ETH_P_IPV6) {
+        if (size < l3 + IPV6_HLEN)
+            return false;
+
+        len = 32;
+        memcpy(input, frame + l3 + 8, len);
+        l4 = l3 + IPV6_HLEN;
+        // Extension headers are not walked (no IPv6_EX hash types)
+        proto = frame[l3 + 6];
+        ip_type = VIRTIO_NET_RSS_HASH_TYPE_IPV6;
+        tcp_type = VIRTIO_NET_RSS_HASH_TYPE_TCPV6;
+        udp_type = VIRTIO_NET_RSS_HASH_TYPE_UDPV6;
+    } else {
+        return false;
+    }
+
+    uint32 l4_type = proto == IPPROTO_TCP_NUM ? tcp_type : (proto == IPPROTO_UDP_NUM ? udp_type : 0);
+    if ((filters.hash_types & l4_type) != 0 && size >= l4 + 4) {
+        memcpy(input + len, frame + l4, 4);
+        len += 4;
+        return true;
+    }
+
+    return (filters.hash_types & ip_type) != 0;
+}
+
+uint32
+Model::VirtioNetCtrl::table_hash(const Snapshot &snap, const uint8 *input, size_t len) {
+    uint32 result = 0;
+
+    for (size_t i = 0; i < len; i++)
+        result ^= snap.hash_table[i][input[i]];
+
+    return result;
+}
+
+bool
+Model::VirtioNetCtrl::hash(const char *frame, size_t size, uint32 &value) const {
+    const uint8 *bytes = reinterpret_cast<const uint8 *>(frame);
+    uint8 input[MAX_HASH_INPUT];
+    size_t len;
+
+    const Snapshot &cur = enter();
+    bool ok = hash_input(cur.filters, bytes, size, input, len);
+
+    if (ok)
+        value = table_hash(cur, input, len);
+    leave(cur);
+    return ok;
+}
+
+bool
+Model::VirtioNetCtrl::classify(const char *frame, size_t size, uint16 &pair) const {
+    const uint8 *bytes = reinterpret_cast<const uint8 *>(frame);
+    uint8 input[MAX_HASH_INPUT];
+    size_t len;
+
+    const Snapshot &cur = enter();
+    const Filters &f = cur.filters;
+    bool ok = accept(f, bytes, size);
+
+    if (!ok)
+        _stats.filtered++;
+    else if (!f.steering)
+        pair = 0;
+    else if (!hash_input(f, bytes, size, input, len))
+        pair = f.unclassified;
+    else
+        pair = f.indir[table_hash(cur, input, len) & f.indir_mask];
+
+    leave(cur);
+    return ok;
+}
@@ -0,0 +1,310 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <model/virtio_net_offload.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+
+static constexpr size_t ETH_HLEN = 14;
+static constexpr size_t VLAN_HLEN = 4;
+static constexpr uint16 ETH_P_IP = 0x0800;
+static constexpr uint16 ETH_P_IPV6 = 0x86dd;
+static constexpr uint16 ETH_P_8021Q = 0x8100;
+static constexpr uint16 ETH_P_8021AD = 0x88a8;
+static constexpr size_t IPV4_MIN_HLEN = 20;
+static constexpr size_t IPV6_HLEN = 40;
+static constexpr size_t TCP_MIN_HLEN = 20;
+static constexpr size_t PSEUDO_MAX = 40;
+static constexpr uint8 IPPROTO_TCP_NUM = 6;
+
+static constexpr uint8 TCP_FIN = 0x01;
+static constexpr uint8 TCP_PSH = 0x08;
+static constexpr uint8 TCP_CWR = 0x80;
+
+// Offsets within the IP and TCP headers
+static constexpr size_t IPV4_TOT_LEN = 2;
+static constexpr size_t IPV4_ID = 4;
+static constexpr size_t IPV4_PROTO = 9;
+static constexpr size_t IPV4_CSUM = 10;
+static constexpr size_t IPV4_ADDRS = 12;
+static constexpr size_t IPV6_PAYLOAD_LEN = 4;
+static constexpr size_t IPV6_NEXT = 6;
+static constexpr size_t IPV6_ADDRS = 8;
+static constexpr size_t TCP_SEQ = 4;
+static constexpr size_t TCP_DOFF = 12;
+static constexpr size_t TCP_FLAGS = 13;
+static constexpr size_t TCP_CSUM = 16;
+
+static inline uint16
+load_be16(const char *p) {
+    uint16 v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap16(v);
+}
+
+static inline void
+store_be16(char *p, uint16 v) {
+    v = __builtin_bswap16(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32
+load_be32(const char *p) {
+    uint32 v;
+    memcpy(&v, p, sizeof(v));
+    return __builtin_bswap32(v);
+}
+
+static inline void
+store_be32(char *p, uint32 v) {
+    v = __builtin_bswap32(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint64
+load64(const uint8 *p) {
+    uint64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// One's complement addition: the carry out of bit 63 is added back in bit 0
+static inline uint64
+add_end_around(uint64 a, uint64 b) {
+    uint64 s = a + b;
+    return s + (s < b ? 1 : 0);
+}
+
+Model::VirtioNetOffload::Offloads
+Model::VirtioNetOffload::guest_offloads(uint64 drv_features) {
+    Offloads o;
+
+    o.csum = (drv_features & VIRTIO_NET_GUEST_CSUM) != 0;
+    o.tso4 = (drv_features & VIRTIO_NET_GUEST_TSO4) != 0;
+    o.tso6 = (drv_features & VIRTIO_NET_GUEST_TSO6) != 0;
+    o.ecn = (drv_features & VIRTIO_NET_GUEST_ECN) != 0;
+    return o;
+}
+
+bool
+Model::VirtioNetOffload::needs_offload(const VirtioNetHeader &hdr, const Offloads &peer) {
+    uint8 gso = static_cast<uint8>(hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN);
+    bool ecn = (hdr.gso_type & VIRTIO_NET_HDR_GSO_ECN) != 0;
+
+    if (gso != VIRTIO_NET_HDR_GSO_NONE) {
+        bool supported = (gso == VIRTIO_NET_HDR_GSO_TCPV4 && peer.tso4) || (gso == VIRTIO_NET_HDR_GSO_TCPV6 && peer.tso6);
+        return !supported || (ecn && !peer.ecn) || !peer.csum;
+    }
+
+    return (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0 && !peer.csum;
+}
+
+/*
+ * The sum is computed 64 bits at a time, in memory order. One's complement addition is
+ * commutative and the byte order only swaps the two halves of the folded result (RFC 1071), so
+ * the final checksum is already in network order when stored as is. Four independent
+ * accumulators keep the carry chains apart and let the CPU run the additions in parallel.
+ */
+uint32
+Model::VirtioNetOffload::csum_partial(const void *buf, size_t len, uint32 sum) {
+    const uint8 *p = static_cast<const uint8 *>(buf);
+    uint64 a0 = sum, a1 = 0, a2 = 0, a3 = 0;
+
+    for (; len >= 32; len -= 32, p += 32) {
+        a0 = add_end_around(a0, load64(p));
+        a1 = add_end_around(a1, load64(p + 8));
+        a2 = add_end_around(a2, load64(p + 16));
+        a3 = add_end_around(a3, load64(p + 24));
+    }
+    for (; len >= 8; len -= 8, p += 8)
+        a0 = add_end_around(a0, load64(p));
+
+    if (len > 0) {
+        uint64 tail = 0;
+        memcpy(&tail, p, len);
+        a1 = add_end_around(a1, tail);
+    }
+
+    uint64 acc = add_end_around(add_end_around(a0, a1), add_end_around(a2, a3));
+    acc = (acc & 0xffffffffull) + (acc >> 32);
+    acc = (acc & 0xffffffffull) + (acc >> 32);
+    return static_cast<uint32>(acc);
+}
+
+uint16
+Model::VirtioNetOffload::csum_fold(uint32 sum) {
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<uint16>(~sum);
+}
+
+Errno
+Model::VirtioNetOffload::complete_checksum(VirtioNetHeader &hdr, char *pkt, size_t size) {
+    size_t start = hdr.csum_start;
+    size_t field = start + hdr.csum_offset;
+
+    if (start >= size || field + sizeof(uint16) > size)
+        return Errno::INVAL;
+
+    // The driver stored the sum of the pseudo header in the checksum field
+    uint16 csum = csum_fold(csum_partial(pkt + start, size - start, 0));
+    memcpy(pkt + field, &csum, sizeof(csum));
+
+    hdr.flags = static_cast<uint8>(hdr.flags & ~VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    return Errno::NONE;
+}
+
+Model::VirtioNetOffload::~VirtioNetOffload() {
+    delete[] _seg;
+}
+
+bool
+Model::VirtioNetOffload::init() {
+    _seg = new (nothrow) char[MAX_HEADERS + MAX_GSO_SIZE];
+    return _seg != nullptr;
+}
+
+Errno
+Model::VirtioNetOffload::process(const VirtioNetHeader &hdr, char *pkt, size_t size, const Offloads &peer, Output &out) {
+    if (!needs_offload(hdr, peer))
+        return out.packet(hdr, pkt, size);
+
+    uint8 gso = static_cast<uint8>(hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN);
+    if (gso != VIRTIO_NET_HDR_GSO_NONE) {
+        if (gso != VIRTIO_NET_HDR_GSO_TCPV4 && gso != VIRTIO_NET_HDR_GSO_TCPV6)
+            return Errno::INVAL;
+
+        return segment(hdr, pkt, size, out);
+    }
+
+    VirtioNetHeader done = hdr;
+    Errno err = complete_checksum(done, pkt, size);
+    if (err != Errno::NONE)
+        return err;
+
+    return out.packet(done, pkt, size);
+}
+
+/*
+ * Every segment is built in [_seg]: a copy of the headers of the GSO packet followed by its
+ * share of the payload. The headers are then fixed up: IP length and identification, TCP
+ * sequence number and flags, and both checksums are computed from scratch.
+ */
+Errno
+Model::VirtioNetOffload::segment(const VirtioNetHeader &hdr, const char *pkt, size_t size, Output &out) {
+    if (_seg == nullptr || hdr.gso_size == 0)
+        return Errno::INVAL;
+
+    // L2: Ethernet header and up to two VLAN tags
+    size_t l3 = ETH_HLEN;
+    if (size < l3)
+        return Errno::INVAL;
+
+    uint16 proto = load_be16(pkt + l3 - sizeof(uint16));
+    for (unsigned tags = 0; (proto == ETH_P_8021Q || proto == ETH_P_8021AD) && tags < 2; tags++) {
+        l3 += VLAN_HLEN;
+        if (size < l3)
+            return Errno::INVAL;
+        proto = load_be16(pkt + l3 - sizeof(uint16));
+    }
+
+    // L3: the TCP header follows the IP header, unless the driver told where it starts
+    bool v4 = proto == ETH_P_IP;
+    size_t l4;
+    if (v4) {
+        if (size < l3 + IPV4_MIN_HLEN || pkt[l3 + IPV4_PROTO] != IPPROTO_TCP_NUM)
+            return Errno::INVAL;
+        l4 = l3 + (static_cast<size_t>(pkt[l3] & 0xf) << 2);
+    } else if (proto == ETH_P_IPV6) {
+        if (size < l3 + IPV6_HLEN)
+            return Errno::INVAL;
+        if ((hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0)
+            l4 = hdr.csum_start;
+        else if (pkt[l3 + IPV6_NEXT] == IPPROTO_TCP_NUM)
+            l4 = l3 + IPV6_HLEN;
+        else
+            return Errno::INVAL;
+    } else {
+        return Errno::INVAL;
+    }
+
+    if (l4 < l3 + (v4 ? IPV4_MIN_HLEN : IPV6_HLEN) || size < l4 + TCP_MIN_HLEN)
+        return Errno::INVAL;
+
+    // L4
+    size_t headers = l4 + (static_cast<size_t>(static_cast<uint8>(pkt[l4 + TCP_DOFF]) >> 4) << 2);
+    if (headers < l4 + TCP_MIN_HLEN || headers > size || headers > MAX_HEADERS)
+        return Errno::INVAL;
+
+    size_t mss = hdr.gso_size;
+    size_t payload = size - headers;
+
+    uint32 seq = load_be32(pkt + l4 + TCP_SEQ);
+    uint16 id = v4 ? load_be16(pkt + l3 + IPV4_ID) : 0;
+    uint8 flags = static_cast<uint8>(pkt[l4 + TCP_FLAGS]);
+
+    VirtioNetHeader seg_hdr;
+    seg_hdr.num_buffers = hdr.num_buffers;
+
+    memcpy(_seg, pkt, headers);
+
+    size_t off = 0;
+    do {
+        size_t chunk = min(mss, payload - off);
+        bool last = off + chunk == payload;
+        size_t l4_len = headers - l4 + chunk;
+        char *ip = _seg + l3;
+        char *tcp = _seg + l4;
+
+        memcpy(_seg + headers, pkt + headers + off, chunk);
+
+        uint8 seg_flags = flags;
+        if (!last)
+            seg_flags = static_cast<uint8>(seg_flags & ~(TCP_FIN | TCP_PSH));
+        if (off != 0)
+            seg_flags = static_cast<uint8>(seg_flags & ~TCP_CWR);
+        tcp[TCP_FLAGS] = static_cast<char>(seg_flags);
+        store_be32(tcp + TCP_SEQ, static_cast<uint32>(seq + off));
+
+        // Pseudo header, in network order
+        char pseudo[PSEUDO_MAX] = {};
+        size_t pseudo_len;
+        if (v4) {
+            size_t ihl = l4 - l3;
+            store_be16(ip + IPV4_TOT_LEN, static_cast<uint16>(ihl + l4_len));
+            store_be16(ip + IPV4_ID, static_cast<uint16>(id + off / mss));
+            memset(ip + IPV4_CSUM, 0, sizeof(uint16));
+            uint16 ip_csum = csum_fold(csum_partial(ip, ihl, 0));
+            memcpy(ip + IPV4_CSUM, &ip_csum, sizeof(ip_csum));
+
+            memcpy(pseudo, ip + IPV4_ADDRS, 8);
+            pseudo[9] = static_cast<char>(IPPROTO_TCP_NUM);
+            store_be16(pseudo + 10, static_cast<uint16>(l4_len));
+            pseudo_len = 12;
+        } else {
+            store_be16(ip + IPV6_PAYLOAD_LEN, static_cast<uint16>(l4 - l3 - IPV6_HLEN + l4_len));
+
+            memcpy(pseudo, ip + IPV6_ADDRS, 32);
+            store_be32(pseudo + 32, static_cast<uint32>(l4_len));
+            pseudo[39] = static_cast<char>(IPPROTO_TCP_NUM);
+            pseudo_len = 40;
+        }
+
+        memset(tcp + TCP_CSUM, 0, sizeof(uint16));
+        uint16 tcp_csum = csum_fold(csum_partial(tcp, l4_len, csum_partial(pseudo, pseudo_len, 0)));
+        memcpy(tcp + TCP_CSUM, &tcp_csum, sizeof(tcp_csum));
+
+        Errno err = out.packet(seg_hdr, _seg, headers + chunk);
+        if (err != Errno::NONE)
+            return err;
+
+        off += chunk;
+    } while (off < payload);
+
+    return Errno::NONE;
+}
@@ -0,0 +1,296 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <model/virtio_net_rx.hpp>
+#include <platform/log.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+
+Model::VirtioNetRx::~VirtioNetRx() {
+    if (_bufs == nullptr)
+        return;
+
+    for (uint16 i = 0; i < _max_buffers; i++) {
+        if (_bufs[i] != nullptr)
+            _bufs[i]->deinit();
+        delete _bufs[i];
+    }
+    delete[] _bufs;
+}
+
+bool
+Model::VirtioNetRx::init(uint16 queue_entries, uint16 max_buffers) {
+    if (queue_entries == 0 || max_buffers == 0)
+        return false;
+
+    _max_buffers = max_buffers;
+    _bufs = new (nothrow) Virtio::Sg::Buffer *[_max_buffers];
+    if (_bufs == nullptr)
+        return false;
+
+    for (uint16 i = 0; i < _max_buffers; i++)
+        _bufs[i] = nullptr;
+
+    for (uint16 i = 0; i < _max_buffers; i++) {
+        _bufs[i] = new (nothrow) Virtio::Sg::Buffer(queue_entries);
+        if (_bufs[i] == nullptr)
+            return false;
+        if (_bufs[i]->init() != Errno::NONE)
+            return false;
+    }
+
+    return true;
+}
+
+void
+Model::VirtioNetRx::begin() {
+    if (_batching || !_dev->rx_queue_constructed(_pair))
+        return;
+
+    _dev->rx_queue(_pair).begin_batch();
+    _batching = true;
+    _batch_packets = 0;
+}
+
+void
+Model::VirtioNetRx::end() {
+    if (!_batching)
+        return;
+
+    _batching = false;
+    if (_dev->rx_queue_constructed(_pair))
+        _dev->rx_queue(_pair).end_batch();
+
+    if (_batch_packets > 0)
+        _dev->signal();
+    _batch_packets = 0;
+}
+
+void
+Model::VirtioNetRx::reset() {
+    // The queue is being reset: no chain is given back to the guest.
+    for (uint16 i = 0; i < _pending; i++)
+        _bufs[i]->reset();
+
+    _pending = 0;
+    _batching = false;
+    _batch_packets = 0;
+}
+
+/*
+ * The first [count] chains were popped but are not used: hand them back to the available ring
+ * so that they are returned again, in the same order, to the next call to receive().
+ */
+void
+Model::VirtioNetRx::give_back(Virtio::DeviceQueue &vq, uint16 count) {
+    for (uint16 i = 0; i < count; i++)
+        _bufs[i]->reset();
+    vq.unpop(count);
+}
+
+/*
+ * Pop chains until [size] bytes fit in them. Without mergeable buffers, a packet is limited to
+ * a single chain whatever its size. The caller checks [room] against the size of the packet.
+ */
+Errno
+Model::VirtioNetRx::pop_chains(Virtio::DeviceQueue &vq, size_t size, uint16 &used, size_t &room) {
+    uint16 max_chains = _dev->mergeable_rx_buffers() ? _max_buffers : 1;
+
+    used = 0;
+    room = 0;
+    while (room < size && used < max_chains) {
+        Virtio::Sg::Buffer &buf = *_bufs[used];
+        Errno err = buf.walk_chain(vq);
+        if (err == Errno::NOENT) {
+            give_back(vq, used);
+            return Errno::NOENT;
+        }
+
+        // The chain was consumed. An RX chain must be writable only and, with mergeable buffers,
+        // at least as large as the header. A driver that breaks this rule cannot expect the
+        // queue to keep working: the chains popped for this packet are not returned.
+        used++;
+        if (err != Errno::NONE || buf.is_readable() || buf.size_bytes() < HEADER_SIZE) {
+            WARN("virtio net: malformed RX chain, dropping the packet");
+            for (uint16 i = 0; i < used; i++)
+                _bufs[i]->reset();
+            _stats.dropped++;
+            return err != Errno::NONE ? err : Errno::NOTRECOVERABLE;
+        }
+
+        room += buf.size_bytes();
+    }
+
+    return Errno::NONE;
+}
+
+void
+Model::VirtioNetRx::publish(Virtio::DeviceQueue &vq, uint16 used) {
+    bool own_batch = !_batching;
+    if (own_batch)
+        vq.begin_batch();
+
+    for (uint16 i = 0; i < used; i++)
+        _bufs[i]->conclude_chain_use(vq);
+
+    if (own_batch) {
+        vq.end_batch();
+        _dev->signal();
+    } else {
+        _batch_packets++;
+    }
+
+    _stats.packets++;
+    _stats.buffers += used;
+}
+
+Errno
+Model::VirtioNetRx::receive(const VirtioNetHeader &hdr, const void *pkt, size_t size) {
+    if (_bufs == nullptr || !_dev->rx_queue_constructed(_pair))
+        return Errno::NOENT;
+
+    Virtio::DeviceQueue &vq = _dev->rx_queue(_pair);
+    size_t total = HEADER_SIZE + size;
+    size_t room = 0;
+    uint16 used = 0;
+
+    // Nothing is copied before the number of chains, and so [num_buffers], is known
+    Errno err = pop_chains(vq, total, used, room);
+    if (err != Errno::NONE)
+        return err;
+
+    if (room < total) {
+        give_back(vq, used);
+        _stats.dropped++;
+        return Errno::INVAL;
+    }
+
+    VirtioNetHeader header = hdr;
+    header.num_buffers = used;
+
+    // The packet is seen as a stream made of the header followed by the data, the chains are
+    // filled one after the other. The header always lies in the first chain.
+    size_t off = 0;
+    for (uint16 i = 0; i < used; i++) {
+        Virtio::Sg::Buffer &buf = *_bufs[i];
+        size_t chain_off = 0;
+
+        while (chain_off < buf.size_bytes() && off < total) {
+            const char *src;
+            size_t avail;
+
+            if (off < HEADER_SIZE) {
+                src = reinterpret_cast<const char *>(&header) + off;
+                avail = HEADER_SIZE - off;
+            } else {
+                src = static_cast<const char *>(pkt) + (off - HEADER_SIZE);
+                avail = total - off;
+            }
+
+            size_t n = min(avail, buf.size_bytes() - chain_off);
+            size_t copied = n;
+            err = buf.copy_from_linear(src, *_dev, copied, chain_off);
+            if (err != Errno::NONE || copied != n) {
+                WARN("virtio net: cannot copy to the RX chain, dropping the packet");
+                give_back(vq, used);
+                _stats.dropped++;
+                return Errno::INVAL;
+            }
+
+            chain_off += n;
+            off += n;
+        }
+    }
+
+    publish(vq, used);
+    return Errno::NONE;
+}
+
+Errno
+Model::VirtioNetRx::prepare(size_t size, iovec *iov, uint16 max_iov, uint16 &iov_cnt) {
+    ASSERT(_pending == 0);
+
+    iov_cnt = 0;
+    if (_bufs == nullptr || !_dev->rx_queue_constructed(_pair))
+        return Errno::NOENT;
+
+    Virtio::DeviceQueue &vq = _dev->rx_queue(_pair);
+    size_t room = 0;
+    uint16 used = 0;
+
+    Errno err = pop_chains(vq, size, used, room);
+    if (err != Errno::NONE)
+        return err;
+
+    uint16 filled = 0; // Chains reached by the vector, the last one possibly in part
+    for (uint16 i = 0; i < used && iov_cnt < max_iov; i++) {
+        filled++;
+        for (auto it = _bufs[i]->begin(); it != _bufs[i]->end() && iov_cnt < max_iov; ++it) {
+            const Virtio::Sg::LinearizedDesc &desc = it.desc_ref();
+            char *hva = nullptr;
+
+            err = _dev->vq_addr_to_w_hva(desc.address, desc.length, hva);
+            if (err != Errno::NONE) {
+                WARN("virtio net: cannot access the RX chain");
+                give_back(vq, used);
+                iov_cnt = 0;
+                return err;
+            }
+
+            iov[iov_cnt].iov_base = hva;
+            iov[iov_cnt].iov_len = desc.length;
+            iov_cnt++;
+        }
+    }
+
+    // The vector is full: the chains it doesn't reach are the last ones popped, they go back
+    for (uint16 i = filled; i < used; i++)
+        _bufs[i]->reset();
+    vq.unpop(static_cast<uint16>(used - filled));
+
+    _pending = filled;
+    return Errno::NONE;
+}
+
+void
+Model::VirtioNetRx::commit(size_t written) {
+    ASSERT(_pending != 0);
+    ASSERT(written >= HEADER_SIZE);
+
+    Virtio::DeviceQueue &vq = _dev->rx_queue(_pair);
+    size_t left = written;
+    uint16 used = 0;
+
+    while (used < _pending && (used == 0 || left > 0)) {
+        size_t n = min(left, _bufs[used]->size_bytes());
+        _bufs[used]->record_written_bytes(*_dev, 0, n);
+        left -= n;
+        used++;
+    }
+
+    uint16 num_buffers = used;
+    size_t n = sizeof(num_buffers);
+    _bufs[0]->copy_from_linear(&num_buffers, *_dev, n, offsetof(VirtioNetHeader, num_buffers));
+
+    // The chains left are the last ones popped: they go back to the available ring
+    for (uint16 i = used; i < _pending; i++)
+        _bufs[i]->reset();
+    vq.unpop(static_cast<uint16>(_pending - used));
+
+    publish(vq, used);
+    _pending = 0;
+}
+
+void
+Model::VirtioNetRx::cancel() {
+    if (_pending == 0)
+        return;
+
+    give_back(_dev->rx_queue(_pair), _pending);
+    _pending = 0;
+}
@@ -0,0 +1,625 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <model/virtio_net_ctrl.hpp>
+#include <model/virtio_net_tap.hpp>
+#include <net/if.h>
+#include <platform/log.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+static constexpr size_t HEADER_SIZE = sizeof(Model::VirtioNetHeader);
+// Ethernet header and one VLAN tag
+static constexpr size_t ETH_OVERHEAD = 18;
+static constexpr size_t DEFAULT_MTU = 1500;
+// Largest packet the TAP interface delivers with segmentation offloads: 64KiB of IP packet
+static constexpr size_t MAX_GSO_PACKET = 0x10000 + ETH_OVERHEAD;
+// Linear copy of a packet and its header, for the offloads completed in software
+static constexpr size_t MAX_LINEAR = HEADER_SIZE + MAX_GSO_PACKET;
+
+// Copy [size] bytes found at [off] in the I/O vector
+static size_t
+copy_from_iov(const iovec *iov, uint16 iov_cnt, size_t off, char *dst, size_t size) {
+    size_t copied = 0;
+
+    for (uint16 i = 0; i < iov_cnt && copied < size; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t len = min(iov[i].iov_len - off, size - copied);
+        memcpy(dst + copied, static_cast<const char *>(iov[i].iov_base) + off, len);
+        copied += len;
+        off = 0;
+    }
+
+    return copied;
+}
+
+// Copy [size] bytes to [off] in the I/O vector
+static size_t
+copy_to_iov(const iovec *iov, uint16 iov_cnt, size_t off, const char *src, size_t size) {
+    size_t copied = 0;
+
+    for (uint16 i = 0; i < iov_cnt && copied < size; i++) {
+        if (off >= iov[i].iov_len) {
+            off -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t len = min(iov[i].iov_len - off, size - copied);
+        memcpy(static_cast<char *>(iov[i].iov_base) + off, src + copied, len);
+        copied += len;
+        off = 0;
+    }
+
+    return copied;
+}
+
+Errno
+Model::VirtioNetTap::TxOutput::packet(const VirtioNetHeader &, const char *pkt, size_t size) {
+    ssize_t n = write(_pair->fd, pkt, size);
+    return n == static_cast<ssize_t>(size) ? Errno::NONE : Errno::AGAIN;
+}
+
+Errno
+Model::VirtioNetTap::RxOutput::packet(const VirtioNetHeader &hdr, const char *pkt, size_t size) {
+    return _pair->rx.receive(hdr, pkt, size);
+}
+
+void
+Model::VirtioNetTap::advertise_features(Model::VirtioNet::UserConfig &user_config) {
+    user_config.device_feature |= VIRTIO_NET_MRG_RXBUF | VIRTIO_NET_CSUM | VIRTIO_NET_GUEST_CSUM | VIRTIO_NET_HOST_TSO4
+                                  | VIRTIO_NET_HOST_TSO6 | VIRTIO_NET_HOST_ECN | VIRTIO_NET_GUEST_TSO4 | VIRTIO_NET_GUEST_TSO6
+                                  | VIRTIO_NET_GUEST_ECN;
+}
+
+Model::VirtioNetTap::Pair::~Pair() {
+    if (tx_buf != nullptr)
+        tx_buf->deinit();
+    delete tx_buf;
+    delete[] tx_iov;
+    delete[] tx_pkt;
+    delete[] rx_pkt;
+
+    if (fd >= 0)
+        close(fd);
+}
+
+Model::VirtioNetTap::~VirtioNetTap() {
+    for (uint16 i = 0; i < _num_pairs; i++) {
+        _dev->set_queue_signal(static_cast<uint16>(2 * i), nullptr);
+        _dev->set_queue_signal(static_cast<uint16>(2 * i + 1), nullptr);
+        delete _pairs[i];
+    }
+    delete[] _pairs;
+
+    if (_stop_fd >= 0)
+        close(_stop_fd);
+}
+
+/*
+ * Attach a queue of the TAP interface to the pair. The first one creates the interface if needed,
+ * the others attach to the interface it got.
+ */
+bool
+Model::VirtioNetTap::open_queue(Pair &p) {
+    p.fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (p.fd < 0) {
+        WARN("virtio net: cannot open /dev/net/tun (%d)", errno);
+        return false;
+    }
+
+    const char *name = p.index == 0 ? _config.ifname : _ifname;
+    ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = static_cast<short>(IFF_TAP | IFF_NO_PI | (_config.vnet_hdr ? IFF_VNET_HDR : 0)
+                                       | (_num_pairs > 1 ? IFF_MULTI_QUEUE : 0));
+    memcpy(ifr.ifr_name, name, strnlen(name, IFNAMSIZ - 1));
+
+    if (ioctl(p.fd, TUNSETIFF, &ifr) != 0) {
+        WARN("virtio net: cannot attach queue %u to TAP interface '%s' (%d)", p.index, name, errno);
+        return false;
+    }
+    if (p.index == 0)
+        memcpy(_ifname, ifr.ifr_name, sizeof(_ifname) - 1);
+
+    if (!_config.vnet_hdr)
+        return true;
+
+    // virtio_net_hdr with [num_buffers], as used with VIRTIO_F_VERSION_1
+    int hdr_size = static_cast<int>(HEADER_SIZE);
+    if (ioctl(p.fd, TUNSETVNETHDRSZ, &hdr_size) != 0) {
+        WARN("virtio net: cannot set the header size of '%s' (%d)", _ifname, errno);
+        return false;
+    }
+
+    // No offload until the guest negotiated them
+    if (ioctl(p.fd, TUNSETOFFLOAD, 0ul) != 0) {
+        WARN("virtio net: cannot reset the offloads of '%s' (%d)", _ifname, errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+Model::VirtioNetTap::init_pair(Pair &p, const Platform_ctx *ctx, uint16 queue_entries) {
+    if (!p.tx_sig.init(ctx) || !p.rx_sig.init(ctx) || !p.tx_lock.init(ctx) || !p.rx_lock.init(ctx))
+        return false;
+
+    p.tx_buf = new (nothrow) Virtio::Sg::Buffer(queue_entries);
+    p.tx_iov_max = queue_entries;
+    p.tx_iov = new (nothrow) iovec[p.tx_iov_max];
+    if (p.tx_buf == nullptr || p.tx_iov == nullptr || p.tx_buf->init() != Errno::NONE)
+        return false;
+
+    if (!p.rx.init(queue_entries))
+        return false;
+
+    p.tx_pkt = new (nothrow) char[MAX_LINEAR];
+    p.rx_pkt = new (nothrow) char[MAX_LINEAR];
+    if (p.tx_pkt == nullptr || p.rx_pkt == nullptr || !p.tx_offload.init() || !p.rx_offload.init())
+        return false;
+
+    if (!open_queue(p))
+        return false;
+
+    p.rx_size = DEFAULT_MTU + ETH_OVERHEAD + HEADER_SIZE;
+
+    _dev->set_queue_signal(static_cast<uint16>(2 * p.index), &p.rx_sig);
+    _dev->set_queue_signal(static_cast<uint16>(2 * p.index + 1), &p.tx_sig);
+    return true;
+}
+
+bool
+Model::VirtioNetTap::init(const Platform_ctx *ctx, uint16 queue_entries) {
+    if (queue_entries == 0 || _config.tx_batch == 0 || _config.rx_batch == 0)
+        return false;
+
+    _stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_stop_fd < 0)
+        return false;
+
+    _num_pairs = _dev->max_queue_pairs();
+    _pairs = new (nothrow) Pair *[_num_pairs]{};
+    if (_pairs == nullptr)
+        return false;
+
+    for (uint16 i = 0; i < _num_pairs; i++) {
+        _pairs[i] = new (nothrow) Pair(*_dev, i);
+        if (_pairs[i] == nullptr || !init_pair(*_pairs[i], ctx, queue_entries))
+            return false;
+    }
+
+    return true;
+}
+
+void
+Model::VirtioNetTap::stop() {
+    _stop = true;
+    uint64 one = 1;
+    // Every RX loop polls the event, it stays readable
+    if (_stop_fd >= 0 && write(_stop_fd, &one, sizeof(one)) != sizeof(one))
+        WARN("virtio net: cannot wake up the RX loops");
+    for (uint16 i = 0; i < _num_pairs; i++) {
+        _pairs[i]->tx_sig.sig();
+        _pairs[i]->rx_sig.sig();
+    }
+}
+
+void
+Model::VirtioNetTap::driver_ok() {
+    uint64 features = _dev->drv_feature();
+    unsigned long offloads = 0;
+
+    // Without the header, the TAP interface only exchanges complete frames
+    if (_config.vnet_hdr && (features & VIRTIO_NET_GUEST_CSUM) != 0) {
+        offloads |= TUN_F_CSUM;
+        if ((features & VIRTIO_NET_GUEST_TSO4) != 0)
+            offloads |= TUN_F_TSO4;
+        if ((features & VIRTIO_NET_GUEST_TSO6) != 0)
+            offloads |= TUN_F_TSO6;
+        if ((offloads & (TUN_F_TSO4 | TUN_F_TSO6)) != 0 && (features & VIRTIO_NET_GUEST_ECN) != 0)
+            offloads |= TUN_F_TSO_ECN;
+    }
+
+    VirtioNetConfig cfg;
+    _dev->get_device_specific_config(cfg);
+    size_t mtu = cfg.mtu != 0 ? cfg.mtu : DEFAULT_MTU;
+
+    for (uint16 i = 0; i < _num_pairs; i++) {
+        Pair &p = *_pairs[i];
+
+        if (_config.vnet_hdr && ioctl(p.fd, TUNSETOFFLOAD, offloads) != 0)
+            WARN("virtio net: cannot set the offloads of '%s' (%d)", _ifname, errno);
+
+        Platform::MutexGuard guard{p.rx_lock};
+        p.rx_guest = VirtioNetOffload::guest_offloads(features);
+        p.rx_size = ((offloads & (TUN_F_TSO4 | TUN_F_TSO6)) != 0 ? MAX_GSO_PACKET : mtu + ETH_OVERHEAD) + HEADER_SIZE;
+    }
+}
+
+void
+Model::VirtioNetTap::reset() {
+    for (uint16 i = 0; i < _num_pairs; i++) {
+        Pair &p = *_pairs[i];
+        {
+            Platform::MutexGuard guard{p.tx_lock};
+            p.tx_buf->reset();
+        }
+        {
+            Platform::MutexGuard guard{p.rx_lock};
+            p.rx.reset();
+            p.rx_pending = 0;
+        }
+    }
+}
+
+void
+Model::VirtioNetTap::run_tx(uint16 pair) {
+    if (pair >= _num_pairs)
+        return;
+
+    Pair &p = *_pairs[pair];
+    while (!_stop) {
+        p.tx_sig.wait();
+        if (_stop)
+            return;
+
+        process_tx(p);
+    }
+}
+
+void
+Model::VirtioNetTap::run_rx(uint16 pair) {
+    if (pair >= _num_pairs)
+        return;
+
+    Pair &p = *_pairs[pair];
+    pollfd fds[2];
+    fds[0].fd = p.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = _stop_fd;
+    fds[1].events = POLLIN;
+
+    while (!_stop) {
+        // A packet held for a pair out of buffers is retried before reading more
+        if (p.rx_pending == 0) {
+            if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                return;
+            if (_stop)
+                return;
+            if ((fds[0].revents & POLLIN) == 0)
+                continue;
+        }
+
+        // Out of buffers: the guest notifies the RX queue once it has posted new ones
+        if (!process_rx(p))
+            wait_rx_buffers(p.rx_pending != 0 ? *_pairs[p.rx_target] : p);
+    }
+}
+
+/*
+ * Wait for the notification of the RX queue of [p]. The loop of the pair and the loops holding a
+ * packet for it may wait together: the one woken up passes the notification on.
+ */
+void
+Model::VirtioNetTap::wait_rx_buffers(Pair &p) {
+    p.rx_waiters++;
+    p.rx_sig.wait();
+    if (--p.rx_waiters > 0)
+        p.rx_sig.sig();
+}
+
+/*
+ * Write the packet held by the TX buffer of the pair: the chain starts with the virtio_net_hdr,
+ * which is also what the TAP interface expects.
+ */
+bool
+Model::VirtioNetTap::transmit(Pair &p) {
+    uint16 iov_cnt = 0;
+
+    for (auto it = p.tx_buf->begin(); it != p.tx_buf->end(); ++it) {
+        const Virtio::Sg::LinearizedDesc &desc = it.desc_ref();
+        char *hva = nullptr;
+
+        if ((desc.flags & VIRTQ_DESC_WRITE_ONLY) != 0 || iov_cnt == p.tx_iov_max)
+            return false;
+        if (_dev->vq_addr_to_r_hva(desc.address, desc.length, hva) != Errno::NONE)
+            return false;
+
+        p.tx_iov[iov_cnt].iov_base = hva;
+        p.tx_iov[iov_cnt].iov_len = desc.length;
+        iov_cnt++;
+    }
+
+    if (p.tx_buf->size_bytes() < HEADER_SIZE)
+        return false;
+
+    ssize_t n = writev(p.fd, p.tx_iov, iov_cnt);
+    return n == static_cast<ssize_t>(p.tx_buf->size_bytes());
+}
+
+/*
+ * Write the packet held by the TX buffer of the pair to a TAP interface without the
+ * virtio_net_hdr: the packet is copied out of the chain and its offloads completed, a GSO packet
+ * is written as its segments.
+ */
+bool
+Model::VirtioNetTap::transmit_offloaded(Pair &p) {
+    size_t size = p.tx_buf->size_bytes();
+    if (size < HEADER_SIZE || size > MAX_LINEAR || p.tx_buf->is_writable())
+        return false;
+    if (p.tx_buf->copy_to_linear(p.tx_pkt, *_dev, size) != Errno::NONE)
+        return false;
+
+    VirtioNetHeader hdr;
+    memcpy(&hdr, p.tx_pkt, HEADER_SIZE);
+
+    const VirtioNetOffload::Offloads none;
+    if (VirtioNetOffload::needs_offload(hdr, none))
+        _stats.tx_offloads++;
+
+    return p.tx_offload.process(hdr, p.tx_pkt + HEADER_SIZE, size - HEADER_SIZE, none, p.tx_out) == Errno::NONE;
+}
+
+void
+Model::VirtioNetTap::process_tx(Pair &p) {
+    Platform::MutexGuard guard{p.tx_lock};
+
+    if (!_dev->tx_queue_constructed(p.index))
+        return;
+
+    Virtio::DeviceQueue &vq = _dev->tx_queue(p.index);
+    bool empty = false;
+
+    while (!empty) {
+        uint16 sent = 0;
+
+        vq.begin_batch();
+        while (sent < _config.tx_batch) {
+            if (p.tx_buf->walk_chain(vq) != Errno::NONE) {
+                empty = true;
+                break;
+            }
+
+            if (_config.vnet_hdr ? transmit(p) : transmit_offloaded(p))
+                _stats.tx_packets++;
+            else
+                _stats.tx_errors++;
+
+            p.tx_buf->conclude_chain_use(vq);
+            sent++;
+        }
+        vq.end_batch();
+
+        if (sent > 0) {
+            _stats.tx_batches++;
+            _dev->signal();
+        }
+    }
+}
+
+/*
+ * Check a packet read into the RX vector of the pair against the receive filters of the control
+ * queue, and pick the pair that must receive it. Without control queue, the packet stays on the
+ * pair it was read on.
+ */
+bool
+Model::VirtioNetTap::classify(const Pair &p, uint16 iov_cnt, size_t size, uint16 &target) const {
+    const VirtioNetCtrl *ctrl = _dev->ctrl();
+    target = p.index;
+    if (ctrl == nullptr)
+        return true;
+
+    char headers[VirtioNetCtrl::MAX_HEADERS];
+    size_t len = copy_from_iov(p.rx_iov, iov_cnt, HEADER_SIZE, headers, min(size - HEADER_SIZE, sizeof(headers)));
+    if (!ctrl->classify(headers, len, target))
+        return false;
+
+    if (target >= _num_pairs)
+        target = 0;
+    return true;
+}
+
+/*
+ * Read a packet into the RX vector of the pair, header included. Without IFF_VNET_HDR, the frame
+ * is read after an empty header.
+ */
+ssize_t
+Model::VirtioNetTap::read_packet(Pair &p, uint16 iov_cnt) {
+    if (_config.vnet_hdr)
+        return readv(p.fd, p.rx_iov, iov_cnt);
+
+    const VirtioNetHeader hdr;
+    if (copy_to_iov(p.rx_iov, iov_cnt, 0, reinterpret_cast<const char *>(&hdr), HEADER_SIZE) != HEADER_SIZE)
+        return -1;
+
+    uint16 first = 0;
+    size_t off = HEADER_SIZE;
+    while (off >= p.rx_iov[first].iov_len) {
+        off -= p.rx_iov[first].iov_len;
+        first++;
+        if (first == iov_cnt)
+            return -1;
+    }
+
+    iovec saved = p.rx_iov[first];
+    p.rx_iov[first].iov_base = static_cast<char *>(saved.iov_base) + off;
+    p.rx_iov[first].iov_len = saved.iov_len - off;
+    ssize_t n = readv(p.fd, p.rx_iov + first, iov_cnt - first);
+    p.rx_iov[first] = saved;
+
+    return n <= 0 ? n : n + static_cast<ssize_t>(HEADER_SIZE);
+}
+
+/*
+ * The offloads of the TAP interface follow the ones the guest negotiated, but the packets queued
+ * before driver_ok() changed them keep theirs. Such a packet is completed in software and copied
+ * into the next chains, those it was read into are handed back. Returns false if the packet needs
+ * no offload and can be committed as is.
+ */
+bool
+Model::VirtioNetTap::offload_rx(Pair &p, uint16 iov_cnt, size_t size) {
+    VirtioNetHeader hdr;
+    copy_from_iov(p.rx_iov, iov_cnt, 0, reinterpret_cast<char *>(&hdr), HEADER_SIZE);
+    if (!VirtioNetOffload::needs_offload(hdr, p.rx_guest))
+        return false;
+
+    copy_from_iov(p.rx_iov, iov_cnt, 0, p.rx_pkt, size);
+    p.rx.cancel();
+    _stats.rx_offloads++;
+
+    // A GSO packet that filled the chains may have been truncated
+    if (hdr.gso_type != VIRTIO_NET_HDR_GSO_NONE && size >= p.rx_size)
+        return true;
+
+    if (p.rx_offload.process(hdr, p.rx_pkt + HEADER_SIZE, size - HEADER_SIZE, p.rx_guest, p.rx_out) != Errno::NONE)
+        WARN("virtio net: cannot complete the offloads of a packet read from '%s'", _ifname);
+    return true;
+}
+
+/*
+ * Copy the packet held in the linear buffer of [from] into the RX queue of its pair. Returns false
+ * if that pair is out of buffers: the packet stays held. A packet that cannot be delivered at all
+ * is dropped: the queue of its pair is not set up, or it is a GSO packet that may have been
+ * truncated, or it needs an offload that fails.
+ */
+bool
+Model::VirtioNetTap::deliver(Pair &from) {
+    Pair &to = *_pairs[from.rx_target];
+    size_t size = from.rx_pending;
+    VirtioNetHeader hdr;
+    memcpy(&hdr, from.rx_pkt, HEADER_SIZE);
+
+    Platform::MutexGuard guard{to.rx_lock};
+    Errno err = Errno::BADR;
+
+    if (_dev->rx_queue_constructed(to.index) && (hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE || !from.rx_full)) {
+        char *pkt = from.rx_pkt + HEADER_SIZE;
+
+        to.rx.begin();
+        if (VirtioNetOffload::needs_offload(hdr, to.rx_guest)) {
+            _stats.rx_offloads++;
+            // [from] owns the offload engine used, [to] the chains it fills. The segments
+            // delivered cannot be taken back: the packet is not retried.
+            err = from.rx_offload.process(hdr, pkt, size - HEADER_SIZE, to.rx_guest, to.rx_out);
+            if (err == Errno::NOENT)
+                err = Errno::BADR;
+        } else {
+            err = to.rx.receive(hdr, pkt, size - HEADER_SIZE);
+        }
+        to.rx.end();
+    }
+
+    if (err == Errno::NOENT)
+        return false;
+
+    if (err == Errno::NONE) {
+        _stats.rx_packets++;
+        if (to.index != from.index)
+            _stats.rx_steered++;
+    } else {
+        _stats.rx_dropped++;
+    }
+    from.rx_pending = 0;
+    return true;
+}
+
+/*
+ * Read the packets pending on the queue of the TAP interface of the pair straight into its RX
+ * chains. A packet for another pair, or read while this pair has no chain for it, is read into
+ * the linear buffer of the pair instead and delivered once the lock is released: the pairs never
+ * hold their RX lock while taking the lock of another one. Returns false if the guest ran out of
+ * buffers before the TAP queue was drained, or if the packet held is still waiting for them.
+ */
+bool
+Model::VirtioNetTap::process_rx(Pair &p) {
+    bool buffers = true;
+    uint16 received = 0;
+
+    if (p.rx_pending != 0 && !deliver(p))
+        return false;
+
+    {
+        Platform::MutexGuard guard{p.rx_lock};
+        bool own = _dev->rx_queue_constructed(p.index);
+
+        if (!own && _num_pairs == 1)
+            return false;
+
+        if (own)
+            p.rx.begin();
+        for (uint16 reads = 0; reads < _config.rx_batch; reads++) {
+            uint16 iov_cnt = 0;
+            uint16 target = p.index;
+            bool chains = own && p.rx.prepare(p.rx_size, p.rx_iov, RX_IOV_MAX, iov_cnt) == Errno::NONE;
+
+            if (!chains && _num_pairs == 1) {
+                buffers = false;
+                break;
+            }
+            if (!chains) {
+                p.rx_iov[0].iov_base = p.rx_pkt;
+                p.rx_iov[0].iov_len = MAX_LINEAR;
+                iov_cnt = 1;
+            }
+
+            ssize_t n = read_packet(p, iov_cnt);
+            if (n < static_cast<ssize_t>(HEADER_SIZE)) {
+                if (chains)
+                    p.rx.cancel();
+                if (n < 0 && errno != EAGAIN && errno != EINTR)
+                    WARN("virtio net: cannot read from '%s' (%d)", _ifname, errno);
+                break;
+            }
+
+            // Filtered out: the chains are reused for the next packet
+            if (!classify(p, iov_cnt, static_cast<size_t>(n), target)) {
+                if (chains)
+                    p.rx.cancel();
+                continue;
+            }
+
+            if (!chains || target != p.index) {
+                p.rx_pending = static_cast<size_t>(n);
+                p.rx_target = target;
+                p.rx_full = p.rx_pending >= (chains ? p.rx_size : MAX_LINEAR);
+                if (chains) {
+                    copy_from_iov(p.rx_iov, iov_cnt, 0, p.rx_pkt, p.rx_pending);
+                    p.rx.cancel();
+                }
+                break;
+            }
+
+            if (!offload_rx(p, iov_cnt, static_cast<size_t>(n)))
+                p.rx.commit(static_cast<size_t>(n));
+            received++;
+        }
+        if (own)
+            p.rx.end();
+    }
+
+    if (received > 0) {
+        _stats.rx_packets += received;
+        _stats.rx_batches++;
+    }
+    if (p.rx_pending != 0 && !deliver(p))
+        return false;
+
+    return buffers;
+}
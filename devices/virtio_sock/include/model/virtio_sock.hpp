@@ -10,8 +10,11 @@
 
 #include <model/iommu_interface.hpp>
 #include <model/irq_controller.hpp>
+#include <model/simple_as.hpp>
 #include <model/virtio.hpp>
 #include <model/virtio_common.hpp>
+#include <model/virtio_sg.hpp>
+#include <model/virtqueue.hpp>
 #include <platform/errno.hpp>
 #include <platform/signal.hpp>
 #include <platform/types.hpp>
@@ -20,14 +23,61 @@
 namespace Model {
     class VirtioSock;
     struct VirtioSockConfig;
+    struct VsockHeader;
     class VirtioSockCallback;
     class Irq_contoller;
+
+    // Queues of a VirtioSock device: RX, TX and event
+    using VirtioSockQueues = Virtio::QueueStorage<3>;
 }
 
 struct Model::VirtioSockConfig {
     uint64 guest_cid{UINT64_MAX};
 };
 
+// 5.10.6 Device Operation: header of every packet, on both the RX and TX queues
+#pragma pack(1)
+struct Model::VsockHeader {
+    uint64 src_cid{0};
+    uint64 dst_cid{0};
+    uint32 src_port{0};
+    uint32 dst_port{0};
+    uint32 len{0};
+    uint16 type{0};
+    uint16 op{0};
+    uint32 flags{0};
+    uint32 buf_alloc{0};
+    uint32 fwd_cnt{0};
+};
+#pragma pack()
+
+static_assert(sizeof(Model::VsockHeader) == 44, "virtio_vsock_hdr is 44 bytes long");
+
+enum : uint64 {
+    VIRTIO_VSOCK_HOST_CID = 2,
+};
+
+enum : uint16 {
+    VIRTIO_VSOCK_TYPE_STREAM = 1,
+    VIRTIO_VSOCK_TYPE_SEQPACKET = 2,
+};
+
+enum : uint16 {
+    VIRTIO_VSOCK_OP_INVALID = 0,
+    VIRTIO_VSOCK_OP_REQUEST = 1,
+    VIRTIO_VSOCK_OP_RESPONSE = 2,
+    VIRTIO_VSOCK_OP_RST = 3,
+    VIRTIO_VSOCK_OP_SHUTDOWN = 4,
+    VIRTIO_VSOCK_OP_RW = 5,
+    VIRTIO_VSOCK_OP_CREDIT_UPDATE = 6,
+    VIRTIO_VSOCK_OP_CREDIT_REQUEST = 7,
+};
+
+enum : uint32 {
+    VIRTIO_VSOCK_SHUTDOWN_RCV = (1 << 0),
+    VIRTIO_VSOCK_SHUTDOWN_SEND = (1 << 1),
+};
+
 class Model::VirtioSockCallback {
 public:
     virtual void device_reset() = 0;
@@ -40,7 +90,9 @@ public:
     virtual Errno unmap(const Model::IOMapping &m) = 0;
 };
 
-class Model::VirtioSock : public Virtio::Device {
+// NOTE: [VirtioSock] is a [Virtio::Sg::Buffer::ChainAccessor] so that backends can copy packets
+// from and to the chains directly, through the persistent view of guest memory.
+class Model::VirtioSock : private Model::VirtioSockQueues, public Virtio::GuestMemDevice {
 
 private:
     enum { RX = 0, TX = 1, EVENT = 2 };
@@ -48,6 +100,8 @@ private:
     Model::VirtioSockCallback *_virtio_sock_callback{nullptr};
     VirtioSockConfig _config;
     Platform::Signal *_sig;
+    // Per queue signal, [_sig] is used for the queues that don't have one
+    Platform::Signal *_queue_sig[EVENT + 1]{};
     bool _backend_connected{false};
 
     void notify(uint32) override;
@@ -62,8 +116,9 @@ public:
 
     VirtioSock(IrqController &irq_ctlr, const Vbus::Bus &bus, uint16 const irq, uint16 const queue_entries,
                const UserConfig &config, Platform::Signal *sig)
-        : Virtio::Device("virtio socket", Virtio::DeviceID::SOCKET, bus, irq_ctlr, &_config, sizeof(_config), irq, queue_entries,
-                         config.transport, config.device_features),
+        : Virtio::GuestMemDevice("virtio socket", Virtio::DeviceID::SOCKET, bus, irq_ctlr, &_config,
+                                 sizeof(_config), irq, queue_entries, config.transport, config.device_features,
+                                 static_cast<VirtioSockQueues &>(*this), VirtioSockQueues::NUM),
           _sig(sig) {
         _config.guest_cid = config.cid;
     }
@@ -73,6 +128,18 @@ public:
         _virtio_sock_callback = &virtio_soc_callback;
     }
 
+    /*! \brief Set the signal raised when the guest notifies a given queue
+     *  \param queue Index of the queue
+     *  \param sig Signal to raise, nullptr to fall back to the signal given at construction
+     *  \return false if the queue doesn't exist
+     */
+    bool set_queue_signal(uint16 queue, Platform::Signal *sig) {
+        if (queue > EVENT)
+            return false;
+        _queue_sig[queue] = sig;
+        return true;
+    }
+
     void connect() { _backend_connected = true; }
 
     void disconnect() { _backend_connected = false; }
@@ -91,4 +158,36 @@ public:
     Virtio::QueueData const &queue_data_rx() const { return queue_data(RX); }
     Virtio::QueueData const &queue_data_tx() const { return queue_data(TX); }
     Virtio::QueueData const &queue_data_event() const { return queue_data(EVENT); }
+
+    bool rx_queue_constructed() { return queue(RX).constructed(); }
+    bool tx_queue_constructed() { return queue(TX).constructed(); }
+    Virtio::DeviceQueue &rx_queue() { return device_queue(RX); }
+    Virtio::DeviceQueue &tx_queue() { return device_queue(TX); }
+
+    uint64 guest_cid() const { return _config.guest_cid; }
+
+    GPA translate(uint64 addr, size_t size_bytes) const {
+        if (not use_io_mappings())
+            return GPA(addr);
+
+        return GPA(translate_io(addr, size_bytes));
+    }
+
+    // [Virtio::Queue::AddressTranslator] overrides inherited by [Virtio::Sg::Buffer::ChainAccessor]
+    Errno vq_addr_to_r_hva(uint64 vqa, size_t size_bytes, char *&hva) override { return vq_addr_to_hva(vqa, size_bytes, hva); }
+    Errno vq_addr_to_w_hva(uint64 vqa, size_t size_bytes, char *&hva) override { return vq_addr_to_hva(vqa, size_bytes, hva); }
+
+private:
+    Errno vq_addr_to_hva(uint64 vqa, size_t size_bytes, char *&hva) const {
+        GPA gpa = translate(vqa, size_bytes);
+        if (gpa.invalid())
+            return Errno::PERM;
+
+        char *view = Model::SimpleAS::gpa_to_vmm_view(*_vbus, gpa, size_bytes);
+        if (view == nullptr)
+            return Errno::INVAL;
+
+        hva = view;
+        return Errno::NONE;
+    }
 };
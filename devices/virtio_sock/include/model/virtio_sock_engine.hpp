@@ -0,0 +1,235 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#pragma once
+
+/*! \file Stream sockets of a VirtioSock device, bridged to AF_UNIX sockets of the host
+ */
+
+#include <model/virtio_sg.hpp>
+#include <model/virtio_sock.hpp>
+#include <model/virtqueue.hpp>
+#include <platform/atomic.hpp>
+#include <platform/context.hpp>
+#include <platform/errno.hpp>
+#include <platform/mutex.hpp>
+#include <platform/signal.hpp>
+#include <platform/types.hpp>
+#include <poll.h>
+#include <sys/uio.h>
+
+namespace Model {
+    class VsockEngine;
+}
+
+/*! \brief Serve the stream sockets of a VirtioSock device on the host side
+ *
+ *  The engine implements the virtio-vsock packet protocol for VIRTIO_VSOCK_TYPE_STREAM and
+ *  connects every guest socket to an AF_UNIX stream socket of the host, with the conventions
+ *  used by other VMMs:
+ *  - a guest connecting to port P of the host (CID 2) is connected to the socket listening at
+ *    "<uds_path>_P",
+ *  - a host process connects to the socket listening at "<uds_path>" and writes "CONNECT P\n":
+ *    the guest socket listening on port P is connected to it, and "OK <host port>\n" is written
+ *    back once the guest accepted the connection.
+ *
+ *  Flow control relies on the credit of the protocol: every connection owns a buffer of
+ *  [buf_alloc] bytes holding the data of the guest until the host socket accepts it, and the
+ *  engine never sends more than the free space of the guest buffer. The counters travel with
+ *  every packet. An explicit CREDIT_UPDATE is only sent when the guest asks for it, or when the
+ *  data forwarded since the last advertisement reaches half of the buffer.
+ *
+ *  TX: the chains of the TX queue are drained in batches, the RW packets of a connection are
+ *  coalesced in its buffer and written with a single system call per batch. RX: control packets
+ *  go first, then the readable host sockets are read straight into the chains of the RX queue,
+ *  each chain being filled as much as the credit allows. The chains of a batch are published
+ *  with a single update of the used index and a single interrupt, on both queues.
+ *
+ *  The TX queue is served by run_tx(), waiting for the notifications, the RX queue and the host
+ *  sockets by run_rx(), polling them. The embedder runs both loops from threads it created.
+ *  reset() must be called from VirtioSockCallback::device_reset.
+ */
+class Model::VsockEngine {
+public:
+    struct Config {
+        const char *uds_path{""}; // Path of the host sockets, see above. Empty: no host-initiated connections
+        uint32 buf_alloc{256 * 1024};
+        uint16 max_connections{64};
+        uint16 tx_batch{64}; // Maximum number of TX chains published at once
+        uint16 rx_batch{64}; // Maximum number of RX chains published at once
+    };
+
+    struct Stats {
+        atomic<uint64> tx_packets{0};     // Packets received from the guest
+        atomic<uint64> tx_bytes{0};       // Payload forwarded to the host sockets
+        atomic<uint64> rx_packets{0};     // Packets sent to the guest
+        atomic<uint64> rx_bytes{0};       // Payload read from the host sockets
+        atomic<uint64> credit_updates{0}; // Explicit CREDIT_UPDATE packets
+        atomic<uint64> resets{0};         // Connections reset, on either side
+
+        void reset() {
+            tx_packets = 0;
+            tx_bytes = 0;
+            rx_packets = 0;
+            rx_bytes = 0;
+            credit_updates = 0;
+            resets = 0;
+        }
+    };
+
+    VsockEngine(Model::VirtioSock &dev, const Config &config) : _dev(&dev), _config(config) {}
+    ~VsockEngine();
+
+    VsockEngine(const VsockEngine &) = delete;
+    VsockEngine &operator=(const VsockEngine &) = delete;
+
+    /*! \brief Allocate the connections and the chain buffers, and listen on [uds_path]
+     *  \param ctx Platform context
+     *  \param queue_entries Size of the RX and TX queues
+     *  \return true on success, false otherwise
+     */
+    bool init(const Platform_ctx *ctx, uint16 queue_entries);
+
+    /*! \brief Serve the TX queue until stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created.
+     */
+    void run_tx();
+
+    /*! \brief Serve the RX queue and the host sockets until stop() is called
+     *
+     *  The caller is expected to call this function from a separate thread that it has
+     *  previously created.
+     */
+    void run_rx();
+
+    /*! \brief Make run_tx() and run_rx() return
+     *
+     *  The caller then joins the threads running them, before destroying the object.
+     */
+    void stop();
+
+    /*! \brief Close all the connections and drop the chains in use, to be called on device reset
+     */
+    void reset();
+
+    /*! \brief Number of connections currently open
+     */
+    uint16 connections() const;
+
+    const Stats &stats() const { return _stats; }
+
+private:
+    static constexpr size_t HEADER_SIZE = sizeof(VsockHeader);
+    static constexpr uint16 RX_IOV_MAX = 64;
+    static constexpr uint16 PENDING_RST = 64;
+
+    enum class State : uint8 {
+        FREE,
+        HANDSHAKE,   // Host-initiated, waiting for "CONNECT P\n"
+        CONNECTING,  // Host-initiated, REQUEST sent to the guest
+        ESTABLISHED, // Data flows
+        CLOSING,     // SHUTDOWN sent to the guest, waiting for its RST
+    };
+
+    // Control packets waiting for an RX chain, sent in this order
+    enum : uint8 {
+        SEND_REQUEST = (1 << 0),
+        SEND_RESPONSE = (1 << 1),
+        SEND_CREDIT_UPDATE = (1 << 2),
+        SEND_SHUTDOWN = (1 << 3),
+    };
+
+    struct Connection {
+        State state{State::FREE};
+        int fd{-1};
+        uint32 local_port{0}; // Port of the host side
+        uint32 peer_port{0};  // Port of the guest side
+        uint8 pending{0};     // SEND_* flags
+        bool readable{false}; // Data may be waiting on [fd]
+        uint32 peer_shutdown{0}; // VIRTIO_VSOCK_SHUTDOWN_* flags received from the guest
+
+        // Credit of the guest: we may send [peer_buf_alloc] - ([tx_cnt] - [peer_fwd_cnt]) bytes
+        uint32 peer_buf_alloc{0};
+        uint32 peer_fwd_cnt{0};
+        uint32 tx_cnt{0};
+        // Our credit: bytes of the guest written to [fd], and the value last told to the guest
+        uint32 fwd_cnt{0};
+        uint32 last_fwd_cnt{0};
+
+        // Data of the guest not written to [fd] yet: [buf_len] bytes at [buf_off]
+        char *buf{nullptr};
+        uint32 buf_off{0};
+        uint32 buf_len{0};
+
+        // Handshake of host-initiated connections
+        char line[32]{};
+        uint8 line_len{0};
+    };
+
+    struct Rst {
+        uint32 local_port;
+        uint32 peer_port;
+    };
+
+    bool listen_host();
+    void wake_rx();
+
+    void process_tx();
+    void handle_packet(const Virtio::Sg::Buffer &buf);
+    void handle_request(const VsockHeader &hdr);
+    void handle_rw(Connection &c, const Virtio::Sg::Buffer &buf, uint32 len);
+    void handle_shutdown(Connection &c, uint32 flags);
+    bool flush(Connection &c);
+
+    bool process_rx();
+    Errno send_control(Virtio::DeviceQueue &vq, uint32 local_port, uint32 peer_port, uint16 op, Connection *c);
+    Errno send_data(Virtio::DeviceQueue &vq, Connection &c);
+    void fill_header(VsockHeader &hdr, uint32 local_port, uint32 peer_port, uint16 op, Connection *c) const;
+
+    void accept_host();
+    void handshake(Connection &c);
+    uint16 build_poll_set(bool &busy);
+
+    Connection *find(uint32 local_port, uint32 peer_port);
+    Connection *alloc();
+    void release(Connection &c);
+    void queue_rst(uint32 local_port, uint32 peer_port);
+    void reset_connection(Connection &c);
+    static uint32 peer_credit(const Connection &c) { return c.peer_buf_alloc - (c.tx_cnt - c.peer_fwd_cnt); }
+
+    Model::VirtioSock *_dev;
+    Config _config;
+    int _listen_fd{-1};
+    int _wake_fd{-1};
+
+    Platform::Signal _sig;
+    mutable Platform::Mutex _lock;
+
+    Connection *_conns{nullptr};
+    Rst _rst[PENDING_RST]{};
+    uint16 _rst_count{0};
+    uint32 _next_port{1u << 30};
+    // The RX queue ran out of chains, the host sockets are not polled for input until the guest
+    // posts new ones
+    bool _rx_starved{false};
+    // The TX thread changed something the RX thread must look at
+    bool _rx_dirty{false};
+
+    Virtio::Sg::Buffer *_tx_buf{nullptr};
+    Virtio::Sg::Buffer *_rx_buf{nullptr};
+    iovec _rx_iov[RX_IOV_MAX];
+
+    pollfd *_fds{nullptr};
+    uint16 *_fd_conn{nullptr};
+
+    atomic<bool> _stop{false};
+
+    Stats _stats;
+};
@@ -14,10 +14,14 @@
 #include <platform/types.hpp>
 
 void
-Model::VirtioSock::notify(uint32 const) {
-    if (_backend_connected) {
+Model::VirtioSock::notify(uint32 const queue) {
+    if (!_backend_connected)
+        return;
+
+    if (queue <= EVENT && _queue_sig[queue] != nullptr)
+        _queue_sig[queue]->sig();
+    else
         _sig->sig();
-    }
 }
 
 void
@@ -0,0 +1,872 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <model/virtio_sock_engine.hpp>
+#include <platform/bits.hpp>
+#include <platform/compiler.hpp>
+#include <platform/log.hpp>
+#include <platform/new.hpp>
+#include <platform/string.hpp>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Slot of [_fds] that is not a connection: the wake-up eventfd or the listening socket
+static constexpr uint16 NO_CONN = 0xffff;
+
+// Path of the socket of the host for the port [port], or of the listening socket if [port] is 0
+static bool
+host_address(const char *uds_path, uint32 port, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    int len;
+    if (port == 0)
+        len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", uds_path);
+    else
+        len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", uds_path, port);
+
+    return len > 0 && static_cast<size_t>(len) < sizeof(addr.sun_path);
+}
+
+// Parse "CONNECT <port>", the first line written by host processes
+static bool
+parse_connect(const char *line, uint32 &port) {
+    static const char CMD[] = "CONNECT ";
+
+    if (strncmp(line, CMD, sizeof(CMD) - 1) != 0)
+        return false;
+
+    uint64 value = 0;
+    const char *p = line + sizeof(CMD) - 1;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        value = value * 10 + static_cast<uint64>(*p - '0');
+        if (value > UINT32_MAX)
+            return false;
+    }
+
+    if (p == line + sizeof(CMD) - 1 || (*p != '\n' && *p != '\r'))
+        return false;
+
+    port = static_cast<uint32>(value);
+    return true;
+}
+
+Model::VsockEngine::~VsockEngine() {
+    _dev->set_queue_signal(0, nullptr);
+    _dev->set_queue_signal(1, nullptr);
+
+    if (_conns != nullptr) {
+        for (uint16 i = 0; i < _config.max_connections; i++) {
+            release(_conns[i]);
+            delete[] _conns[i].buf;
+        }
+    }
+    delete[] _conns;
+    delete[] _fds;
+    delete[] _fd_conn;
+
+    if (_tx_buf != nullptr)
+        _tx_buf->deinit();
+    delete _tx_buf;
+    if (_rx_buf != nullptr)
+        _rx_buf->deinit();
+    delete _rx_buf;
+
+    if (_listen_fd >= 0) {
+        close(_listen_fd);
+        unlink(_config.uds_path);
+    }
+    if (_wake_fd >= 0)
+        close(_wake_fd);
+}
+
+bool
+Model::VsockEngine::listen_host() {
+    sockaddr_un addr;
+    if (!host_address(_config.uds_path, 0, addr)) {
+        WARN("virtio sock: socket path too long '%s'", _config.uds_path);
+        return false;
+    }
+
+    _listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_listen_fd < 0)
+        return false;
+
+    unlink(addr.sun_path); // In case there was a socket left behind
+    if (bind(_listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0 || listen(_listen_fd, 16) != 0) {
+        WARN("virtio sock: cannot listen on '%s' (%d)", addr.sun_path, errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+Model::VsockEngine::init(const Platform_ctx *ctx, uint16 queue_entries) {
+    if (queue_entries == 0 || _config.max_connections == 0 || _config.max_connections >= NO_CONN || _config.buf_alloc == 0
+        || _config.tx_batch == 0 || _config.rx_batch == 0)
+        return false;
+
+    if (!_sig.init(ctx) || !_lock.init(ctx))
+        return false;
+
+    uint16 max_fds = static_cast<uint16>(_config.max_connections + 2);
+    _conns = new (nothrow) Connection[_config.max_connections];
+    _fds = new (nothrow) pollfd[max_fds];
+    _fd_conn = new (nothrow) uint16[max_fds];
+    _tx_buf = new (nothrow) Virtio::Sg::Buffer(queue_entries);
+    _rx_buf = new (nothrow) Virtio::Sg::Buffer(queue_entries);
+    if (_conns == nullptr || _fds == nullptr || _fd_conn == nullptr || _tx_buf == nullptr || _rx_buf == nullptr)
+        return false;
+    if (_tx_buf->init() != Errno::NONE || _rx_buf->init() != Errno::NONE)
+        return false;
+
+    _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_wake_fd < 0)
+        return false;
+
+    if (_config.uds_path[0] != '\0' && !listen_host())
+        return false;
+
+    // Notifications of both queues wake up the TX thread, which hands over to the RX thread
+    _dev->set_queue_signal(0, &_sig);
+    _dev->set_queue_signal(1, &_sig);
+    return true;
+}
+
+void
+Model::VsockEngine::stop() {
+    _stop = true;
+    wake_rx();
+    _sig.sig();
+}
+
+void
+Model::VsockEngine::reset() {
+    Platform::MutexGuard guard{_lock};
+
+    for (uint16 i = 0; i < _config.max_connections; i++)
+        release(_conns[i]);
+
+    _rst_count = 0;
+    _rx_starved = false;
+    _tx_buf->reset();
+    _rx_buf->reset();
+}
+
+uint16
+Model::VsockEngine::connections() const {
+    Platform::MutexGuard guard{_lock};
+    uint16 count = 0;
+
+    for (uint16 i = 0; i < _config.max_connections; i++) {
+        if (_conns[i].state != State::FREE)
+            count++;
+    }
+
+    return count;
+}
+
+void
+Model::VsockEngine::wake_rx() {
+    uint64 one = 1;
+    if (_wake_fd >= 0 && write(_wake_fd, &one, sizeof(one)) != sizeof(one))
+        WARN("virtio sock: cannot wake up the RX loop");
+}
+
+void
+Model::VsockEngine::run_tx() {
+    while (!_stop) {
+        _sig.wait();
+        if (_stop)
+            return;
+
+        process_tx();
+
+        // New control packets, connections or credit, or new RX chains for a starved RX queue
+        Platform::MutexGuard guard{_lock};
+        if (_rx_dirty || _rx_starved) {
+            _rx_dirty = false;
+            wake_rx();
+        }
+    }
+}
+
+Model::VsockEngine::Connection *
+Model::VsockEngine::find(uint32 local_port, uint32 peer_port) {
+    for (uint16 i = 0; i < _config.max_connections; i++) {
+        Connection &c = _conns[i];
+        if (c.state != State::FREE && c.state != State::HANDSHAKE && c.local_port == local_port && c.peer_port == peer_port)
+            return &c;
+    }
+
+    return nullptr;
+}
+
+Model::VsockEngine::Connection *
+Model::VsockEngine::alloc() {
+    for (uint16 i = 0; i < _config.max_connections; i++) {
+        Connection &c = _conns[i];
+        if (c.state != State::FREE)
+            continue;
+
+        // The buffer is kept when the connection is released
+        if (c.buf == nullptr)
+            c.buf = new (nothrow) char[_config.buf_alloc];
+        return c.buf != nullptr ? &c : nullptr;
+    }
+
+    return nullptr;
+}
+
+void
+Model::VsockEngine::release(Connection &c) {
+    if (c.fd >= 0)
+        close(c.fd);
+
+    char *buf = c.buf;
+    c = Connection();
+    c.buf = buf;
+}
+
+void
+Model::VsockEngine::queue_rst(uint32 local_port, uint32 peer_port) {
+    // Out of room: the guest eventually times out on its own
+    if (_rst_count == PENDING_RST)
+        return;
+
+    _rst[_rst_count++] = Rst{local_port, peer_port};
+    _rx_dirty = true;
+}
+
+void
+Model::VsockEngine::reset_connection(Connection &c) {
+    queue_rst(c.local_port, c.peer_port);
+    release(c);
+    _stats.resets++;
+}
+
+/*
+ * Write the data of the guest held by [c] to the host socket. Returns false if the connection
+ * was reset.
+ */
+bool
+Model::VsockEngine::flush(Connection &c) {
+    while (c.buf_len > 0) {
+        ssize_t n = send(c.fd, c.buf + c.buf_off, c.buf_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                // The RX thread waits for the socket to be writable
+                _rx_dirty = true;
+                break;
+            }
+
+            reset_connection(c);
+            return false;
+        }
+
+        c.buf_off += static_cast<uint32>(n);
+        c.buf_len -= static_cast<uint32>(n);
+        c.fwd_cnt += static_cast<uint32>(n);
+        _stats.tx_bytes += static_cast<uint64>(n);
+    }
+
+    if (c.buf_len == 0) {
+        c.buf_off = 0;
+        if ((c.peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND) != 0)
+            shutdown(c.fd, SHUT_WR);
+    }
+
+    // Credit updates are suppressed until the guest could be running short of credit. The
+    // counter also travels with every packet sent to the guest.
+    if (c.fwd_cnt - c.last_fwd_cnt >= _config.buf_alloc / 2) {
+        c.pending |= SEND_CREDIT_UPDATE;
+        _rx_dirty = true;
+    }
+
+    return true;
+}
+
+void
+Model::VsockEngine::handle_request(const VsockHeader &hdr) {
+    sockaddr_un addr;
+    Connection *c = alloc();
+
+    if (c == nullptr || _config.uds_path[0] == '\0' || !host_address(_config.uds_path, hdr.dst_port, addr)) {
+        queue_rst(hdr.dst_port, hdr.src_port);
+        return;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+        if (fd >= 0)
+            close(fd);
+        queue_rst(hdr.dst_port, hdr.src_port);
+        return;
+    }
+
+    c->fd = fd;
+    c->state = State::ESTABLISHED;
+    c->local_port = hdr.dst_port;
+    c->peer_port = hdr.src_port;
+    c->peer_buf_alloc = hdr.buf_alloc;
+    c->peer_fwd_cnt = hdr.fwd_cnt;
+    c->pending = SEND_RESPONSE;
+    c->readable = true;
+    _rx_dirty = true;
+}
+
+void
+Model::VsockEngine::handle_rw(Connection &c, const Virtio::Sg::Buffer &buf, uint32 len) {
+    if (len == 0)
+        return;
+
+    // A guest that ignores the credit cannot expect the connection to keep working
+    if (len > buf.size_bytes() - HEADER_SIZE || len > _config.buf_alloc - c.buf_len) {
+        WARN("virtio sock: guest overran the credit of port %u, resetting", c.local_port);
+        reset_connection(c);
+        return;
+    }
+
+    if (c.buf_off + c.buf_len + len > _config.buf_alloc) {
+        memmove(c.buf, c.buf + c.buf_off, c.buf_len);
+        c.buf_off = 0;
+    }
+
+    size_t size = len;
+    if (buf.copy_to_linear(c.buf + c.buf_off + c.buf_len, *_dev, size, HEADER_SIZE) != Errno::NONE) {
+        reset_connection(c);
+        return;
+    }
+
+    c.buf_len += len;
+}
+
+void
+Model::VsockEngine::handle_shutdown(Connection &c, uint32 flags) {
+    c.peer_shutdown |= flags & (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND);
+
+    if ((c.peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_SEND) != 0 && c.buf_len == 0)
+        shutdown(c.fd, SHUT_WR);
+
+    // Fully shut down: the data still buffered is written if the host socket takes it at once,
+    // and the guest expects a RST to release its socket.
+    if (c.peer_shutdown == (VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND)) {
+        if (flush(c))
+            reset_connection(c);
+    }
+}
+
+void
+Model::VsockEngine::handle_packet(const Virtio::Sg::Buffer &buf) {
+    VsockHeader hdr;
+    size_t size = HEADER_SIZE;
+
+    if (buf.size_bytes() < HEADER_SIZE || buf.copy_to_linear(&hdr, *_dev, size) != Errno::NONE)
+        return;
+
+    _stats.tx_packets++;
+
+    // Not for us
+    if (hdr.src_cid != _dev->guest_cid() || hdr.dst_cid != VIRTIO_VSOCK_HOST_CID)
+        return;
+
+    if (hdr.type != VIRTIO_VSOCK_TYPE_STREAM) {
+        if (hdr.op != VIRTIO_VSOCK_OP_RST)
+            queue_rst(hdr.dst_port, hdr.src_port);
+        return;
+    }
+
+    Connection *c = find(hdr.dst_port, hdr.src_port);
+    if (hdr.op == VIRTIO_VSOCK_OP_REQUEST) {
+        if (c != nullptr)
+            reset_connection(*c);
+        else
+            handle_request(hdr);
+        return;
+    }
+
+    if (c == nullptr) {
+        if (hdr.op != VIRTIO_VSOCK_OP_RST)
+            queue_rst(hdr.dst_port, hdr.src_port);
+        return;
+    }
+
+    // Every packet carries the credit of the guest
+    bool stalled = peer_credit(*c) == 0;
+    c->peer_buf_alloc = hdr.buf_alloc;
+    c->peer_fwd_cnt = hdr.fwd_cnt;
+    if (stalled && peer_credit(*c) != 0)
+        _rx_dirty = true;
+
+    switch (hdr.op) {
+    case VIRTIO_VSOCK_OP_RESPONSE: {
+        if (c->state != State::CONNECTING) {
+            reset_connection(*c);
+            break;
+        }
+
+        char reply[32];
+        int len = snprintf(reply, sizeof(reply), "OK %u\n", c->local_port);
+        if (send(c->fd, reply, static_cast<size_t>(len), MSG_NOSIGNAL) != len) {
+            reset_connection(*c);
+            break;
+        }
+
+        c->state = State::ESTABLISHED;
+        c->readable = true;
+        _rx_dirty = true;
+        break;
+    }
+    case VIRTIO_VSOCK_OP_RW:
+        // Late data of a connection being closed is dropped
+        if (c->state == State::ESTABLISHED)
+            handle_rw(*c, buf, hdr.len);
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_UPDATE:
+        break;
+    case VIRTIO_VSOCK_OP_CREDIT_REQUEST:
+        c->pending |= SEND_CREDIT_UPDATE;
+        _rx_dirty = true;
+        break;
+    case VIRTIO_VSOCK_OP_SHUTDOWN:
+        handle_shutdown(*c, hdr.flags);
+        break;
+    case VIRTIO_VSOCK_OP_RST:
+        release(*c);
+        _stats.resets++;
+        break;
+    default:
+        reset_connection(*c);
+        break;
+    }
+}
+
+void
+Model::VsockEngine::process_tx() {
+    Platform::MutexGuard guard{_lock};
+
+    if (!_dev->tx_queue_constructed())
+        return;
+
+    Virtio::DeviceQueue &vq = _dev->tx_queue();
+    bool empty = false;
+
+    while (!empty) {
+        uint16 received = 0;
+
+        vq.begin_batch();
+        while (received < _config.tx_batch) {
+            if (_tx_buf->walk_chain(vq) != Errno::NONE) {
+                empty = true;
+                break;
+            }
+
+            handle_packet(*_tx_buf);
+            _tx_buf->conclude_chain_use(vq);
+            received++;
+        }
+        vq.end_batch();
+
+        // The RW packets of the batch are written with one system call per connection
+        for (uint16 i = 0; i < _config.max_connections; i++) {
+            Connection &c = _conns[i];
+            if (c.state == State::ESTABLISHED && c.buf_len > 0)
+                flush(c);
+        }
+
+        if (received > 0)
+            _dev->signal();
+    }
+}
+
+void
+Model::VsockEngine::fill_header(VsockHeader &hdr, uint32 local_port, uint32 peer_port, uint16 op, Connection *c) const {
+    hdr = VsockHeader();
+    hdr.src_cid = VIRTIO_VSOCK_HOST_CID;
+    hdr.dst_cid = _dev->guest_cid();
+    hdr.src_port = local_port;
+    hdr.dst_port = peer_port;
+    hdr.type = VIRTIO_VSOCK_TYPE_STREAM;
+    hdr.op = op;
+    hdr.buf_alloc = _config.buf_alloc;
+
+    if (c != nullptr) {
+        hdr.fwd_cnt = c->fwd_cnt;
+        // The guest now knows about all the data forwarded so far
+        c->last_fwd_cnt = c->fwd_cnt;
+        c->pending &= static_cast<uint8>(~SEND_CREDIT_UPDATE);
+    }
+}
+
+Errno
+Model::VsockEngine::send_control(Virtio::DeviceQueue &vq, uint32 local_port, uint32 peer_port, uint16 op, Connection *c) {
+    Errno err = _rx_buf->walk_chain(vq);
+    if (err != Errno::NONE) {
+        // Malformed chain: it is not returned, the packet is lost
+        _rx_buf->reset();
+        return err;
+    }
+
+    if (_rx_buf->size_bytes() < HEADER_SIZE) {
+        _rx_buf->conclude_chain_use(vq);
+        return Errno::INVAL;
+    }
+
+    VsockHeader hdr;
+    fill_header(hdr, local_port, peer_port, op, c);
+    if (op == VIRTIO_VSOCK_OP_SHUTDOWN)
+        hdr.flags = VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND;
+
+    size_t size = HEADER_SIZE;
+    err = _rx_buf->copy_from_linear(&hdr, *_dev, size);
+    _rx_buf->conclude_chain_use(vq);
+
+    if (err == Errno::NONE) {
+        _stats.rx_packets++;
+        if (op == VIRTIO_VSOCK_OP_CREDIT_UPDATE)
+            _stats.credit_updates++;
+    }
+    return err;
+}
+
+/*
+ * Read the host socket of [c] straight into the next RX chain, after the header, as much as the
+ * chain and the credit of the guest allow. Returns AGAIN if there was nothing to read, the chain
+ * is then handed back.
+ */
+Errno
+Model::VsockEngine::send_data(Virtio::DeviceQueue &vq, Connection &c) {
+    Errno err = _rx_buf->walk_chain(vq);
+    if (err != Errno::NONE) {
+        _rx_buf->reset();
+        return err;
+    }
+
+    if (_rx_buf->size_bytes() <= HEADER_SIZE || _rx_buf->is_readable()) {
+        _rx_buf->conclude_chain_use(vq);
+        return Errno::INVAL;
+    }
+
+    size_t max = min(_rx_buf->size_bytes() - HEADER_SIZE, static_cast<size_t>(peer_credit(c)));
+    size_t room = 0;
+    size_t off = 0;
+    uint16 iov_cnt = 0;
+
+    for (auto it = _rx_buf->begin(); it != _rx_buf->end() && iov_cnt < RX_IOV_MAX && room < max; ++it) {
+        const Virtio::Sg::LinearizedDesc &desc = it.desc_ref();
+        size_t skip = off < HEADER_SIZE ? min(HEADER_SIZE - off, static_cast<size_t>(desc.length)) : 0;
+        off += desc.length;
+        if (skip == desc.length)
+            continue;
+
+        size_t len = min(desc.length - skip, max - room);
+        char *hva = nullptr;
+        if (_dev->vq_addr_to_w_hva(desc.address + skip, len, hva) != Errno::NONE) {
+            _rx_buf->conclude_chain_use(vq);
+            return Errno::INVAL;
+        }
+
+        _rx_iov[iov_cnt].iov_base = hva;
+        _rx_iov[iov_cnt].iov_len = len;
+        iov_cnt++;
+        room += len;
+    }
+
+    ssize_t n = readv(c.fd, _rx_iov, iov_cnt);
+    if (n <= 0) {
+        _rx_buf->reset();
+        vq.unpop(1);
+        c.readable = false;
+
+        if (n == 0) {
+            // The host closed the connection: the guest answers the SHUTDOWN with a RST
+            c.state = State::CLOSING;
+            c.pending |= SEND_SHUTDOWN;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            reset_connection(c);
+        }
+        return Errno::AGAIN;
+    }
+
+    VsockHeader hdr;
+    fill_header(hdr, c.local_port, c.peer_port, VIRTIO_VSOCK_OP_RW, &c);
+    hdr.len = static_cast<uint32>(n);
+
+    size_t size = HEADER_SIZE;
+    err = _rx_buf->copy_from_linear(&hdr, *_dev, size);
+    if (err == Errno::NONE)
+        err = _rx_buf->record_written_bytes(*_dev, HEADER_SIZE, static_cast<size_t>(n));
+    _rx_buf->conclude_chain_use(vq);
+
+    // The data is gone either way, the guest has to be told about it
+    c.tx_cnt += static_cast<uint32>(n);
+    if (static_cast<size_t>(n) < room)
+        c.readable = false;
+
+    if (err != Errno::NONE) {
+        reset_connection(c);
+        return err;
+    }
+
+    _stats.rx_packets++;
+    _stats.rx_bytes += static_cast<uint64>(n);
+    return Errno::NONE;
+}
+
+/*
+ * Fill the RX queue: RSTs of the connections that are gone, the control packets of the open
+ * connections, then the data of the readable host sockets, one chain per connection and per
+ * round. Returns false if the guest ran out of buffers.
+ */
+bool
+Model::VsockEngine::process_rx() {
+    if (!_dev->rx_queue_constructed())
+        return false;
+
+    static constexpr uint16 OPS[] = {VIRTIO_VSOCK_OP_REQUEST, VIRTIO_VSOCK_OP_RESPONSE, VIRTIO_VSOCK_OP_CREDIT_UPDATE,
+                                     VIRTIO_VSOCK_OP_SHUTDOWN};
+
+    Virtio::DeviceQueue &vq = _dev->rx_queue();
+    uint16 sent = 0;
+    Errno err = Errno::NONE;
+
+    vq.begin_batch();
+
+    uint16 rst = 0;
+    while (rst < _rst_count && sent < _config.rx_batch) {
+        err = send_control(vq, _rst[rst].local_port, _rst[rst].peer_port, VIRTIO_VSOCK_OP_RST, nullptr);
+        if (err == Errno::NOENT)
+            break;
+        sent++; // The chain is consumed either way, a malformed one does not take the RST with it
+        if (err == Errno::NONE)
+            rst++;
+    }
+    memmove(_rst, _rst + rst, (_rst_count - rst) * sizeof(Rst));
+    _rst_count = static_cast<uint16>(_rst_count - rst);
+
+    for (uint16 i = 0; i < _config.max_connections && err != Errno::NOENT && sent < _config.rx_batch; i++) {
+        Connection &c = _conns[i];
+
+        uint8 bit = 0;
+        while (bit < ARRAY_LENGTH(OPS) && c.pending != 0 && sent < _config.rx_batch) {
+            if ((c.pending & (1 << bit)) == 0) {
+                bit++;
+                continue;
+            }
+
+            err = send_control(vq, c.local_port, c.peer_port, OPS[bit], &c);
+            if (err == Errno::NOENT)
+                break;
+            sent++;
+
+            // The bit only goes once the packet is queued, a malformed chain is consumed and the next one is tried
+            if (err != Errno::NONE) {
+                c.pending |= static_cast<uint8>(1 << bit); // fill_header() may have cleared SEND_CREDIT_UPDATE
+                continue;
+            }
+            c.pending &= static_cast<uint8>(~(1 << bit));
+            bit++;
+        }
+    }
+
+    bool progress = true;
+    while (progress && err != Errno::NOENT && sent < _config.rx_batch) {
+        progress = false;
+
+        for (uint16 i = 0; i < _config.max_connections && sent < _config.rx_batch; i++) {
+            Connection &c = _conns[i];
+            if (c.state != State::ESTABLISHED || !c.readable || (c.peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_RCV) != 0
+                || peer_credit(c) == 0)
+                continue;
+
+            err = send_data(vq, c);
+            if (err == Errno::NOENT)
+                break;
+            if (err == Errno::NONE) {
+                sent++;
+                progress = true;
+            }
+        }
+    }
+
+    vq.end_batch();
+
+    if (sent > 0)
+        _dev->signal();
+
+    return err != Errno::NOENT;
+}
+
+void
+Model::VsockEngine::accept_host() {
+    int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    Connection *c = alloc();
+    if (c == nullptr) {
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->state = State::HANDSHAKE;
+}
+
+/*
+ * Read the "CONNECT <port>\n" line of a host-initiated connection, one byte at a time so that
+ * the data following it stays in the socket.
+ */
+void
+Model::VsockEngine::handshake(Connection &c) {
+    while (true) {
+        ssize_t n = read(c.fd, c.line + c.line_len, 1);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (n <= 0) {
+            release(c);
+            return;
+        }
+
+        if (c.line[c.line_len++] == '\n')
+            break;
+        if (c.line_len == sizeof(c.line) - 1) {
+            release(c);
+            return;
+        }
+    }
+
+    uint32 port;
+    c.line[c.line_len] = '\0';
+    if (!parse_connect(c.line, port)) {
+        release(c);
+        return;
+    }
+
+    do {
+        c.local_port = _next_port++;
+        if (_next_port == 0)
+            _next_port = 1u << 30;
+    } while (find(c.local_port, port) != nullptr);
+
+    c.peer_port = port;
+    c.state = State::CONNECTING;
+    c.pending = SEND_REQUEST;
+}
+
+/*
+ * Poll set of the RX thread. [busy] is set if there is work to do right away: control packets
+ * or readable sockets that the last round could not serve.
+ */
+uint16
+Model::VsockEngine::build_poll_set(bool &busy) {
+    uint16 n = 0;
+
+    _rx_dirty = false;
+    busy = false;
+
+    _fds[n] = pollfd{_wake_fd, POLLIN, 0};
+    _fd_conn[n++] = NO_CONN;
+    if (_listen_fd >= 0) {
+        _fds[n] = pollfd{_listen_fd, POLLIN, 0};
+        _fd_conn[n++] = NO_CONN;
+    }
+
+    for (uint16 i = 0; i < _config.max_connections; i++) {
+        const Connection &c = _conns[i];
+        short events = 0;
+
+        if (c.state == State::FREE)
+            continue;
+
+        if (c.state == State::HANDSHAKE) {
+            events = POLLIN;
+        } else if (c.state == State::ESTABLISHED && !_rx_starved && (c.peer_shutdown & VIRTIO_VSOCK_SHUTDOWN_RCV) == 0
+                   && peer_credit(c) != 0) {
+            if (c.readable)
+                busy = true;
+            else
+                events = POLLIN;
+        }
+
+        if (c.buf_len > 0)
+            events |= POLLOUT;
+        if (c.pending != 0 && !_rx_starved)
+            busy = true;
+
+        if (events != 0) {
+            _fds[n] = pollfd{c.fd, events, 0};
+            _fd_conn[n++] = i;
+        }
+    }
+
+    if (_rst_count > 0 && !_rx_starved)
+        busy = true;
+
+    return n;
+}
+
+void
+Model::VsockEngine::run_rx() {
+    while (!_stop) {
+        uint16 nfds;
+        bool busy;
+        {
+            Platform::MutexGuard guard{_lock};
+            nfds = build_poll_set(busy);
+        }
+
+        if (poll(_fds, nfds, busy ? 0 : -1) < 0 && errno != EINTR)
+            return;
+        if (_stop)
+            return;
+
+        Platform::MutexGuard guard{_lock};
+
+        if ((_fds[0].revents & POLLIN) != 0) {
+            uint64 count;
+            if (read(_wake_fd, &count, sizeof(count)) == sizeof(count))
+                _rx_starved = false;
+        }
+
+        for (uint16 i = 1; i < nfds; i++) {
+            if (_fds[i].revents == 0)
+                continue;
+
+            if (_fd_conn[i] == NO_CONN) {
+                accept_host();
+                continue;
+            }
+
+            // The connection may have been released, and the slot reused, by the TX thread
+            Connection &c = _conns[_fd_conn[i]];
+            if (c.state == State::FREE || c.fd != _fds[i].fd)
+                continue;
+
+            if (c.state == State::HANDSHAKE) {
+                handshake(c);
+                continue;
+            }
+
+            if ((_fds[i].revents & POLLOUT) != 0 && !flush(c))
+                continue;
+            if ((_fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+                c.readable = true;
+        }
+
+        if (!process_rx())
+            _rx_starved = true;
+    }
+}
@@ -0,0 +1,13 @@
+# vmm libs - devices
+LIBS += vbus simple_as
+
+# vmm libs - config
+LIBS += vmm_debug
+
+# vmm libs - platform
+LIBS += $(PLATFORM)
+
+# vmm libs - arch
+LIBS += arch_api
+
+$(eval $(call dep_hook,simple_as_posix,$(LIBS)))
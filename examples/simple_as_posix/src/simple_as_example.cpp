@@ -0,0 +1,402 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <cstring>
+#include <model/dirty_log.hpp>
+#include <model/guest_mem_view.hpp>
+#include <model/lazy_restore.hpp>
+#include <model/simple_as.hpp>
+#include <platform/log.hpp>
+#include <platform/memory.hpp>
+#include <platform/numa.hpp>
+#include <platform/types.hpp>
+#include <thread>
+#include <unistd.h>
+#include <vbus/vbus.hpp>
+
+/*
+ * The guest memory model on its own, without vCPU or device: two address spaces backed by memory
+ * files sit next to each other on a bus, and the accesses of the device models go through the
+ * bus as they would in a VMM.
+ *
+ * A write spanning both address spaces must land in both, and a write running past the second
+ * one must not write anything.
+ *
+ * An address space backed by 2 MiB pages of hugetlbfs serves the same accesses, when the host has
+ * such pages in its pool.
+ *
+ * The first address space is placed on the last NUMA node of the host, which the bus reports for
+ * its addresses only.
+ *
+ * The writes through the bus must mark the pages they touch in the dirty log of each address
+ * space, and only those. The writes through the VMM view, as a vCPU makes them, are logged when
+ * the host tracks them.
+ *
+ * The content of the first address space is captured to a file, the base image of a
+ * copy-on-write address space. Once written, the clone is restored: it must read as the base
+ * image again, and its dirty log must report every page.
+ *
+ * A fresh address space is then restored lazily from a capture, with userfaultfd when the host
+ * lets us use it: the pages read before the background restore are served on demand, in the
+ * order of the accesses, and the content must match the capture once all are restored.
+ *
+ * Last, a GuestMemView on the second address space serves accesses until the AS is unregistered
+ * from the bus: the view is invalidated, its owner called back, and the accesses refused.
+ */
+
+static const uint64 GUEST_BASE = 0x10000000;
+static const size_t AS_SIZE = 0x400000; // Two 2 MiB huge pages
+static const size_t PAGE = 0x1000;
+static const uint64 HUGE_BASE = GUEST_BASE + 2 * AS_SIZE;
+static const uint64 CLONE_BASE = GUEST_BASE + 3 * AS_SIZE;
+static const uint64 LAZY_BASE = GUEST_BASE + 4 * AS_SIZE;
+
+/*
+ * An address space of the guest and the memory file behind it, which it owns. The AS is
+ * registered on the bus by init() and until the object is destroyed or unregister() is called.
+ * With [cow], the file is the base image of a copy-on-write AS.
+ */
+class Guest_ram {
+public:
+    Guest_ram(Vbus::Bus &bus, uint64 base, int fd, Platform::Mem::HugePages huge = Platform::Mem::HugePages::NONE,
+              bool cow = false)
+        : _bus(&bus), _base(base), _fd(fd), _as(Range<mword>{base, AS_SIZE}, descr(fd, huge, cow), Platform::Mem::Cred{}) {}
+
+    ~Guest_ram() {
+        unregister();
+        _as.destruct();
+        if (_fd >= 0)
+            close(_fd);
+    }
+
+    bool init() {
+        if (_fd < 0 || !_as.map_host())
+            return false;
+
+        _registered = _bus->register_device(&_as, _base, AS_SIZE);
+        return _registered;
+    }
+
+    void unregister() {
+        if (_registered)
+            _bus->unregister_device(_base, AS_SIZE);
+        _registered = false;
+    }
+
+    Model::SimpleAS &as() { return _as; }
+    char *hva(uint64 off) const { return _as.get_vmm_view() + off; }
+
+private:
+    static Platform::Mem::MemDescr descr(int fd, Platform::Mem::HugePages huge, bool cow) {
+        Platform::Mem::MemSel sel = static_cast<Platform::Mem::MemSel>(fd);
+        return cow ? Platform::Mem::MemDescr::cow(sel, huge) : Platform::Mem::MemDescr(sel, huge);
+    }
+
+    Vbus::Bus *_bus;
+    uint64 _base;
+    int _fd;
+    Model::SimpleAS _as;
+    bool _registered{false};
+};
+
+static int
+open_ram(const char *name, Platform::Mem::HugePages huge = Platform::Mem::HugePages::NONE) {
+    return Platform::Mem::create_mem(name, AS_SIZE, huge);
+}
+
+static void
+fill(char *buf, size_t size, uint8 seed) {
+    for (size_t i = 0; i < size; i++)
+        buf[i] = static_cast<char>(i * 31 + seed);
+}
+
+static bool
+check_fill(const char *buf, size_t size, uint8 seed) {
+    for (size_t i = 0; i < size; i++) {
+        if (buf[i] != static_cast<char>(i * 31 + seed))
+            return false;
+    }
+    return true;
+}
+
+// Two pages across the boundary of the address spaces, then one page past the end of the second
+static void
+check_split_write(const Vbus::Bus &bus, const Guest_ram &ram0, const Guest_ram &ram1) {
+    static char buf[2 * PAGE];
+    static char back[2 * PAGE];
+    const GPA boundary(GUEST_BASE + AS_SIZE);
+
+    fill(buf, sizeof(buf), 1);
+    Errno err = Model::SimpleAS::write_bus(bus, GPA(boundary.get_value() - PAGE), buf, sizeof(buf));
+    ASSERT(err == Errno::NONE);
+    ASSERT(memcmp(ram0.hva(AS_SIZE - PAGE), buf, PAGE) == 0);
+    ASSERT(memcmp(ram1.hva(0), buf + PAGE, PAGE) == 0);
+
+    err = Model::SimpleAS::read_bus(bus, GPA(boundary.get_value() - PAGE), back, sizeof(back));
+    ASSERT(err == Errno::NONE && memcmp(back, buf, sizeof(buf)) == 0);
+
+    // Nothing holds the second page: the first one must not be written either
+    fill(buf, sizeof(buf), 2);
+    err = Model::SimpleAS::write_bus(bus, GPA(boundary.get_value() + AS_SIZE - PAGE), buf, sizeof(buf));
+    ASSERT(err != Errno::NONE);
+    ASSERT(!check_fill(ram1.hva(AS_SIZE - PAGE), PAGE, 2));
+
+    INFO("Split write across two address spaces checked");
+}
+
+// Accesses through the bus to an AS backed by huge pages, skipped if the pool has none
+static void
+check_hugetlb(Vbus::Bus &bus) {
+    static char buf[2 * PAGE];
+    static char back[2 * PAGE];
+    const uint64 base = HUGE_BASE;
+
+    Guest_ram ram(bus, base, open_ram("vml-simple-as-huge", Platform::Mem::HugePages::HUGETLB_2M),
+                  Platform::Mem::HugePages::HUGETLB_2M);
+    if (!ram.init()) {
+        INFO("No 2 MiB pages of hugetlbfs available, skipping the huge page check");
+        return;
+    }
+    ASSERT(ram.as().page_size() == Platform::Mem::HUGE_PAGE_2M);
+
+    // Across the boundary of the huge pages
+    const GPA gpa(base + Platform::Mem::HUGE_PAGE_2M - PAGE);
+    fill(buf, sizeof(buf), 3);
+    Errno err = Model::SimpleAS::write_bus(bus, gpa, buf, sizeof(buf));
+    ASSERT(err == Errno::NONE);
+    ASSERT(memcmp(ram.hva(Platform::Mem::HUGE_PAGE_2M - PAGE), buf, sizeof(buf)) == 0);
+
+    err = Model::SimpleAS::read_bus(bus, gpa, back, sizeof(back));
+    ASSERT(err == Errno::NONE && memcmp(back, buf, sizeof(buf)) == 0);
+
+    INFO("Address space backed by 2 MiB pages checked");
+}
+
+// Placement of [ram0] on a NUMA node, skipped if the host cannot bind memory
+static void
+check_numa(const Vbus::Bus &bus, Guest_ram &ram0) {
+    const uint16 nodes = Platform::Numa::node_count();
+    const uint16 node = static_cast<uint16>(nodes - 1);
+
+    ASSERT(ram0.as().numa_node() == Model::SimpleAS::NO_NUMA_NODE);
+    ASSERT(!ram0.as().set_numa_node(nodes));
+
+    fill(ram0.hva(0), PAGE, 4);
+    if (!ram0.as().set_numa_node(node)) {
+        INFO("Cannot bind memory to NUMA node %u, skipping the NUMA check", node);
+        return;
+    }
+
+    // The pages already there moved, with their content
+    ASSERT(check_fill(ram0.hva(0), PAGE, 4));
+    ASSERT(ram0.as().numa_node() == node);
+    ASSERT(Model::SimpleAS::numa_node_at(bus, GPA(GUEST_BASE + AS_SIZE - 1)) == node);
+    ASSERT(Model::SimpleAS::numa_node_at(bus, GPA(GUEST_BASE + AS_SIZE)) == Model::SimpleAS::NO_NUMA_NODE);
+    ASSERT(Model::SimpleAS::numa_node_at(bus, GPA(GUEST_BASE - 1)) == Model::SimpleAS::NO_NUMA_NODE);
+
+    INFO("Address space placed on NUMA node %u of %u", node, nodes);
+}
+
+// Take the bits of [log]: the number of pages written since the previous collection
+static uint64
+collect(Model::DirtyLog &log) {
+    uint64 pages = 0;
+
+    for (uint64 w = 0; w < log.words(); w++)
+        pages += static_cast<uint64>(__builtin_popcountll(log.get_and_clear(w)));
+    return pages;
+}
+
+static void
+check_dirty_log(const Vbus::Bus &bus, Guest_ram &ram0, Guest_ram &ram1) {
+    static char buf[2 * PAGE];
+
+    bool ok = ram0.as().enable_dirty_log() && ram1.as().enable_dirty_log();
+    ASSERT(ok);
+    Model::DirtyLog &log0 = *ram0.as().dirty_log();
+    Model::DirtyLog &log1 = *ram1.as().dirty_log();
+    ASSERT(collect(log0) == 0 && collect(log1) == 0);
+
+    // A few bytes on each side of the boundary
+    fill(buf, 16, 5);
+    Errno err = Model::SimpleAS::write_bus(bus, GPA(GUEST_BASE + AS_SIZE - 8), buf, 16);
+    ASSERT(err == Errno::NONE);
+    ASSERT(log0.is_dirty(AS_SIZE - 1) && log1.is_dirty(0) && !log1.is_dirty(PAGE));
+    ASSERT(collect(log0) == 1 && collect(log1) == 1);
+    ASSERT(collect(log0) == 0 && collect(log1) == 0);
+
+    // Two pages from the middle of a page: three pages touched
+    fill(buf, sizeof(buf), 6);
+    err = Model::SimpleAS::write_bus(bus, GPA(GUEST_BASE + AS_SIZE + 3 * PAGE + PAGE / 2), buf, sizeof(buf));
+    ASSERT(err == Errno::NONE);
+    ASSERT(!log1.is_dirty(2 * PAGE) && log1.is_dirty(3 * PAGE) && log1.is_dirty(5 * PAGE) && !log1.is_dirty(6 * PAGE));
+    ASSERT(collect(log1) == 3 && collect(log0) == 0);
+
+    if (!ram0.as().enable_dirty_log(true)) {
+        INFO("Dirty log checked, the host does not track the writes to the VMM view");
+        return;
+    }
+
+    // The whole AS is dirty until the first sync
+    ok = Model::SimpleAS::sync_dirty_log(bus);
+    ASSERT(ok && collect(log0) == log0.pages());
+
+    fill(ram0.hva(7 * PAGE), PAGE, 7);
+    ok = Model::SimpleAS::sync_dirty_log(bus);
+    ASSERT(ok && log0.is_dirty(7 * PAGE) && collect(log0) == 1);
+
+    INFO("Dirty log checked, writes to the VMM view included");
+}
+
+// A clone of [ram0] from its capture, written then restored
+static void
+check_restore(Vbus::Bus &bus, Guest_ram &ram0) {
+    static char buf[2 * PAGE];
+
+    fill(ram0.hva(0), AS_SIZE, 8);
+    int snap_fd = open_ram("vml-simple-as-snap");
+    bool ok = snap_fd >= 0 && ram0.as().capture(snap_fd);
+    ASSERT(ok);
+
+    Guest_ram clone(bus, CLONE_BASE, snap_fd, Platform::Mem::HugePages::NONE, true);
+    ok = clone.init() && clone.as().enable_dirty_log();
+    ASSERT(ok);
+    ASSERT(memcmp(clone.hva(0), ram0.hva(0), AS_SIZE) == 0);
+
+    Model::DirtyLog &log = *clone.as().dirty_log();
+    fill(buf, sizeof(buf), 9);
+    Errno err = Model::SimpleAS::write_bus(bus, GPA(CLONE_BASE + PAGE), buf, sizeof(buf));
+    ASSERT(err == Errno::NONE);
+    fill(clone.hva(AS_SIZE - PAGE), PAGE, 10);
+    ASSERT(memcmp(clone.hva(PAGE), buf, sizeof(buf)) == 0);
+    ASSERT(check_fill(ram0.hva(0), AS_SIZE, 8)); // The base image is not written
+    ASSERT(collect(log) == 2);
+
+    ok = clone.as().restore();
+    ASSERT(ok);
+    ASSERT(memcmp(clone.hva(0), ram0.hva(0), AS_SIZE) == 0);
+    ASSERT(collect(log) == log.pages());
+
+    INFO("Copy-on-write clone restored to its base image");
+}
+
+// A fresh AS filled from a capture of [ram0] as it is accessed, skipped without userfaultfd
+static void
+check_lazy_restore(Vbus::Bus &bus, Guest_ram &ram0) {
+    static char buf[PAGE];
+    const uint64 first = 5;
+    const uint64 second = 2;
+
+    fill(ram0.hva(first * PAGE), PAGE, 11);
+    int snap_fd = open_ram("vml-simple-as-lazy-snap");
+    bool ok = snap_fd >= 0 && ram0.as().capture(snap_fd);
+    ASSERT(ok);
+
+    Guest_ram ram(bus, LAZY_BASE, open_ram("vml-simple-as-lazy"));
+    ok = ram.init();
+    ASSERT(ok);
+
+    Model::LazyRestore lazy(ram.as(), snap_fd);
+    if (!lazy.start()) {
+        INFO("userfaultfd is not available, skipping the lazy restore check");
+        close(snap_fd);
+        return;
+    }
+    std::thread faults([&lazy] { lazy.run_faults(); });
+
+    // On demand, before the background restore starts
+    Errno err = Model::SimpleAS::read_bus(bus, GPA(LAZY_BASE + first * PAGE), buf, sizeof(buf));
+    ASSERT(err == Errno::NONE && check_fill(buf, sizeof(buf), 11));
+    err = Model::SimpleAS::read_bus(bus, GPA(LAZY_BASE + second * PAGE), buf, sizeof(buf));
+    ASSERT(err == Errno::NONE && memcmp(buf, ram0.hva(second * PAGE), sizeof(buf)) == 0);
+
+    std::thread prefetch([&lazy] { lazy.run_prefetch(); });
+    prefetch.join();
+    ok = lazy.wait();
+    ASSERT(ok && lazy.done());
+    ASSERT(memcmp(ram.hva(0), ram0.hva(0), AS_SIZE) == 0);
+
+    lazy.stop();
+    faults.join();
+    close(snap_fd);
+
+    // The fault loop records a page once the copy woke up the reader: checked with the loop gone
+    uint64 order[2];
+    const Model::LazyRestore::Stats &stats = lazy.stats();
+    ASSERT(lazy.access_order(order, 2) == 2 && order[0] == first && order[1] == second);
+    ASSERT(stats.faults >= 2 && stats.faults + stats.prefetched == AS_SIZE / PAGE);
+
+    INFO("Lazy restore checked: %llu pages on demand, %llu in the background",
+         static_cast<unsigned long long>(stats.faults.load()), static_cast<unsigned long long>(stats.prefetched.load()));
+}
+
+class View_callback : public Model::GuestMemView::Callback {
+public:
+    void view_invalidated(Model::GuestMemView &) override { invalidations++; }
+
+    uint32 invalidations{0};
+};
+
+static void
+check_view(Vbus::Bus &bus, Guest_ram &ram1) {
+    static char buf[2 * PAGE];
+    static char back[2 * PAGE];
+    const GPA gpa(GUEST_BASE + AS_SIZE + 8 * PAGE);
+    Model::GuestMemView view;
+    View_callback cb;
+
+    // A view is held by a single AS
+    Errno err = view.acquire(bus, GPA(GUEST_BASE + AS_SIZE - PAGE), 2 * PAGE, true, &cb);
+    ASSERT(err == Errno::INVAL && !view.valid());
+
+    err = view.acquire(bus, gpa, sizeof(buf), true, &cb);
+    ASSERT(err == Errno::NONE && view.valid() && view.covers(gpa, sizeof(buf)));
+    ASSERT(!view.covers(GPA(gpa.get_value() + PAGE), sizeof(buf)));
+
+    fill(buf, sizeof(buf), 12);
+    err = view.write(gpa, buf, sizeof(buf));
+    ASSERT(err == Errno::NONE && memcmp(ram1.hva(8 * PAGE), buf, sizeof(buf)) == 0);
+    err = view.read(gpa, back, sizeof(back));
+    ASSERT(err == Errno::NONE && memcmp(back, buf, sizeof(buf)) == 0);
+    ASSERT(ram1.as().dirty_log()->is_dirty(8 * PAGE) && ram1.as().dirty_log()->is_dirty(9 * PAGE));
+
+    ram1.unregister();
+    ASSERT(!view.valid() && cb.invalidations == 1);
+    ASSERT(view.read(gpa, back, sizeof(back)) == Errno::INVAL);
+    ASSERT(view.write(gpa, buf, sizeof(buf)) == Errno::INVAL);
+    view.release();
+    ASSERT(cb.invalidations == 1);
+
+    // Nothing to map anymore
+    err = view.acquire(bus, gpa, sizeof(buf), false, &cb);
+    ASSERT(err == Errno::INVAL && !view.valid());
+
+    INFO("Guest memory view invalidated by the unregistration of its address space");
+}
+
+int
+main() {
+    Vbus::Bus bus;
+
+    INFO("== Simple AS Test application ==");
+
+    Guest_ram ram0(bus, GUEST_BASE, open_ram("vml-simple-as-0"));
+    Guest_ram ram1(bus, GUEST_BASE + AS_SIZE, open_ram("vml-simple-as-1"));
+    bool ok = ram0.init() && ram1.init();
+    ASSERT(ok);
+
+    check_split_write(bus, ram0, ram1);
+    check_hugetlb(bus);
+    check_numa(bus, ram0);
+    check_dirty_log(bus, ram0, ram1);
+    check_restore(bus, ram0);
+    check_lazy_restore(bus, ram0);
+    check_view(bus, ram1);
+
+    return 0;
+}
@@ -0,0 +1,440 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <debug_switches.hpp>
+#include <fcntl.h>
+#include <model/cpu.hpp>
+#include <model/gic.hpp>
+#include <model/virtio_block.hpp>
+#include <model/virtio_block_engine.hpp>
+#include <model/virtio_block_workers.hpp>
+#include <model/virtio_mmio.hpp>
+#include <platform/context.hpp>
+#include <platform/log.hpp>
+#include <platform/reg_accessor.hpp>
+#include <platform/semaphore.hpp>
+#include <platform/types.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vbus/vbus.hpp>
+
+static const constexpr uint32 GUEST_RAM_SIZE = 0x100000;
+static const constexpr uint64 VIRTIO_BASE = 0x44000;
+static const uint64 GUEST_BASE = 0x10000000;
+
+static const uint16 QUEUE_SIZE = 64;
+static const uint16 NUM_QUEUES = 2;
+static const uint16 NUM_REQUESTS = 16;
+static const uint32 REQUEST_SIZE = 0x1000;
+static const uint64 DISK_SIZE = 0x100000;
+static const uint64 SECTOR_SIZE = static_cast<uint64>(Model::VirtioBlockProtocol::SIZE);
+
+// Layout of the guest memory used by each request queue, from GUEST_BASE + queue * Q_REGION
+static const uint64 Q_REGION = 0x40000;
+static const uint64 Q_DESC = 0x0;
+static const uint64 Q_DRIVER = 0x1000;
+static const uint64 Q_DEVICE = 0x2000;
+static const uint64 HEADERS = 0x3000;
+static const uint64 STATUSES = 0x4000;
+static const uint64 DATA = 0x10000;
+
+static Semaphore wait_sm;
+
+class Dummy_vcpu : public Model::Cpu {
+public:
+    Dummy_vcpu(Model::GicD &gic) : Model::Cpu(&gic, 0, 0) {}
+
+    virtual void recall(bool, RecallReason) override {}
+};
+
+class Block_backend : public Virtio::Callback, public Model::VirtioBlockCallback {
+public:
+    explicit Block_backend(Model::VirtioBlockWorkers &workers) : _workers(&workers) {}
+
+    void driver_ok() override {
+        DEBUG("Driver OK callback from model");
+        wait_sm.release();
+    }
+
+    void device_reset() override { _workers->reset(); }
+    void shutdown() override {}
+
+    void attach() override {}
+    void detach() override {}
+    Errno map(const Model::IOMapping &) override { return Errno::NONE; }
+    Errno unmap(const Model::IOMapping &) override { return Errno::NONE; }
+
+private:
+    Model::VirtioBlockWorkers *_workers;
+};
+
+/*
+ * Minimal driver side of a request queue: every request is a chain of three descriptors
+ * (header, data, status) laid out statically in guest memory.
+ */
+class Block_driver {
+public:
+    Block_driver(Vbus::Bus &bus, uint16 queue) : _bus(&bus), _base(GUEST_BASE + queue * Q_REGION) {
+        _queue = Virtio::DriverQueue(hva(Q_DESC, 0x1000), hva(Q_DRIVER, 0x1000), hva(Q_DEVICE, 0x1000), QUEUE_SIZE);
+    }
+
+    uint64 gpa(uint64 off) const { return _base + off; }
+    char *hva(uint64 off, size_t sz) const { return Model::SimpleAS::gpa_to_vmm_view(*_bus, GPA(gpa(off)), sz); }
+    char *data(uint16 req) const { return hva(DATA + req * REQUEST_SIZE, REQUEST_SIZE); }
+    uint8 status(uint16 req) const { return static_cast<uint8>(*hva(STATUSES + req, 1)); }
+
+    void queue_request(uint16 req, Model::VirtioBlockRequestType type, uint64 sector, uint32 data_size) {
+        Model::VirtioBlockRequestHeader hdr;
+        hdr.type = static_cast<uint32>(type);
+        hdr.sector = sector;
+        memcpy(hva(HEADERS + req * sizeof(hdr), sizeof(hdr)), &hdr, sizeof(hdr));
+        *hva(STATUSES + req, 1) = static_cast<char>(0xff);
+
+        uint16 data_flags = VIRTQ_DESC_CONT_NEXT;
+        if (type == Model::VirtioBlockRequestType::IN || type == Model::VirtioBlockRequestType::GET_ID)
+            data_flags |= VIRTQ_DESC_WRITE_ONLY;
+
+        uint16 idx = static_cast<uint16>(req * 3);
+        Virtio::Descriptor head = _queue.initialize_descriptor(idx);
+        uint16 next = static_cast<uint16>(data_size != 0 ? idx + 1 : idx + 2);
+        set(head, gpa(HEADERS + req * sizeof(hdr)), sizeof(hdr), VIRTQ_DESC_CONT_NEXT, next);
+        if (data_size != 0)
+            set(_queue.initialize_descriptor(static_cast<uint16>(idx + 1)), gpa(DATA + req * REQUEST_SIZE), data_size,
+                data_flags, static_cast<uint16>(idx + 2));
+        set(_queue.initialize_descriptor(static_cast<uint16>(idx + 2)), gpa(STATUSES + req), 1, VIRTQ_DESC_WRITE_ONLY, 0);
+
+        _queue.send(cxx::move(head), 0);
+    }
+
+    uint16 wait_completions(uint16 expected) {
+        uint16 received = 0;
+
+        for (unsigned tries = 0; received < expected && tries < 5000; tries++) {
+            Virtio::Descriptor desc;
+            if (_queue.recv(desc) == Errno::NONE)
+                received++;
+            else
+                usleep(1000);
+        }
+
+        return received;
+    }
+
+private:
+    static void set(const Virtio::Descriptor &desc, uint64 addr, uint32 len, uint16 flags, uint16 next) {
+        desc.set_address(addr);
+        desc.set_length(len);
+        desc.set_flags(flags);
+        desc.set_next(next);
+    }
+
+    Vbus::Bus *_bus;
+    uint64 _base;
+    Virtio::DriverQueue _queue;
+};
+
+static void
+init_virtio_block(Vbus::Bus &vbus, VcpuCtx &vctx) {
+    uint64 val;
+    Vbus::Err err;
+
+    // Reset.
+    val = 0x0;
+    err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x70, 4, val);
+    ASSERT(err == Vbus::OK);
+
+    for (uint16 q = 0; q < NUM_QUEUES; q++) {
+        uint64 base = GUEST_BASE + q * Q_REGION;
+
+        // Select queue.
+        val = q;
+        err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x30, 4, val);
+        ASSERT(err == Vbus::OK);
+
+        // Num queue.
+        val = static_cast<uint64>(QUEUE_SIZE);
+        err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x38, 4, val);
+        ASSERT(err == Vbus::OK);
+
+        // Desc low
+        val = base + Q_DESC;
+        err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x80, 4, val);
+        ASSERT(err == Vbus::OK);
+
+        // Driver low
+        val = base + Q_DRIVER;
+        err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x90, 4, val);
+        ASSERT(err == Vbus::OK);
+
+        // Device low
+        val = base + Q_DEVICE;
+        err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0xA0, 4, val);
+        ASSERT(err == Vbus::OK);
+
+        // Queue ready
+        val = 1;
+        err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x44, 4, val);
+        ASSERT(err == Vbus::OK);
+    }
+
+    // Driver OK.
+    val = 0x4;
+    err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x70, 4, val);
+    ASSERT(err == Vbus::OK);
+}
+
+static void
+kick(Vbus::Bus &vbus, VcpuCtx &vctx, uint16 queue = 0) {
+    uint64 val = queue;
+    Vbus::Err err = vbus.access(Vbus::WRITE, vctx, VIRTIO_BASE + 0x50, 4, val);
+    ASSERT(err == Vbus::OK);
+}
+
+static bool
+check_statuses(const Block_driver &drv, uint16 num) {
+    for (uint16 i = 0; i < num; i++) {
+        if (drv.status(i) != static_cast<uint8>(Model::VirtioBlockStatus::OK)) {
+            WARN("Request %u failed with status %u", i, drv.status(i));
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+pin_thread(std::thread &thread, uint16 cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) != 0)
+        WARN("Cannot pin a worker thread to CPU %u", cpu);
+}
+
+int
+main() {
+    Platform_ctx ctx;
+    Stats::requested = true; // The merge statistics are printed at the end
+    Vbus::Bus vbus;
+    Model::GicD gicd(Model::GIC_V2, 1, nullptr);
+
+    bool ok = gicd.init();
+    ASSERT(ok);
+
+    ok = Model::Cpu::init(1);
+    ASSERT(ok);
+
+    Dummy_vcpu vcpu(gicd);
+    ok = vcpu.setup(&ctx);
+    ASSERT(ok);
+
+    Platform::Signal sig;
+    ok = sig.init(&ctx);
+    ASSERT(ok);
+
+    // Guest memory
+    Vbus::Bus bus;
+    static const char *TMP_FILE = "vml-virtio-block-example";
+
+    shm_unlink(TMP_FILE); // In case there was a file left behind
+    int fd = shm_open(TMP_FILE, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("shm_open");
+        exit(1);
+    }
+
+    int rc = ftruncate(fd, GUEST_RAM_SIZE);
+    if (rc == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    Model::SimpleAS sas(Range<mword>{GUEST_BASE, GUEST_RAM_SIZE}, Platform::Mem::MemDescr(fd), Platform::Mem::Cred{});
+    ok = sas.map_host();
+    ASSERT(ok);
+    ok = bus.register_device(&sas, GUEST_BASE, GUEST_RAM_SIZE);
+    ASSERT(ok);
+
+    // Disk image
+    char disk_path[] = "/tmp/vml-virtio-block-XXXXXX";
+    int disk_fd = mkstemp(disk_path);
+    if (disk_fd == -1) {
+        perror("mkstemp");
+        exit(1);
+    }
+    unlink(disk_path);
+
+    rc = ftruncate(disk_fd, static_cast<off_t>(DISK_SIZE));
+    if (rc == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    Model::VirtioBlockEngine::Config engine_config;
+    engine_config.fd = disk_fd;
+    engine_config.capacity = DISK_SIZE / SECTOR_SIZE;
+    engine_config.queue_depth = NUM_REQUESTS;
+    engine_config.serial = "vml-example-disk";
+
+    Virtio::MMIOTransport transport;
+    Model::VirtioBlock::UserConfig config;
+    config.transport = &transport;
+    config.num_queues = NUM_QUEUES;
+    config.block_config.capacity = DISK_SIZE / SECTOR_SIZE;
+    config.block_config.seg_max = QUEUE_SIZE - 2;
+    config.block_config.size_max = REQUEST_SIZE;
+    Model::VirtioBlockEngine::advertise_features(engine_config, config);
+
+    Model::VirtioBlock virtio_block(gicd, bus, 0x30, QUEUE_SIZE, config, &sig);
+
+    Model::VirtioBlockWorkers::Config workers_config;
+    workers_config.engine = engine_config;
+
+    Model::VirtioBlockWorkers workers(virtio_block, workers_config);
+    ok = workers.init(&ctx, QUEUE_SIZE);
+    ASSERT(ok);
+
+    Block_backend backend(workers);
+    virtio_block.register_callback(backend, backend);
+    virtio_block.connect();
+
+    INFO("== Virtio Block Test application ==");
+    INFO("Serving the disk image on %u queues with %s", workers.num_queues(),
+         workers.engine(0).uses_io_uring() ? "io_uring" : "preadv/pwritev");
+
+    ok = vbus.register_device(&gicd, 0x43000, 0x1000);
+    ASSERT(ok == true);
+
+    ok = vbus.register_device(&virtio_block, VIRTIO_BASE, 0x1000);
+    ASSERT(ok == true);
+
+    // Queue i is served next to the vCPU i, i.e. host CPU i here
+    std::thread workers_threads[NUM_QUEUES];
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (uint16 q = 0; q < workers.num_queues(); q++) {
+        workers_threads[q] = std::thread([&workers, q] { workers.run(q); });
+        if (num_cpus > q)
+            pin_thread(workers_threads[q], q);
+    }
+
+    RegAccessor regs(ctx, 0);
+    VcpuCtx vctx{&regs, 0};
+
+    INFO("Mocking virtio init on virtio block");
+    init_virtio_block(vbus, vctx);
+
+    wait_sm.acquire();
+    INFO("Virtio device initialized");
+
+    Block_driver drv(bus, 0);
+
+    INFO("Writing %u requests of %u bytes", NUM_REQUESTS, REQUEST_SIZE);
+    for (uint16 i = 0; i < NUM_REQUESTS; i++) {
+        memset(drv.data(i), 'a' + i, REQUEST_SIZE);
+        drv.queue_request(i, Model::VirtioBlockRequestType::OUT, i * (REQUEST_SIZE / SECTOR_SIZE), REQUEST_SIZE);
+    }
+    kick(vbus, vctx);
+    ASSERT(drv.wait_completions(NUM_REQUESTS) == NUM_REQUESTS);
+    ASSERT(check_statuses(drv, NUM_REQUESTS));
+
+    INFO("Flushing and reading the device ID");
+    drv.queue_request(0, Model::VirtioBlockRequestType::FLUSH, 0, 0);
+    drv.queue_request(1, Model::VirtioBlockRequestType::GET_ID, 0,
+                      static_cast<uint32>(Model::VirtioBlockGetID::DATA_SIZE));
+    kick(vbus, vctx);
+    ASSERT(drv.wait_completions(2) == 2);
+    ASSERT(check_statuses(drv, 2));
+    ASSERT(strncmp(drv.data(1), engine_config.serial, static_cast<size_t>(Model::VirtioBlockGetID::DATA_SIZE)) == 0);
+
+    // Submitted backwards, the engine sorts them back into a single sequential read
+    INFO("Reading back %u requests", NUM_REQUESTS);
+    for (uint16 i = NUM_REQUESTS; i-- > 0;) {
+        memset(drv.data(i), 0, REQUEST_SIZE);
+        drv.queue_request(i, Model::VirtioBlockRequestType::IN, i * (REQUEST_SIZE / SECTOR_SIZE), REQUEST_SIZE);
+    }
+    kick(vbus, vctx);
+    ASSERT(drv.wait_completions(NUM_REQUESTS) == NUM_REQUESTS);
+    ASSERT(check_statuses(drv, NUM_REQUESTS));
+
+    for (uint16 i = 0; i < NUM_REQUESTS; i++) {
+        for (uint32 b = 0; b < REQUEST_SIZE; b++)
+            ASSERT(drv.data(i)[b] == static_cast<char>('a' + i));
+    }
+
+    INFO("Zeroing and discarding the data");
+    Model::VirtioBlockDiscardWriteZeroes seg{0, REQUEST_SIZE / SECTOR_SIZE, 0};
+    memcpy(drv.data(0), &seg, sizeof(seg));
+    drv.queue_request(0, Model::VirtioBlockRequestType::WRITE_ZEROES, 0, sizeof(seg));
+
+    seg.sector = REQUEST_SIZE / SECTOR_SIZE;
+    memcpy(drv.data(1), &seg, sizeof(seg));
+    bool discard = (config.device_feature & static_cast<uint64>(Model::VirtioBlockFeatures::DISCARD)) != 0;
+    drv.queue_request(1, discard ? Model::VirtioBlockRequestType::DISCARD : Model::VirtioBlockRequestType::WRITE_ZEROES, 0,
+                      sizeof(seg));
+    kick(vbus, vctx);
+    ASSERT(drv.wait_completions(2) == 2);
+    ASSERT(check_statuses(drv, 2));
+
+    for (uint16 i = 0; i < 2; i++) {
+        char sector[SECTOR_SIZE];
+        ssize_t res = pread(disk_fd, sector, sizeof(sector), static_cast<off_t>(i * REQUEST_SIZE));
+        ASSERT(res == static_cast<ssize_t>(sizeof(sector)));
+        for (char c : sector)
+            ASSERT(c == 0);
+    }
+
+    INFO("Checking out of range requests");
+    drv.queue_request(0, Model::VirtioBlockRequestType::IN, DISK_SIZE / SECTOR_SIZE, REQUEST_SIZE);
+    kick(vbus, vctx);
+    ASSERT(drv.wait_completions(1) == 1);
+    ASSERT(drv.status(0) == static_cast<uint8>(Model::VirtioBlockStatus::IOERR));
+
+    INFO("Writing through the second queue");
+    Block_driver drv1(bus, 1);
+    for (uint16 i = 0; i < NUM_REQUESTS; i++) {
+        memset(drv1.data(i), 'A' + i, REQUEST_SIZE);
+        drv1.queue_request(i, Model::VirtioBlockRequestType::OUT, i * (REQUEST_SIZE / SECTOR_SIZE), REQUEST_SIZE);
+    }
+    kick(vbus, vctx, 1);
+    ASSERT(drv1.wait_completions(NUM_REQUESTS) == NUM_REQUESTS);
+    ASSERT(check_statuses(drv1, NUM_REQUESTS));
+
+    for (uint16 i = 0; i < NUM_REQUESTS; i++)
+        drv.queue_request(i, Model::VirtioBlockRequestType::IN, i * (REQUEST_SIZE / SECTOR_SIZE), REQUEST_SIZE);
+    kick(vbus, vctx);
+    ASSERT(drv.wait_completions(NUM_REQUESTS) == NUM_REQUESTS);
+    ASSERT(check_statuses(drv, NUM_REQUESTS));
+    for (uint16 i = 0; i < NUM_REQUESTS; i++)
+        ASSERT(memcmp(drv.data(i), drv1.data(i), REQUEST_SIZE) == 0);
+
+    for (uint16 q = 0; q < workers.num_queues(); q++) {
+        const Model::VirtioBlockEngine::MergeStats &stats = workers.engine(q).stats();
+        INFO("Queue %u served %llu requests, %llu IN/OUT requests in %llu host I/Os (%llu merged, ratio %llu.%02llu)", q,
+             static_cast<unsigned long long>(stats.requests), static_cast<unsigned long long>(stats.rw_requests),
+             static_cast<unsigned long long>(stats.host_ios), static_cast<unsigned long long>(stats.merged_requests),
+             static_cast<unsigned long long>(stats.merge_ratio() / 100),
+             static_cast<unsigned long long>(stats.merge_ratio() % 100));
+    }
+
+    workers.stop();
+    for (uint16 q = 0; q < workers.num_queues(); q++)
+        workers_threads[q].join();
+
+    close(disk_fd);
+    rc = shm_unlink(TMP_FILE);
+    if (rc != 0) {
+        perror("shm_unlink");
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,1552 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <model/cpu.hpp>
+#include <model/gic.hpp>
+#include <model/virtio_mmio.hpp>
+#include <model/virtio_net.hpp>
+#include <model/virtio_net_ctrl.hpp>
+#include <model/virtio_net_offload.hpp>
+#include <model/virtio_net_tap.hpp>
+#include <platform/context.hpp>
+#include <platform/log.hpp>
+#include <platform/reg_accessor.hpp>
+#include <platform/semaphore.hpp>
+#include <platform/types.hpp>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vbus/vbus.hpp>
+
+/*
+ * Two VMs, each with a VirtioNet device backed by a TAP interface, talk to each other over a
+ * veth pair:
+ *
+ *   VM 0 - vml-tap0 - vml-br0 - vml-veth0 <-> vml-veth1 - vml-br1 - vml-tap1 - VM 1
+ *
+ * The driver side of each VM is mocked: frames are queued on the TX queue of one VM and must
+ * show up on the RX queue of the other one. The RX buffers are smaller than the frames so that
+ * every frame is spread over several mergeable buffers.
+ *
+ * vml-tap0 is opened without the virtio_net_hdr: the TCP packets VM 0 sends with a partial
+ * checksum or as a GSO packet are completed by VirtioNetOffload, and VM 1 checks the checksums
+ * and the segments it receives. The offload library is also checked on its own, before the TAP
+ * interfaces are created.
+ *
+ * The control queue is checked first, on a third device without backend: the receive filters,
+ * the multiqueue steering and the RSS hash against the test vectors of the Microsoft
+ * specification. It needs no TAP interface and runs even when the rest of the test is skipped.
+ *
+ * VM 1 serves two queue pairs and a control queue, vml-tap1 has a queue per pair: the TCP flows
+ * VM 0 sends last must each arrive on the pair picked by their RSS hash, whatever queue of the
+ * interface the kernel put them on.
+ */
+
+static const constexpr uint32 GUEST_RAM_SIZE = 0x100000;
+static const uint64 VIRTIO_BASE = 0x44000;
+static const uint64 GUEST_BASE = 0x10000000;
+static const uint16 NUM_VMS = 2;
+
+static const uint16 QUEUE_SIZE = 64;
+static const uint16 RX = 0;
+static const uint16 TX = 1;
+static const uint32 RX_BUF_SIZE = 512;
+static const uint32 FRAME_SIZE = 1000;
+static const uint16 NUM_FRAMES = 48;
+static const uint16 ETHERTYPE = 0x88b5; // Local experimental EtherType
+static const uint32 PROBE = 0xffffffff;
+
+// TCP packets completed by the offloads
+static const uint16 PORT_CSUM = 40000; // Partial checksum
+static const uint16 PORT_GSO = 40001;  // GSO packet
+static const uint32 TCP_SEQ = 0x01020304;
+static const uint32 CSUM_PAYLOAD = 200;
+static const uint32 GSO_PAYLOAD = 1800;
+static const uint16 GSO_MSS = 500;
+static const uint16 GSO_SEGMENTS = (GSO_PAYLOAD + GSO_MSS - 1) / GSO_MSS;
+
+// VM 1 serves two queue pairs: TCP flows steered by its control queue
+static const uint16 MAX_PAIRS = 2;
+static const uint16 PORT_STEERING = 41000; // First port of the flows
+static const uint16 STEERING_FLOWS = 16;
+
+// Control queue check: a third device with two queue pairs, whose control queue is the only one set up
+static const uint64 CTRL_BASE = VIRTIO_BASE + NUM_VMS * 0x1000;
+static const uint16 CTRL_PAIRS = 2;
+static const uint16 CTRL_QUEUE = 2 * CTRL_PAIRS;
+static const uint8 CTRL_MAC[6] = {0x52, 0x54, 0x00, 0x00, 0x00, 0x0a + NUM_VMS};
+static const uint16 NO_VLAN = 0xffff;
+
+// Layout of the guest memory of each VM
+static const uint64 Q_REGION = 0x4000; // Descriptors, driver and device areas of queue i at i * Q_REGION
+static const uint64 Q_DESC = 0x0;
+static const uint64 Q_DRIVER = 0x1000;
+static const uint64 Q_DEVICE = 0x2000;
+static const uint64 RX_BUFS = 0x20000; // RX buffers of pair i at RX_BUFS + i * RX_PAIR_SIZE
+static const uint64 RX_PAIR_SIZE = QUEUE_SIZE * RX_BUF_SIZE;
+static const uint64 TX_BUFS = 0x40000;
+static const uint64 TX_BUF_SIZE = 0x800;
+static const uint64 CMD = 0x30000; // Control command, followed by its ack
+static const uint64 CMD_SIZE = 0x1000;
+static const uint64 ACK = CMD + CMD_SIZE;
+
+static const uint32 HEADER_SIZE = sizeof(Model::VirtioNetHeader);
+
+static Semaphore wait_sm;
+
+class Dummy_vcpu : public Model::Cpu {
+public:
+    Dummy_vcpu(Model::GicD &gic) : Model::Cpu(&gic, 0, 0) {}
+
+    virtual void recall(bool, RecallReason) override {}
+};
+
+static int
+open_guest_ram(const char *name) {
+    shm_unlink(name); // In case there was a file left behind
+    int fd = shm_open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("shm_open");
+        exit(1);
+    }
+
+    if (ftruncate(fd, GUEST_RAM_SIZE) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    return fd;
+}
+
+static Model::VirtioNet::UserConfig
+net_config(Virtio::Transport &transport, uint16 id, uint16 pairs) {
+    Model::VirtioNet::UserConfig config;
+    config.transport = &transport;
+    config.device_feature = VIRTIO_NET_MAC;
+    config.mac = 0x0a0000005452ull | (static_cast<uint64>(id) << 40); // 52:54:00:00:00:0X
+    config.mtu = 1500;
+    if (pairs > 1)
+        Model::VirtioNetCtrl::advertise_features(config, pairs);
+    Model::VirtioNetTap::advertise_features(config);
+    return config;
+}
+
+static void
+write_reg(Vbus::Bus &vbus, VcpuCtx &vctx, uint64 base, uint64 reg, uint64 val) {
+    Vbus::Err err = vbus.access(Vbus::WRITE, vctx, base + reg, 4, val);
+    ASSERT(err == Vbus::OK);
+}
+
+/*
+ * Driver side of a control queue: one command at a time, its header and data in a descriptor and
+ * its ack in a second one. The device executes the command when the queue is notified: the chain
+ * is used on return.
+ */
+class Ctrl_driver {
+public:
+    void init(Vbus::Bus &ram, uint64 mmio_base, uint16 queue) {
+        const uint64 base = queue * Q_REGION;
+
+        _ram = &ram;
+        _mmio_base = mmio_base;
+        _index = queue;
+        _queue = Virtio::DriverQueue(hva(base + Q_DESC, 0x1000), hva(base + Q_DRIVER, 0x1000), hva(base + Q_DEVICE, 0x1000),
+                                     QUEUE_SIZE);
+    }
+
+    // Set up the queue, after the feature negotiation
+    void setup(Vbus::Bus &vbus, VcpuCtx &vctx) {
+        const uint64 base = GUEST_BASE + _index * Q_REGION;
+
+        _vbus = &vbus;
+        _vctx = &vctx;
+        write_reg(vbus, vctx, _mmio_base, 0x30, _index);
+        write_reg(vbus, vctx, _mmio_base, 0x38, QUEUE_SIZE);
+        write_reg(vbus, vctx, _mmio_base, 0x80, base + Q_DESC);
+        write_reg(vbus, vctx, _mmio_base, 0x90, base + Q_DRIVER);
+        write_reg(vbus, vctx, _mmio_base, 0xA0, base + Q_DEVICE);
+        write_reg(vbus, vctx, _mmio_base, 0x44, 1);
+    }
+
+    uint8 command(Model::VirtioNetCtrlClass cls, uint8 cmd, const void *data, uint32 size) {
+        ASSERT(2 + size <= CMD_SIZE);
+        char *buf = hva(CMD, CMD_SIZE);
+        buf[0] = static_cast<char>(cls);
+        buf[1] = static_cast<char>(cmd);
+        if (size != 0)
+            memcpy(buf + 2, data, size);
+        *hva(ACK, 1) = static_cast<char>(0xff);
+
+        Virtio::Descriptor head = _queue.initialize_descriptor(0);
+        head.set_address(GUEST_BASE + CMD);
+        head.set_length(2 + size);
+        head.set_flags(VIRTQ_DESC_CONT_NEXT);
+        head.set_next(1);
+
+        Virtio::Descriptor ack = _queue.initialize_descriptor(1);
+        ack.set_address(GUEST_BASE + ACK);
+        ack.set_length(1);
+        ack.set_flags(VIRTQ_DESC_WRITE_ONLY);
+        ack.set_next(0);
+
+        _queue.send(cxx::move(head), 0);
+        write_reg(*_vbus, *_vctx, _mmio_base, 0x50, _index);
+
+        Virtio::Descriptor used;
+        Errno err = _queue.recv(used);
+        ASSERT(err == Errno::NONE && used.index() == 0);
+        return static_cast<uint8>(*hva(ACK, 1));
+    }
+
+private:
+    char *hva(uint64 off, size_t sz) { return Model::SimpleAS::gpa_to_vmm_view(*_ram, GPA(GUEST_BASE + off), sz); }
+
+    Vbus::Bus *_ram{nullptr};
+    uint64 _mmio_base{0};
+    uint16 _index{0};
+    Virtio::DriverQueue _queue;
+    Vbus::Bus *_vbus{nullptr};
+    VcpuCtx *_vctx{nullptr};
+};
+
+/*
+ * One VM: guest memory, the VirtioNet device and its TAP backend, and a minimal driver side for
+ * the RX and TX queues. With several queue pairs, the device also serves a control queue and
+ * every pair gets a queue of the TAP interface. Packets are only sent on the first pair.
+ */
+class Net_vm : public Virtio::Callback, public Model::VirtioNetCallback {
+public:
+    Net_vm(uint16 id, Model::GicD &gicd, const char *ram_name, const Model::VirtioNetTap::Config &tap_config, uint16 pairs = 1)
+        : _id(id), _pairs(pairs), _ram_name(ram_name), _ram_fd(open_guest_ram(ram_name)),
+          _sas(Range<mword>{GUEST_BASE, GUEST_RAM_SIZE}, Platform::Mem::MemDescr(_ram_fd), Platform::Mem::Cred{}),
+          _net(gicd, _bus, static_cast<uint16>(0x30 + id), QUEUE_SIZE, net_config(_transport, id, pairs), &_sig),
+          _ctrl(_net), _tap(_net, tap_config) {
+        ASSERT(pairs <= MAX_PAIRS);
+    }
+
+    ~Net_vm() {
+        _tap.stop();
+        for (uint16 p = 0; p < _pairs; p++) {
+            if (_tx_threads[p].joinable())
+                _tx_threads[p].join();
+            if (_rx_threads[p].joinable())
+                _rx_threads[p].join();
+        }
+        close(_ram_fd);
+        shm_unlink(_ram_name);
+    }
+
+    bool init(const Platform_ctx *ctx) {
+        if (!_sig.init(ctx) || !_sas.map_host() || !_bus.register_device(&_sas, GUEST_BASE, GUEST_RAM_SIZE))
+            return false;
+
+        for (uint16 p = 0; p < _pairs; p++) {
+            uint64 rx = 2 * p * Q_REGION;
+            _rxq[p] = Virtio::DriverQueue(hva(rx + Q_DESC, 0x1000), hva(rx + Q_DRIVER, 0x1000), hva(rx + Q_DEVICE, 0x1000),
+                                          QUEUE_SIZE);
+        }
+        _txq = Virtio::DriverQueue(hva(Q_REGION + Q_DESC, 0x1000), hva(Q_REGION + Q_DRIVER, 0x1000),
+                                   hva(Q_REGION + Q_DEVICE, 0x1000), QUEUE_SIZE);
+
+        if (_pairs > 1) {
+            if (!_ctrl.init(ctx, QUEUE_SIZE))
+                return false;
+            _ctrl_driver.init(_bus, mmio_base(), static_cast<uint16>(2 * _pairs));
+        }
+
+        if (!_tap.init(ctx, QUEUE_SIZE))
+            return false;
+
+        _net.register_callback(*this, *this);
+        _net.connect();
+
+        for (uint16 p = 0; p < _pairs; p++) {
+            _tx_threads[p] = std::thread([this, p] { _tap.run_tx(p); });
+            _rx_threads[p] = std::thread([this, p] { _tap.run_rx(p); });
+        }
+        return true;
+    }
+
+    void driver_ok() override {
+        _tap.driver_ok();
+        wait_sm.release();
+    }
+
+    void device_reset() override { _tap.reset(); }
+    void shutdown() override {}
+
+    void attach() override {}
+    void detach() override {}
+    Errno map(const Model::IOMapping &) override { return Errno::NONE; }
+    Errno unmap(const Model::IOMapping &) override { return Errno::NONE; }
+
+    Model::VirtioNet &device() { return _net; }
+    const Model::VirtioNetTap &tap() const { return _tap; }
+    Ctrl_driver &ctrl_driver() { return _ctrl_driver; }
+    uint64 mmio_base() const { return VIRTIO_BASE + _id * 0x1000; }
+    uint16 pairs() const { return _pairs; }
+
+    void post_rx_buffers() {
+        for (uint16 p = 0; p < _pairs; p++) {
+            for (uint16 i = 0; i < QUEUE_SIZE; i++)
+                post_rx_buffer(p, i);
+        }
+    }
+
+    // Queue one frame on the TX queue, the device is kicked by the caller
+    void send(const char *frame, uint32 size, const Model::VirtioNetHeader &hdr = Model::VirtioNetHeader()) {
+        ASSERT(size + HEADER_SIZE <= TX_BUF_SIZE);
+        while (_tx_inflight == QUEUE_SIZE) {
+            if (reclaim_tx() == 0)
+                usleep(100);
+        }
+
+        uint16 idx = static_cast<uint16>(_tx_next++ % QUEUE_SIZE);
+        char *buf = hva(TX_BUFS + idx * TX_BUF_SIZE, TX_BUF_SIZE);
+        memcpy(buf, &hdr, HEADER_SIZE);
+        memcpy(buf + HEADER_SIZE, frame, size);
+
+        Virtio::Descriptor desc = _txq.initialize_descriptor(idx);
+        desc.set_address(GUEST_BASE + TX_BUFS + idx * TX_BUF_SIZE);
+        desc.set_length(HEADER_SIZE + size);
+        desc.set_flags(0);
+        desc.set_next(0);
+        _txq.send(cxx::move(desc), 0);
+        _tx_inflight++;
+    }
+
+    uint16 reclaim_tx() {
+        uint16 reclaimed = 0;
+        Virtio::Descriptor desc;
+
+        while (_txq.recv(desc) == Errno::NONE) {
+            _tx_inflight--;
+            reclaimed++;
+        }
+        return reclaimed;
+    }
+
+    // Gather the next frame from the RX queue of [pair], [num_buffers] tells how many buffers it spans
+    bool receive(char *frame, uint32 max_size, uint32 &size, uint16 &buffers, uint16 pair = 0) {
+        Virtio::Descriptor desc;
+        if (_rxq[pair].recv(desc) != Errno::NONE)
+            return false;
+
+        Model::VirtioNetHeader hdr;
+        uint32 len = rx_used_len(pair);
+        char *buf = rx_buffer(pair, desc.index());
+        ASSERT(len >= HEADER_SIZE && len <= RX_BUF_SIZE);
+        memcpy(&hdr, buf, HEADER_SIZE);
+        ASSERT(hdr.num_buffers >= 1);
+
+        size = 0;
+        buffers = hdr.num_buffers;
+        append(frame, max_size, size, buf + HEADER_SIZE, len - HEADER_SIZE);
+        post_rx_buffer(pair, desc.index());
+
+        for (uint16 b = 1; b < buffers; b++) {
+            // The buffers of a frame are published at once
+            Errno err = _rxq[pair].recv(desc);
+            ASSERT(err == Errno::NONE);
+            len = rx_used_len(pair);
+            ASSERT(len <= RX_BUF_SIZE);
+            append(frame, max_size, size, rx_buffer(pair, desc.index()), len);
+            post_rx_buffer(pair, desc.index());
+        }
+
+        return true;
+    }
+
+private:
+    char *hva(uint64 off, size_t sz) { return Model::SimpleAS::gpa_to_vmm_view(_bus, GPA(GUEST_BASE + off), sz); }
+
+    static uint64 rx_buffer_off(uint16 pair, uint16 idx) { return RX_BUFS + pair * RX_PAIR_SIZE + idx * RX_BUF_SIZE; }
+    char *rx_buffer(uint16 pair, uint16 idx) { return hva(rx_buffer_off(pair, idx), RX_BUF_SIZE); }
+
+    void post_rx_buffer(uint16 pair, uint16 idx) {
+        Virtio::Descriptor desc = _rxq[pair].initialize_descriptor(idx);
+        desc.set_address(GUEST_BASE + rx_buffer_off(pair, idx));
+        desc.set_length(RX_BUF_SIZE);
+        desc.set_flags(VIRTQ_DESC_WRITE_ONLY);
+        desc.set_next(0);
+        _rxq[pair].send(cxx::move(desc), 0);
+    }
+
+    // Length of the used element returned by the last recv() on the RX queue of [pair]
+    uint32 rx_used_len(uint16 pair) {
+        uint32 len;
+        uint16 entry = static_cast<uint16>(_rx_used[pair]++ % QUEUE_SIZE);
+        memcpy(&len, hva(2 * pair * Q_REGION + Q_DEVICE + 4 + entry * 8 + 4, sizeof(len)), sizeof(len));
+        return len;
+    }
+
+    static void append(char *frame, uint32 max_size, uint32 &size, const char *data, uint32 len) {
+        ASSERT(size + len <= max_size);
+        memcpy(frame + size, data, len);
+        size += len;
+    }
+
+    uint16 _id;
+    uint16 _pairs;
+    const char *_ram_name;
+    int _ram_fd;
+    Vbus::Bus _bus;
+    Model::SimpleAS _sas;
+    Platform::Signal _sig;
+    Virtio::MMIOTransport _transport;
+    Model::VirtioNet _net;
+    Model::VirtioNetCtrl _ctrl; // Only with several queue pairs
+    Model::VirtioNetTap _tap;
+    std::thread _tx_threads[MAX_PAIRS];
+    std::thread _rx_threads[MAX_PAIRS];
+
+    Ctrl_driver _ctrl_driver;
+    Virtio::DriverQueue _rxq[MAX_PAIRS];
+    Virtio::DriverQueue _txq;
+    uint32 _rx_used[MAX_PAIRS]{};
+    uint32 _tx_next{0};
+    uint16 _tx_inflight{0};
+};
+
+static void
+write_reg(Vbus::Bus &vbus, VcpuCtx &vctx, const Net_vm &vm, uint64 reg, uint64 val) {
+    write_reg(vbus, vctx, vm.mmio_base(), reg, val);
+}
+
+static void
+init_virtio_net(Vbus::Bus &vbus, VcpuCtx &vctx, Net_vm &vm) {
+    // Reset.
+    write_reg(vbus, vctx, vm, 0x70, 0);
+
+    // Driver features: mergeable RX buffers, TX checksum and TCPv4 segmentation offloads, the
+    // control queue and multiqueue with several pairs, and VIRTIO_F_VERSION_1
+    uint64 features = VIRTIO_NET_MRG_RXBUF | VIRTIO_NET_MAC | VIRTIO_NET_CSUM | VIRTIO_NET_HOST_TSO4;
+    if (vm.pairs() > 1)
+        features |= VIRTIO_NET_CTRL_VQ | VIRTIO_NET_MQ;
+    write_reg(vbus, vctx, vm, 0x24, 0);
+    write_reg(vbus, vctx, vm, 0x20, features);
+    write_reg(vbus, vctx, vm, 0x24, 1);
+    write_reg(vbus, vctx, vm, 0x20, 1);
+
+    for (uint16 q = 0; q < 2 * vm.pairs(); q++) {
+        uint64 base = GUEST_BASE + q * Q_REGION;
+
+        write_reg(vbus, vctx, vm, 0x30, q);
+        write_reg(vbus, vctx, vm, 0x38, QUEUE_SIZE);
+        write_reg(vbus, vctx, vm, 0x80, base + Q_DESC);
+        write_reg(vbus, vctx, vm, 0x90, base + Q_DRIVER);
+        write_reg(vbus, vctx, vm, 0xA0, base + Q_DEVICE);
+        write_reg(vbus, vctx, vm, 0x44, 1);
+    }
+    if (vm.pairs() > 1)
+        vm.ctrl_driver().setup(vbus, vctx);
+
+    // Driver OK.
+    write_reg(vbus, vctx, vm, 0x70, 0x4);
+}
+
+static void
+kick(Vbus::Bus &vbus, VcpuCtx &vctx, const Net_vm &vm, uint16 queue) {
+    write_reg(vbus, vctx, vm, 0x50, queue);
+}
+
+static bool
+run(const char *cmd) {
+    return system(cmd) == 0;
+}
+
+static void
+teardown_topology() {
+    run("ip link del vml-veth0 2>/dev/null");
+    run("ip link del vml-br0 2>/dev/null");
+    run("ip link del vml-br1 2>/dev/null");
+}
+
+static bool
+setup_topology() {
+    teardown_topology();
+
+    return run("ip link add vml-veth0 type veth peer name vml-veth1") && run("ip link add vml-br0 type bridge")
+           && run("ip link add vml-br1 type bridge") && run("ip link set vml-tap0 master vml-br0 up")
+           && run("ip link set vml-veth0 master vml-br0 up") && run("ip link set vml-tap1 master vml-br1 up")
+           && run("ip link set vml-veth1 master vml-br1 up") && run("ip link set vml-br0 up")
+           && run("ip link set vml-br1 up");
+}
+
+static uint32
+build_frame(char *frame, uint16 src, uint32 seq) {
+    memset(frame, 0xff, 6); // Broadcast, flooded by the bridges
+    const uint8 mac[6] = {0x52, 0x54, 0x00, 0x00, 0x00, static_cast<uint8>(0x0a + src)};
+    memcpy(frame + 6, mac, sizeof(mac));
+    frame[12] = static_cast<char>(ETHERTYPE >> 8);
+    frame[13] = static_cast<char>(ETHERTYPE & 0xff);
+    memcpy(frame + 14, &seq, sizeof(seq));
+    for (uint32 i = 18; i < FRAME_SIZE; i++)
+        frame[i] = static_cast<char>(seq + i);
+
+    return FRAME_SIZE;
+}
+
+static bool
+is_test_frame(const char *frame, uint32 size) {
+    return size >= 18 && static_cast<uint8>(frame[12]) == (ETHERTYPE >> 8)
+           && static_cast<uint8>(frame[13]) == (ETHERTYPE & 0xff);
+}
+
+/*
+ * Poll the RX queue of [vm] for up to [timeout_ms] until [expected] test frames arrived. Other
+ * frames (IPv6 neighbour discovery, ...) are skipped, and so are probes unless [probe] is set.
+ */
+static uint16
+wait_frames(Vbus::Bus &vbus, VcpuCtx &vctx, Net_vm &vm, uint16 src, uint16 expected, bool probe, uint16 &max_buffers,
+            unsigned timeout_ms) {
+    static char frame[4096];
+    static char ref[FRAME_SIZE];
+    uint16 received = 0;
+    bool reposted = false;
+
+    for (unsigned tries = 0; received < expected && tries < timeout_ms; tries++) {
+        uint32 size;
+        uint16 buffers;
+
+        if (!vm.receive(frame, sizeof(frame), size, buffers)) {
+            // Tell the device about the buffers posted back once the queue is drained
+            if (reposted)
+                kick(vbus, vctx, vm, RX);
+            reposted = false;
+            usleep(1000);
+            continue;
+        }
+        reposted = true;
+        if (!is_test_frame(frame, size))
+            continue;
+
+        uint32 seq;
+        memcpy(&seq, frame + 14, sizeof(seq));
+        if ((seq == PROBE) != probe)
+            continue;
+
+        if (!probe) {
+            ASSERT(seq == received);
+            build_frame(ref, src, seq);
+            ASSERT(size == FRAME_SIZE && memcmp(frame, ref, FRAME_SIZE) == 0);
+        }
+
+        if (buffers > max_buffers)
+            max_buffers = buffers;
+        received++;
+    }
+
+    return received;
+}
+
+static bool
+exchange(Vbus::Bus &vbus, VcpuCtx &vctx, Net_vm &from, uint16 src, Net_vm &to) {
+    static char frame[FRAME_SIZE];
+    uint16 max_buffers = 0;
+    uint32 size;
+
+    // The bridges may take a moment to forward, probe until the path works
+    bool up = false;
+    for (unsigned tries = 0; !up && tries < 50; tries++) {
+        size = build_frame(frame, src, PROBE);
+        from.send(frame, size);
+        kick(vbus, vctx, from, TX);
+        up = wait_frames(vbus, vctx, to, src, 1, true, max_buffers, 100) == 1;
+    }
+    if (!up) {
+        WARN("No frame made it from VM %u to VM %u", src, 1 - src);
+        return false;
+    }
+    // Skip the probes that are still in flight
+    usleep(100000);
+    wait_frames(vbus, vctx, to, src, QUEUE_SIZE, true, max_buffers, 0);
+
+    for (uint32 seq = 0; seq < NUM_FRAMES; seq++) {
+        size = build_frame(frame, src, seq);
+        from.send(frame, size);
+    }
+    kick(vbus, vctx, from, TX);
+
+    max_buffers = 0;
+    uint16 received = wait_frames(vbus, vctx, to, src, NUM_FRAMES, false, max_buffers, 3000);
+    from.reclaim_tx();
+
+    INFO("VM %u -> VM %u: %u/%u frames of %u bytes received, up to %u RX buffers per frame", src, 1 - src, received,
+         NUM_FRAMES, FRAME_SIZE, max_buffers);
+    return received == NUM_FRAMES;
+}
+
+static void
+store_be16(uint8 *p, uint16 v) {
+    p[0] = static_cast<uint8>(v >> 8);
+    p[1] = static_cast<uint8>(v);
+}
+
+static uint16
+load_be16(const uint8 *p) {
+    return static_cast<uint16>(p[0] << 8 | p[1]);
+}
+
+static uint32
+load_be32(const uint8 *p) {
+    return static_cast<uint32>(p[0]) << 24 | static_cast<uint32>(p[1]) << 16 | static_cast<uint32>(p[2]) << 8 | p[3];
+}
+
+// RFC 1071 sum, 16 bits at a time in network order: the reference the offloads are checked against
+static uint32
+ref_sum(const uint8 *p, size_t len, uint32 sum) {
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += load_be16(p + i);
+    if ((len & 1) != 0)
+        sum += static_cast<uint32>(p[len - 1] << 8);
+    return sum;
+}
+
+static uint16
+ref_fold(uint32 sum) {
+    while ((sum >> 16) != 0)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<uint16>(~sum);
+}
+
+static uint32
+pseudo_sum(const uint8 *pkt, bool v6, size_t tcp_len) {
+    const uint8 *ip = pkt + 14;
+    uint32 sum = v6 ? ref_sum(ip + 8, 32, 0) : ref_sum(ip + 12, 8, 0);
+    return sum + 6 /* TCP */ + static_cast<uint32>(tcp_len);
+}
+
+/*
+ * Ethernet + IPv4 or IPv6 + TCP packet to 10.0.0.2 or fd00::2 with [payload] bytes of data. The
+ * TCP checksum holds the sum of the pseudo header, as a driver leaves it with NEEDS_CSUM.
+ */
+static uint32
+build_tcp(uint8 *pkt, bool v6, uint16 port, uint32 payload, Model::VirtioNetHeader &hdr) {
+    const uint32 l3 = 14;
+    const uint32 l4 = l3 + (v6 ? 40 : 20);
+    const uint32 size = l4 + 20 + payload;
+
+    memset(pkt, 0, l4 + 20);
+    memset(pkt, 0xff, 6); // Broadcast, flooded by the bridges
+    const uint8 mac[6] = {0x52, 0x54, 0x00, 0x00, 0x00, 0x0a};
+    memcpy(pkt + 6, mac, sizeof(mac));
+    store_be16(pkt + 12, v6 ? 0x86dd : 0x0800);
+
+    uint8 *ip = pkt + l3;
+    if (v6) {
+        ip[0] = 0x60;
+        store_be16(ip + 4, static_cast<uint16>(size - l4));
+        ip[6] = 6;
+        ip[7] = 64;
+        ip[8] = 0xfd;
+        ip[23] = 1;
+        ip[24] = 0xfd;
+        ip[39] = 2;
+    } else {
+        ip[0] = 0x45;
+        store_be16(ip + 2, static_cast<uint16>(size - l3));
+        store_be16(ip + 4, 0x1234);
+        ip[8] = 64;
+        ip[9] = 6;
+        const uint8 addrs[8] = {10, 0, 0, 1, 10, 0, 0, 2};
+        memcpy(ip + 12, addrs, sizeof(addrs));
+        store_be16(ip + 10, ref_fold(ref_sum(ip, 20, 0)));
+    }
+
+    uint8 *tcp = pkt + l4;
+    store_be16(tcp, port);
+    store_be16(tcp + 2, 80);
+    store_be16(tcp + 4, static_cast<uint16>(TCP_SEQ >> 16));
+    store_be16(tcp + 6, static_cast<uint16>(TCP_SEQ));
+    tcp[12] = 0x50;
+    tcp[13] = 0x19; // FIN, PSH, ACK
+    store_be16(tcp + 14, 0xffff);
+    for (uint32 i = 0; i < payload; i++)
+        tcp[20 + i] = static_cast<uint8>(i * 7 + port);
+    store_be16(tcp + 16, static_cast<uint16>(~ref_fold(pseudo_sum(pkt, v6, size - l4))));
+
+    hdr = Model::VirtioNetHeader();
+    hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr.csum_start = static_cast<uint16>(l4);
+    hdr.csum_offset = 16;
+    hdr.hdr_len = static_cast<uint16>(l4 + 20);
+    return size;
+}
+
+/*
+ * Check a complete TCP packet built by build_tcp(): checksums, lengths, and the data found at its
+ * sequence number. Returns the offset of its data in the original payload.
+ */
+static uint32
+check_tcp(const uint8 *pkt, uint32 size, bool v6, uint16 port) {
+    const uint32 l4 = 14 + (v6 ? 40 : 20);
+    ASSERT(size >= l4 + 20);
+    const uint8 *ip = pkt + 14;
+    const uint8 *tcp = pkt + l4;
+
+    if (v6) {
+        ASSERT(load_be16(ip + 4) == size - l4);
+    } else {
+        ASSERT(load_be16(ip + 2) == size - 14);
+        ASSERT(ref_fold(ref_sum(ip, 20, 0)) == 0);
+    }
+    ASSERT(load_be16(tcp) == port);
+    ASSERT(ref_fold(ref_sum(tcp, size - l4, pseudo_sum(pkt, v6, size - l4))) == 0);
+
+    uint32 off = load_be32(tcp + 4) - TCP_SEQ;
+    for (uint32 i = 0; i < size - l4 - 20; i++)
+        ASSERT(tcp[20 + i] == static_cast<uint8>((off + i) * 7 + port));
+    return off;
+}
+
+static bool
+is_tcp(const uint8 *pkt, uint32 size, uint16 port) {
+    return size >= 54 && load_be16(pkt + 12) == 0x0800 && pkt[23] == 6 && load_be16(pkt + 34) == port;
+}
+
+// Keeps the packets handed over by VirtioNetOffload
+class Offload_sink : public Model::VirtioNetOffload::Output {
+public:
+    static const uint16 MAX_PACKETS = 8;
+
+    Errno packet(const Model::VirtioNetHeader &hdr, const char *pkt, size_t size) override {
+        ASSERT(count < MAX_PACKETS && size <= sizeof(pkts[0]));
+        hdrs[count] = hdr;
+        memcpy(pkts[count], pkt, size);
+        sizes[count] = static_cast<uint32>(size);
+        count++;
+        return Errno::NONE;
+    }
+
+    Model::VirtioNetHeader hdrs[MAX_PACKETS];
+    uint8 pkts[MAX_PACKETS][2048];
+    uint32 sizes[MAX_PACKETS];
+    uint16 count{0};
+};
+
+// Segment a GSO packet in software, the segments must add up to the original payload
+static void
+check_segmentation(Model::VirtioNetOffload &offload, bool v6) {
+    static uint8 pkt[2048];
+    static Offload_sink sink;
+    Model::VirtioNetHeader hdr;
+
+    uint32 size = build_tcp(pkt, v6, PORT_GSO, GSO_PAYLOAD, hdr);
+    hdr.gso_type = v6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.gso_size = GSO_MSS;
+
+    sink.count = 0;
+    Errno err = offload.process(hdr, reinterpret_cast<char *>(pkt), size, Model::VirtioNetOffload::Offloads(), sink);
+    ASSERT(err == Errno::NONE && sink.count == GSO_SEGMENTS);
+
+    uint32 expected = 0;
+    for (uint16 s = 0; s < sink.count; s++) {
+        const uint8 *seg = sink.pkts[s];
+        const uint32 l4 = 14 + (v6 ? 40 : 20);
+        bool last = s + 1 == sink.count;
+
+        ASSERT(sink.hdrs[s].gso_type == VIRTIO_NET_HDR_GSO_NONE && sink.hdrs[s].flags == 0);
+        ASSERT(check_tcp(seg, sink.sizes[s], v6, PORT_GSO) == expected);
+        ASSERT((seg[l4 + 13] & 0x09) == (last ? 0x09 : 0)); // FIN and PSH on the last segment only
+        expected += sink.sizes[s] - l4 - 20;
+    }
+    ASSERT(expected == GSO_PAYLOAD);
+}
+
+/*
+ * VirtioNetOffload on its own: the checksum against the reference, the completion of a partial
+ * checksum, the packets the receiver can handle and the segmentation of TCPv4 and TCPv6 packets.
+ */
+static void
+check_offload_library() {
+    static uint8 buf[256];
+    static uint8 pkt[2048];
+    static Offload_sink sink;
+    Model::VirtioNetHeader hdr;
+
+    for (uint32 i = 0; i < sizeof(buf); i++)
+        buf[i] = static_cast<uint8>(i * 31 + 7);
+    for (uint32 len = 0; len < 200; len += 13) {
+        uint16 csum = Model::VirtioNetOffload::csum_fold(Model::VirtioNetOffload::csum_partial(buf, len, 0));
+        ASSERT(load_be16(reinterpret_cast<const uint8 *>(&csum)) == ref_fold(ref_sum(buf, len, 0)));
+    }
+
+    uint32 size = build_tcp(pkt, false, PORT_CSUM, CSUM_PAYLOAD, hdr);
+    Errno err = Model::VirtioNetOffload::complete_checksum(hdr, reinterpret_cast<char *>(pkt), size);
+    ASSERT(err == Errno::NONE && (hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) == 0);
+    check_tcp(pkt, size, false, PORT_CSUM);
+
+    Model::VirtioNetOffload offload;
+    bool ok = offload.init();
+    ASSERT(ok);
+
+    // A receiver handling the checksums gets the packet untouched
+    Model::VirtioNetOffload::Offloads csum;
+    csum.csum = true;
+    size = build_tcp(pkt, false, PORT_CSUM, CSUM_PAYLOAD, hdr);
+    err = offload.process(hdr, reinterpret_cast<char *>(pkt), size, csum, sink);
+    ASSERT(err == Errno::NONE && sink.count == 1 && (sink.hdrs[0].flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) != 0);
+    ASSERT(memcmp(sink.pkts[0], pkt, size) == 0);
+
+    check_segmentation(offload, false);
+    check_segmentation(offload, true);
+
+    // UDP fragmentation is not implemented
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_UDP;
+    hdr.gso_size = GSO_MSS;
+    err = offload.process(hdr, reinterpret_cast<char *>(pkt), size, Model::VirtioNetOffload::Offloads(), sink);
+    ASSERT(err == Errno::INVAL);
+
+    INFO("Software offloads checked");
+}
+
+static Model::VirtioNet::UserConfig
+ctrl_config(Virtio::Transport &transport) {
+    Model::VirtioNet::UserConfig config;
+    config.transport = &transport;
+    config.device_feature = VIRTIO_NET_MAC;
+    memcpy(&config.mac, CTRL_MAC, sizeof(CTRL_MAC));
+    Model::VirtioNetCtrl::advertise_features(config, CTRL_PAIRS);
+    return config;
+}
+
+/*
+ * A VirtioNet device with a control queue and two queue pairs, but no backend: VirtioNetCtrl is
+ * checked without TAP interface, hence without CAP_NET_ADMIN. Commands are queued on the control
+ * queue by a minimal driver, their effect is observed through classify() and hash().
+ */
+class Ctrl_vm {
+public:
+    Ctrl_vm(Model::GicD &gicd, const char *ram_name)
+        : _ram_name(ram_name), _ram_fd(open_guest_ram(ram_name)),
+          _sas(Range<mword>{GUEST_BASE, GUEST_RAM_SIZE}, Platform::Mem::MemDescr(_ram_fd), Platform::Mem::Cred{}),
+          _net(gicd, _bus, static_cast<uint16>(0x30 + NUM_VMS), QUEUE_SIZE, ctrl_config(_transport), &_sig), _ctrl(_net) {}
+
+    ~Ctrl_vm() {
+        close(_ram_fd);
+        shm_unlink(_ram_name);
+    }
+
+    bool init(const Platform_ctx *ctx) {
+        if (!_sig.init(ctx) || !_sas.map_host() || !_bus.register_device(&_sas, GUEST_BASE, GUEST_RAM_SIZE))
+            return false;
+
+        _driver.init(_bus, CTRL_BASE, CTRL_QUEUE);
+        return _ctrl.init(ctx, QUEUE_SIZE);
+    }
+
+    // Negotiate the control features, multiqueue and RSS, and set up the control queue
+    void start(Vbus::Bus &vbus, VcpuCtx &vctx) {
+        const uint64 features = VIRTIO_NET_MAC | VIRTIO_NET_CTRL_VQ | VIRTIO_NET_CTRL_RX | VIRTIO_NET_CTRL_VLAN
+                                | VIRTIO_NET_CTRL_MAC_ADDR | VIRTIO_NET_MQ | VIRTIO_NET_RSS;
+        write_reg(vbus, vctx, CTRL_BASE, 0x70, 0);
+        write_reg(vbus, vctx, CTRL_BASE, 0x24, 0);
+        write_reg(vbus, vctx, CTRL_BASE, 0x20, features & 0xffffffff);
+        write_reg(vbus, vctx, CTRL_BASE, 0x24, 1);
+        write_reg(vbus, vctx, CTRL_BASE, 0x20, (features >> 32) | 1); // VIRTIO_F_VERSION_1
+
+        _driver.setup(vbus, vctx);
+        write_reg(vbus, vctx, CTRL_BASE, 0x70, 0x4);
+        ASSERT(_net.ctrl_queue_index() == CTRL_QUEUE);
+    }
+
+    // Send a command that must be acked with VIRTIO_NET_OK
+    void expect_ok(Model::VirtioNetCtrlClass cls, uint8 cmd, const void *data, uint32 size) {
+        ASSERT(_driver.command(cls, cmd, data, size) == static_cast<uint8>(Model::VirtioNetCtrlAck::OK));
+        _commands++;
+    }
+
+    // Send a command that must be rejected
+    void expect_err(Model::VirtioNetCtrlClass cls, uint8 cmd, const void *data, uint32 size) {
+        ASSERT(_driver.command(cls, cmd, data, size) == static_cast<uint8>(Model::VirtioNetCtrlAck::ERR));
+        _commands++;
+        _errors++;
+    }
+
+    bool classify(const uint8 *frame, uint32 size, uint16 &pair) const {
+        return _ctrl.classify(reinterpret_cast<const char *>(frame), size, pair);
+    }
+
+    bool accepts(const uint8 *frame, uint32 size) const {
+        uint16 pair;
+        return classify(frame, size, pair);
+    }
+
+    bool hash(const uint8 *frame, uint32 size, uint32 &value) const {
+        return _ctrl.hash(reinterpret_cast<const char *>(frame), size, value);
+    }
+
+    Model::VirtioNet &device() { return _net; }
+    const Model::VirtioNetCtrl &ctrl() const { return _ctrl; }
+    uint64 commands() const { return _commands; }
+    uint64 errors() const { return _errors; }
+
+private:
+    const char *_ram_name;
+    int _ram_fd;
+    Vbus::Bus _bus;
+    Model::SimpleAS _sas;
+    Platform::Signal _sig;
+    Virtio::MMIOTransport _transport;
+    Model::VirtioNet _net;
+    Model::VirtioNetCtrl _ctrl;
+    Ctrl_driver _driver;
+    uint64 _commands{0};
+    uint64 _errors{0};
+};
+
+// Key and test vectors of the Microsoft RSS specification, "Verifying the RSS Hash Calculation"
+static const uint8 RSS_KEY[Model::VirtioNetCtrl::RSS_MAX_KEY_SIZE]
+    = {0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+       0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+       0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa};
+
+struct Rss_vector {
+    const char *src;
+    uint16 sport;
+    const char *dst;
+    uint16 dport;
+    uint32 ip_hash; // Addresses only
+    uint32 l4_hash; // Addresses and ports
+};
+
+static const Rss_vector RSS_VECTORS[] = {
+    {"66.9.149.187", 2794, "161.142.100.80", 1766, 0x323e8fc2, 0x51ccc178},
+    {"199.92.111.2", 14230, "65.69.140.83", 4739, 0xd718262a, 0xc626b0ea},
+    {"24.19.198.95", 12898, "12.22.207.184", 38024, 0xd2d0a5de, 0x5c2b394a},
+    {"38.27.205.30", 48228, "209.142.163.6", 2217, 0x82989176, 0xafc7327f},
+    {"153.39.163.191", 44251, "202.188.127.2", 1303, 0x5d1809c5, 0x10e828a2},
+    {"3ffe:2501:200:1fff::7", 2794, "3ffe:2501:200:3::1", 1766, 0x2cc18cd5, 0x40207d3d},
+    {"3ffe:501:8::260:97ff:fe40:efab", 14230, "ff02::1", 4739, 0x0f0c461c, 0xdde51bbf},
+    {"3ffe:1900:4545:3:200:f8ff:fe21:67cf", 44251, "fe80::200:f8ff:fe21:67cf", 38024, 0x4b61e985, 0x02d1feef},
+};
+
+static const uint8 IP_PROTO_TCP = 6;
+static const uint8 IP_PROTO_UDP = 17;
+static const uint8 IP_PROTO_GRE = 47; // No ports: hashed on the addresses only
+
+struct Flow {
+    bool v6;
+    uint8 src[16];
+    uint8 dst[16];
+    uint16 sport;
+    uint16 dport;
+};
+
+static Flow
+parse_flow(const Rss_vector &v) {
+    Flow f;
+    f.v6 = strchr(v.src, ':') != nullptr;
+    int family = f.v6 ? AF_INET6 : AF_INET;
+    bool ok = inet_pton(family, v.src, f.src) == 1 && inet_pton(family, v.dst, f.dst) == 1;
+    ASSERT(ok);
+    f.sport = v.sport;
+    f.dport = v.dport;
+    return f;
+}
+
+static Flow
+random_flow(uint32 &seed, bool v6) {
+    Flow f;
+    f.v6 = v6;
+    for (uint32 i = 0; i < sizeof(f.src); i++) {
+        seed = seed * 1103515245 + 12345;
+        f.src[i] = static_cast<uint8>(seed >> 24);
+        f.dst[i] = static_cast<uint8>(seed >> 16);
+    }
+    f.sport = static_cast<uint16>(seed >> 8);
+    f.dport = static_cast<uint16>(seed * 7 + 1);
+    return f;
+}
+
+// Input of the Toeplitz hash: source and destination addresses, then the ports if [ports]
+static size_t
+flow_input(const Flow &f, bool ports, uint8 *input) {
+    size_t alen = f.v6 ? 16 : 4;
+    memcpy(input, f.src, alen);
+    memcpy(input + alen, f.dst, alen);
+    if (!ports)
+        return 2 * alen;
+
+    store_be16(input + 2 * alen, f.sport);
+    store_be16(input + 2 * alen + 2, f.dport);
+    return 2 * alen + 4;
+}
+
+// Ethernet frame to [mac] carrying an IP packet of the flow with the L4 protocol [proto]
+static uint32
+build_flow(uint8 *frame, const uint8 *mac, const Flow &f, uint8 proto) {
+    const uint32 l4 = 14 + (f.v6 ? 40 : 20);
+
+    memset(frame, 0, l4 + 20);
+    memcpy(frame, mac, 6);
+    memcpy(frame + 6, CTRL_MAC, 6);
+    store_be16(frame + 12, f.v6 ? 0x86dd : 0x0800);
+
+    uint8 *ip = frame + 14;
+    if (f.v6) {
+        ip[0] = 0x60;
+        store_be16(ip + 4, 20);
+        ip[6] = proto;
+        ip[7] = 64;
+        memcpy(ip + 8, f.src, 16);
+        memcpy(ip + 24, f.dst, 16);
+    } else {
+        ip[0] = 0x45;
+        store_be16(ip + 2, 40);
+        ip[8] = 64;
+        ip[9] = proto;
+        memcpy(ip + 12, f.src, 4);
+        memcpy(ip + 16, f.dst, 4);
+    }
+    store_be16(frame + l4, f.sport);
+    store_be16(frame + l4 + 2, f.dport);
+    return l4 + 20;
+}
+
+// Ethernet frame to [mac] of the experimental EtherType, tagged with [vid] unless it is NO_VLAN
+static uint32
+build_eth(uint8 *frame, const uint8 *mac, uint16 vid) {
+    const uint32 size = 64;
+    uint32 type = 12;
+
+    memset(frame, 0, size);
+    memcpy(frame, mac, 6);
+    memcpy(frame + 6, CTRL_MAC, 6);
+    if (vid != NO_VLAN) {
+        store_be16(frame + 12, 0x8100);
+        store_be16(frame + 14, vid);
+        type += 4;
+    }
+    store_be16(frame + type, ETHERTYPE);
+    return size;
+}
+
+// One table of VIRTIO_NET_CTRL_MAC_TABLE_SET: [entries] times [mac]
+static uint32
+mac_table(uint8 *data, uint32 entries, const uint8 *mac) {
+    memcpy(data, &entries, sizeof(entries));
+    for (uint32 i = 0; i < entries; i++)
+        memcpy(data + sizeof(entries) + i * 6, mac, 6);
+    return static_cast<uint32>(sizeof(entries)) + entries * 6;
+}
+
+struct Rss_config {
+    uint32 hash_types{0};
+    uint16 mask{0};
+    uint16 unclassified{0};
+    uint16 indir[256]{};
+    uint16 max_tx_vq{0};
+    uint8 key_len{0};
+    uint8 key[64]{};
+};
+
+// struct virtio_net_rss_config, see VirtioNetCtrl::exec_rss_config()
+static uint32
+rss_config(uint8 *data, const Rss_config &c) {
+    const uint32 off = 8 + (c.mask + 1u) * 2;
+
+    memcpy(data, &c.hash_types, 4);
+    memcpy(data + 4, &c.mask, 2);
+    memcpy(data + 6, &c.unclassified, 2);
+    memcpy(data + 8, c.indir, off - 8);
+    memcpy(data + off, &c.max_tx_vq, 2);
+    data[off + 2] = c.key_len;
+    memcpy(data + off + 3, c.key, c.key_len);
+    return off + 3 + c.key_len;
+}
+
+/*
+ * The test vectors against toeplitz(), then hash() with the default state of the device: every
+ * hash type and the key of the specification. UDP shares the input of TCP, GRE has no ports.
+ */
+static void
+check_rss_vectors(const Ctrl_vm &vm) {
+    static const uint8 BROADCAST[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    static uint8 frame[128];
+    uint8 input[36];
+    uint32 value;
+
+    for (const Rss_vector &v : RSS_VECTORS) {
+        Flow f = parse_flow(v);
+
+        ASSERT(Model::VirtioNetCtrl::toeplitz(RSS_KEY, input, flow_input(f, false, input)) == v.ip_hash);
+        ASSERT(Model::VirtioNetCtrl::toeplitz(RSS_KEY, input, flow_input(f, true, input)) == v.l4_hash);
+
+        ASSERT(vm.hash(frame, build_flow(frame, BROADCAST, f, IP_PROTO_TCP), value) && value == v.l4_hash);
+        ASSERT(vm.hash(frame, build_flow(frame, BROADCAST, f, IP_PROTO_UDP), value) && value == v.l4_hash);
+        ASSERT(vm.hash(frame, build_flow(frame, BROADCAST, f, IP_PROTO_GRE), value) && value == v.ip_hash);
+    }
+
+    ASSERT(!vm.hash(frame, build_eth(frame, BROADCAST, NO_VLAN), value));
+}
+
+/*
+ * VIRTIO_NET_CTRL_RX, VIRTIO_NET_CTRL_MAC and VIRTIO_NET_CTRL_VLAN, each followed by the frames
+ * they let through. A rejected command must leave the filters as they were.
+ */
+static void
+check_filters(Ctrl_vm &vm) {
+    using Model::VirtioNetCtrlClass;
+    static const uint8 BROADCAST[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    static const uint8 OTHER[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x99};
+    static const uint8 LISTED[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x98};
+    static const uint8 MULTICAST[6] = {0x01, 0x00, 0x5e, 0x00, 0x00, 0x01};
+    static const uint8 NEW_MAC[6] = {0x52, 0x54, 0x00, 0x00, 0x00, 0x42};
+    static uint8 frame[128];
+    static uint8 data[512];
+    const uint8 off = 0;
+    const uint8 on = 1;
+
+    // Promiscuous after reset
+    ASSERT(vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+
+    vm.expect_ok(VirtioNetCtrlClass::RX, VIRTIO_NET_CTRL_RX_PROMISC, &off, 1);
+    ASSERT(!vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+    ASSERT(vm.accepts(frame, build_eth(frame, CTRL_MAC, NO_VLAN)));
+    ASSERT(vm.accepts(frame, build_eth(frame, BROADCAST, NO_VLAN)));
+    ASSERT(!vm.accepts(frame, build_eth(frame, MULTICAST, NO_VLAN)));
+
+    vm.expect_ok(VirtioNetCtrlClass::RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &on, 1);
+    ASSERT(vm.accepts(frame, build_eth(frame, MULTICAST, NO_VLAN)));
+    vm.expect_ok(VirtioNetCtrlClass::RX, VIRTIO_NET_CTRL_RX_ALLMULTI, &off, 1);
+    ASSERT(!vm.accepts(frame, build_eth(frame, MULTICAST, NO_VLAN)));
+
+    vm.expect_err(VirtioNetCtrlClass::RX, 2, &on, 1);
+    vm.expect_err(VirtioNetCtrlClass::RX, VIRTIO_NET_CTRL_RX_PROMISC, nullptr, 0);
+    ASSERT(!vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+
+    uint32 size = mac_table(data, 1, LISTED);
+    size += mac_table(data + size, 1, MULTICAST);
+    vm.expect_ok(VirtioNetCtrlClass::MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, data, size);
+    ASSERT(vm.accepts(frame, build_eth(frame, LISTED, NO_VLAN)));
+    ASSERT(vm.accepts(frame, build_eth(frame, MULTICAST, NO_VLAN)));
+    ASSERT(!vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+
+    // The second table announces an address that the command doesn't carry
+    size = mac_table(data, 1, OTHER);
+    size += mac_table(data + size, 1, MULTICAST);
+    vm.expect_err(VirtioNetCtrlClass::MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, data, size - 6);
+    ASSERT(vm.accepts(frame, build_eth(frame, LISTED, NO_VLAN)));
+    ASSERT(!vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+
+    // Too many unicast addresses: all of them are accepted
+    size = mac_table(data, Model::VirtioNetCtrl::MAC_TABLE_ENTRIES + 1, LISTED);
+    size += mac_table(data + size, 0, nullptr);
+    vm.expect_ok(VirtioNetCtrlClass::MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, data, size);
+    ASSERT(vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+    ASSERT(!vm.accepts(frame, build_eth(frame, MULTICAST, NO_VLAN)));
+
+    size = mac_table(data, 0, nullptr);
+    size += mac_table(data + size, 0, nullptr);
+    vm.expect_ok(VirtioNetCtrlClass::MAC, VIRTIO_NET_CTRL_MAC_TABLE_SET, data, size);
+    ASSERT(!vm.accepts(frame, build_eth(frame, LISTED, NO_VLAN)));
+
+    Model::VirtioNetConfig config;
+    vm.expect_ok(VirtioNetCtrlClass::MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET, NEW_MAC, sizeof(NEW_MAC));
+    vm.device().get_device_specific_config(config);
+    ASSERT(memcmp(config.mac, NEW_MAC, sizeof(NEW_MAC)) == 0);
+    ASSERT(vm.accepts(frame, build_eth(frame, NEW_MAC, NO_VLAN)));
+    ASSERT(!vm.accepts(frame, build_eth(frame, CTRL_MAC, NO_VLAN)));
+
+    vm.expect_err(VirtioNetCtrlClass::MAC, VIRTIO_NET_CTRL_MAC_ADDR_SET, CTRL_MAC, 3);
+    vm.expect_err(VirtioNetCtrlClass::MAC, 2, CTRL_MAC, sizeof(CTRL_MAC));
+    ASSERT(vm.accepts(frame, build_eth(frame, NEW_MAC, NO_VLAN)));
+
+    // Tagged frames are dropped until their VLAN is added
+    uint16 vid = 5;
+    ASSERT(!vm.accepts(frame, build_eth(frame, NEW_MAC, vid)));
+    vm.expect_ok(VirtioNetCtrlClass::VLAN, VIRTIO_NET_CTRL_VLAN_ADD, &vid, sizeof(vid));
+    ASSERT(vm.accepts(frame, build_eth(frame, NEW_MAC, 5)));
+    ASSERT(!vm.accepts(frame, build_eth(frame, NEW_MAC, 6)));
+    vm.expect_err(VirtioNetCtrlClass::VLAN, 2, &vid, sizeof(vid));
+    vm.expect_ok(VirtioNetCtrlClass::VLAN, VIRTIO_NET_CTRL_VLAN_DEL, &vid, sizeof(vid));
+    ASSERT(!vm.accepts(frame, build_eth(frame, NEW_MAC, 5)));
+
+    vid = 4096;
+    vm.expect_err(VirtioNetCtrlClass::VLAN, VIRTIO_NET_CTRL_VLAN_ADD, &vid, sizeof(vid));
+
+    // Not served
+    vm.expect_err(VirtioNetCtrlClass::GUEST_OFFLOADS, 0, &on, 1);
+
+    vm.expect_ok(VirtioNetCtrlClass::RX, VIRTIO_NET_CTRL_RX_PROMISC, &on, 1);
+    ASSERT(vm.accepts(frame, build_eth(frame, OTHER, NO_VLAN)));
+}
+
+/*
+ * VIRTIO_NET_CTRL_MQ: VQ_PAIRS_SET spreads the flows over the pairs with the default key, then
+ * RSS_CONFIG programs the hash types, the indirection table and the key. Every rejected RSS
+ * configuration must leave the previous one in place.
+ */
+static void
+check_steering(Ctrl_vm &vm) {
+    using Model::VirtioNetCtrlClass;
+    static uint8 frame[128];
+    static uint8 data[1024];
+    static Rss_config config;
+    uint8 input[36];
+    uint32 value;
+    uint16 pair;
+
+    const Flow first = parse_flow(RSS_VECTORS[0]);
+    ASSERT(vm.ctrl().active_queue_pairs() == 1);
+    ASSERT(vm.classify(frame, build_flow(frame, CTRL_MAC, first, IP_PROTO_TCP), pair) && pair == 0);
+
+    uint16 pairs = CTRL_PAIRS;
+    vm.expect_ok(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs));
+    ASSERT(vm.ctrl().active_queue_pairs() == CTRL_PAIRS);
+
+    // The default indirection table alternates between the pairs
+    for (const Rss_vector &v : RSS_VECTORS) {
+        ASSERT(vm.classify(frame, build_flow(frame, CTRL_MAC, parse_flow(v), IP_PROTO_TCP), pair));
+        ASSERT(pair == (v.l4_hash & 1));
+    }
+
+    pairs = 0;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs));
+    pairs = CTRL_PAIRS + 1;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs));
+    ASSERT(vm.ctrl().active_queue_pairs() == CTRL_PAIRS);
+
+    // Addresses only, the key of the specification, a table of 8 entries
+    static const uint16 INDIR[8] = {1, 0, 0, 1, 0, 1, 1, 0};
+    config.hash_types = VIRTIO_NET_RSS_HASH_TYPE_IPV4 | VIRTIO_NET_RSS_HASH_TYPE_IPV6;
+    config.mask = 7;
+    config.unclassified = 1;
+    memcpy(config.indir, INDIR, sizeof(INDIR));
+    config.max_tx_vq = CTRL_PAIRS;
+    config.key_len = sizeof(RSS_KEY);
+    memcpy(config.key, RSS_KEY, sizeof(RSS_KEY));
+    vm.expect_ok(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, config));
+
+    for (const Rss_vector &v : RSS_VECTORS) {
+        uint32 size = build_flow(frame, CTRL_MAC, parse_flow(v), IP_PROTO_TCP);
+        ASSERT(vm.hash(frame, size, value) && value == v.ip_hash);
+        ASSERT(vm.classify(frame, size, pair) && pair == INDIR[v.ip_hash & 7]);
+    }
+    ASSERT(vm.classify(frame, build_eth(frame, CTRL_MAC, NO_VLAN), pair) && pair == 1);
+
+    // Every hash type and a key of our own: hash() must follow toeplitz()
+    config.hash_types = Model::VirtioNetCtrl::SUPPORTED_HASH_TYPES;
+    for (uint8 i = 0; i < config.key_len; i++)
+        config.key[i] = static_cast<uint8>(i * 37 + 11);
+    vm.expect_ok(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, config));
+
+    uint32 seed = 1;
+    for (uint16 i = 0; i < 64; i++) {
+        Flow f = random_flow(seed, (i & 1) != 0);
+        uint32 expected = Model::VirtioNetCtrl::toeplitz(config.key, input, flow_input(f, true, input));
+        ASSERT(vm.hash(frame, build_flow(frame, CTRL_MAC, f, IP_PROTO_UDP), value) && value == expected);
+        ASSERT(vm.classify(frame, build_flow(frame, CTRL_MAC, f, IP_PROTO_TCP), pair) && pair == INDIR[expected & 7]);
+
+        expected = Model::VirtioNetCtrl::toeplitz(config.key, input, flow_input(f, false, input));
+        ASSERT(vm.hash(frame, build_flow(frame, CTRL_MAC, f, IP_PROTO_GRE), value) && value == expected);
+    }
+
+    Rss_config bad = config;
+    bad.mask = 2; // Not a power of two
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+    bad.mask = 255; // Longer than RSS_MAX_INDIRECTION_TABLE_LENGTH
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+
+    bad = config;
+    bad.hash_types |= 1u << 6; // IPv4 options and IPv6 extension headers are not supported
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+
+    bad = config;
+    bad.key_len = Model::VirtioNetCtrl::RSS_MAX_KEY_SIZE + 1;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+
+    bad = config;
+    bad.unclassified = CTRL_PAIRS;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+
+    bad = config;
+    bad.max_tx_vq = 0;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+    bad.max_tx_vq = CTRL_PAIRS + 1;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+
+    bad = config;
+    bad.indir[3] = CTRL_PAIRS;
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, bad));
+
+    // The key is cut short
+    vm.expect_err(VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG, data, rss_config(data, config) - 1);
+
+    uint32 expected = Model::VirtioNetCtrl::toeplitz(config.key, input, flow_input(first, true, input));
+    ASSERT(vm.hash(frame, build_flow(frame, CTRL_MAC, first, IP_PROTO_TCP), value) && value == expected);
+    ASSERT(vm.ctrl().active_queue_pairs() == CTRL_PAIRS);
+}
+
+/*
+ * VirtioNetCtrl on a device of its own: needs no TAP interface, runs before the TAP test that
+ * may be skipped.
+ */
+static void
+check_ctrl(const Platform_ctx &ctx, Model::GicD &gicd, Vbus::Bus &vbus, VcpuCtx &vctx) {
+    Ctrl_vm vm(gicd, "vml-virtio-net-example-ctrl");
+
+    bool ok = vm.init(&ctx) && vbus.register_device(&vm.device(), CTRL_BASE, 0x1000);
+    ASSERT(ok);
+    vm.start(vbus, vctx);
+
+    check_rss_vectors(vm);
+    check_filters(vm);
+    check_steering(vm);
+
+    const Model::VirtioNetCtrl::Stats &stats = vm.ctrl().stats();
+    ASSERT(stats.commands == vm.commands() && stats.errors == vm.errors() && stats.filtered != 0);
+    vbus.unregister_device(CTRL_BASE, 0x1000);
+
+    INFO("Control queue checked: %llu commands, %llu rejected, %llu frames filtered",
+         static_cast<unsigned long long>(stats.commands.load()), static_cast<unsigned long long>(stats.errors.load()),
+         static_cast<unsigned long long>(stats.filtered.load()));
+}
+
+/*
+ * Poll every RX queue of [vm] once for a frame, returned with the pair it arrived on. The buffers
+ * posted back are announced once all the queues are drained.
+ */
+static bool
+receive_any(Vbus::Bus &vbus, VcpuCtx &vctx, Net_vm &vm, char *frame, uint32 max_size, uint32 &size, uint16 &pair,
+            bool &reposted) {
+    uint16 buffers;
+
+    for (pair = 0; pair < vm.pairs(); pair++) {
+        if (vm.receive(frame, max_size, size, buffers, pair)) {
+            reposted = true;
+            return true;
+        }
+    }
+
+    if (reposted) {
+        for (uint16 p = 0; p < vm.pairs(); p++)
+            kick(vbus, vctx, vm, static_cast<uint16>(2 * p + RX));
+    }
+    reposted = false;
+    return false;
+}
+
+/*
+ * VM 0 sends a TCP packet with a partial checksum and a GSO packet to its TAP interface, which
+ * takes no header: VM 1 must receive the packet with its checksum completed and the segments.
+ */
+static bool
+exchange_offloads(Vbus::Bus &vbus, VcpuCtx &vctx, Net_vm &from, Net_vm &to) {
+    static uint8 pkt[2048];
+    static char frame[4096];
+    Model::VirtioNetHeader hdr;
+
+    uint32 size = build_tcp(pkt, false, PORT_CSUM, CSUM_PAYLOAD, hdr);
+    from.send(reinterpret_cast<const char *>(pkt), size, hdr);
+
+    size = build_tcp(pkt, false, PORT_GSO, GSO_PAYLOAD, hdr);
+    hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr.gso_size = GSO_MSS;
+    from.send(reinterpret_cast<const char *>(pkt), size, hdr);
+    kick(vbus, vctx, from, TX);
+
+    uint16 csum_pkts = 0;
+    uint16 segments = 0;
+    uint32 gso_bytes = 0;
+    bool reposted = false;
+    for (unsigned tries = 0; (csum_pkts < 1 || segments < GSO_SEGMENTS) && tries < 3000; tries++) {
+        uint16 pair;
+
+        if (!receive_any(vbus, vctx, to, frame, sizeof(frame), size, pair, reposted)) {
+            usleep(1000);
+            continue;
+        }
+
+        const uint8 *rcv = reinterpret_cast<const uint8 *>(frame);
+        if (is_tcp(rcv, size, PORT_CSUM)) {
+            ASSERT(check_tcp(rcv, size, false, PORT_CSUM) == 0 && size == 54 + CSUM_PAYLOAD);
+            csum_pkts++;
+        } else if (is_tcp(rcv, size, PORT_GSO)) {
+            ASSERT(check_tcp(rcv, size, false, PORT_GSO) == segments * GSO_MSS);
+            gso_bytes += size - 54;
+            segments++;
+        }
+    }
+    from.reclaim_tx();
+
+    INFO("VM 0 -> VM 1: %u/1 packets with a partial checksum, %u/%u segments of a GSO packet", csum_pkts, segments,
+         GSO_SEGMENTS);
+    return csum_pkts == 1 && segments == GSO_SEGMENTS && gso_bytes == GSO_PAYLOAD && from.tap().stats().tx_offloads == 2;
+}
+
+/*
+ * VM 0 sends TCP flows to VM 1, whose TAP interface has a queue per pair. Whatever queue of the
+ * interface the kernel picked, each packet must be received on the pair selected by the RSS hash
+ * of its flow: the default key, and the indirection table set by VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET.
+ */
+static bool
+exchange_steering(Vbus::Bus &vbus, VcpuCtx &vctx, Net_vm &from, Net_vm &to) {
+    static uint8 pkt[2048];
+    static char frame[4096];
+    Model::VirtioNetHeader hdr;
+    bool reposted = false;
+    uint32 size;
+    uint16 pair;
+
+    // Leftovers of the previous exchanges
+    while (receive_any(vbus, vctx, to, frame, sizeof(frame), size, pair, reposted)) {
+    }
+
+    for (uint16 i = 0; i < STEERING_FLOWS; i++) {
+        size = build_tcp(pkt, false, static_cast<uint16>(PORT_STEERING + i), CSUM_PAYLOAD, hdr);
+        from.send(reinterpret_cast<const char *>(pkt), size, hdr);
+    }
+    kick(vbus, vctx, from, TX);
+
+    uint16 received = 0;
+    uint16 pairs_used = 0;
+    uint32 seen = 0;
+    for (unsigned tries = 0; received < STEERING_FLOWS && tries < 3000; tries++) {
+        if (!receive_any(vbus, vctx, to, frame, sizeof(frame), size, pair, reposted)) {
+            usleep(1000);
+            continue;
+        }
+
+        const uint8 *rcv = reinterpret_cast<const uint8 *>(frame);
+        if (size < 54 || load_be16(rcv + 12) != 0x0800 || rcv[23] != IP_PROTO_TCP)
+            continue;
+        uint16 port = load_be16(rcv + 34);
+        if (port < PORT_STEERING || port >= PORT_STEERING + STEERING_FLOWS)
+            continue;
+        ASSERT(check_tcp(rcv, size, false, port) == 0 && size == 54 + CSUM_PAYLOAD);
+
+        Flow f;
+        uint8 input[Model::VirtioNetCtrl::RSS_MAX_KEY_SIZE];
+        f.v6 = false;
+        memcpy(f.src, rcv + 26, 4);
+        memcpy(f.dst, rcv + 30, 4);
+        f.sport = port;
+        f.dport = load_be16(rcv + 36);
+        uint32 hash = Model::VirtioNetCtrl::toeplitz(RSS_KEY, input, flow_input(f, true, input));
+        ASSERT(pair == (hash & 0x7f) % to.pairs());
+
+        uint32 bit = 1u << (port - PORT_STEERING);
+        ASSERT((seen & bit) == 0);
+        seen |= bit;
+        pairs_used = static_cast<uint16>(pairs_used | (1u << pair));
+        received++;
+    }
+    from.reclaim_tx();
+
+    INFO("VM 0 -> VM 1: %u/%u TCP flows received on the pair picked by their hash, %u/%u pairs used", received,
+         STEERING_FLOWS, __builtin_popcount(pairs_used), to.pairs());
+    return received == STEERING_FLOWS && pairs_used == (1u << to.pairs()) - 1;
+}
+
+static void
+print_stats(uint16 id, const Net_vm &vm) {
+    const Model::VirtioNetTap::Stats &stats = vm.tap().stats();
+    uint64 buffers = 0;
+
+    for (uint16 p = 0; p < vm.tap().queue_pairs(); p++)
+        buffers += vm.tap().rx_stats(p).buffers;
+
+    INFO("VM %u (%s): TX %llu packets in %llu batches (%llu errors), RX %llu packets in %llu batches over %llu buffers", id,
+         vm.tap().ifname(), static_cast<unsigned long long>(stats.tx_packets),
+         static_cast<unsigned long long>(stats.tx_batches), static_cast<unsigned long long>(stats.tx_errors),
+         static_cast<unsigned long long>(stats.rx_packets), static_cast<unsigned long long>(stats.rx_batches),
+         static_cast<unsigned long long>(buffers));
+    INFO("VM %u (%s): %u queue pairs, %llu RX packets steered to another pair, %llu dropped", id, vm.tap().ifname(),
+         vm.tap().queue_pairs(), static_cast<unsigned long long>(stats.rx_steered),
+         static_cast<unsigned long long>(stats.rx_dropped));
+    INFO("VM %u (%s): offloads completed in software for %llu TX and %llu RX packets", id, vm.tap().ifname(),
+         static_cast<unsigned long long>(stats.tx_offloads), static_cast<unsigned long long>(stats.rx_offloads));
+}
+
+int
+main() {
+    Platform_ctx ctx;
+    Vbus::Bus vbus;
+    Model::GicD gicd(Model::GIC_V2, 1, nullptr);
+
+    bool ok = gicd.init();
+    ASSERT(ok);
+
+    ok = Model::Cpu::init(1);
+    ASSERT(ok);
+
+    Dummy_vcpu vcpu(gicd);
+    ok = vcpu.setup(&ctx);
+    ASSERT(ok);
+
+    ok = vbus.register_device(&gicd, 0x43000, 0x1000);
+    ASSERT(ok == true);
+
+    INFO("== Virtio Net Test application ==");
+
+    check_offload_library();
+
+    RegAccessor regs(ctx, 0);
+    VcpuCtx vctx{&regs, 0};
+    check_ctrl(ctx, gicd, vbus, vctx);
+
+    Model::VirtioNetTap::Config tap_config[NUM_VMS];
+    tap_config[0].ifname = "vml-tap0";
+    tap_config[0].vnet_hdr = false;
+    tap_config[1].ifname = "vml-tap1";
+
+    Net_vm vm0(0, gicd, "vml-virtio-net-example-0", tap_config[0]);
+    Net_vm vm1(1, gicd, "vml-virtio-net-example-1", tap_config[1], MAX_PAIRS);
+    Net_vm *vms[NUM_VMS] = {&vm0, &vm1};
+
+    // TAP interfaces and bridges need CAP_NET_ADMIN
+    if (!vm0.init(&ctx) || !vm1.init(&ctx)) {
+        INFO("Cannot create the TAP interfaces, skipping the test");
+        return 0;
+    }
+    if (!setup_topology()) {
+        INFO("Cannot create the bridges and the veth pair, skipping the test");
+        teardown_topology();
+        return 0;
+    }
+
+    for (Net_vm *vm : vms) {
+        ok = vbus.register_device(&vm->device(), vm->mmio_base(), 0x1000);
+        ASSERT(ok == true);
+
+        init_virtio_net(vbus, vctx, *vm);
+        wait_sm.acquire();
+        ASSERT(vm->device().mergeable_rx_buffers());
+
+        if (vm->pairs() > 1) {
+            uint16 pairs = vm->pairs();
+            uint8 ack = vm->ctrl_driver().command(Model::VirtioNetCtrlClass::MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                                                  &pairs, sizeof(pairs));
+            ASSERT(ack == static_cast<uint8>(Model::VirtioNetCtrlAck::OK));
+        }
+
+        vm->post_rx_buffers();
+        for (uint16 p = 0; p < vm->pairs(); p++)
+            kick(vbus, vctx, *vm, static_cast<uint16>(2 * p + RX));
+    }
+    INFO("Virtio devices initialized");
+
+    ok = exchange(vbus, vctx, vm0, 0, vm1) && exchange(vbus, vctx, vm1, 1, vm0) && exchange_offloads(vbus, vctx, vm0, vm1)
+         && exchange_steering(vbus, vctx, vm0, vm1);
+
+    for (uint16 i = 0; i < NUM_VMS; i++)
+        print_stats(i, *vms[i]);
+
+    teardown_topology();
+    ASSERT(ok);
+
+    return 0;
+}
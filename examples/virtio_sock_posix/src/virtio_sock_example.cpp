@@ -0,0 +1,603 @@
+/**
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <model/cpu.hpp>
+#include <model/gic.hpp>
+#include <model/virtio_mmio.hpp>
+#include <model/virtio_sock.hpp>
+#include <model/virtio_sock_engine.hpp>
+#include <platform/context.hpp>
+#include <platform/log.hpp>
+#include <platform/reg_accessor.hpp>
+#include <platform/semaphore.hpp>
+#include <platform/types.hpp>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vbus/vbus.hpp>
+
+/*
+ * A VM with a VirtioSock device served by a VsockEngine. The driver side is mocked, it speaks
+ * the virtio-vsock protocol on the RX and TX queues:
+ * - the guest connects to port 1234 of the host, served by an echo server listening on
+ *   "<UDS_PATH>_1234", and streams more data than the buffers of both sides can hold: the
+ *   transfer only completes if the credit flows back in both directions,
+ * - the guest connects to a port without a host socket and must be reset,
+ * - a host process connects to port 6000 of the guest through "<UDS_PATH>".
+ */
+
+static const constexpr uint32 GUEST_RAM_SIZE = 0x100000;
+static const uint64 VIRTIO_BASE = 0x44000;
+static const uint64 GUEST_BASE = 0x10000000;
+static const uint64 GUEST_CID = 3;
+static const char *const UDS_PATH = "/tmp/vml-vsock-example";
+
+static const uint16 QUEUE_SIZE = 64;
+static const uint16 RX = 0;
+static const uint16 TX = 1;
+static const uint32 RX_BUF_SIZE = 2048;
+static const uint32 TX_BUF_SIZE = 0x1000;
+
+static const uint32 ECHO_PORT = 1234;
+static const uint32 REFUSED_PORT = 4321;
+static const uint32 GUEST_PORT = 6000;
+static const uint32 GUEST_BUF_ALLOC = 64 * 1024;
+static const uint32 HOST_BUF_ALLOC = 64 * 1024;
+static const uint32 STREAM_SIZE = 1024 * 1024;
+static const uint32 CHUNK_SIZE = 3000;
+
+// Layout of the guest memory
+static const uint64 Q_REGION = 0x4000; // Descriptors, driver and device areas of queue i at i * Q_REGION
+static const uint64 Q_DESC = 0x0;
+static const uint64 Q_DRIVER = 0x1000;
+static const uint64 Q_DEVICE = 0x2000;
+static const uint64 RX_BUFS = 0x10000;
+static const uint64 TX_BUFS = 0x40000;
+
+static const uint32 HEADER_SIZE = sizeof(Model::VsockHeader);
+
+static Semaphore wait_sm;
+
+class Dummy_vcpu : public Model::Cpu {
+public:
+    Dummy_vcpu(Model::GicD &gic) : Model::Cpu(&gic, 0, 0) {}
+
+    virtual void recall(bool, RecallReason) override {}
+};
+
+static int
+open_guest_ram(const char *name) {
+    shm_unlink(name); // In case there was a file left behind
+    int fd = shm_open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        perror("shm_open");
+        exit(1);
+    }
+
+    if (ftruncate(fd, GUEST_RAM_SIZE) == -1) {
+        perror("ftruncate");
+        exit(1);
+    }
+
+    return fd;
+}
+
+static Model::VirtioSock::UserConfig
+sock_config(Virtio::Transport &transport) {
+    Model::VirtioSock::UserConfig config;
+    config.transport = &transport;
+    config.cid = GUEST_CID;
+    return config;
+}
+
+static char
+pattern(uint32 off) {
+    return static_cast<char>((off * 7) ^ (off >> 8));
+}
+
+/*
+ * The VM: guest memory, the VirtioSock device and its engine, and a minimal driver side for the
+ * RX and TX queues.
+ */
+class Sock_vm : public Virtio::Callback, public Model::VirtioSockCallback {
+public:
+    Sock_vm(Model::GicD &gicd, const char *ram_name, const Model::VsockEngine::Config &engine_config)
+        : _ram_name(ram_name), _ram_fd(open_guest_ram(ram_name)),
+          _sas(Range<mword>{GUEST_BASE, GUEST_RAM_SIZE}, Platform::Mem::MemDescr(_ram_fd), Platform::Mem::Cred{}),
+          _sock(gicd, _bus, 0x30, QUEUE_SIZE, sock_config(_transport), &_sig), _engine(_sock, engine_config) {}
+
+    ~Sock_vm() {
+        _engine.stop();
+        if (_tx_thread.joinable())
+            _tx_thread.join();
+        if (_rx_thread.joinable())
+            _rx_thread.join();
+        close(_ram_fd);
+        shm_unlink(_ram_name);
+    }
+
+    bool init(const Platform_ctx *ctx) {
+        if (!_sig.init(ctx) || !_sas.map_host() || !_bus.register_device(&_sas, GUEST_BASE, GUEST_RAM_SIZE))
+            return false;
+
+        _rxq = Virtio::DriverQueue(hva(Q_DESC, 0x1000), hva(Q_DRIVER, 0x1000), hva(Q_DEVICE, 0x1000), QUEUE_SIZE);
+        _txq = Virtio::DriverQueue(hva(Q_REGION + Q_DESC, 0x1000), hva(Q_REGION + Q_DRIVER, 0x1000),
+                                   hva(Q_REGION + Q_DEVICE, 0x1000), QUEUE_SIZE);
+
+        if (!_engine.init(ctx, QUEUE_SIZE))
+            return false;
+
+        _sock.register_callback(*this, *this);
+        _sock.connect();
+
+        _tx_thread = std::thread([this] { _engine.run_tx(); });
+        _rx_thread = std::thread([this] { _engine.run_rx(); });
+        return true;
+    }
+
+    void driver_ok() override { wait_sm.release(); }
+
+    void device_reset() override { _engine.reset(); }
+    void shutdown() override {}
+
+    void attach() override {}
+    void detach() override {}
+    Errno map(const Model::IOMapping &) override { return Errno::NONE; }
+    Errno unmap(const Model::IOMapping &) override { return Errno::NONE; }
+
+    Model::VirtioSock &device() { return _sock; }
+    const Model::VsockEngine &engine() const { return _engine; }
+    uint64 mmio_base() const { return VIRTIO_BASE; }
+
+    void post_rx_buffers() {
+        for (uint16 i = 0; i < QUEUE_SIZE; i++)
+            post_rx_buffer(i);
+    }
+
+    bool tx_full() {
+        reclaim_tx();
+        return _tx_inflight == QUEUE_SIZE;
+    }
+
+    // Queue one packet on the TX queue, the device is kicked by the caller
+    void send(uint16 op, uint32 src_port, uint32 dst_port, uint32 fwd_cnt, const char *data = nullptr, uint32 len = 0,
+              uint32 flags = 0) {
+        ASSERT(len + HEADER_SIZE <= TX_BUF_SIZE);
+        while (tx_full())
+            usleep(100);
+
+        Model::VsockHeader hdr;
+        hdr.src_cid = GUEST_CID;
+        hdr.dst_cid = VIRTIO_VSOCK_HOST_CID;
+        hdr.src_port = src_port;
+        hdr.dst_port = dst_port;
+        hdr.len = len;
+        hdr.type = VIRTIO_VSOCK_TYPE_STREAM;
+        hdr.op = op;
+        hdr.flags = flags;
+        hdr.buf_alloc = GUEST_BUF_ALLOC;
+        hdr.fwd_cnt = fwd_cnt;
+
+        uint16 idx = static_cast<uint16>(_tx_next++ % QUEUE_SIZE);
+        char *buf = hva(TX_BUFS + idx * TX_BUF_SIZE, TX_BUF_SIZE);
+        memcpy(buf, &hdr, HEADER_SIZE);
+        if (len != 0)
+            memcpy(buf + HEADER_SIZE, data, len);
+
+        Virtio::Descriptor desc = _txq.initialize_descriptor(idx);
+        desc.set_address(GUEST_BASE + TX_BUFS + idx * TX_BUF_SIZE);
+        desc.set_length(HEADER_SIZE + len);
+        desc.set_flags(0);
+        desc.set_next(0);
+        _txq.send(cxx::move(desc), 0);
+        _tx_inflight++;
+    }
+
+    // Take the next packet off the RX queue, its data is copied to [data]
+    bool receive(Model::VsockHeader &hdr, char *data, uint32 max_size) {
+        Virtio::Descriptor desc;
+        if (_rxq.recv(desc) != Errno::NONE)
+            return false;
+
+        uint32 len = rx_used_len();
+        const char *buf = hva(RX_BUFS + desc.index() * RX_BUF_SIZE, RX_BUF_SIZE);
+        ASSERT(len >= HEADER_SIZE && len <= RX_BUF_SIZE);
+        memcpy(&hdr, buf, HEADER_SIZE);
+        ASSERT(hdr.len == len - HEADER_SIZE && hdr.len <= max_size);
+        memcpy(data, buf + HEADER_SIZE, hdr.len);
+
+        post_rx_buffer(desc.index());
+        _reposted = true;
+        return true;
+    }
+
+    // Tell the device about the buffers posted back once the queue is drained
+    bool reposted() {
+        bool r = _reposted;
+        _reposted = false;
+        return r;
+    }
+
+private:
+    char *hva(uint64 off, size_t sz) { return Model::SimpleAS::gpa_to_vmm_view(_bus, GPA(GUEST_BASE + off), sz); }
+
+    void reclaim_tx() {
+        Virtio::Descriptor desc;
+
+        while (_txq.recv(desc) == Errno::NONE)
+            _tx_inflight--;
+    }
+
+    void post_rx_buffer(uint16 idx) {
+        Virtio::Descriptor desc = _rxq.initialize_descriptor(idx);
+        desc.set_address(GUEST_BASE + RX_BUFS + idx * RX_BUF_SIZE);
+        desc.set_length(RX_BUF_SIZE);
+        desc.set_flags(VIRTQ_DESC_WRITE_ONLY);
+        desc.set_next(0);
+        _rxq.send(cxx::move(desc), 0);
+    }
+
+    // Length of the used element returned by the last recv() on the RX queue
+    uint32 rx_used_len() {
+        uint32 len;
+        uint16 entry = static_cast<uint16>(_rx_used++ % QUEUE_SIZE);
+        memcpy(&len, hva(Q_DEVICE + 4 + entry * 8 + 4, sizeof(len)), sizeof(len));
+        return len;
+    }
+
+    const char *_ram_name;
+    int _ram_fd;
+    Vbus::Bus _bus;
+    Model::SimpleAS _sas;
+    Platform::Signal _sig;
+    Virtio::MMIOTransport _transport;
+    Model::VirtioSock _sock;
+    Model::VsockEngine _engine;
+    std::thread _tx_thread;
+    std::thread _rx_thread;
+
+    Virtio::DriverQueue _rxq;
+    Virtio::DriverQueue _txq;
+    uint32 _rx_used{0};
+    uint32 _tx_next{0};
+    uint16 _tx_inflight{0};
+    bool _reposted{false};
+};
+
+static void
+write_reg(Vbus::Bus &vbus, VcpuCtx &vctx, const Sock_vm &vm, uint64 reg, uint64 val) {
+    Vbus::Err err = vbus.access(Vbus::WRITE, vctx, vm.mmio_base() + reg, 4, val);
+    ASSERT(err == Vbus::OK);
+}
+
+static void
+init_virtio_sock(Vbus::Bus &vbus, VcpuCtx &vctx, const Sock_vm &vm) {
+    // Reset.
+    write_reg(vbus, vctx, vm, 0x70, 0);
+
+    // Driver features: VIRTIO_F_VERSION_1
+    write_reg(vbus, vctx, vm, 0x24, 1);
+    write_reg(vbus, vctx, vm, 0x20, 1);
+
+    for (uint16 q = RX; q <= TX; q++) {
+        uint64 base = GUEST_BASE + q * Q_REGION;
+
+        write_reg(vbus, vctx, vm, 0x30, q);
+        write_reg(vbus, vctx, vm, 0x38, QUEUE_SIZE);
+        write_reg(vbus, vctx, vm, 0x80, base + Q_DESC);
+        write_reg(vbus, vctx, vm, 0x90, base + Q_DRIVER);
+        write_reg(vbus, vctx, vm, 0xA0, base + Q_DEVICE);
+        write_reg(vbus, vctx, vm, 0x44, 1);
+    }
+
+    // Driver OK.
+    write_reg(vbus, vctx, vm, 0x70, 0x4);
+}
+
+static void
+kick(Vbus::Bus &vbus, VcpuCtx &vctx, const Sock_vm &vm, uint16 queue) {
+    write_reg(vbus, vctx, vm, 0x50, queue);
+}
+
+/*
+ * Wait for up to [timeout_ms] for the next packet on the RX queue, the RX queue is kicked when
+ * buffers were posted back.
+ */
+static bool
+wait_packet(Vbus::Bus &vbus, VcpuCtx &vctx, Sock_vm &vm, Model::VsockHeader &hdr, char *data, unsigned timeout_ms) {
+    for (unsigned tries = 0; tries < timeout_ms; tries++) {
+        if (vm.receive(hdr, data, RX_BUF_SIZE))
+            return true;
+
+        if (vm.reposted())
+            kick(vbus, vctx, vm, RX);
+        usleep(1000);
+    }
+
+    return false;
+}
+
+static int
+host_socket() {
+    return socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+static bool
+host_path(sockaddr_un &addr, uint32 port) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int len = port == 0 ? snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", UDS_PATH)
+                        : snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u", UDS_PATH, port);
+    return len > 0 && static_cast<size_t>(len) < sizeof(addr.sun_path);
+}
+
+// Echo server of the host, serves a single connection
+static void
+echo_server(int listen_fd) {
+    static char buf[16384];
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0)
+        return;
+
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            break;
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(fd, buf + off, static_cast<size_t>(n - off));
+            if (w <= 0)
+                break;
+            off += w;
+        }
+    }
+    close(fd);
+}
+
+/*
+ * The guest streams [STREAM_SIZE] bytes to the echo server and reads them back. It only sends
+ * within the credit of the host, and tells the host about the data it consumed every quarter of
+ * its buffer.
+ */
+static bool
+guest_to_host(Vbus::Bus &vbus, VcpuCtx &vctx, Sock_vm &vm) {
+    static char data[RX_BUF_SIZE];
+    static char chunk[CHUNK_SIZE];
+    static const uint32 port = 5000;
+    Model::VsockHeader hdr;
+
+    vm.send(VIRTIO_VSOCK_OP_REQUEST, port, ECHO_PORT, 0);
+    kick(vbus, vctx, vm, TX);
+    if (!wait_packet(vbus, vctx, vm, hdr, data, 1000) || hdr.op != VIRTIO_VSOCK_OP_RESPONSE || hdr.dst_port != port
+        || hdr.src_port != ECHO_PORT) {
+        WARN("The guest could not connect to the host");
+        return false;
+    }
+
+    uint32 host_buf_alloc = hdr.buf_alloc;
+    uint32 host_fwd_cnt = hdr.fwd_cnt;
+    uint32 sent = 0;
+    uint32 received = 0;
+    uint32 advertised = 0;
+    uint32 rw_packets = 0;
+    unsigned idle = 0;
+
+    while (received < STREAM_SIZE && idle < 3000) {
+        bool progress = false;
+
+        // Send as much as the credit of the host allows
+        while (sent < STREAM_SIZE && !vm.tx_full()) {
+            uint32 credit = host_buf_alloc - (sent - host_fwd_cnt);
+            uint32 len = min(min(CHUNK_SIZE, STREAM_SIZE - sent), credit);
+            if (len == 0)
+                break;
+
+            for (uint32 i = 0; i < len; i++)
+                chunk[i] = pattern(sent + i);
+            vm.send(VIRTIO_VSOCK_OP_RW, port, ECHO_PORT, received, chunk, len);
+            sent += len;
+            progress = true;
+        }
+        if (progress)
+            kick(vbus, vctx, vm, TX);
+
+        while (vm.receive(hdr, data, sizeof(data))) {
+            progress = true;
+            ASSERT(hdr.src_port == ECHO_PORT && hdr.dst_port == port);
+            host_buf_alloc = hdr.buf_alloc;
+            host_fwd_cnt = hdr.fwd_cnt;
+
+            if (hdr.op == VIRTIO_VSOCK_OP_CREDIT_UPDATE)
+                continue;
+            ASSERT(hdr.op == VIRTIO_VSOCK_OP_RW);
+            rw_packets++;
+
+            for (uint32 i = 0; i < hdr.len; i++)
+                ASSERT(data[i] == pattern(received + i));
+            received += hdr.len;
+        }
+
+        if (received - advertised >= GUEST_BUF_ALLOC / 4) {
+            advertised = received;
+            vm.send(VIRTIO_VSOCK_OP_CREDIT_UPDATE, port, ECHO_PORT, received);
+            kick(vbus, vctx, vm, TX);
+        }
+        if (vm.reposted())
+            kick(vbus, vctx, vm, RX);
+
+        idle = progress ? 0 : idle + 1;
+        if (!progress)
+            usleep(1000);
+    }
+
+    INFO("Guest -> host -> guest: %u/%u bytes echoed in %u RW packets", received, STREAM_SIZE, rw_packets);
+    if (received != STREAM_SIZE)
+        return false;
+
+    // Full shutdown, the host answers with a RST
+    vm.send(VIRTIO_VSOCK_OP_SHUTDOWN, port, ECHO_PORT, received, nullptr, 0,
+            VIRTIO_VSOCK_SHUTDOWN_RCV | VIRTIO_VSOCK_SHUTDOWN_SEND);
+    kick(vbus, vctx, vm, TX);
+    return wait_packet(vbus, vctx, vm, hdr, data, 1000) && hdr.op == VIRTIO_VSOCK_OP_RST && hdr.dst_port == port;
+}
+
+static bool
+refused(Vbus::Bus &vbus, VcpuCtx &vctx, Sock_vm &vm) {
+    static char data[RX_BUF_SIZE];
+    Model::VsockHeader hdr;
+
+    vm.send(VIRTIO_VSOCK_OP_REQUEST, 5001, REFUSED_PORT, 0);
+    kick(vbus, vctx, vm, TX);
+    bool ok = wait_packet(vbus, vctx, vm, hdr, data, 1000) && hdr.op == VIRTIO_VSOCK_OP_RST && hdr.dst_port == 5001;
+
+    INFO("Connection to a port without host socket: %s", ok ? "reset" : "not reset");
+    return ok;
+}
+
+// A host process connects to the guest, sends a message and closes the connection
+static void
+host_client(bool &ok) {
+    static const char msg[] = "hello from the host";
+    char reply[32] = {};
+    sockaddr_un addr;
+    int fd = host_socket();
+
+    ok = false;
+    if (fd < 0 || !host_path(addr, 0) || connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+        return;
+
+    char cmd[32];
+    int len = snprintf(cmd, sizeof(cmd), "CONNECT %u\n", GUEST_PORT);
+    if (write(fd, cmd, static_cast<size_t>(len)) != len)
+        return;
+
+    for (size_t off = 0; off < sizeof(reply) - 1 && strchr(reply, '\n') == nullptr; off++) {
+        if (read(fd, reply + off, 1) != 1)
+            break;
+    }
+
+    ok = strncmp(reply, "OK ", 3) == 0 && write(fd, msg, sizeof(msg)) == sizeof(msg);
+    close(fd);
+}
+
+static bool
+host_to_guest(Vbus::Bus &vbus, VcpuCtx &vctx, Sock_vm &vm) {
+    static char data[RX_BUF_SIZE];
+    Model::VsockHeader hdr;
+    bool client_ok = false;
+    std::thread client([&client_ok] { host_client(client_ok); });
+
+    bool ok = wait_packet(vbus, vctx, vm, hdr, data, 1000) && hdr.op == VIRTIO_VSOCK_OP_REQUEST && hdr.dst_port == GUEST_PORT;
+    uint32 host_port = hdr.src_port;
+    if (ok) {
+        vm.send(VIRTIO_VSOCK_OP_RESPONSE, GUEST_PORT, host_port, 0);
+        kick(vbus, vctx, vm, TX);
+    }
+
+    // The message, then the SHUTDOWN of the closed host socket
+    uint32 received = 0;
+    while (ok && wait_packet(vbus, vctx, vm, hdr, data, 1000)) {
+        if (hdr.op == VIRTIO_VSOCK_OP_RW) {
+            received += hdr.len;
+            continue;
+        }
+        ok = hdr.op == VIRTIO_VSOCK_OP_SHUTDOWN;
+        break;
+    }
+
+    if (ok) {
+        vm.send(VIRTIO_VSOCK_OP_RST, GUEST_PORT, host_port, received);
+        kick(vbus, vctx, vm, TX);
+    }
+
+    client.join();
+    ok = ok && client_ok && received == sizeof("hello from the host");
+    INFO("Host -> guest: connection from host port %u, %u bytes received", host_port, received);
+    return ok;
+}
+
+int
+main() {
+    Platform_ctx ctx;
+    Vbus::Bus vbus;
+    Model::GicD gicd(Model::GIC_V2, 1, nullptr);
+
+    bool ok = gicd.init();
+    ASSERT(ok);
+
+    ok = Model::Cpu::init(1);
+    ASSERT(ok);
+
+    Dummy_vcpu vcpu(gicd);
+    ok = vcpu.setup(&ctx);
+    ASSERT(ok);
+
+    ok = vbus.register_device(&gicd, 0x43000, 0x1000);
+    ASSERT(ok == true);
+
+    INFO("== Virtio Sock Test application ==");
+
+    // Echo server of the host
+    sockaddr_un addr;
+    int listen_fd = host_socket();
+    ok = listen_fd >= 0 && host_path(addr, ECHO_PORT);
+    ASSERT(ok);
+    unlink(addr.sun_path);
+    ok = bind(listen_fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0 && listen(listen_fd, 1) == 0;
+    ASSERT(ok);
+    std::thread echo([listen_fd] { echo_server(listen_fd); });
+
+    Model::VsockEngine::Config engine_config;
+    engine_config.uds_path = UDS_PATH;
+    engine_config.buf_alloc = HOST_BUF_ALLOC;
+
+    Sock_vm vm(gicd, "vml-virtio-sock-example", engine_config);
+    ok = vm.init(&ctx);
+    ASSERT(ok);
+
+    RegAccessor regs(ctx, 0);
+    VcpuCtx vctx{&regs, 0};
+
+    ok = vbus.register_device(&vm.device(), vm.mmio_base(), 0x1000);
+    ASSERT(ok == true);
+
+    init_virtio_sock(vbus, vctx, vm);
+    wait_sm.acquire();
+    vm.post_rx_buffers();
+    kick(vbus, vctx, vm, RX);
+    INFO("Virtio device initialized");
+
+    ok = guest_to_host(vbus, vctx, vm) && refused(vbus, vctx, vm) && host_to_guest(vbus, vctx, vm);
+
+    // Wait for the engine to process the last RST
+    for (unsigned tries = 0; tries < 1000 && vm.engine().connections() != 0; tries++)
+        usleep(1000);
+
+    const Model::VsockEngine::Stats &stats = vm.engine().stats();
+    INFO("Engine: TX %llu packets (%llu bytes), RX %llu packets (%llu bytes), %llu credit updates, %llu resets, "
+         "%u connections left",
+         static_cast<unsigned long long>(stats.tx_packets), static_cast<unsigned long long>(stats.tx_bytes),
+         static_cast<unsigned long long>(stats.rx_packets), static_cast<unsigned long long>(stats.rx_bytes),
+         static_cast<unsigned long long>(stats.credit_updates), static_cast<unsigned long long>(stats.resets),
+         vm.engine().connections());
+
+    ok = ok && vm.engine().connections() == 0;
+
+    shutdown(listen_fd, SHUT_RDWR);
+    echo.join();
+    close(listen_fd);
+    unlink(addr.sun_path);
+
+    ASSERT(ok);
+    return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+#pragma once
+
+/*! \file Minimal io_uring wrapper, built directly on top of the system calls
+ */
+
+#include <platform/types.hpp>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <algorithm>
+#include <cerrno>
+#include <linux/io_uring.h>
+#include <platform/compiler.hpp>
+#include <platform/string.hpp>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Platform {
+    class IoUring;
+}
+
+/*! \brief Asynchronous I/O submission and completion rings
+ *
+ *  One instance is meant to be driven by a single thread. Requests are prepared with the
+ *  prep_* functions, handed to the kernel with submit() and their results are collected
+ *  with next_completion(). The caller must not have more requests in flight than the number
+ *  of entries requested at init().
+ *
+ *  io_uring is a Linux facility: on other hosts, init() fails and the callers fall back to
+ *  synchronous I/O.
+ */
+#ifdef __linux__
+class Platform::IoUring {
+public:
+    IoUring() = default;
+    ~IoUring() { destroy(); }
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    /*! \brief Create the rings
+     *  \param entries Number of submission entries, rounded up by the kernel to a power of 2
+     *  \return true on success, false if io_uring is not available on this host
+     */
+    bool init(uint32 entries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+
+        _fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        if (_fd < 0)
+            return false;
+
+        _sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(uint32);
+        _cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0u)
+            _sq_map_sz = _cq_map_sz = std::max(_sq_map_sz, _cq_map_sz);
+
+        _sq_map = mmap(nullptr, _sq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if (_sq_map == MAP_FAILED) {
+            _sq_map = nullptr;
+            destroy();
+            return false;
+        }
+
+        if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0u) {
+            _cq_map = _sq_map;
+        } else {
+            _cq_map = mmap(nullptr, _cq_map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+            if (_cq_map == MAP_FAILED) {
+                _cq_map = nullptr;
+                destroy();
+                return false;
+            }
+        }
+
+        _sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, _sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            destroy();
+            return false;
+        }
+        _sqes = static_cast<io_uring_sqe *>(sqes);
+
+        char *sq = static_cast<char *>(_sq_map);
+        char *cq = static_cast<char *>(_cq_map);
+
+        _sq_head = reinterpret_cast<uint32 *>(sq + p.sq_off.head);
+        _sq_tail = reinterpret_cast<uint32 *>(sq + p.sq_off.tail);
+        _sq_mask = *reinterpret_cast<uint32 *>(sq + p.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<uint32 *>(sq + p.sq_off.array);
+        _sq_entries = p.sq_entries;
+
+        _cq_head = reinterpret_cast<uint32 *>(cq + p.cq_off.head);
+        _cq_tail = reinterpret_cast<uint32 *>(cq + p.cq_off.tail);
+        _cq_mask = *reinterpret_cast<uint32 *>(cq + p.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+
+        _local_tail = *_sq_tail;
+        return true;
+    }
+
+    void destroy() {
+        if (_sqes != nullptr)
+            munmap(_sqes, _sqes_sz);
+        if (_cq_map != nullptr && _cq_map != _sq_map)
+            munmap(_cq_map, _cq_map_sz);
+        if (_sq_map != nullptr)
+            munmap(_sq_map, _sq_map_sz);
+        if (_fd >= 0)
+            close(_fd);
+
+        _sqes = nullptr;
+        _cq_map = nullptr;
+        _sq_map = nullptr;
+        _fd = -1;
+    }
+
+    bool is_valid() const { return _fd >= 0; }
+
+    bool prep_readv(int fd, const iovec *iov, uint32 iovcnt, uint64 off, uint64 user_data) {
+        return prep(IORING_OP_READV, fd, reinterpret_cast<uint64>(iov), iovcnt, off, 0, user_data, false);
+    }
+
+    bool prep_writev(int fd, const iovec *iov, uint32 iovcnt, uint64 off, uint64 user_data) {
+        return prep(IORING_OP_WRITEV, fd, reinterpret_cast<uint64>(iov), iovcnt, off, 0, user_data, false);
+    }
+
+    /*! \brief Prepare a data sync of [fd]
+     *  \param drain Start it only once all the requests submitted before it have completed. The
+     *         kernel does not order the requests otherwise, not even the ones of a single submit().
+     */
+    bool prep_fdatasync(int fd, uint64 user_data, bool drain) {
+        return prep(IORING_OP_FSYNC, fd, 0, 0, 0, IORING_FSYNC_DATASYNC, user_data, drain);
+    }
+
+    /*! \brief Hand over all the prepared requests to the kernel
+     *  \param wait_nr Number of completions to wait for before returning
+     *  \return the number of requests consumed by the kernel, or a negative errno
+     */
+    int submit(uint32 wait_nr = 0) {
+        uint32 to_submit = _local_tail - *_sq_tail;
+
+        __atomic_store_n(_sq_tail, _local_tail, __ATOMIC_RELEASE);
+        if (to_submit == 0 && wait_nr == 0)
+            return 0;
+
+        long ret = syscall(__NR_io_uring_enter, _fd, to_submit, wait_nr, wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0);
+        return ret < 0 ? -errno : static_cast<int>(ret);
+    }
+
+    /*! \brief Consume one completion, if any
+     *  \param user_data Cookie given when the request was prepared
+     *  \param res Result of the request: number of bytes or negative errno
+     *  \return true if a completion was consumed
+     */
+    bool next_completion(uint64 &user_data, int32 &res) {
+        uint32 head = *_cq_head;
+
+        if (head == __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+
+        const io_uring_cqe &cqe = _cqes[head & _cq_mask];
+        user_data = cqe.user_data;
+        res = cqe.res;
+
+        __atomic_store_n(_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    bool prep(uint8 op, int fd, uint64 addr, uint32 len, uint64 off, uint32 op_flags, uint64 user_data, bool drain) {
+        if (__UNLIKELY__(_local_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries))
+            return false;
+
+        uint32 idx = _local_tail & _sq_mask;
+        io_uring_sqe &sqe = _sqes[idx];
+
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = op;
+        sqe.flags = drain ? IOSQE_IO_DRAIN : 0;
+        sqe.fd = fd;
+        sqe.addr = addr;
+        sqe.len = len;
+        sqe.off = off;
+        sqe.fsync_flags = op_flags;
+        sqe.user_data = user_data;
+
+        _sq_array[idx] = idx;
+        _local_tail++;
+        return true;
+    }
+
+    int _fd{-1};
+
+    void *_sq_map{nullptr};
+    void *_cq_map{nullptr};
+    size_t _sq_map_sz{0};
+    size_t _cq_map_sz{0};
+    io_uring_sqe *_sqes{nullptr};
+    size_t _sqes_sz{0};
+
+    uint32 *_sq_head{nullptr};
+    uint32 *_sq_tail{nullptr};
+    uint32 *_sq_array{nullptr};
+    uint32 _sq_mask{0};
+    uint32 _sq_entries{0};
+    uint32 _local_tail{0};
+
+    uint32 *_cq_head{nullptr};
+    uint32 *_cq_tail{nullptr};
+    uint32 _cq_mask{0};
+    io_uring_cqe *_cqes{nullptr};
+};
+
+#else
+
+class Platform::IoUring {
+public:
+    bool init(uint32) { return false; }
+    void destroy() {}
+    bool is_valid() const { return false; }
+    bool prep_readv(int, const iovec *, uint32, uint64, uint64) { return false; }
+    bool prep_writev(int, const iovec *, uint32, uint64, uint64) { return false; }
+    bool prep_fdatasync(int, uint64, bool) { return false; }
+    int submit(uint32 = 0) { return 0; }
+    bool next_completion(uint64 &, int32 &) { return false; }
+};
+
+#endif
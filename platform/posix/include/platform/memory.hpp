@@ -7,6 +7,8 @@
  */
 #pragma once
 
+#include <cerrno>
+#include <fcntl.h>
 #include <math.h>
 #include <platform/bits.hpp>
 #include <platform/mempage.hpp>
@@ -15,6 +17,10 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/memfd.h>
+#endif
+
 // NOLINTBEGIN(readability-convert-member-functions-to-static)
 
 typedef uint64 GFN;
@@ -29,8 +35,33 @@ namespace Platform::Mem {
     class MemDescr;
     class Cred;
 
+    /*! \brief Host pages backing a memory descriptor
+     *  \note Huge pages are a Linux facility: on other hosts, the memory is backed by base pages
+     *        whatever the descriptor says
+     */
+    enum class HugePages : uint8 {
+        NONE,       /*!< Base pages of the host */
+        THP,        /*!< Transparent huge pages: mappings are aligned and advised with MADV_HUGEPAGE */
+        HUGETLB_2M, /*!< 2 MiB pages of hugetlbfs, see create_mem() */
+        HUGETLB_1G, /*!< 1 GiB pages of hugetlbfs, see create_mem() */
+    };
+
+    static constexpr size_t HUGE_PAGE_2M = 2ul << 20;
+    static constexpr size_t HUGE_PAGE_1G = 1ul << 30;
+
+#ifdef __linux__
+    static inline int create_mem(const char *name, size_t size, HugePages huge);
+#endif
     static inline void *map_mem(const MemDescr &descr, mword offset, size_t size, int flags, MemSel);
     static inline bool unmap_mem(const void *addr, size_t size);
+
+    static inline bool dirty_tracking_supported();
+    static inline bool dirty_clear();
+    static inline bool dirty_pages(const void *addr, size_t size, uint64 *bitmap);
+
+    static inline bool private_pages(const void *addr, size_t size, uint64 *bitmap);
+    static inline bool discard_private(void *addr, size_t size);
+    static inline bool write_pages(int fd, const void *addr, size_t size, const uint64 *bitmap);
 };
 
 class Platform::Mem::Cred {
@@ -45,23 +76,63 @@ public:
 
 class Platform::Mem::MemDescr {
 public:
-    MemDescr(MemSel fd, Cred) : _memrange_sel(fd) {}
+    MemDescr(MemSel fd, Cred, HugePages huge = HugePages::NONE) : _memrange_sel(fd), _huge(huge) {}
 
-    explicit MemDescr(MemSel fd) : _memrange_sel(fd) {}
+    explicit MemDescr(MemSel fd, HugePages huge = HugePages::NONE) : _memrange_sel(fd), _huge(huge) {}
 
     MemDescr() : _memrange_sel(~0UL) {}
 
+    /*! \brief Descriptor of a copy-on-write view of [fd]: the file is the read-only base image,
+     *         the pages written through a mapping are private to it and never reach the file
+     *  \note Every mapping of the descriptor has its own copy: the guest memory must be accessed
+     *        through a single one, see Model::SimpleAS::map_host()
+     */
+    static MemDescr cow(MemSel fd, HugePages huge = HugePages::NONE) {
+        MemDescr descr(fd, huge);
+        descr._cow = true;
+        return descr;
+    }
+
     MemSel msel() const { return _memrange_sel; }
     Platform::Mem::Cred cred() const { return _cred; }
+    HugePages huge_pages() const { return _huge; }
+
+    /*! \brief Size of the pages backing this memory: mappings are aligned on it
+     *  \note Transparent huge pages are not guaranteed, the kernel may fall back to base pages
+     */
+    size_t page_size() const {
+#ifdef __linux__
+        switch (_huge) {
+        case HugePages::THP:
+        case HugePages::HUGETLB_2M:
+            return HUGE_PAGE_2M;
+        case HugePages::HUGETLB_1G:
+            return HUGE_PAGE_1G;
+        default:
+            break;
+        }
+#endif
+        return static_cast<size_t>(getpagesize());
+    }
+
+    bool hugetlb() const {
+#ifdef __linux__
+        return _huge == HugePages::HUGETLB_2M || _huge == HugePages::HUGETLB_1G;
+#else
+        return false;
+#endif
+    }
+    bool copy_on_write() const { return _cow; }
 
 private:
     MemSel _memrange_sel{~0UL};
     Platform::Mem::Cred _cred;
+    HugePages _huge{HugePages::NONE};
+    bool _cow{false};
 };
 
 static inline mword
-align_mmap(mword &offset, mword &size) {
-    size_t pagesize = static_cast<size_t>(getpagesize());
+align_mmap(mword &offset, mword &size, size_t pagesize = static_cast<size_t>(getpagesize())) {
     mword aligned_off = align_dn(offset, pagesize);
     mword offset_in_page = offset - aligned_off;
     size_t aligned_size = align_up(size + offset_in_page, pagesize);
@@ -72,10 +143,92 @@ align_mmap(mword &offset, mword &size) {
     return offset_in_page;
 }
 
+#ifdef __linux__
+/*
+ * Create [size] bytes of memory to back a guest, [size] is rounded up to the page size. Hugetlbfs
+ * pages come from the pool of the host (vm.nr_hugepages and the like): the creation fails if the
+ * pool cannot hold [size]. Returns the file descriptor to give to MemDescr, -1 on failure.
+ */
+static inline int
+Platform::Mem::create_mem(const char *name, size_t size, HugePages huge) {
+    unsigned int flags = MFD_CLOEXEC;
+    size_t page_size = static_cast<size_t>(getpagesize());
+
+    if (huge == HugePages::HUGETLB_2M) {
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+        page_size = HUGE_PAGE_2M;
+    } else if (huge == HugePages::HUGETLB_1G) {
+        flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+        page_size = HUGE_PAGE_1G;
+    }
+
+    int fd = memfd_create(name, flags);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+
+    if (ftruncate(fd, static_cast<off_t>(align_up(size, page_size))) != 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+#endif
+
+/*
+ * A range of a file is mapped at an address aligned like its offset in the file, modulo the huge
+ * page size: this is what lets the kernel use transparent huge pages for it. The slack of the
+ * reservation is released once the mapping is in place.
+ */
+static inline void *
+map_mem_aligned(int fd, mword offset, size_t size, int flags, int share, size_t align) {
+    size_t resv_size = size + align;
+    void *resv = mmap(nullptr, resv_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (resv == MAP_FAILED)
+        return MAP_FAILED;
+
+    mword resv_start = reinterpret_cast<mword>(resv);
+    mword start = align_up(resv_start, align) + (offset % align);
+    if (start - align >= resv_start)
+        start -= align;
+
+    void *res = mmap(reinterpret_cast<void *>(start), size, flags, share | MAP_FIXED, fd, static_cast<long>(offset));
+    if (res == MAP_FAILED) {
+        munmap(resv, resv_size);
+        return MAP_FAILED;
+    }
+
+    if (start > resv_start)
+        munmap(resv, start - resv_start);
+    if (start + size < resv_start + resv_size)
+        munmap(reinterpret_cast<void *>(start + size), resv_start + resv_size - (start + size));
+
+    return res;
+}
+
 static inline void *
 Platform::Mem::map_mem(const Platform::Mem::MemDescr &descr, mword offset, size_t size, int flags, MemSel) {
-    mword offset_in_page = align_mmap(offset, size);
-    void *res = mmap(nullptr, size, flags, MAP_SHARED, static_cast<int>(descr.msel()), static_cast<long>(offset));
+    // Hugetlbfs memory can only be mapped by whole huge pages
+    mword offset_in_page = descr.hugetlb() ? align_mmap(offset, size, descr.page_size()) : align_mmap(offset, size);
+    int fd = static_cast<int>(descr.msel());
+    int share = descr.copy_on_write() ? MAP_PRIVATE : MAP_SHARED;
+    void *res;
+
+#ifdef __linux__
+    if (descr.huge_pages() == HugePages::THP && size >= descr.page_size()) {
+        res = map_mem_aligned(fd, offset, size, flags, share, descr.page_size());
+        if (res != MAP_FAILED && madvise(res, size, MADV_HUGEPAGE) != 0)
+            perror("madvise");
+    } else {
+        res = mmap(nullptr, size, flags, share, fd, static_cast<long>(offset));
+    }
+#else
+    res = mmap(nullptr, size, flags, share, fd, static_cast<long>(offset));
+#endif
+
     if (res == MAP_FAILED) {
         perror("mmap");
         return nullptr;
@@ -84,14 +237,211 @@ Platform::Mem::map_mem(const Platform::Mem::MemDescr &descr, mword offset, size_
     return reinterpret_cast<void *>(reinterpret_cast<mword>(res) + offset_in_page);
 }
 
+/*
+ * The kernel refuses to unmap hugetlbfs memory from an address that is not aligned on its huge
+ * page size. The descriptor is not known here: the huge page boundaries are tried in turn when
+ * the base page one is refused, a refused munmap leaves the mappings untouched.
+ */
 static inline bool
 Platform::Mem::unmap_mem(const void *addr, size_t size) {
     mword offset = reinterpret_cast<mword>(addr);
-    align_mmap(offset, size);
-    int r = munmap(reinterpret_cast<void *>(offset), size);
+    size_t len = size;
+    align_mmap(offset, len);
+    int r = munmap(reinterpret_cast<void *>(offset), len);
+
+#ifdef __linux__
+    static constexpr size_t HUGE_SIZES[] = {HUGE_PAGE_2M, HUGE_PAGE_1G};
+    for (size_t i = 0; r != 0 && errno == EINVAL && i < sizeof(HUGE_SIZES) / sizeof(HUGE_SIZES[0]); i++) {
+        offset = reinterpret_cast<mword>(addr);
+        len = size;
+        align_mmap(offset, len, HUGE_SIZES[i]);
+        r = munmap(reinterpret_cast<void *>(offset), len);
+    }
+#endif
+
     if (r != 0)
         perror("munmap");
     return r == 0;
 }
 
+/*
+ * Write tracking relies on the soft-dirty bit of the page table entries: writing "4" to
+ * /proc/self/clear_refs clears it for the whole process, and /proc/self/pagemap reports it for
+ * every page written through a given mapping since then. Only the writes made through that
+ * mapping are seen, not the ones made through other mappings of the same memory.
+ */
+namespace Platform::Mem {
+    static constexpr uint64 PAGEMAP_SOFT_DIRTY = 1ull << 55;
+    static constexpr uint64 PAGEMAP_FILE = 1ull << 61; // File page or shared anonymous page
+    static constexpr uint64 PAGEMAP_SWAPPED = 1ull << 62;
+    static constexpr uint64 PAGEMAP_PRESENT = 1ull << 63;
+    static constexpr size_t PAGEMAP_CHUNK = 512;
+
+    static inline int
+    pagemap_fd() {
+        static const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        return fd;
+    }
+
+    static inline bool
+    pagemap_read(const void *addr, uint64 *entries, size_t count) {
+        size_t pagesize = static_cast<size_t>(getpagesize());
+        off_t off = static_cast<off_t>((reinterpret_cast<mword>(addr) / pagesize) * sizeof(uint64));
+        size_t len = count * sizeof(uint64);
+
+        return pread(pagemap_fd(), entries, len, off) == static_cast<ssize_t>(len);
+    }
+};
+
+/*
+ * The kernel may not track soft-dirty bits (CONFIG_MEM_SOFT_DIRTY): a page of a new mapping is
+ * always reported dirty when it does.
+ */
+static inline bool
+Platform::Mem::dirty_tracking_supported() {
+    static const bool supported = [] {
+        if (pagemap_fd() < 0 || access("/proc/self/clear_refs", W_OK) != 0)
+            return false;
+
+        size_t pagesize = static_cast<size_t>(getpagesize());
+        void *page = mmap(nullptr, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED)
+            return false;
+
+        *static_cast<volatile char *>(page) = 1;
+        uint64 entry = 0;
+        bool res = pagemap_read(page, &entry, 1) && (entry & PAGEMAP_SOFT_DIRTY) != 0;
+        munmap(page, pagesize);
+        return res;
+    }();
+
+    return supported;
+}
+
+static inline bool
+Platform::Mem::dirty_clear() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    bool res = write(fd, "4", 1) == 1;
+    close(fd);
+    return res;
+}
+
+/*
+ * Set the bit of every page of [addr, addr + size) written since the last dirty_clear() in
+ * [bitmap], one bit per page. [addr] must be page aligned.
+ */
+static inline bool
+Platform::Mem::dirty_pages(const void *addr, size_t size, uint64 *bitmap) {
+    size_t pagesize = static_cast<size_t>(getpagesize());
+    size_t pages = align_up(size, pagesize) / pagesize;
+    uint64 entries[PAGEMAP_CHUNK];
+
+    for (size_t i = 0; i < (pages + 63) / 64; i++)
+        bitmap[i] = 0;
+
+    for (size_t first = 0; first < pages; first += PAGEMAP_CHUNK) {
+        size_t count = min(pages - first, PAGEMAP_CHUNK);
+
+        if (!pagemap_read(static_cast<const char *>(addr) + first * pagesize, entries, count))
+            return false;
+
+        for (size_t i = 0; i < count; i++) {
+            if ((entries[i] & PAGEMAP_SOFT_DIRTY) != 0)
+                bitmap[(first + i) / 64] |= 1ull << ((first + i) % 64);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Set the bit of every page of the copy-on-write mapping [addr, addr + size) that has its own copy
+ * in [bitmap], one bit per page: the ones written since the mapping was created or last discarded.
+ * The other pages are those of the file. [addr] must be page aligned.
+ */
+static inline bool
+Platform::Mem::private_pages(const void *addr, size_t size, uint64 *bitmap) {
+    size_t pagesize = static_cast<size_t>(getpagesize());
+    size_t pages = align_up(size, pagesize) / pagesize;
+    uint64 entries[PAGEMAP_CHUNK];
+
+    if (pagemap_fd() < 0)
+        return false;
+
+    for (size_t i = 0; i < (pages + 63) / 64; i++)
+        bitmap[i] = 0;
+
+    for (size_t first = 0; first < pages; first += PAGEMAP_CHUNK) {
+        size_t count = min(pages - first, PAGEMAP_CHUNK);
+
+        if (!pagemap_read(static_cast<const char *>(addr) + first * pagesize, entries, count))
+            return false;
+
+        for (size_t i = 0; i < count; i++) {
+            bool used = (entries[i] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) != 0;
+            if (used && (entries[i] & PAGEMAP_FILE) == 0)
+                bitmap[(first + i) / 64] |= 1ull << ((first + i) % 64);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Drop the private copies of the pages of a copy-on-write mapping: the next accesses see the
+ * content of the file again.
+ */
+static inline bool
+Platform::Mem::discard_private(void *addr, size_t size) {
+    if (madvise(addr, size, MADV_DONTNEED) != 0) {
+        perror("madvise");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Write the pages of [addr, addr + size) to [fd], at their offset from [addr]. Only the pages set
+ * in [bitmap] are written, all of them if it is nullptr. Runs of pages are written at once.
+ */
+static inline bool
+Platform::Mem::write_pages(int fd, const void *addr, size_t size, const uint64 *bitmap) {
+    size_t pagesize = static_cast<size_t>(getpagesize());
+    size_t pages = align_up(size, pagesize) / pagesize;
+    size_t page = 0;
+
+    while (page < pages) {
+        size_t first = page;
+
+        if (bitmap != nullptr) {
+            while (first < pages && (bitmap[first / 64] & (1ull << (first % 64))) == 0)
+                first++;
+            page = first;
+            while (page < pages && (bitmap[page / 64] & (1ull << (page % 64))) != 0)
+                page++;
+        } else {
+            page = pages;
+        }
+
+        size_t off = first * pagesize;
+        size_t end = min(page * pagesize, size);
+        while (off < end) {
+            ssize_t n = pwrite(fd, static_cast<const char *>(addr) + off, end - off, static_cast<off_t>(off));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                perror("pwrite");
+                return false;
+            }
+            off += static_cast<size_t>(n);
+        }
+    }
+
+    return true;
+}
+
 // NOLINTEND(readability-convert-member-functions-to-static)
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+#pragma once
+
+/*! \file NUMA topology of the host, placement of memory and threads on its nodes
+ *
+ *  The topology is read from sysfs. A host without NUMA information is seen as a single node
+ *  holding all the CPUs. Placement is only implemented on Linux: other hosts are a single node
+ *  on which nothing can be bound.
+ *
+ *  This header is meant for translation units only: the public headers of the models do not
+ *  include it, so that they stay free of the Linux headers.
+ */
+
+#include <platform/types.hpp>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// NOLINTBEGIN(readability-convert-member-functions-to-static)
+
+namespace Platform::Numa {
+    static constexpr uint16 NO_NODE = 0xffff;
+    static constexpr uint16 MAX_NODES = 64;
+
+    static inline uint16 node_count();
+    static inline uint16 node_of_cpu(uint64 cpu);
+    static inline bool bind_mem(void *addr, size_t size, uint16 node);
+    static inline bool bind_thread(uint16 node);
+};
+
+#ifdef __linux__
+
+namespace Platform::Numa {
+    static inline bool cpus_of_node(uint16 node, cpu_set_t &cpus);
+
+    /*
+     * Parse a sysfs list such as "0-3,8,10-11" and call [fn] for every element.
+     */
+    template<typename FN>
+    static inline bool parse_list(const char *path, FN fn) {
+        char buf[256];
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (n <= 0)
+            return false;
+        buf[n] = '\0';
+
+        const char *p = buf;
+        while (*p >= '0' && *p <= '9') {
+            uint64 first = 0, last;
+            while (*p >= '0' && *p <= '9')
+                first = first * 10 + static_cast<uint64>(*p++ - '0');
+
+            last = first;
+            if (*p == '-') {
+                p++;
+                last = 0;
+                while (*p >= '0' && *p <= '9')
+                    last = last * 10 + static_cast<uint64>(*p++ - '0');
+            }
+
+            for (uint64 i = first; i <= last; i++)
+                fn(i);
+
+            if (*p == ',')
+                p++;
+        }
+
+        return true;
+    }
+};
+
+static inline uint16
+Platform::Numa::node_count() {
+    static const uint16 count = [] {
+        uint64 last = 0;
+        if (!parse_list("/sys/devices/system/node/online", [&last](uint64 node) { last = node; }))
+            return uint16(1);
+
+        return static_cast<uint16>(last < MAX_NODES ? last + 1 : MAX_NODES);
+    }();
+
+    return count;
+}
+
+static inline bool
+Platform::Numa::cpus_of_node(uint16 node, cpu_set_t &cpus) {
+    char path[64];
+
+    CPU_ZERO(&cpus);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+    if (!parse_list(path, [&cpus](uint64 cpu) {
+            if (cpu < CPU_SETSIZE)
+                CPU_SET(cpu, &cpus);
+        }))
+        return node == 0 && node_count() == 1 && sched_getaffinity(0, sizeof(cpus), &cpus) == 0;
+
+    return CPU_COUNT(&cpus) != 0;
+}
+
+/*
+ * The node of every CPU is read once, like the node count: the topology of the host does not
+ * change while we run.
+ */
+static inline uint16
+Platform::Numa::node_of_cpu(uint64 cpu) {
+    struct CpuNodes {
+        uint16 node[CPU_SETSIZE];
+    };
+
+    static const CpuNodes map = [] {
+        CpuNodes res;
+        for (size_t i = 0; i < CPU_SETSIZE; i++)
+            res.node[i] = NO_NODE;
+
+        for (uint16 node = 0; node < node_count(); node++) {
+            cpu_set_t cpus;
+            if (!cpus_of_node(node, cpus))
+                continue;
+
+            for (size_t i = 0; i < CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &cpus) && res.node[i] == NO_NODE)
+                    res.node[i] = node;
+            }
+        }
+
+        return res;
+    }();
+
+    return cpu < CPU_SETSIZE ? map.node[cpu] : NO_NODE;
+}
+
+/*
+ * Allocate the pages of [addr, addr + size) on [node] only, and move the ones already allocated.
+ * On memory shared through a file, the policy applies to the file, whatever the mapping used.
+ */
+static inline bool
+Platform::Numa::bind_mem(void *addr, size_t size, uint16 node) {
+    if (node >= MAX_NODES)
+        return false;
+
+    unsigned long mask = 1ul << node;
+    long r = syscall(SYS_mbind, addr, size, MPOL_BIND, &mask, MAX_NODES + 1, MPOL_MF_MOVE);
+    if (r != 0)
+        perror("mbind");
+    return r == 0;
+}
+
+/*
+ * Restrict the calling thread to the CPUs of [node].
+ */
+static inline bool
+Platform::Numa::bind_thread(uint16 node) {
+    cpu_set_t cpus;
+    if (!cpus_of_node(node, cpus))
+        return false;
+
+    return sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+}
+
+#else
+
+static inline uint16
+Platform::Numa::node_count() {
+    return 1;
+}
+
+static inline uint16
+Platform::Numa::node_of_cpu(uint64) {
+    return NO_NODE;
+}
+
+static inline bool
+Platform::Numa::bind_mem(void *, size_t, uint16) {
+    return false;
+}
+
+static inline bool
+Platform::Numa::bind_thread(uint16) {
+    return false;
+}
+
+#endif
+
+// NOLINTEND(readability-convert-member-functions-to-static)
@@ -14,3 +14,14 @@
 #include <time.h>
 
 typedef uint64 Tsc;
+
+/*! \brief Read the monotonic clock
+ *  \return the current time in nanoseconds, from an unspecified starting point
+ */
+inline uint64
+now_ns() {
+    timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64>(ts.tv_sec) * 1000000000ull + static_cast<uint64>(ts.tv_nsec);
+}
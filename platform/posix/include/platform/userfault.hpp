@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2025 BlueRock Security, Inc.
+ * All rights reserved.
+ *
+ * This software is distributed under the terms of the BlueRock Open-Source License.
+ * See the LICENSE-BlueRock file in the repository root for details.
+ */
+#pragma once
+
+/*! \file Minimal userfaultfd wrapper: missing-page faults of a range served by a thread of ours
+ */
+
+#include <platform/errno.hpp>
+#include <platform/types.hpp>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Platform {
+    class UserFault;
+}
+
+/*! \brief Missing-page faults of registered ranges, reported to user space
+ *
+ *  A thread touching a page of a registered range that has no page yet blocks until the page is
+ *  provided with copy(). Anonymous, shmem (memfd) and hugetlbfs mappings can be registered, not
+ *  private file mappings. The faults raised by the kernel on behalf of the process, e.g. by a
+ *  system call or a hypervisor, are reported as well: this may require the
+ *  vm.unprivileged_userfaultfd sysctl or CAP_SYS_PTRACE.
+ *
+ *  userfaultfd is a Linux facility: on other hosts, init() fails.
+ */
+#ifdef __linux__
+class Platform::UserFault {
+public:
+    UserFault() = default;
+    ~UserFault() { destroy(); }
+
+    UserFault(const UserFault &) = delete;
+    UserFault &operator=(const UserFault &) = delete;
+
+    /*! \brief Open the file descriptors and negotiate the API
+     *  \return true on success, false if userfaultfd is not available to this process
+     */
+    bool init() {
+        _fd = static_cast<int>(syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK));
+        _wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (_fd < 0 || _wake_fd < 0) {
+            destroy();
+            return false;
+        }
+
+        uffdio_api api{};
+        api.api = UFFD_API;
+        if (ioctl(_fd, UFFDIO_API, &api) != 0) {
+            destroy();
+            return false;
+        }
+
+        return true;
+    }
+
+    /*! \brief Report the missing-page faults of [addr, addr + size), page aligned
+     */
+    bool register_missing(void *addr, size_t size) {
+        uffdio_register reg{};
+        reg.range.start = reinterpret_cast<mword>(addr);
+        reg.range.len = size;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+        if (ioctl(_fd, UFFDIO_REGISTER, &reg) != 0)
+            return false;
+
+        return (reg.ioctls & (1ull << _UFFDIO_COPY)) != 0;
+    }
+
+    bool unregister(void *addr, size_t size) {
+        uffdio_range range{reinterpret_cast<mword>(addr), size};
+        return ioctl(_fd, UFFDIO_UNREGISTER, &range) == 0;
+    }
+
+    /*! \brief Wait for the next missing-page fault
+     *  \param addr Faulting address, not aligned
+     *  \return Errno::NONE if a fault was read, Errno::AGAIN if the wait was interrupted, see
+     *          interrupt(), or got another event, Errno::INVAL on error
+     */
+    Errno next_fault(mword &addr) {
+        pollfd fds[2] = {{_fd, POLLIN, 0}, {_wake_fd, POLLIN, 0}};
+
+        int n = poll(fds, 2, -1);
+        if (n < 0)
+            return errno == EINTR ? Errno::AGAIN : Errno::INVAL;
+        if ((fds[0].revents & POLLIN) == 0)
+            return (fds[0].revents & (POLLERR | POLLHUP)) != 0 ? Errno::INVAL : Errno::AGAIN;
+
+        uffd_msg msg;
+        ssize_t r = read(_fd, &msg, sizeof(msg));
+        if (r != static_cast<ssize_t>(sizeof(msg)))
+            return (r < 0 && errno != EAGAIN && errno != EINTR) ? Errno::INVAL : Errno::AGAIN;
+        if (msg.event != UFFD_EVENT_PAGEFAULT)
+            return Errno::AGAIN;
+
+        addr = static_cast<mword>(msg.arg.pagefault.address);
+        return Errno::NONE;
+    }
+
+    /*! \brief Provide the pages of [dst, dst + size) with the content of [src] and wake up the
+     *         threads waiting for them
+     *  \param copied Bytes provided, also when the copy stopped early
+     *  \return Errno::NONE if everything was copied, Errno::AGAIN if the copy stopped early,
+     *          Errno::EXIST if the first page already exists, Errno::INVAL on error
+     */
+    Errno copy(void *dst, const void *src, size_t size, size_t &copied) {
+        uffdio_copy cp{};
+        cp.dst = reinterpret_cast<mword>(dst);
+        cp.src = reinterpret_cast<mword>(src);
+        cp.len = size;
+
+        copied = 0;
+        if (ioctl(_fd, UFFDIO_COPY, &cp) == 0) {
+            copied = size;
+            return Errno::NONE;
+        }
+
+        if (cp.copy > 0)
+            copied = static_cast<size_t>(cp.copy);
+        if (errno == EEXIST && copied == 0)
+            return Errno::EXIST;
+        return (errno == EAGAIN || errno == EEXIST) ? Errno::AGAIN : Errno::INVAL;
+    }
+
+    /*! \brief Wake up the threads waiting for pages of [addr, addr + size) that exist already
+     */
+    bool wake(void *addr, size_t size) {
+        uffdio_range range{reinterpret_cast<mword>(addr), size};
+        return ioctl(_fd, UFFDIO_WAKE, &range) == 0;
+    }
+
+    /*! \brief Make the pending and next waits of next_fault() return Errno::AGAIN
+     */
+    bool interrupt() {
+        uint64 one = 1;
+        return write(_wake_fd, &one, sizeof(one)) == sizeof(one);
+    }
+
+    bool is_valid() const { return _fd >= 0; }
+
+    void destroy() {
+        if (_fd >= 0)
+            close(_fd);
+        if (_wake_fd >= 0)
+            close(_wake_fd);
+        _fd = -1;
+        _wake_fd = -1;
+    }
+
+private:
+    int _fd{-1};
+    int _wake_fd{-1}; // eventfd interrupting next_fault()
+};
+
+#else
+
+class Platform::UserFault {
+public:
+    bool init() { return false; }
+    bool register_missing(void *, size_t) { return false; }
+    bool unregister(void *, size_t) { return false; }
+    Errno next_fault(mword &) { return Errno::INVAL; }
+    Errno copy(void *, const void *, size_t, size_t &copied) {
+        copied = 0;
+        return Errno::INVAL;
+    }
+    bool wake(void *, size_t) { return false; }
+    bool interrupt() { return false; }
+    bool is_valid() const { return false; }
+    void destroy() {}
+};
+
+#endif
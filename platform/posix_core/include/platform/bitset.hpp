@@ -14,7 +14,10 @@
 #include <algorithm>
 #include <bitset>
 #include <cstddef>
+#include <cstdint>
 #include <platform/atomic.hpp>
+#include <platform/compiler.hpp>
+#include <platform/new.hpp>
 
 /*! \brief Bitfield with atomic operations
  *
@@ -70,5 +73,285 @@ private:
     std::atomic<bool> _flags[SIZE];
 };
 
+/*! \brief Word-based bitfield with atomic operations and a summary level
+ *
+ *  Bits are stored in 64-bit words. A second level keeps one bit per word and
+ *  that bit is set whenever the word has at least one bit set. Checking if any
+ *  bit is set only requires looking at the summary words and searching for a bit
+ *  skips empty words.
+ *
+ *  The summary is kept coherent with concurrent 'set' and 'clr': once all the
+ *  pending operations returned, a summary bit is set if and only if the matching
+ *  word is not empty.
+ */
+template<size_t SIZE>
+class AtomicBitmap {
+public:
+    AtomicBitmap() { reset(); }
+
+    /*! \brief Value returned by 'first_set' when no bit was set
+     */
+    static constexpr size_t NOT_FOUND = ~0x0ull;
+
+    /*! \brief Set all bits to unset
+     */
+    void reset() {
+        for (auto& w : _words)
+            w.store(0);
+        for (auto& w : _summary)
+            w.store(0);
+    }
+
+    /*! \brief Check if a bit is set
+     *  \param bit index of the bit to check
+     *  \return true if the bit is set, false otherwise
+     */
+    bool is_set(const size_t bit) const { return (_words[word_idx(bit)].load() & word_mask(bit)) != 0; }
+
+    /*! \brief Set the bit at index
+     *  \param bit index of the bit to set
+     */
+    void set(const size_t bit) {
+        const size_t w = word_idx(bit);
+
+        _words[w].fetch_or(word_mask(bit));
+        _summary[word_idx(w)].fetch_or(word_mask(w));
+    }
+
+    /*! \brief Clear the bit at index
+     *  \param bit index of the bit to clear
+     */
+    void clr(const size_t bit) {
+        const size_t w = word_idx(bit);
+
+        if ((_words[w].fetch_and(~word_mask(bit)) & ~word_mask(bit)) != 0)
+            return;
+
+        _summary[word_idx(w)].fetch_and(~word_mask(w));
+        // A concurrent 'set' may have filled the word again before the summary was cleared
+        if (_words[w].load() != 0)
+            _summary[word_idx(w)].fetch_or(word_mask(w));
+    }
+
+    /*! \brief Check if at least one bit is set
+     *  \return true if a bit is set, false otherwise
+     */
+    bool any() const {
+        for (const auto& w : _summary)
+            if (w.load() != 0)
+                return true;
+
+        return false;
+    }
+
+    /*! \brief Check if at least one bit is set, without relying on the summary
+     *  \return true if a bit is set, false otherwise
+     *
+     *  This is meant for consistency checks of the summary level.
+     */
+    bool any_slow() const {
+        for (const auto& w : _words)
+            if (w.load() != 0)
+                return true;
+
+        return false;
+    }
+
+    /*! \brief Search for the first bit set
+     *  \param start first bit that will be considered
+     *  \param len number of bits to consider starting from start
+     *  \return the index of the first bit set or NOT_FOUND
+     */
+    size_t first_set(size_t start, size_t len) const {
+        const size_t end = std::min(start + len, SIZE);
+
+        for (size_t i = start; i < end;) {
+            const size_t w = word_idx(i);
+            const uint64_t bits = _words[w].load() & ~(word_mask(i) - 1);
+
+            if (bits != 0) {
+                const size_t found = (w * BITS_PER_WORD) + static_cast<size_t>(ctz64(bits));
+                return found < end ? found : NOT_FOUND;
+            }
+
+            i = (w + 1) * BITS_PER_WORD;
+        }
+
+        return NOT_FOUND;
+    }
+
+private:
+    static constexpr size_t BITS_PER_WORD = 64;
+    static constexpr size_t NUM_WORDS = (SIZE + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    static constexpr size_t NUM_SUMMARY_WORDS = (NUM_WORDS + BITS_PER_WORD - 1) / BITS_PER_WORD;
+
+    static constexpr size_t word_idx(size_t bit) { return bit / BITS_PER_WORD; }
+    static constexpr uint64_t word_mask(size_t bit) { return 1ull << (bit % BITS_PER_WORD); }
+
+    std::atomic<uint64_t> _words[NUM_WORDS];
+    std::atomic<uint64_t> _summary[NUM_SUMMARY_WORDS];
+};
+
+/*! \brief Two-level atomic bitfield for large and sparsely used index spaces
+ *
+ *  Bits are grouped in leaves of LEAF_SIZE bits (see AtomicBitmap). A leaf is only
+ *  allocated when 'prepare' is called for one of its bits. Bits of a leaf that was not
+ *  prepared read as unset and cannot be set. A summary word keeps track of the leaves
+ *  that have at least one bit set.
+ */
+template<size_t SIZE, size_t LEAF_SIZE>
+class SparseAtomicBitmap {
+    static_assert(SIZE % LEAF_SIZE == 0, "Leaves must cover the bitfield exactly");
+    static_assert(SIZE / LEAF_SIZE <= 64, "The summary must fit in a word");
+
+public:
+    using Leaf = AtomicBitmap<LEAF_SIZE>;
+
+    SparseAtomicBitmap() {
+        for (auto& l : _leaves)
+            l.store(nullptr);
+        _summary.store(0);
+    }
+
+    ~SparseAtomicBitmap() {
+        for (auto& l : _leaves)
+            delete l.load();
+    }
+
+    SparseAtomicBitmap(const SparseAtomicBitmap&) = delete;
+    SparseAtomicBitmap& operator=(const SparseAtomicBitmap&) = delete;
+
+    /*! \brief Value returned by 'first_set' when no bit was set
+     */
+    static constexpr size_t NOT_FOUND = ~0x0ull;
+
+    /*! \brief Allocate the leaf holding a given bit, if needed
+     *  \param bit index of a bit that will be set in the future
+     *  \return true if the leaf is available, false if the allocation failed
+     */
+    bool prepare(const size_t bit) {
+        std::atomic<Leaf*>& slot = _leaves[leaf_idx(bit)];
+
+        if (slot.load() != nullptr)
+            return true;
+
+        Leaf* leaf = new (nothrow) Leaf;
+        if (leaf == nullptr)
+            return false;
+
+        Leaf* expected = nullptr;
+        if (!slot.compare_exchange_strong(expected, leaf))
+            delete leaf; // Prepared concurrently
+
+        return true;
+    }
+
+    /*! \brief Set all bits to unset. Leaves stay allocated.
+     */
+    void reset() {
+        for (auto& l : _leaves)
+            if (l.load() != nullptr)
+                l.load()->reset();
+        _summary.store(0);
+    }
+
+    /*! \brief Check if a bit is set
+     *  \param bit index of the bit to check
+     *  \return true if the bit is set, false otherwise
+     */
+    bool is_set(const size_t bit) const {
+        const Leaf* l = _leaves[leaf_idx(bit)].load();
+        return l != nullptr && l->is_set(bit % LEAF_SIZE);
+    }
+
+    /*! \brief Set the bit at index
+     *  \param bit index of the bit to set
+     *  \return false if the leaf holding the bit was not prepared, true otherwise
+     */
+    bool set(const size_t bit) {
+        const size_t li = leaf_idx(bit);
+        Leaf* l = _leaves[li].load();
+
+        if (l == nullptr)
+            return false;
+
+        l->set(bit % LEAF_SIZE);
+        _summary.fetch_or(1ull << li);
+        return true;
+    }
+
+    /*! \brief Clear the bit at index
+     *  \param bit index of the bit to clear
+     */
+    void clr(const size_t bit) {
+        const size_t li = leaf_idx(bit);
+        Leaf* l = _leaves[li].load();
+
+        if (l == nullptr)
+            return;
+
+        l->clr(bit % LEAF_SIZE);
+        if (l->any())
+            return;
+
+        _summary.fetch_and(~(1ull << li));
+        // A concurrent 'set' may have filled the leaf again before the summary was cleared
+        if (l->any())
+            _summary.fetch_or(1ull << li);
+    }
+
+    /*! \brief Check if at least one bit is set
+     *  \return true if a bit is set, false otherwise
+     */
+    bool any() const { return _summary.load() != 0; }
+
+    /*! \brief Check if at least one bit is set, without relying on the summaries
+     *  \return true if a bit is set, false otherwise
+     */
+    bool any_slow() const {
+        for (const auto& l : _leaves)
+            if (l.load() != nullptr && l.load()->any_slow())
+                return true;
+
+        return false;
+    }
+
+    /*! \brief Search for the first bit set
+     *  \param start first bit that will be considered
+     *  \param len number of bits to consider starting from start
+     *  \return the index of the first bit set or NOT_FOUND
+     */
+    size_t first_set(size_t start, size_t len) const {
+        const size_t end = std::min(start + len, SIZE);
+
+        for (size_t i = start; i < end;) {
+            const uint64_t leaves = _summary.load() >> leaf_idx(i);
+            if (leaves == 0)
+                return NOT_FOUND;
+
+            const size_t li = leaf_idx(i) + static_cast<size_t>(ctz64(leaves));
+            const size_t leaf_start = li * LEAF_SIZE;
+            if (leaf_start >= end)
+                return NOT_FOUND;
+
+            const size_t from = std::max(i, leaf_start);
+            const size_t to = std::min(end, leaf_start + LEAF_SIZE);
+            const size_t found = _leaves[li].load()->first_set(from - leaf_start, to - from);
+            if (found != Leaf::NOT_FOUND)
+                return leaf_start + found;
+
+            i = leaf_start + LEAF_SIZE;
+        }
+
+        return NOT_FOUND;
+    }
+
+private:
+    static constexpr size_t leaf_idx(size_t bit) { return bit / LEAF_SIZE; }
+
+    std::atomic<Leaf*> _leaves[SIZE / LEAF_SIZE];
+    std::atomic<uint64_t> _summary;
+};
+
 template<size_t SIZE>
 using Bitset = std::bitset<SIZE>;
@@ -56,6 +56,18 @@ ffs(unsigned int val) {
     return __builtin_ffs(static_cast<int>(val));
 }
 
+// NOTE: the result is undefined if [val] is zero
+static inline int
+ctz64(unsigned long long val) {
+    return __builtin_ctzll(val);
+}
+
+// NOTE: the result is undefined if [val] is zero
+static inline int
+clz64(unsigned long long val) {
+    return __builtin_clzll(val);
+}
+
 /* provide interception for ABORT_WITH in log.hpp */
 extern void __on_abort();
 
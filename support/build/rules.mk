@@ -65,7 +65,7 @@ endif
 
 LIBDIR := $(VMM_ROOT)devices $(VMM_ROOT)arch $(VMM_ROOT)vcpu $(VMM_ROOT)config $(VMM_ROOT)platform
 LIBS  = vbus vpl011 gic irq_controller vuart timer arch_api simple_as virtio_base virtio_console
-LIBS += virtio_net firmware vcpu_roundup cpu_model virtio_sock vmm_debug posix posix_core lifecycle msr
+LIBS += virtio_net virtio_block firmware vcpu_roundup cpu_model virtio_sock vmm_debug posix posix_core lifecycle msr
 
 find_path_to_lib = $(foreach d, $(LIBDIR), $(wildcard $(d)/$(1)))
 INCLS := $(foreach l, $(LIBS), $(addsuffix /include,$(call find_path_to_lib,$l)))
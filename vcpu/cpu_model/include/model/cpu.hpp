@@ -32,6 +32,13 @@ class Model::CpuIrqInterface {
 public:
     virtual void notify_interrupt_pending() = 0;
     virtual Model::LocalIrqController *local_irq_ctlr() = 0;
+
+    /*! \brief Is the CPU blocked waiting for an interrupt (WFI)?
+     *
+     * This is only a hint used by the interrupt controller to balance 1-of-N
+     * interrupts. It can be stale by the time the caller acts on it.
+     */
+    virtual bool is_halted() const { return false; }
 };
 
 class Model::Cpu : public Model::CpuIrqInterface {
@@ -109,6 +116,9 @@ private:
     // Conceptually, atomic<State>
     atomic<uint8> _state{OFF};
 
+    // Set while the VCPU is blocked in wait_for_interrupt
+    atomic<bool> _halted{false};
+
     bool is_roundup_pending() const { return _state == EMULATE_ROUNDEDUP; }
 
     bool is_turned_on_by_guest() const { return !_execution_paused.is_requested_by(Request::Requestor::VMM); }
@@ -163,6 +173,13 @@ public:
     static Pcpu_id get_pcpu(Vcpu_id);
     static VcpuVHWId get_vcpu_vhw_id(Vcpu_id);
 
+    // Host NUMA node of the physical CPU running the VCPU, Platform::Numa::NO_NODE if unknown
+    static uint16 get_numa_node(Vcpu_id);
+    // Restrict the calling thread to the CPUs of a host NUMA node. VCPU threads and device workers
+    // use it to run next to the memory they touch most, e.g. Model::SimpleAS::numa_node_at() of
+    // their virtqueues.
+    static bool bind_thread_to_node(uint16 node);
+
     // Debugging/Info purposes: describe the current status of the VCPU
     // NOTE: the specification of this function is simply: returns a string
     //       it isn't meaningful to specify what the string means.
@@ -264,6 +281,7 @@ public:
     void wait_for_resume() { _resume_sig.wait(); }
     void wait_for_interrupt(bool will_timeout, uint64 timeout_absolut);
     void notify_interrupt_pending() override;
+    bool is_halted() const override { return _halted; }
 
     Model::LocalIrqController *local_irq_ctlr() override { return _lirq_ctlr; }
 
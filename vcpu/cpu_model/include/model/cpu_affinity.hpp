@@ -24,6 +24,13 @@ public:
         return CpuAffinity{static_cast<uint32>(((vcpu_id / 16) << 8) | (vcpu_id % 16))};
     }
 
+    // Construct affinity from the position of a vcpu on the host NUMA topology: Aff2 is the node,
+    // so that clusters never span two nodes. This supports 256 nodes of 256 clusters of 16 vcpus.
+    static CpuAffinity from_numa_position(uint16 node, uint64 index_in_node) {
+        uint32 cluster = static_cast<uint32>((index_in_node / 16) % 256);
+        return CpuAffinity{(static_cast<uint32>(node & 0xff) << 16) | (cluster << 8) | static_cast<uint32>(index_in_node % 16)};
+    }
+
     // Retrieve 64-bit MPIDR from packed affinity value.
     uint64 mpidr() const {
         return ((static_cast<uint64>(_aff) << 8) & 0xff00000000ull) | (static_cast<uint64>(_aff) & 0xffffffull);
@@ -18,6 +18,7 @@
 #include <platform/memory.hpp>
 #include <platform/mutex.hpp>
 #include <platform/new.hpp>
+#include <platform/numa.hpp>
 #include <platform/signal.hpp>
 #include <platform/types.hpp>
 #include <platform/vm_types.hpp>
@@ -69,6 +70,20 @@ Model::Cpu::get_pcpu(Vcpu_id id) {
     return vcpus[id]->_pcpu_id;
 }
 
+uint16
+Model::Cpu::get_numa_node(Vcpu_id id) {
+    ASSERT(id < configured_vcpus);
+    return Platform::Numa::node_of_cpu(vcpus[id]->_pcpu_id);
+}
+
+bool
+Model::Cpu::bind_thread_to_node(uint16 node) {
+    if (node >= Platform::Numa::node_count())
+        return false;
+
+    return Platform::Numa::bind_thread(node);
+}
+
 VcpuVHWId
 Model::Cpu::get_vcpu_vhw_id(Vcpu_id id) {
     ASSERT(id < configured_vcpus);
@@ -506,6 +521,8 @@ Model::Cpu::set_space_on(Vcpu_id id, RegAccessor& regs, Platform::Mem::MemSel sp
 void
 Model::Cpu::wait_for_interrupt(bool will_timeout, uint64 const timeout_absolute) {
     uint8 irr;
+
+    _halted = true;
     if (!will_timeout)
         while (!_lirq_ctlr->int_pending(&irr) and !_lirq_ctlr->nmi_pending() and !is_roundup_pending()
                and !_dump_regs.is_requested())
@@ -514,6 +531,7 @@ Model::Cpu::wait_for_interrupt(bool will_timeout, uint64 const timeout_absolute)
         if (!_lirq_ctlr->int_pending(&irr) and !is_roundup_pending() and !_dump_regs.is_requested())
             block_timeout(timeout_absolute);
     }
+    _halted = false;
 }
 
 void